@@ -156,6 +156,7 @@ LOCAL_SRC_FILES := \
   ../source/benchmark.cpp                                              \
   ../source/book/apery_book.cpp                                        \
   ../source/book/book.cpp                                              \
+  ../source/book/book_test_cmd.cpp                                     \
   ../source/book/makebook.cpp                                          \
   ../source/book/makebook2015.cpp                                      \
   ../source/book/makebook2019.cpp                                      \
@@ -174,6 +175,7 @@ LOCAL_SRC_FILES := \
   ../source/eval/evaluate_io.cpp                                       \
   ../source/eval/evaluate_mir_inv_tools.cpp                            \
   ../source/eval/material/evaluate_material.cpp                        \
+  ../source/learn/compressed_sfen.cpp                                  \
   ../source/learn/learner.cpp                                          \
   ../source/learn/learning_tools.cpp                                   \
   ../source/learn/multi_think.cpp
@@ -203,6 +205,7 @@ endif
 ifeq ($(findstring YANEURAOU_ENGINE_NNUE,$(YANEURAOU_EDITION)),YANEURAOU_ENGINE_NNUE)
 LOCAL_SRC_FILES += \
   ../source/eval/nnue/evaluate_nnue.cpp                                \
+  ../source/eval/nnue/evaluate_nnue_dispatch.cpp                       \
   ../source/eval/nnue/evaluate_nnue_learner.cpp                        \
   ../source/eval/nnue/nnue_test_command.cpp                            \
   ../source/eval/nnue/features/k.cpp                                   \
@@ -106,6 +106,11 @@ void bench_cmd(Position& current, istringstream& is)
 	// main threadが探索したノード数
 	int64_t nodes_main = 0;
 
+#if defined(USE_EVAL_HASH) && defined(EVAL_NNUE)
+	// EvalHashを調べた回数と、hitした回数
+	uint64_t eval_hash_probes = 0, eval_hash_hits = 0;
+#endif
+
 	// ベンチの計測用タイマー
 	Timer time;
 	time.reset();
@@ -128,6 +133,10 @@ void bench_cmd(Position& current, istringstream& is)
 
 		nodes += Threads.nodes_searched();
 		nodes_main += Threads.main()->nodes.load(std::memory_order_relaxed);
+#if defined(USE_EVAL_HASH) && defined(EVAL_NNUE)
+		eval_hash_probes += Threads.eval_hash_probes();
+		eval_hash_hits += Threads.eval_hash_hits();
+#endif
 	}
 
 	auto elapsed = time.elapsed() + 1; // 0除算の回避のため
@@ -142,6 +151,12 @@ void bench_cmd(Position& current, istringstream& is)
 		<< "\nNodes searched(main thread) : " << nodes_main
 		<< "\nNodes/second  (main thread) : " << 1000 * nodes_main / elapsed;
 
+#if defined(USE_EVAL_HASH) && defined(EVAL_NNUE)
+	if (eval_hash_probes)
+		cout << "\nEvalHash hits   : " << eval_hash_hits << " / " << eval_hash_probes
+			 << " (" << 100.0 * eval_hash_hits / eval_hash_probes << "%)";
+#endif
+
 	cout << sync_endl;
 
 	// Optionsを書き換えたので復元。
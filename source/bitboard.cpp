@@ -1,4 +1,5 @@
 ﻿#include "bitboard.h"
+#include "misc.h"
 #include "extra/long_effect.h"
 #include "mate/mate.h"
 
@@ -260,6 +261,9 @@ Bitboard RookAttack[512000 + 1 /* SQ_NB対応*/];
 
 int RookAttackIndex[SQ_NB_PLUS1];
 Bitboard RookBlockMask[SQ_NB_PLUS1];
+#if defined (USE_CPU_DISPATCH) && !defined (USE_BMI2)
+bool UsePext = false;
+#endif
 Bitboard BishopAttack[20224 + 1 /* SQ_NB対応*/];
 int BishopAttackIndex[SQ_NB_PLUS1];
 Bitboard BishopBlockMask[SQ_NB_PLUS1];
@@ -357,6 +361,8 @@ namespace {
 				const Bitboard occupied = indexToOccupied(i, num1s, blockMask[sq]);
 #if defined (USE_BMI2)
 				attacks[index + occupiedToIndex(occupied & blockMask[sq], blockMask[sq])] = attackCalc(sq, occupied, isBishop);
+#elif defined (USE_CPU_DISPATCH)
+				attacks[index + occupiedToIndex(occupied & blockMask[sq], blockMask[sq], magic[sq], shift[sq])] = attackCalc(sq, occupied, isBishop);
 #else
 				attacks[index + occupiedToIndex(occupied, magic[sq], shift[sq])] = attackCalc(sq, occupied, isBishop);
 #endif
@@ -373,6 +379,13 @@ namespace {
 	// Apery型の遠方駒の利きの処理で用いるテーブルの初期化
 	void init_apery_attack_tables()
 	{
+#if defined (USE_CPU_DISPATCH) && !defined (USE_BMI2)
+		// テーブルの中身はindexの求め方に依存するので、ここで決めておく。
+		// PEXT命令を使うのは、上位のTARGET_CPU(AVX2以上)向けのビルドでUSE_BMI2を指定しているときと同じ条件。
+		UsePext = CpuId::fast_pext() && CpuId::dispatch_supports("AVX2");
+		CpuId::set_dispatched("Bitboard", UsePext ? "PEXT" : "magic");
+#endif
+
 		// 飛車の利きテーブルの初期化
 		initAttacks(false);
 
@@ -493,6 +493,13 @@ extern const u64 RookMagic[SQ_NB_PLUS1];
 extern const u64 BishopMagic[SQ_NB_PLUS1];
 #endif
 
+#if defined (USE_CPU_DISPATCH) && !defined (USE_BMI2)
+// CPU dispatch用のビルドでは、PEXT bitboardとmagic bitboardとを起動時に切り替える。
+// Bitboards::init()で、PEXT命令が使えて速いCPUであればtrueにして、テーブルもそれに合わせて初期化する。
+// テーブルのサイズと、各升のテーブルの開始位置(RookShiftBits)はmagic bitboardのものを用いる。
+extern bool UsePext;
+#endif
+
 #endif // defined(USE_OLD_YANEURAOU_EFFECT)
 
 // --------------------
@@ -649,6 +656,29 @@ inline Bitboard bishopEffect(const Square sq, const Bitboard& occupied) {
 	const Bitboard block(occupied & BishopBlockMask[sq]);
 	return BishopAttack[BishopAttackIndex[sq] + occupiedToIndex(block, BishopBlockMask[sq])];
 }
+#elif defined (USE_CPU_DISPATCH)
+
+// PEXT bitboardとmagic bitboardとをUsePextで切り替える。
+// -mbmi2を指定せずにビルドするので、PEXT命令はinline asmで書く。
+inline u64 occupiedToIndex(const Bitboard& block, const Bitboard& mask, const u64 magic, const int shiftBits) {
+	if (UsePext) {
+		u64 index;
+		__asm__("pextq %2, %1, %0" : "=r"(index) : "r"(block.merge()), "r"(mask.merge()));
+		return index;
+	}
+	return (block.merge() * magic) >> shiftBits;
+}
+
+inline Bitboard rookEffect(const Square sq, const Bitboard& occupied) {
+	const Bitboard block(occupied & RookBlockMask[sq]);
+	return RookAttack[RookAttackIndex[sq] + occupiedToIndex(block, RookBlockMask[sq], RookMagic[sq], RookShiftBits[sq])];
+}
+
+inline Bitboard bishopEffect(const Square sq, const Bitboard& occupied) {
+	const Bitboard block(occupied & BishopBlockMask[sq]);
+	return BishopAttack[BishopAttackIndex[sq] + occupiedToIndex(block, BishopBlockMask[sq], BishopMagic[sq], BishopShiftBits[sq])];
+}
+
 #else
 
 // magic bitboard.
@@ -11,6 +11,8 @@
 #include <unordered_set>
 #include <iomanip>		// std::setprecision()
 #include <numeric>      // std::accumulate()
+#include <cstring>      // std::memcmp()
+#include <cmath>        // std::round()
 
 using namespace std;
 using std::cout;
@@ -72,9 +74,14 @@ namespace Book
 	// すでに並び替わっているなら、何もしない。
 	void BookMoves::sort_moves()
 	{
+		// すでに並び替わっているなら何もしない。
+		// 定跡の読み込み後はすべて並び替え済みなので、find()でlockを取らずに済む。
+		if (sorted)
+			return ;
+
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
 
-		// すでに並び替わっているなら何もしない。
+		// lockを取るまでの間に他のスレッドが並び替えたかも知れない。
 		if (sorted)
 			return ;
 
@@ -166,6 +173,12 @@ namespace Book
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
 
+		if (compact)
+		{
+			insert_compact(sfen, { bp }, overwrite);
+			return;
+		}
+
 		auto it = book_body.find(sfen);
 		if (it == book_body.end())
 		{
@@ -186,10 +199,230 @@ namespace Book
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
 
+		if (compact)
+		{
+			// fのなかでこのMemoryBookに局面が追加されるとcompact_bodyのentryが移動しうるので、indexで回してコピーしてから渡す。
+			for (size_t i = 0; i < compact_body.size(); ++i)
+			{
+				auto entry = compact_body.get_entries()[i];
+				f(compact_sfen(entry), compact_body.get_moves(entry));
+			}
+			return;
+		}
+
 		for(auto& it : book_body)
 			f(it.first,it.second);
 	}
 
+	// [ASYNC] foreach()の並列版。
+	void MemoryBook::foreach_parallel(size_t thread_num, std::function<void(size_t /*thread_id*/, const std::string& /*sfen*/, BookMovesPtr)> f) const
+	{
+		thread_num = std::max(thread_num, (size_t)1);
+
+		if (compact)
+		{
+			const auto& entries = compact_body.get_entries();
+			Tools::parallel_run(thread_num, [&](size_t id) {
+				const size_t start = entries.size() * id / thread_num, end = entries.size() * (id + 1) / thread_num;
+				for (size_t i = start; i < end; ++i)
+					f(id, compact_sfen(entries[i]), compact_body.get_moves(entries[i]));
+			});
+			return;
+		}
+
+		// std::unordered_mapはスレッドで分担できないので、各要素へのポインターを配列にしておく。
+		vector<const BookType::value_type*> items;
+		items.reserve(book_body.size());
+		for (auto& it : book_body)
+			items.push_back(&it);
+
+		Tools::parallel_run(thread_num, [&](size_t id) {
+			const size_t start = items.size() * id / thread_num, end = items.size() * (id + 1) / thread_num;
+			for (size_t i = start; i < end; ++i)
+				f(id, items[i]->first, items[i]->second);
+		});
+	}
+
+	// ----------------------------------
+	//		コンパクトなメモリ上の定跡
+	// ----------------------------------
+
+	CompactBookMove::CompactBookMove(const BookMove& bm)
+		: move(bm.move.to_u16()), ponder(bm.ponder.to_u16())
+		, value((s16)std::clamp(bm.value, (int)INT16_MIN, (int)INT16_MAX))
+		, depth((s16)std::clamp(bm.depth, (int)INT16_MIN, (int)INT16_MAX))
+		, move_count((u32)std::min(bm.move_count, (uint64_t)UINT32_MAX))
+		, win(encode_count(bm.win)), draw(encode_count(bm.draw))
+	{
+	}
+
+	BookMove CompactBookMove::to_book_move() const
+	{
+		return BookMove(Move16(move), Move16(ponder), value, depth, move_count, decode_count(win), decode_count(draw));
+	}
+
+	// xを0.5刻みに丸めて2倍した整数x2を16bitに符号化する。(負の値は0とみなす)
+	//   bit15 == 0 : 下位15bitがx2そのもの。x2が32767以下(xが16383.5以下)なら元の値に戻る。
+	//   bit15 == 1 : x2 = (2048 + 下位11bit) * 2^(bit14..11 + 4) の浮動小数点形式。相対誤差は1/4096以下。
+	//                表せる最大値(xで約10億)を超える値は飽和させる。
+	u16 CompactBookMove::encode_count(double x)
+	{
+		const double x2 = std::round(std::max(x, 0.0) * 2);
+		if (x2 <= 32767)
+			return (u16)x2;
+
+		// x2 = f * 2^e , 0.5 <= f < 1 として、仮数部12bit(先頭の1を含む)に丸める。
+		int e;
+		std::frexp(x2, &e);
+		e -= 12;
+		u64 q = (u64)std::llround(std::ldexp(x2, -e));
+		if (q == 4096)
+		{
+			q = 2048;
+			++e;
+		}
+		// x2 >= 32768なので、e >= 4。
+		if (e - 4 > 15)
+			return 0xffff;
+		return u16(0x8000 | ((e - 4) << 11) | (q - 2048));
+	}
+
+	double CompactBookMove::decode_count(u16 c)
+	{
+		if (!(c & 0x8000))
+			return c / 2.0;
+		return std::ldexp(double(2048 + (c & 0x7ff)), ((c >> 11) & 0xf) + 4) / 2;
+	}
+
+	void CompactBook::clear()
+	{
+		// clear()だけだとcapacityが残るので、swapして解放する。
+		std::vector<CompactBookEntry>().swap(entries);
+		std::vector<u32>().swap(index);
+		std::vector<CompactBookMove>().swap(arena);
+		arena_garbage = 0;
+	}
+
+	u64 CompactBook::memory_usage() const
+	{
+		return entries.capacity() * sizeof(CompactBookEntry)
+			+ index.capacity() * sizeof(u32)
+			+ arena.capacity() * sizeof(CompactBookMove);
+	}
+
+	u64 CompactBook::hash(const PackedSfen& sfen, u16 ply)
+	{
+		// PackedSfenは先頭のほうに盤面が詰まっていて各bitが一様ではないので、64bitずつ混ぜる。
+		u64 h = ply;
+		for (int i = 0; i < (int)(sizeof(PackedSfen) / sizeof(u64)); ++i)
+		{
+			u64 w;
+			std::memcpy(&w, sfen.data + i * sizeof(u64), sizeof(u64));
+			h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+			h ^= h >> 29;
+		}
+		return h;
+	}
+
+	size_t CompactBook::find_slot(const PackedSfen& sfen, u16 ply) const
+	{
+		// linear probing。indexの負荷率は1/2以下にしてあるので空きslotは必ずある。
+		const size_t mask = index.size() - 1;
+		for (size_t i = hash(sfen, ply) & mask; ; i = (i + 1) & mask)
+		{
+			const u32 e = index[i];
+			if (e == UINT32_MAX)
+				return i;
+
+			const auto& entry = entries[e];
+			if (entry.ply == ply && std::memcmp(&entry.sfen, &sfen, sizeof(PackedSfen)) == 0)
+				return i;
+		}
+	}
+
+	void CompactBook::rehash(size_t slot_num)
+	{
+		index.assign(slot_num, UINT32_MAX);
+		for (size_t i = 0; i < entries.size(); ++i)
+			index[find_slot(entries[i].sfen, entries[i].ply)] = (u32)i;
+	}
+
+	const CompactBookEntry* CompactBook::find(const PackedSfen& sfen, u16 ply) const
+	{
+		if (index.empty())
+			return nullptr;
+
+		const u32 e = index[find_slot(sfen, ply)];
+		return e == UINT32_MAX ? nullptr : &entries[e];
+	}
+
+	BookMovesPtr CompactBook::get_moves(const CompactBookEntry& entry, bool sort) const
+	{
+		BookMovesPtr pml_entry(new BookMoves());
+		for (u32 i = 0; i < entry.move_num; ++i)
+			pml_entry->push_back(arena[entry.move_index + i].to_book_move());
+
+		// 指し手は追加された順に格納してあるので、ここで並び替える。
+		// (通常の形式でwrite_book()の直前に並び替えるのと同じ順序になるように)
+		if (sort)
+			pml_entry->sort_moves();
+
+		return pml_entry;
+	}
+
+	void CompactBook::set_moves(const PackedSfen& sfen, u16 ply, BookMoves& bm)
+	{
+		// indexの負荷率が1/2を超えるなら倍に広げる。
+		if ((entries.size() + 1) * 2 > index.size())
+			rehash(std::max(index.size() * 2, (size_t)1024));
+
+		const size_t slot = find_slot(sfen, ply);
+		if (index[slot] == UINT32_MAX)
+		{
+			index[slot] = (u32)entries.size();
+			entries.push_back(CompactBookEntry{ sfen, (u32)arena.size(), 0, ply });
+		}
+		auto& entry = entries[index[slot]];
+
+		// 1局面の指し手はMAX_MOVES以下のはずなのでu16に収まる。
+		const size_t n = std::min(bm.size(), (size_t)UINT16_MAX);
+
+		if (n > entry.move_num)
+		{
+			// 今の場所に収まらないのでarenaの末尾に移す。元の場所は使われなくなる。
+			// (arenaのindexはu32なので、全局面の指し手の合計は2^32未満でなければならない)
+			arena_garbage += entry.move_num;
+			entry.move_index = (u32)arena.size();
+			arena.resize(arena.size() + n);
+		}
+		else
+			arena_garbage += entry.move_num - n;
+
+		for (size_t i = 0; i < n; ++i)
+			arena[entry.move_index + i] = CompactBookMove(bm[i]);
+		entry.move_num = (u16)n;
+
+		// 使われていない指し手がarenaの半分を超えたら詰め直す。
+		if (arena_garbage > 1024 * 1024 && arena_garbage * 2 > arena.size())
+			compact_arena();
+	}
+
+	void CompactBook::compact_arena()
+	{
+		std::vector<CompactBookMove> new_arena;
+		new_arena.reserve(arena.size() - arena_garbage);
+
+		for (auto& entry : entries)
+		{
+			const u32 move_index = (u32)new_arena.size();
+			new_arena.insert(new_arena.end(), arena.begin() + entry.move_index, arena.begin() + entry.move_index + entry.move_num);
+			entry.move_index = move_index;
+		}
+
+		arena.swap(new_arena);
+		arena_garbage = 0;
+	}
+
 	// ----------------------------------
 	//			MemoryBook
 	// ----------------------------------
@@ -202,6 +435,21 @@ namespace Book
 		return Options["IgnoreBookPly"] ? StringExtension::trim_number(input) : StringExtension::trim(input);
 	}
 
+	// 定跡の読み書きに用いるスレッド数。Options["Threads"]の値に従う。
+	static size_t book_thread_num()
+	{
+		return Options.count("Threads") ? std::max((size_t)Options["Threads"], (size_t)1) : 1;
+	}
+
+	// 定跡ファイルがバイナリ形式であるかを先頭のmagicで判定する。
+	static bool is_binary_book_file(const std::string& filename)
+	{
+		ifstream ifs(filename, ios::in | ios::binary);
+		char magic[sizeof(kBinaryBookMagic)] = {};
+		ifs.read(magic, sizeof(magic));
+		return !ifs.fail() && std::memcmp(magic, kBinaryBookMagic, sizeof(magic)) == 0;
+	}
+
 	// 定跡ファイルの読み込み(book.db)など。
 	Tools::Result MemoryBook::read_book(const std::string& filename, bool on_the_fly_)
 	{
@@ -225,9 +473,19 @@ namespace Book
 
 		// 別のファイルを開こうとしているので前回メモリに丸読みした定跡をクリアしておかないといけない。
 		book_body.clear();
+		compact_body.clear();
 		this->on_the_fly = false;
 		this->ignoreBookPly = ignore_book_ply_;
 
+		// 前回mapしたバイナリ形式の定跡もunmapしておく。
+		binary_book.close();
+		binary_entries = nullptr;
+		binary_moves = nullptr;
+		binary_entry_count = 0;
+
+		// on the flyで開いていたテキスト形式の定跡もunmapしておく。
+		text_book.close();
+
 		// フォルダ名を取り去ったものが"no_book"(定跡なし)もしくは"book.bin"(Aperyの定跡ファイル)であるかを判定する。
 		auto pure_filename = Path::GetFileName(filename);
 
@@ -248,14 +506,29 @@ namespace Book
 		else {
 			// やねうら王定跡データベースを読み込む
 
+			// バイナリ形式の定跡ファイルであるなら、memory mapするだけで良い。
+			// (BookOnTheFlyの値に関わらず、実際の読み込みはアクセスしたときにOSが行う)
+			if (is_binary_book_file(filename))
+			{
+				auto result = read_binary_book(filename);
+				if (result.is_not_ok())
+				{
+					sync_cout << "info string Error! : can't read binary book file : " + filename << " , " << result.to_string() << sync_endl;
+					return result;
+				}
+
+				sync_cout << "info string read binary book file : " << filename << " , positions = " << binary_entry_count << sync_endl;
+
+				this->book_name = filename;
+				this->pure_book_name = pure_filename;
+				return Tools::Result::Ok();
+			}
+
 			// ファイルだけオープンして読み込んだことにする。
 			if (on_the_fly_)
 			{
-				if (fs.is_open())
-					fs.close();
-
-				fs.open(filename, ios::in);
-				if (fs.fail())
+				// memory mapしておけば、find()のときにファイルのseek位置を共有しないので複数スレッドから同時に調べられる。
+				if (text_book.open(filename).is_not_ok())
 				{
 					sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
 					return Tools::Result(Tools::ResultCode::FileOpenError);
@@ -270,104 +543,264 @@ namespace Book
 
 			sync_cout << "info string read book file : " << filename << sync_endl;
 
-			TextFileReader reader;
-			// ReadLine()の時に行の末尾のスペース、タブを自動トリム。空行は自動スキップ。
-			reader.SetTrim(true);
-			reader.SkipEmptyLine(true);
-
-			auto result = reader.Open(filename);
+			auto result = read_text_book(filename);
 			if (result.is_not_ok())
 			{
 				sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
 				//      exit(EXIT_FAILURE);
 				return result; // 読み込み失敗
 			}
+		}
 
-			string sfen;
+		// 読み込んだファイル名を保存しておく。二度目のread_book()はskipする。
+		this->book_name = filename;
+		this->pure_book_name = pure_filename;
 
-			// 手数違いの重複エントリーは、手数の一番若いほうだけをMemoryBook::write_book()で書き出すようにしたので、
-			// 以下のコードは不要(のはず)
-#if 0
-			// 一つ前のsfen文字列と、同一sfenエントリー内の手数の最小値
-			string last_sfen;
-			int last_sfen_ply = 0;
-			bool ignore_book_ply = Options["IgnoreBookPly"];
-#endif
+		sync_cout << "info string read book done." << sync_endl;
+
+		// メモリに丸読みしたときは、そのメモリ使用量を出力しておく。
+		if (!on_the_fly && pure_filename != kAperyBookName)
+			print_memory_usage();
+
+		return Tools::Result::Ok();
+	}
+
+	// テキスト形式の定跡ファイルをメモリに丸読みする。read_book()の下請け。
+	// ファイルをmemory mapして、"sfen "で始まる行の位置で区切り、Options["Threads"]個のスレッドで並列に解析する。
+	// 解析した局面をbook_body(compact_body)に追加するのは1スレッドで行う。
+	Tools::Result MemoryBook::read_text_book(const std::string& filename)
+	{
+		MemoryMappedFile file;
+		auto result = file.open(filename);
+		if (result.is_not_ok())
+		{
+			// 空のファイルはmemory mapできないが、定跡が空であるだけなのでエラーにはしない。
+			ifstream ifs(filename, ios::in | ios::binary | ios::ate);
+			return (!ifs.fail() && ifs.tellg() == 0) ? Tools::Result::Ok() : result;
+		}
+
+		const char* data = (const char*)file.data();
+		const u64 file_size = file.size();
+
+		// 定跡に登録されている手数を無視するのか？
+		// (これがtrueならばsfenから手数を除去しておく)
+		const bool ignoreBookPly = Options["IgnoreBookPly"];
 
-			// 定跡に登録されている手数を無視するのか？
-			// (これがtrueならばsfenから手数を除去しておく)
-			bool ignoreBookPly = Options["IgnoreBookPly"];
+		const size_t thread_num = book_thread_num();
 
-			std::string line;
-			while(reader.ReadLine(line).is_ok())
+		// ファイルを1スレッドあたりこのサイズずつに区切って解析する。
+		// 解析結果はスレッド数分ずつbook_bodyに追加していくので、一時的に必要となるメモリはこのスレッド数倍程度で済む。
+		const u64 piece_size = 16 * 1024 * 1024;
+		const u64 piece_num = std::max((u64)thread_num, (file_size + piece_size - 1) / piece_size);
+
+		// pos以降で、"sfen "で始まる行の先頭の位置を返す。なければfile_size。
+		auto next_record = [&](u64 pos) {
+			if (pos == 0)
+				return pos;
+
+			while (pos < file_size)
+			{
+				// posが行頭であるなら、"sfen "で始まるかを調べる。
+				if (data[pos - 1] == '\n' && pos + 5 <= file_size && std::memcmp(data + pos, "sfen ", 5) == 0)
+					return pos;
+
+				// 次の行頭へ
+				auto p = (const char*)std::memchr(data + pos, '\n', size_t(file_size - pos));
+				if (p == nullptr)
+					break;
+				pos = u64(p - data) + 1;
+			}
+			return file_size;
+		};
+
+		// i番目の区間の先頭。各区間は"sfen "で始まる行から始まる。(ファイルの先頭の区間を除く)
+		vector<u64> bounds(piece_num + 1);
+		for (u64 i = 0; i < piece_num; ++i)
+			bounds[i] = next_record(file_size * i / piece_num);
+		bounds[piece_num] = file_size;
+
+		// 解析した1局面分
+		struct ParsedRecord
+		{
+			string sfen;
+			BookMovesPtr moves;
+
+			// コンパクトな形式のときのkey
+			PackedSfen packed;
+			u16 ply;
+		};
+
+		// [start,end)の範囲を解析してrecordsに追加する。
+		auto parse = [&](u64 start, u64 end, vector<ParsedRecord>& records)
+		{
+			string line;
+			for (u64 pos = start; pos < end; )
 			{
+				auto p = (const char*)std::memchr(data + pos, '\n', size_t(end - pos));
+				const u64 line_end = p == nullptr ? end : u64(p - data);
+				line.assign(data + pos, size_t(line_end - pos));
+				pos = line_end + 1;
+
+				// 行の末尾のスペース、タブ、改行を除去。空行はskip。
+				StringExtension::trim_inplace(line);
+				if (line.empty())
+					continue;
 
 				// バージョン識別文字列(とりあえず読み飛ばす)
-				if (line.length() >= 1 && line[0] == '#')
+				if (line[0] == '#')
 					continue;
 
 				// コメント行(とりあえず読み飛ばす)
-				if (line.length() >= 2 && line.substr(0, 2) == "//")
+				if (line.length() >= 2 && line.compare(0, 2, "//") == 0)
 					continue;
 
 				// "sfen "で始まる行は局面のデータであり、sfen文字列が格納されている。
-				if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
+				if (line.length() >= 5 && line.compare(0, 5, "sfen ") == 0)
 				{
 					// 5文字目から末尾までをくり抜く。
 					// 末尾のゴミは除去されているはずなので、Options["IgnoreBookPly"] == trueのときは、手数(数字)を除去。
-
-					sfen = line.substr(5); // 新しいsfen文字列を"sfen "を除去して格納
+					string sfen = line.substr(5);
 					if (ignoreBookPly)
 						StringExtension::trim_number_inplace(sfen); // 末尾の数字除去
 
-#if 0
-					if (ignore_book_ply)
-					{
-						int ply = StringExtension::to_int(StringExtension::mid(line, sfen.length() + 5), 0);
+					records.push_back(ParsedRecord{ std::move(sfen), BookMovesPtr(new BookMoves()), PackedSfen(), 0 });
+					continue;
+				}
+
+				// 局面が指定される前の指し手と、Options["IgnoreBookPly"]==true絡みでskipするエントリー
+				if (records.empty() || records.back().sfen.size() == 0)
+					continue;
+
+				records.back().moves->insert(BookMove::from_string(line), true);
+			}
+
+			// 局面ごとの後処理もこのスレッドで済ませておく。
+			for (auto& record : records)
+			{
+				// 指し手を並び替えておく。
+				// こうしておけばfind()でBookMovesを書き換えることがないので、find()を複数スレッドから同時に呼び出せる。
+				record.moves->sort_moves();
+
+				// コンパクトな形式なら、sfen文字列からkeyを求めておく。(Position::set()を伴うので重い)
+				if (compact)
+					compact_key(record.sfen, record.packed, record.ply);
+			}
+		};
+
+		vector<vector<ParsedRecord>> records(thread_num);
+		for (u64 first = 0; first < piece_num; first += thread_num)
+		{
+			const size_t num = (size_t)std::min((u64)thread_num, piece_num - first);
 
-						// Options["IgnoreBookPly"] == trueのときに手数違いの重複エントリーがある場合がある。
-						// すでに見つけたentryなら、このentryに対して一切の操作を行わない。
-						// 若い手数のほうの局面情報を優先すべき。
-						// ※　定跡DBはsfen文字列順にソートされているので、手数違いのエントリーは連続していると仮定できる。
+			Tools::parallel_run(num, [&](size_t id) {
+				parse(bounds[first + id], bounds[first + id + 1], records[id]);
+			});
 
-						if (last_sfen != sfen)
-							last_sfen_ply = INT_MAX;
-						else if (last_sfen_ply < ply)
-							sfen = "";
+			// ファイル上の順番に追加していく。
+			// 同じ局面が複数回出現したときは、insert()と同じく指し手を合算する。
+			for (size_t id = 0; id < num; ++id)
+			{
+				for (auto& record : records[id])
+				{
+					// 指し手のない局面は登録しない。
+					if (record.moves->size() == 0)
+						continue;
 
-						last_sfen_ply = std::min(last_sfen_ply,ply); // 同一sfenエントリーのなかでの最小値にする
-						last_sfen = sfen;
+					if (compact)
+					{
+						auto entry = compact_body.find(record.packed, record.ply);
+						if (entry != nullptr)
+						{
+							auto move_list = compact_body.get_moves(*entry, false);
+							for (auto& bp : *record.moves)
+								move_list->insert(bp, true);
+							compact_body.set_moves(record.packed, record.ply, *move_list);
+						}
+						else
+							compact_body.set_moves(record.packed, record.ply, *record.moves);
+						continue;
 					}
-#endif
 
-					continue;
+					auto it = book_body.find(record.sfen);
+					if (it == book_body.end())
+						book_body.emplace(std::move(record.sfen), record.moves);
+					else
+					{
+						auto& book_moves = *it->second;
+						for (auto& bp : *record.moves)
+							book_moves.insert(bp, true);
+						book_moves.sort_moves();
+					}
 				}
+				records[id].clear();
+			}
+		}
 
-				// Options["IgnoreBookPly"]==true絡みでskipするエントリーであるかの判定
-				if (sfen.size() == 0)
-					continue;
+		return Tools::Result::Ok();
+	}
+
+	// sfen文字列でsort済みの局面を、thread_num個のスレッドで並列に文字列化してfsに書き出す。write_book()の下請け。
+	// vectored_bookは、sfen文字列と、get_moves()でその局面のBookMovesPtrが得られる何かのpair。
+	template <typename T, typename F>
+	static Tools::Result write_sorted_book(std::fstream& fs, const vector<pair<string, T>>& vectored_book, size_t thread_num, F get_moves)
+	{
+		// 1スレッドが一度に文字列化する局面数
+		const size_t block_size = 4096;
+		vector<string> buffers(thread_num);
+
+		// 進捗の出力
+		u64 counter = 0;
+		auto output_progress = [&]()
+		{
+			if ((counter % 1000) == 0)
+			{
+				if ((counter % 80000) == 0) // 80文字ごとに改行
+					cout << endl;
+				cout << ".";
+			}
+			counter++;
+		};
 
-				insert(sfen, BookMove::from_string(line));
+		for (size_t first = 0; first < vectored_book.size(); first += block_size * thread_num)
+		{
+			Tools::parallel_run(thread_num, [&](size_t id) {
+				const size_t start = std::min(first + block_size * id, vectored_book.size());
+				const size_t end   = std::min(start + block_size, vectored_book.size());
 
-				// このinsert()、この関数の40%ぐらいの時間を消費している。
-				// 他の部分をせっかく高速化したのに…。
+				std::ostringstream oss;
+				for (size_t i = start; i < end; ++i)
+				{
+					oss << "sfen " << vectored_book[i].first /* is sfen string */ << '\n'; // sfen
 
-				// これ、ファイルから読み込んだ文字列のまま保存しておき、
-				// アクセスするときに解凍するほうが良かったか…。
+					auto move_list = get_moves(vectored_book[i].second);
 
-				// unorderedmapなのでこれ以上どうしようもないな…。
+					// 何らかsortしておく。
+					move_list->sort_moves();
 
-				// テキストそのまま持っておいて、メモリ上で二分探索する実装のほうが良かったか。
-				// (定跡がsfen文字列でソート済みであることが保証されているなら。保証されてないんだけども。)
+					for (auto& bp : *move_list)
+						oss << bp.move << ' ' << bp.ponder << ' ' << bp.value << " " << bp.depth << " " << bp.move_count << " " << bp.win << " " << bp.draw << '\n';
+					// 指し手、相手の応手、そのときの評価値、探索深さ、採択回数、win、draw
+				}
+				buffers[id] = oss.str();
+			});
 
+			// スレッドごとに文字列化したものを順番に書き出す。
+			for (auto& buffer : buffers)
+			{
+				fs.write(buffer.data(), buffer.size());
+				buffer.clear();
 			}
+
+			for (size_t i = first; i < std::min(first + block_size * thread_num, vectored_book.size()); ++i)
+				output_progress();
+
+			if (fs.fail())
+				return Tools::Result(Tools::ResultCode::FileWriteError);
 		}
 
-		// 読み込んだファイル名を保存しておく。二度目のread_book()はskipする。
-		this->book_name = filename;
-		this->pure_book_name = pure_filename;
+		fs.close();
 
-		sync_cout << "info string read book done." << sync_endl;
+		cout << endl << "done!" << endl;
 
 		return Tools::Result::Ok();
 	}
@@ -394,16 +827,17 @@ namespace Book
 		// バージョン識別用文字列
 		fs << "#YANEURAOU-DB2016 1.00" << endl;
 
+		// コンパクトな形式のときは別の経路で書き出す。
+		if (compact)
+			return write_compact_book(fs);
+
 		vector<pair<string, BookMovesPtr> > vectored_book;
 		
-		// 重複局面の手数違いを除去するのに用いる。
+		// 重複局面の手数違いを除去する必要がある。
 		// 手数違いの重複局面はOptions["IgnoreBookPly"]==trueのときに有害であるため、plyが最小のもの以外を削除する必要がある。
 		// (Options["BookOnTheFly"]==true かつ Options["IgnoreBookPly"] == true のときに、手数違いのものがヒットするだとか、そういう問題と、
 		// Options["IgnoreBookPly"]==trueのときにMemoryBook::read_book()で読み込むときに重複エントリーがあって何か地雷を踏んでしまう的な問題を回避。
 
-		// sfenの手数の手前までの文字列とそのときの手数
-		std::unordered_map<string, int> book_ply;
-
 		for (auto& it : book_body)
 		{
 			// 指し手のない空っぽのentryは書き出さないように。
@@ -416,92 +850,457 @@ namespace Book
 		// (USI原案のほうでは規定されているのだが、将棋所が採用しているUSIプロトコルではこの規定がない。)
 		// sortするタイミングで、一度すべての局面を読み込み、sfen()化しなおすことで
 		// やねうら王が用いているsfenの手駒表記(USI原案)に統一されるようにする。
+		// これは局面ごとに独立しているので、スレッドで分担して行う。
 
-		// 進捗の出力
-		u64 counter = 0;
-		auto output_progress = [&]()
-		{
-			if ((counter % 1000) == 0)
-			{
-				if ((counter % 80000) == 0) // 80文字ごとに改行
-					cout << endl;
-				cout << ".";
-			}
-			counter++;
-		};
+		const size_t thread_num = book_thread_num();
 
-		{
+		Tools::parallel_run(thread_num, [&](size_t id) {
 			Position pos;
+			const size_t start = vectored_book.size() * id / thread_num, end = vectored_book.size() * (id + 1) / thread_num;
 
-			// std::vectorにしてあるのでit.firstを書き換えてもitは無効にならないはず。
-			for (auto& it : vectored_book)
+			// std::vectorにしてあるのでfirstを書き換えても問題ない。
+			for (size_t i = start; i < end; ++i)
 			{
-				output_progress();
-
 				StateInfo si;
-				pos.set(it.first,&si,Threads.main());
-				auto sfen = pos.sfen();
-				it.first = sfen;
-
-				auto sfen_left = StringExtension::trim_number(sfen); // 末尾にplyがあるはずじゃろ
-				int ply = StringExtension::to_int(sfen.substr(sfen_left.length()), 0);
-
-				auto it2 = book_ply.find(sfen_left);
-				if (it2 == book_ply.end())
-					book_ply[sfen_left] = ply; // エントリーが見つからなかったので何も考えずに追加
-				else
-					it2->second = std::min(it2->second, ply); // 手数の短いほうを代入しておく。
+				pos.set(vectored_book[i].first, &si, Threads.main());
+				vectored_book[i].first = pos.sfen();
 			}
-		}
+		});
 
 		// ここvectored_bookが、sfen文字列でsortされていて欲しいのでsortする。
 		// アルファベットの範囲ではlocaleの影響は受けない…はず…。
-		std::sort(vectored_book.begin(), vectored_book.end(),
+		Tools::parallel_sort(vectored_book, thread_num,
 			[](const pair<string, BookMovesPtr>&lhs, const pair<string, BookMovesPtr>&rhs) {
 			return lhs.first < rhs.first;
 		});
 
-		for (auto& it : vectored_book)
+		// -- 重複局面の手数違いの局面はスキップする(ファイルに書き出さない)
+
+		// sfen文字列でsortしてあるので、手数の手前までが同じ局面は連続している。
+		// そのなかで手数が最小のものだけを残す。
 		{
-			output_progress();
+			// 末尾の手数を取り除いた長さ。StringExtension::trim_number()と同じだが、文字列のcopyを避ける。
+			auto sfen_left_length = [](const string& sfen) {
+				size_t cur = sfen.length();
+				while (cur > 0 && sfen[cur - 1] == ' ')
+					cur--;
+				while (cur > 0 && '0' <= sfen[cur - 1] && sfen[cur - 1] <= '9')
+					cur--;
+				while (cur > 0 && sfen[cur - 1] == ' ')
+					cur--;
+				return cur;
+			};
+
+			size_t write_index = 0;
+			for (size_t i = 0; i < vectored_book.size(); )
+			{
+				const auto& sfen = vectored_book[i].first;
+				const size_t left = sfen_left_length(sfen);
+
+				size_t best = i;
+				int best_ply = INT_MAX;
+				size_t j = i;
+				for (; j < vectored_book.size(); ++j)
+				{
+					const auto& sfen2 = vectored_book[j].first;
+					if (sfen_left_length(sfen2) != left || sfen2.compare(0, left, sfen, 0, left) != 0)
+						break;
+
+					int ply = StringExtension::to_int(sfen2.substr(left), 0);
+					if (ply < best_ply)
+					{
+						best_ply = ply;
+						best = j;
+					}
+				}
+
+				if (write_index != best)
+					vectored_book[write_index] = std::move(vectored_book[best]);
+				write_index++;
+				i = j;
+			}
+			vectored_book.resize(write_index);
+		}
+
+		return write_sorted_book(fs, vectored_book, thread_num, [](const BookMovesPtr& moves) { return moves; });
+	}
+
+	// 定跡ファイルをバイナリ形式で書き出す。
+	Tools::Result MemoryBook::write_binary_book(const std::string& filename) const
+	{
+		std::lock_guard<std::recursive_mutex> lock(const_cast<MemoryBook*>(this)->mutex_);
+
+		cout << endl << "write " + filename;
+
+		// 局面のhash key , 手数 , 指し手集合
+		struct KeyedBookMoves
+		{
+			u64 key;
+			int ply;
+			BookMovesPtr moves;
+
+			// keyを求めるための局面のsfen文字列
+			const string* sfen;
 
-			// -- 重複局面の手数違いの局面はスキップする(ファイルに書き出さない)
+			// コンパクトな形式のときは、moves,sfenではなくcompact_bodyのentryのindexを持つ。
+			size_t compact_index;
+		};
+		vector<KeyedBookMoves> keyed_book;
+		keyed_book.reserve(book_body.size());
 
-			auto sfen = it.first;
-			auto sfen_left = StringExtension::trim_number(sfen); // 末尾にplyがあるはずじゃろ
-			int ply = StringExtension::to_int(sfen.substr(sfen_left.length()), 0);
-			if (book_ply[sfen_left] != ply)
+		for (auto& it : book_body)
+		{
+			// 指し手のない空っぽのentryは書き出さないように。
+			if (it.second->size() == 0)
 				continue;
 
-			// -- このentryを書き出す
+			keyed_book.push_back(KeyedBookMoves{ 0, 0, it.second, &it.first, 0 });
+		}
+
+		const auto& compact_entries = compact_body.get_entries();
+		for (size_t i = 0; i < compact_entries.size(); ++i)
+			if (compact_entries[i].move_num != 0)
+				keyed_book.push_back(KeyedBookMoves{ 0, 0, BookMovesPtr(), nullptr, i });
 
-			fs << "sfen " << it.first /* is sfen string */ << endl; // sfen
+		// 局面を設定してhash keyを求めるのは、局面ごとに独立しているのでスレッドで分担して行う。
+		const size_t thread_num = book_thread_num();
+		Tools::parallel_run(thread_num, [&](size_t id) {
+			Position pos;
+			const size_t start = keyed_book.size() * id / thread_num, end = keyed_book.size() * (id + 1) / thread_num;
+			for (size_t i = start; i < end; ++i)
+			{
+				auto& it = keyed_book[i];
+				StateInfo si;
+				if (it.sfen != nullptr)
+					pos.set(*it.sfen, &si, Threads.main());
+				else
+					compact_position(compact_entries[it.compact_index], pos, &si);
+
+				it.key = pos.key();
+				it.ply = it.sfen != nullptr ? pos.game_ply() : compact_entries[it.compact_index].ply;
+			}
+		});
 
-			auto& move_list = *it.second;
+		// hash keyの昇順。同じhash key(手数違いの同一局面)なら手数の若いほうを先頭に。
+		Tools::parallel_sort(keyed_book, thread_num, [](const KeyedBookMoves& lhs, const KeyedBookMoves& rhs) {
+			return lhs.key != rhs.key ? lhs.key < rhs.key : lhs.ply < rhs.ply;
+		});
+
+		vector<BinaryBookEntry> entries;
+		vector<BinaryBookMove> moves;
+		entries.reserve(keyed_book.size());
 
-			// 何らかsortしておく。
+		for (auto& it : keyed_book)
+		{
+			// 手数違いの重複局面は手数の一番若いものだけを書き出す。
+			if (!entries.empty() && entries.back().key == it.key)
+				continue;
+
+			auto moves_ptr = it.moves ? it.moves : compact_body.get_moves(compact_entries[it.compact_index]);
+			auto& move_list = *moves_ptr;
 			move_list.sort_moves();
 
+			entries.push_back(BinaryBookEntry{ it.key, (u32)moves.size(), (u32)move_list.size() });
 			for (auto& bp : move_list)
-				fs << bp.move << ' ' << bp.ponder << ' ' << bp.value << " " << bp.depth << " " << bp.move_count << " " << bp.win << " " << bp.draw << endl;
-			// 指し手、相手の応手、そのときの評価値、探索深さ、採択回数、win、draw
+				moves.emplace_back(bp);
 
-			if (fs.fail())
-				return Tools::Result(Tools::ResultCode::FileWriteError);
+			// BinaryBookEntry::move_indexは32bitなので、これを超える指し手数は扱えない。
+			if (moves.size() > UINT32_MAX)
+				return Tools::Result(Tools::ResultCode::SomeError);
 		}
 
+		BinaryBookHeader header = {};
+		std::memcpy(header.magic, kBinaryBookMagic, sizeof(header.magic));
+		header.version     = kBinaryBookVersion;
+		header.key_bits    = 64;
+		header.entry_count = entries.size();
+		header.move_count  = moves.size();
+
+		fstream fs;
+		fs.open(filename, ios::out | ios::binary);
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		// msys2のgccなどでは一度に2GB以上書き出せないので細切れに書き出す。
+		auto write_blocks = [&](const void* ptr, u64 size) {
+			const u64 block_size = 1024 * 1024 * 1024;
+			for (u64 pos = 0; pos < size; pos += block_size)
+				fs.write((const char*)ptr + pos, std::min(block_size, size - pos));
+		};
+
+		write_blocks(&header, sizeof(header));
+		write_blocks(entries.data(), entries.size() * sizeof(BinaryBookEntry));
+		write_blocks(moves.data(), moves.size() * sizeof(BinaryBookMove));
+
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileWriteError);
+
 		fs.close();
 
-		cout << endl << "done!" << endl;
+		cout << endl << "positions = " << entries.size() << " , moves = " << moves.size() << endl << "done!" << endl;
+
+		return Tools::Result::Ok();
+	}
+
+	// バイナリ形式の定跡ファイルをmapする。
+	Tools::Result MemoryBook::read_binary_book(const std::string& filename)
+	{
+		auto result = binary_book.open(filename);
+		if (result.is_not_ok())
+			return result;
+
+		// ヘッダーと、ファイルサイズの整合性をチェックする。
+		const auto& header = *(const BinaryBookHeader*)binary_book.data();
+		if (binary_book.size() < sizeof(BinaryBookHeader)
+			|| std::memcmp(header.magic, kBinaryBookMagic, sizeof(header.magic)) != 0
+			|| header.version  != kBinaryBookVersion
+			|| header.key_bits != 64
+			|| binary_book.size() != sizeof(BinaryBookHeader)
+				+ header.entry_count * sizeof(BinaryBookEntry) + header.move_count * sizeof(BinaryBookMove))
+		{
+			binary_book.close();
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		}
+
+		binary_entries     = (const BinaryBookEntry*)(binary_book.data() + sizeof(BinaryBookHeader));
+		binary_moves       = (const BinaryBookMove*)(binary_entries + header.entry_count);
+		binary_entry_count = header.entry_count;
 
 		return Tools::Result::Ok();
 	}
 
+	// binary_bookからposの局面を二分探索する。
+	// mapした領域は読み込み専用なので、lockは不要。
+	BookMovesPtr MemoryBook::find_binary(const Position& pos) const
+	{
+		const u64 key = pos.key();
+
+		auto last = binary_entries + binary_entry_count;
+		auto it = std::lower_bound(binary_entries, last, key,
+			[](const BinaryBookEntry& entry, u64 k) { return entry.key < k; });
+
+		if (it == last || it->key != key)
+			return BookMovesPtr();
+
+		BookMovesPtr pml_entry(new BookMoves());
+		for (u32 i = 0; i < it->move_num; ++i)
+			pml_entry->push_back(binary_moves[it->move_index + i].to_book_move());
+
+		// write_binary_book()でsortしてから書き出しているので、ここでは並び替わらないはずだが、
+		// sortedフラグを立てておくために呼び出しておく。
+		pml_entry->sort_moves();
+
+		return pml_entry;
+	}
+
+	// 局面をコンパクトな形式で保持するかを設定する。
+	void MemoryBook::set_compact(bool compact_)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+#if !defined(USE_SFEN_PACKER)
+		if (compact_)
+		{
+			sync_cout << "info string Error! : compact book needs USE_SFEN_PACKER." << sync_endl;
+			return;
+		}
+#endif
+
+		book_body.clear();
+		compact_body.clear();
+		compact = compact_;
+
+		// 次のread_book()で必ず読み直されるように。
+		book_name = "";
+		pure_book_name = "";
+	}
+
+	// メモリ上に保持している局面数
+	size_t MemoryBook::size() const
+	{
+		std::lock_guard<std::recursive_mutex> lock(const_cast<MemoryBook*>(this)->mutex_);
+		return compact ? compact_body.size() : book_body.size();
+	}
+
+	// メモリ上に保持している定跡のおおよそのバイト数
+	u64 MemoryBook::memory_usage() const
+	{
+		std::lock_guard<std::recursive_mutex> lock(const_cast<MemoryBook*>(this)->mutex_);
+
+		if (compact)
+			return compact_body.memory_usage();
+
+		// std::unordered_mapの内部構造は処理系依存なので、おおよその値。
+		// bucketの配列 + 各node(次のnodeへのpointer、hash値のcache、key/value)
+		u64 total = book_body.bucket_count() * sizeof(void*);
+		for (auto& it : book_body)
+		{
+			total += sizeof(void*) + sizeof(size_t) + sizeof(BookType::value_type);
+
+			// sfen文字列はSSO(15文字まで)に収まらなければheapに確保されている。
+			if (it.first.capacity() > 15)
+				total += it.first.capacity() + 1;
+
+			// shared_ptrの制御ブロック + BookMoves本体 + 指し手の配列
+			total += 2 * sizeof(void*) + sizeof(BookMoves) + it.second->size() * sizeof(BookMove);
+		}
+		return total;
+	}
+
+	// 局面数とメモリ使用量を出力する。
+	void MemoryBook::print_memory_usage() const
+	{
+		const u64 positions = size();
+		const u64 memory = memory_usage();
+
+		sync_cout << "info string book positions = " << positions
+			<< " , memory = " << memory / (1024 * 1024) << "[MB]"
+			<< " , " << (positions ? memory / positions : 0) << " bytes/position"
+			<< (compact ? " (compact)" : "") << sync_endl;
+	}
+
+	// sfen文字列から、compact_bodyのkeyを得る。
+	bool MemoryBook::compact_key(const std::string& sfen, PackedSfen& packed, u16& ply) const
+	{
+#if defined(USE_SFEN_PACKER)
+		// 末尾の手数。IgnoreBookPlyで取り除かれていれば0。
+		auto sfen_left = StringExtension::trim_number(sfen);
+		ply = (u16)std::clamp(StringExtension::to_int(sfen.substr(sfen_left.length()), 0), 0, (int)UINT16_MAX);
+
+		Position pos;
+		StateInfo si;
+		pos.set(sfen, &si, Threads.main());
+		pos.sfen_pack(packed);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// Positionから、compact_bodyのkeyを得る。find()で用いるのでsfen()を経由しない。
+	bool MemoryBook::compact_key(const Position& pos, PackedSfen& packed, u16& ply) const
+	{
+#if defined(USE_SFEN_PACKER)
+		// read_book()でIgnoreBookPlyのときは手数を取り除いて読み込んでいる。(trim()と同じ扱い)
+		ply = Options["IgnoreBookPly"] ? 0 : (u16)std::min(pos.game_ply(), (int)UINT16_MAX);
+
+		// sfen_pack()はposを書き換えないが、constが付いていないので外して呼び出す。
+		const_cast<Position&>(pos).sfen_pack(packed);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// compact_bodyの局面をposに設定する。
+	void MemoryBook::compact_position(const CompactBookEntry& entry, Position& pos, StateInfo* si) const
+	{
+#if defined(USE_SFEN_PACKER)
+		pos.set_from_packed_sfen(entry.sfen, si, Threads.main(), false, entry.ply);
+#endif
+	}
+
+	// compact_bodyの局面のsfen文字列を得る。
+	std::string MemoryBook::compact_sfen(const CompactBookEntry& entry) const
+	{
+#if defined(USE_SFEN_PACKER)
+		Position pos;
+		StateInfo si;
+		compact_position(entry, pos, &si);
+
+		// 手数が0のときは、手数なしで読み込まれた局面なので、手数は付けずに返す。
+		return entry.ply == 0 ? StringExtension::trim_number(pos.sfen()) : pos.sfen();
+#else
+		return std::string();
+#endif
+	}
+
+	// compact_bodyの局面sfenに指し手を追加する。
+	void MemoryBook::insert_compact(const std::string& sfen, const std::vector<BookMove>& moves, bool overwrite)
+	{
+		PackedSfen packed;
+		u16 ply;
+		if (!compact_key(sfen, packed, ply))
+			return;
+
+		// 一度BookMovesに戻して、BookMoves::insert()と同じ規則で合算してから書き戻す。
+		auto entry = compact_body.find(packed, ply);
+		BookMovesPtr move_list = entry == nullptr ? BookMovesPtr(new BookMoves()) : compact_body.get_moves(*entry, false);
+		for (auto& bp : moves)
+			move_list->insert(bp, overwrite);
+
+		compact_body.set_moves(packed, ply, *move_list);
+	}
+
+	// compact_bodyをテキスト形式で書き出す。
+	Tools::Result MemoryBook::write_compact_book(std::fstream& fs) const
+	{
+		const auto& entries = compact_body.get_entries();
+
+		const size_t thread_num = book_thread_num();
+
+		// 局面(PackedSfen)、手数の順に並べて、手数違いの同一局面は手数の一番若いものだけを書き出す。
+		// (MemoryBook::write_book()と同じ規則)
+		vector<u32> order(entries.size());
+		std::iota(order.begin(), order.end(), 0);
+		Tools::parallel_sort(order, thread_num, [&](u32 lhs, u32 rhs) {
+			int c = std::memcmp(&entries[lhs].sfen, &entries[rhs].sfen, sizeof(PackedSfen));
+			return c != 0 ? c < 0 : entries[lhs].ply < entries[rhs].ply;
+		});
+
+		// 書き出すものだけsfen文字列にしてsfen文字列でsortする。
+		// sfen文字列は局面数分だけ一時的に確保されるが、BookMovesは書き出すときに1局面ずつ作る。
+		vector<pair<string, u32>> vectored_book;
+		const PackedSfen* last_sfen = nullptr;
+		for (auto i : order)
+		{
+			// 指し手のない空っぽのentryは書き出さないように。
+			if (entries[i].move_num == 0)
+				continue;
+
+			if (last_sfen != nullptr && std::memcmp(last_sfen, &entries[i].sfen, sizeof(PackedSfen)) == 0)
+				continue;
+			last_sfen = &entries[i].sfen;
+
+			vectored_book.emplace_back(string(), i);
+		}
+		vector<u32>().swap(order);
+
+		// sfen文字列化は局面ごとに独立しているので、スレッドで分担して行う。
+		Tools::parallel_run(thread_num, [&](size_t id) {
+			const size_t start = vectored_book.size() * id / thread_num, end = vectored_book.size() * (id + 1) / thread_num;
+			for (size_t i = start; i < end; ++i)
+				vectored_book[i].first = compact_sfen(entries[vectored_book[i].second]);
+		});
+
+		Tools::parallel_sort(vectored_book, thread_num, [](const pair<string, u32>& lhs, const pair<string, u32>& rhs) {
+			return lhs.first < rhs.first;
+		});
+
+		return write_sorted_book(fs, vectored_book, thread_num, [&](u32 index) { return compact_body.get_moves(entries[index]); });
+	}
+
 	// book_body.find()のwrapper。book_body.find()ではなく、こちらのfindを呼び出して用いること。
 	// sfen : sfen文字列(末尾にplyまで書かれているものとする)
 	BookMovesPtr MemoryBook::find(const std::string& sfen) const
 	{
 		std::lock_guard<std::recursive_mutex> lock(const_cast<MemoryBook*>(this)->mutex_);
+		return find_unlocked(sfen);
+	}
+
+	// find(const std::string&)の、lockを取らない版。
+	BookMovesPtr MemoryBook::find_unlocked(const std::string& sfen) const
+	{
+		if (compact)
+		{
+			PackedSfen packed;
+			u16 ply;
+			if (!compact_key(trim(sfen), packed, ply))
+				return BookMovesPtr();
+
+			auto entry = compact_body.find(packed, ply);
+			return entry == nullptr ? BookMovesPtr() : compact_body.get_moves(*entry);
+		}
 
 		auto it = book_body.find(trim(sfen));
 		return it == book_body.end() ? BookMovesPtr() : it->second;
@@ -513,13 +1312,29 @@ namespace Book
 	void MemoryBook::append(const std::string& sfen, const Book::BookMovesPtr& ptr)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+		if (compact)
+		{
+			PackedSfen packed;
+			u16 ply;
+			if (compact_key(StringExtension::trim(sfen), packed, ply))
+				compact_body.set_moves(packed, ply, *ptr);
+			return;
+		}
+
 		book_body[sfen] = ptr;
 	}
 
 
-	BookMovesPtr MemoryBook::find(const Position& pos)
+	BookMovesPtr MemoryBook::find(const Position& pos) const
 	{
-		std::lock_guard<std::recursive_mutex> lock(mutex_);
+		// この関数は複数スレッドから同時に呼び出されうるが、lockは取らない。
+		// read_book()以降、book_bodyもtext_bookもbinary_bookも書き換わらないので、読み出すだけなら安全である。
+		// (見つけたBookMovesが並び替えられていなければsort_moves()で並び替えるが、それはBookMoves側のlockで保護される)
+
+		// バイナリ形式の定跡ならhash keyで調べられる。
+		if (binary_book.is_open())
+			return find_binary(pos);
 
 		// "no_book"は定跡なしという意味なので定跡の指し手が見つからなかったことにする。
 		if (pure_book_name == "no_book")
@@ -551,163 +1366,159 @@ namespace Book
 		else {
 			// やねうら王定跡データベースを用いて指し手を選択する
 
+			// コンパクトな形式なら、sfen()を呼び出さずにPackedSfenで調べられる。
+			if (compact && !on_the_fly)
+			{
+				PackedSfen packed;
+				u16 ply;
+				if (!compact_key(pos, packed, ply))
+					return BookMovesPtr();
+
+				auto entry = compact_body.find(packed, ply);
+				return entry == nullptr ? BookMovesPtr() : compact_body.get_moves(*entry);
+			}
+
 			// 定跡がないならこのまま返る。(sfen()を呼び出すコストの節約)
 			if (!on_the_fly && book_body.size() == 0)
 				return BookMovesPtr();
 
-			auto sfen = pos.sfen();
-
-			BookType::iterator it;
-
 			// "sfen lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1"のような文字列である。
 			// IgnoreBookPlyがtrueのときは、
 			// "sfen lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b -"まで一致したなら一致したとみなせば良い。
 			// これはStringExtension::trim_number()でできる。
 
-			if (on_the_fly)
-			{
-				// ディスクから読み込むなら、いずれにせよ、新規エントリーを作成してそれを返す必要がある。
-				BookMovesPtr pml_entry(new BookMoves());
+			// IgnoreBookPlyのときは末尾の手数は取り除いておく。
+			// read_book()で取り除くと、そのあと書き出すときに手数が消失するのでまずい。(気がする)
+			auto sfen = trim(pos.sfen());
 
-				// IgnoreBookPlyのときは末尾の手数は取り除いておく。
-				// read_book()で取り除くと、そのあと書き出すときに手数が消失するのでまずい。(気がする)
-				sfen = trim(sfen);
-
-				// ファイル自体はオープンされてして、ファイルハンドルはfsだと仮定して良い。
+			if (on_the_fly)
+				return find_on_the_fly(sfen);
 
-				// ファイルサイズ取得
-				// C++的には未定義動作だが、これのためにsys/stat.hをincludeしたくない。
-				// ここでfs.clear()を呼ばないとeof()のあと、tellg()が失敗する。
-				fs.clear();
-				fs.seekg(0, std::ios::beg);
-				auto file_start = fs.tellg();
+			// on the flyではない場合
+			auto it = book_body.find(sfen);
+			if (it != book_body.end())
+			{
+				// read_book()で読み込んだものは並び替え済みなので、ここでは何もしないはず。
+				// (makebookなどで、あとから追加された局面に限り並び替えが発生する。そのときは共有しているBookMovesを書き換える)
+				it->second->sort_moves();
+				return BookMovesPtr(it->second);
+			}
 
-				// 現在のファイルのシーク位置を返す関数(ファイルの先頭位置を0とする)
-				auto current_pos = [&]() { return s64(fs.tellg() - file_start); };
+			// 空のentryを返す。
+			return BookMovesPtr();
+		}
+	}
 
-				fs.clear();
-				fs.seekg(0, std::ios::end);
+	// on_the_fly == trueのときに、memory mapしたテキスト形式の定跡ファイルから局面を二分探索する。
+	// ファイルハンドルのseek位置のような共有状態を持たないので、複数スレッドから同時に呼び出して良い。
+	BookMovesPtr MemoryBook::find_on_the_fly(const std::string& sfen) const
+	{
+		const char* data = (const char*)text_book.data();
+		const s64 file_size = (s64)text_book.size();
 
-				// ファイルサイズ(現在、ファイルの末尾を指しているはずなので..)
-				auto file_size = current_pos();
+		// posから始まる行の行末('\n'の位置。なければfile_size)を返す。
+		auto line_end = [&](s64 pos) {
+			auto p = (const char*)std::memchr(data + pos, '\n', size_t(file_size - pos));
+			return p == nullptr ? file_size : s64(p - data);
+		};
 
-				// 与えられたseek位置から"sfen"文字列を探し、それを返す。どこまでもなければ""が返る。
-				// hackとして、seek位置は-2しておく。(1行読み捨てるので、seek_fromぴったりのところに
-				// "sfen"から始まる文字列があるとそこを読み捨ててしまうため。-2してあれば、そこに
-				// CR+LFがあるはずだから、ここを読み捨てても大丈夫。)
-				auto next_sfen = [&](s64 seek_from)
+		// 与えられたseek位置以降で、"sfen"から始まる行を探し、そのsfen文字列を返す。どこまでもなければ""が返る。
+		// next_line_startには、その行の次の行の先頭位置が返る。
+		// seek_fromが行の途中を指しているときは、その行は読み捨てる。(seek_fromぴったりから始まる行は読み捨てない)
+		auto next_sfen = [&](s64 seek_from, s64& next_line_start)
+		{
+			s64 p = seek_from == 0 ? 0 : std::min(line_end(seek_from - 1) + 1, file_size);
+			while (p < file_size)
+			{
+				s64 e = line_end(p);
+				if (e - p >= 5 && std::memcmp(data + p, "sfen ", 5) == 0)
 				{
-					string line;
-
-					seek_from = std::max( s64(0), seek_from - 2);
-					fs.seekg(seek_from , fstream::beg);
-
-					// --- 1行読み捨てる
-
-					// seek_from == 0の場合も、ここで1行読み捨てられるが、1行目は
-					// ヘッダ行であり、問題ない。
-					getline(fs, line);
-					
-					// getlineはeof()を正しく反映させないのでgetline()の返し値を用いる必要がある。
-					while (getline(fs, line))
-					{
-						if (!line.compare(0, 4, "sfen"))
-						{
-							// ios::binaryつけているので末尾に'\r'が付与されている。禿げそう。
-							// →　trim()で吸収する。(trimがStringExtension::trim_number()を呼び出すがそちらで吸収される)
-							return trim(line.substr(5));
-							// "sfen"という文字列は取り除いたものを返す。
-							// IgnoreBookPly == trueのときは手数の表記も取り除いて比較したほうがいい。
-						}
-					}
-					return string();
-				};
+					next_line_start = std::min(e + 1, file_size);
 
-				// バイナリサーチ
-				// [s,e) の範囲で求める。
+					// "sfen"という文字列は取り除いたものを返す。
+					// 末尾に'\r'があるかも知れないが、trim()で吸収される。
+					// IgnoreBookPly == trueのときは手数の表記も取り除いて比較したほうがいい。
+					return trim(string(data + p + 5, size_t(e - p - 5)));
+				}
+				p = e + 1;
+			}
+			next_line_start = file_size;
+			return string();
+		};
 
-				s64 s = 0, e = file_size, m;
-				// s,eは無符号型だと、s - 2のような式が負にならないことを保証するのが面倒くさい。
-				// こういうのを無符号型で扱うのは筋が悪い。
+		// バイナリサーチ
+		// [s,e) の範囲に目的の"sfen"の行の先頭があるものとして探す。
 
-				while (true)
-				{
-					m = (s + e) / 2;
+		s64 s = 0, e = file_size, m, next = 0;
+		// s,eは無符号型だと、s - 1のような式が負にならないことを保証するのが面倒くさい。
+		// こういうのを無符号型で扱うのは筋が悪い。
 
-					auto sfen2 = next_sfen(m);
-					if (sfen2 == "" || sfen < sfen2)
-					{ // 左(それより小さいところ)を探す
-						e = m;
-					}
-					else if (sfen > sfen2)
-					{ // 右(それより大きいところ)を探す
-						s = current_pos();
-					}
-					else {
-						// 見つかった！
-						break;
-					}
+		while (true)
+		{
+			m = (s + e) / 2;
 
-					// 40バイトより小さなsfenはありえないので、この範囲に２つの"sfen"で始まる文字列が
-					// 入っていないことは保証されている。
-					// ゆえに、探索範囲がこれより小さいなら先頭から調べて("sfen"と書かれている文字列を探して)終了。
-					if (s + 40 > e)
-					{
-						if ( next_sfen(s) == sfen)
-							// 見つかった！
-							break;
+			auto sfen2 = next_sfen(m, next);
+			if (sfen2 == "" || sfen < sfen2)
+			{ // 左(それより小さいところ)を探す
+				e = m;
+			}
+			else if (sfen > sfen2)
+			{ // 右(それより大きいところ)を探す
+				s = next;
+			}
+			else {
+				// 見つかった！
+				break;
+			}
 
-						// 見つからなかった
-						return BookMovesPtr();
-					}
+			// 40バイトより小さなsfenはありえないので、この範囲に２つの"sfen"で始まる文字列が
+			// 入っていないことは保証されている。
+			// ゆえに、探索範囲がこれより小さいなら先頭から調べて("sfen"と書かれている文字列を探して)終了。
+			if (s + 40 > e)
+			{
+				if (next_sfen(s, next) == sfen)
+					// 見つかった！
+					break;
 
-				}
-				// 見つけた処理
+				// 見つからなかった
+				return BookMovesPtr();
+			}
+		}
 
-				// read_bookとほとんど同じ読み込み処理がここに必要。辛い。
+		// 見つけた処理
 
-				// sfen文字列が合致したところまでは確定しており、そこまでfileのseekは完了している。
-				// その直後に指し手が書かれているのでそれをgetline()で読み込めば良い。
+		// sfen文字列が合致した行の次の行(next)から、次の"sfen"の行までに指し手が書かれている。
 
-				while (!fs.eof())
-				{
-					string line;
-					getline(fs, line);
+		BookMovesPtr pml_entry(new BookMoves());
 
-					// バージョン識別文字列(とりあえず読み飛ばす)
-					if (line.length() >= 1 && line[0] == '#')
-						continue;
+		for (s64 p = next; p < file_size; )
+		{
+			s64 end = line_end(p);
+			string line(data + p, size_t(end - p));
+			p = end + 1;
 
-					// コメント行(とりあえず読み飛ばす)
-					if (line.length() >= 2 && line.substr(0, 2) == "//")
-						continue;
+			StringExtension::trim_inplace(line);
 
-					// 次のsfenに遭遇したらこれにて終了。
-					if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
-					{
-						break;
-					}
+			// 空行
+			if (line.empty())
+				continue;
 
-					pml_entry->push_back(BookMove::from_string(line));
-				}
-				pml_entry->sort_moves();
-				return pml_entry;
+			// バージョン識別文字列(とりあえず読み飛ばす)
+			if (line[0] == '#')
+				continue;
 
-			} else {
+			// コメント行(とりあえず読み飛ばす)
+			if (line.length() >= 2 && line.substr(0, 2) == "//")
+				continue;
 
-				// on the flyではない場合
-				it = book_body.find(trim(sfen));
-				if (it != book_body.end())
-				{
-					// メモリ上に丸読みしてあるので参照透明だと思って良い。
-					it->second->sort_moves();
-					return BookMovesPtr(it->second);
-				}
+			// 次のsfenに遭遇したらこれにて終了。
+			if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
+				break;
 
-				// 空のentryを返す。
-				return BookMovesPtr();
-			}
+			pml_entry->push_back(BookMove::from_string(line));
 		}
+		pml_entry->sort_moves();
+		return pml_entry;
 	}
 
 	// Apery用定跡ファイルの読み込み
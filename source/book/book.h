@@ -88,7 +88,7 @@ namespace Book
 
 		// copy constructor
 		// std::recursive_mutexを持っているので暗黙のコピーは不可。自前でコピーしてやる。
-		BookMoves(const BookMoves& bm) { sorted = bm.sorted; moves = bm.moves; }
+		BookMoves(const BookMoves& bm) { sorted = bm.sorted.load(); moves = bm.moves; }
 
 		// [ASYNC] BookMoveを一つ追加する
 		// ただし、その局面ですでに同じmoveの指し手が登録されている場合、
@@ -111,10 +111,13 @@ namespace Book
 
 		// [ASYNC] 指し手を出現回数、評価値順に並び替える。
 		// ※　より正確に言うなら、BookMoveのoperator <()で定義されている順。
-		// すでに並び替わっているなら、何もしない。
+		// すでに並び替わっているなら、何もしない。(このときはlockも取らない)
 		// 書き出す寸前とか、読み込んで、定跡にhitした直後とかにsort_moves()を呼び出せば良いという考え。
 		void sort_moves();
 
+		// [ASYNC] sort_moves()で並び替え済みであるか。
+		bool is_sorted() const { return sorted; }
+
 		// [ASYNC] このクラスの持つ指し手集合に対して、それぞれの局面を列挙する時に用いる
 		void foreach(std::function<void(BookMove&)> f);
 
@@ -138,7 +141,8 @@ namespace Book
 		// ↑のmovesがsort済みであるかのフラグ。insertなどに対してfalseに変更しておき、
 		// sort()を呼び出されたら、sort()して、このフラグをtrueに変更する。
 		// なるべく遅延してsortしたいため。
-		bool sorted = false;
+		// sort済みならlockを取らずに読み出せるようにatomicにしてある。
+		std::atomic<bool> sorted = false;
 
 		// このrecordを操作するときのrecursive_mutex
 		std::recursive_mutex mutex_;
@@ -149,6 +153,194 @@ namespace Book
 	// sfen文字列からBookMovesPtrへの写像。(これが定跡データがメモリ上に存在するときの構造)
 	typedef std::unordered_map<std::string /* sfen */, BookMovesPtr > BookType;
 
+	// ----------------------------------
+	//		バイナリ形式の定跡ファイル
+	// ----------------------------------
+
+	// テキスト形式の定跡DB(.db)を"makebook convert_binary"でコンパイルしたもの。
+	// ファイルの構造は、
+	//   BinaryBookHeader
+	//   BinaryBookEntry[entry_count] : 局面のhash key(Position::key())の昇順に並んでいる。
+	//   BinaryBookMove [move_count]  : 各局面の指し手を局面ごとに連結したもの。
+	// となっている。(endianはlittle endianを前提とする)
+	//
+	// read_book()はこれをmemory mapするだけなので、
+	// ・sfen文字列の解析が不要なので読み込みが一瞬で終わる。
+	// ・同じ定跡ファイルを用いる複数のエンジンプロセスで物理メモリが共有される。
+	// ・読み込み専用なのでfind()にlockが要らない。
+	// ・hash keyで二分探索するので、find()はO(log n)でディスクのseekも発生しない。
+	// ・局面はhash keyで区別するので手数は無視される。(Options["IgnoreBookPly"] == trueと同じ挙動)
+
+	struct BinaryBookHeader
+	{
+		// ファイル識別用の文字列。kBinaryBookMagicと一致しなければならない。
+		char magic[16];
+
+		// フォーマットのversion。kBinaryBookVersionと一致しなければならない。
+		u32 version;
+
+		// 局面のhash keyのbit数。(HASH_KEY_BITSに関わらず、Position::key()は64bit)
+		u32 key_bits;
+
+		// BinaryBookEntryの数(局面数)
+		u64 entry_count;
+
+		// BinaryBookMoveの数(全局面の指し手の合計)
+		u64 move_count;
+
+		u8 reserved[24];
+	};
+	static_assert(sizeof(BinaryBookHeader) == 64, "sizeof(BinaryBookHeader) must be 64");
+
+	// 局面ひとつ分の索引
+	struct BinaryBookEntry
+	{
+		// この局面のPosition::key()
+		u64 key;
+
+		// この局面の指し手が格納されているBinaryBookMoveの配列上のindex
+		u32 move_index;
+
+		// この局面の指し手の数
+		u32 move_num;
+	};
+	static_assert(sizeof(BinaryBookEntry) == 16, "sizeof(BinaryBookEntry) must be 16");
+
+	// BookMoveをファイルに書き出すための固定長の形式
+	struct BinaryBookMove
+	{
+		u16 move;
+		u16 ponder;
+		s32 value;
+		s32 depth;
+		u32 reserved;
+		u64 move_count;
+		double win;
+		double draw;
+
+		BinaryBookMove() {}
+		BinaryBookMove(const BookMove& bm)
+			: move(bm.move.to_u16()), ponder(bm.ponder.to_u16()), value(bm.value), depth(bm.depth), reserved(0)
+			, move_count(bm.move_count), win(bm.win), draw(bm.draw) {}
+
+		BookMove to_book_move() const { return BookMove(Move16(move), Move16(ponder), value, depth, move_count, win, draw); }
+	};
+	static_assert(sizeof(BinaryBookMove) == 40, "sizeof(BinaryBookMove) must be 40");
+
+	// BinaryBookHeader::magicに書かれている文字列
+	constexpr char kBinaryBookMagic[16] = "YANEURAOU-BOOK";
+	constexpr u32 kBinaryBookVersion = 1;
+
+	// ----------------------------------
+	//		コンパクトなメモリ上の定跡
+	// ----------------------------------
+
+	// MemoryBookは通常、sfen文字列をkeyとしたstd::unordered_mapに、局面ごとにshared_ptr<BookMoves>を持つ。
+	// これだと1局面あたり数百バイト消費するので、makebookで数千万局面を扱うとメモリが足りなくなる。
+	// そこで、MemoryBook::set_compact(true)としたときは、以下のCompactBookに格納する。
+	// ・局面はPackedSfen(32バイト)と手数でkeyとする。sfen文字列は持たない。
+	// ・指し手は全局面分をひとつの配列(arena)に連続して格納する。
+	// ・指し手の統計情報は量子化してCompactBookMove(16バイト)に詰め込む。
+
+	// 量子化したBookMove
+	struct CompactBookMove
+	{
+		u16 move;
+		u16 ponder;
+
+		// 評価値と探索深さはs16の範囲に丸める。
+		s16 value;
+		s16 depth;
+
+		// 採択回数はu32の範囲で飽和させる。
+		u32 move_count;
+
+		// win,drawは、move_countとは独立に、それぞれを0.5刻みに丸めて16bitに符号化したもの。(encode_count()参照)
+		// 16383.5以下なら元の値に復元される。(move_countが0で、win,drawだけがある定跡も損なわれない)
+		u16 win;
+		u16 draw;
+
+		CompactBookMove() {}
+		CompactBookMove(const BookMove& bm);
+
+		BookMove to_book_move() const;
+
+		// win,drawの回数を16bitに符号化する/元に戻す。
+		static u16 encode_count(double x);
+		static double decode_count(u16 c);
+	};
+	static_assert(sizeof(CompactBookMove) == 16, "sizeof(CompactBookMove) must be 16");
+
+	// CompactBookの局面ひとつ分
+	struct CompactBookEntry
+	{
+		// 局面(手数は含まない)
+		PackedSfen sfen;
+
+		// この局面の指し手が格納されているarena上のindex
+		u32 move_index;
+
+		// この局面の指し手の数
+		u16 move_num;
+
+		// 手数。sfen文字列に手数が書かれていなかったときは0。
+		u16 ply;
+	};
+	static_assert(sizeof(CompactBookEntry) == 40, "sizeof(CompactBookEntry) must be 40");
+
+	// CompactBookEntryの集合と、指し手のarena。
+	// 局面はPackedSfenと手数のhash値によるopen addressingのhash tableで引く。
+	// このクラス自体はthread safeではない。MemoryBookのほうでlockを取ってから呼び出す。
+	struct CompactBook
+	{
+		// 格納している局面を全部捨てる。
+		void clear();
+
+		// 格納している局面数
+		size_t size() const { return entries.size(); }
+
+		// 確保しているメモリのバイト数
+		u64 memory_usage() const;
+
+		// 局面を探す。見つからなければnullptr。
+		const CompactBookEntry* find(const PackedSfen& sfen, u16 ply) const;
+
+		// entryの指し手をBookMovesにして返す。
+		// sort == falseなら、格納した順のまま返す。(並び替えた指し手を書き戻すと、同点の指し手の順序が変わってしまうので)
+		BookMovesPtr get_moves(const CompactBookEntry& entry, bool sort = true) const;
+
+		// 局面の指し手をbmで置き換える。局面が登録されていなければ追加する。
+		// 指し手はbmの順番のまま格納し、get_moves()のときに並び替える。
+		void set_moves(const PackedSfen& sfen, u16 ply, BookMoves& bm);
+
+		// 格納している局面。(追加した順)
+		const std::vector<CompactBookEntry>& get_entries() const { return entries; }
+
+	private:
+		// 局面のhash値
+		static u64 hash(const PackedSfen& sfen, u16 ply);
+
+		// indexのなかで、sfen,plyの局面が格納されている(あるいは格納すべき)slot
+		size_t find_slot(const PackedSfen& sfen, u16 ply) const;
+
+		// indexを作り直す。
+		void rehash(size_t slot_num);
+
+		// arenaから参照されていない指し手を取り除く。
+		void compact_arena();
+
+		std::vector<CompactBookEntry> entries;
+
+		// entriesへのindexのhash table。空きslotはUINT32_MAX。要素数は2の累乗。
+		std::vector<u32> index;
+
+		// 全局面の指し手
+		std::vector<CompactBookMove> arena;
+
+		// arenaのなかで、もう参照されていない指し手の数
+		u64 arena_garbage = 0;
+	};
+
 	// メモリ上にある定跡ファイル
 	// ・sfen文字列をkeyとして、局面の指し手へ変換するのが主な役割。(このとき重複した指し手は除外するものとする)
 	// ・on the flyが指定されているときは実際はメモリ上にはないがこれを透過的に扱う。
@@ -158,7 +350,12 @@ namespace Book
 		// ・見つからなかった場合、nullptrが返る。
 		// ・read_book()のときにon_the_flyが指定されていれば実際にはメモリ上には定跡データが存在しないので
 		// ファイルを調べに行き、BookMovesPtrをメモリ上に作って、それをくるんだBookMovesPtrを返す。
-		BookMovesPtr find(const Position& pos);
+		// ・この関数はlockを取らない。read_book()のあと、定跡を書き換えない限りは、
+		//   on_the_flyであるかに関わらず、複数スレッドから同時に呼び出して問題ない。
+		// ・ただし、返す前にBookMoves::sort_moves()を呼び出すので、並び替えられていない局面(read_book()のあとに
+		//   append(),insert()したもの)については、共有しているBookMovesを書き換える。(読み出し専用ではない)
+		//   read_book()で読み込んだ局面は読み込み時に並び替え済みなので、書き換えは起きない。
+		BookMovesPtr find(const Position& pos) const;
 
 		// [ASYNC] 定跡を内部に読み込む。
 		// ・Aperyの定跡ファイルは"book/book.bin"だと仮定。(これはon the fly読み込みに非対応なので丸読みする)
@@ -176,6 +373,12 @@ namespace Book
 		// また、事前にis_ready()は呼び出されているものとする。
 		Tools::Result write_book(const std::string& filename /*, bool sort = false*/) const;
 
+		// [ASYNC] 定跡ファイルをバイナリ形式(BinaryBookHeaderのコメント参照)で書き出す。
+		// ・"makebook convert_binary"コマンドで用いる。
+		// ・局面はPosition::key()で区別されるので、手数違いの同一局面は手数の一番若いものだけが書き出される。
+		// ・事前にis_ready()は呼び出されているものとする。
+		Tools::Result write_binary_book(const std::string& filename) const;
+
 		// [ASYNC] Aperyの定跡ファイルを読み込む
 		// ・この関数はread_bookの下請けとして存在する。外部から直接呼び出すのは定跡のコンバートの時ぐらい。
 		Tools::Result read_apery_book(const std::string& filename);
@@ -189,6 +392,10 @@ namespace Book
 		// [ASYNC] book_body.find()のwrapper。book_body.find()ではなく、こちらのfindを呼び出して用いること。
 		BookMovesPtr find(const std::string& sfen) const;
 
+		// find(const std::string&)の、lockを取らない版。BookMovesの並び替えも行わない。
+		// ・定跡を書き換えていない間であれば、複数スレッドから同時に呼び出して良い。(makebook mergeで用いる)
+		BookMovesPtr find_unlocked(const std::string& sfen) const;
+
 		// [ASYNC] メモリに保持している定跡に局面を一つ追加する。
 		//   book_body[sfen] = ptr;
 		// と等価。すでに登録されているとしたら、それは置き換わる。
@@ -201,8 +408,34 @@ namespace Book
 		void insert(const std::string& sfen, const BookMove& bp , bool overwrite = true);
 
 		// [ASYNC] このクラスの持つ定跡DBに対して、それぞれの局面を列挙する時に用いる
+		// ・コンパクトな形式のときは、fに渡されるBookMovesPtrはコピーなので、それを書き換えても定跡には反映されない。
 		void foreach(std::function<void(std::string /*sfen*/, BookMovesPtr)> f);
 
+		// [ASYNC] foreach()の並列版。thread_num個のスレッドで局面を分担して列挙する。
+		// ・fは複数のスレッドから同時に呼び出される。thread_idは0～thread_num-1で、呼び出し元のスレッドを表す。
+		// ・lockは取らないので、列挙している間、このMemoryBookを書き換えてはならない。
+		// 　(find(const Position&)やfind_unlocked()のように、lockを取らない読み出しは同時に行って良い)
+		void foreach_parallel(size_t thread_num, std::function<void(size_t /*thread_id*/, const std::string& /*sfen*/, BookMovesPtr)> f) const;
+
+		// [ASYNC] 局面をコンパクトな形式(CompactBookのコメント参照)で保持するかを設定する。
+		// ・保持している定跡はクリアされる。このあとのread_book()、insert()などはこの形式で格納される。
+		// ・makebookのfrom_sfen,think,merge,sort,convert_binaryで"compact"を指定したときに用いる。
+		// ・USE_SFEN_PACKERがdefineされていないと使えない。
+		void set_compact(bool compact_);
+
+		// 局面をコンパクトな形式で保持しているか。
+		bool is_compact() const { return compact; }
+
+		// [ASYNC] メモリ上に保持している局面数
+		size_t size() const;
+
+		// [ASYNC] メモリ上に保持している定跡のおおよそのバイト数
+		// ・コンパクトな形式にしたときにどれだけ減るかの目安にする。
+		u64 memory_usage() const;
+
+		// [ASYNC] 局面数とメモリ使用量を"info string"で出力する。
+		void print_memory_usage() const;
+
 	protected:
 
 		// メモリ上に読み込まれた定跡本体
@@ -229,8 +462,13 @@ namespace Book
 		// これが異なるならファイルの読み直しが必要になる。
 		bool ignoreBookPly = false;
 
-		// 上のon_the_fly == trueのときに、開いている定跡ファイルのファイルハンドル
-		std::fstream fs;
+		// 上のon_the_fly == trueのときに、開いている定跡ファイルをmemory mapしたもの。
+		// 複数スレッドから同時にfind()されても、seek位置のような共有状態がないのでlockが要らない。
+		MemoryMappedFile text_book;
+
+		// on_the_fly == trueのときに、text_bookから局面を二分探索する。find()の下請け。
+		// sfen : trim()済みのsfen文字列
+		BookMovesPtr find_on_the_fly(const std::string& sfen) const;
 
 		// read_book()のときに読み込んだbookの名前
 		// ・on_the_fly == trueのときは、読み込む予定のファイルの名前。
@@ -238,6 +476,52 @@ namespace Book
 		// 判定のためにファイル名を内部的に保持してある。
 		std::string book_name;
 		std::string pure_book_name; // book_nameからフォルダ名を取り除いたもの。
+
+		// --- バイナリ形式の定跡ファイル
+
+		// read_book()で読み込んだ定跡ファイルがバイナリ形式であれば、それをmapしたもの。
+		// テキスト形式の定跡を読み込んだときはis_open() == falseである。
+		MemoryMappedFile binary_book;
+
+		// binary_bookの索引部と指し手部の先頭。
+		const BinaryBookEntry* binary_entries = nullptr;
+		const BinaryBookMove*  binary_moves   = nullptr;
+		u64 binary_entry_count = 0;
+
+		// テキスト形式の定跡ファイルをメモリに丸読みする。read_book()の下請け。
+		// Options["Threads"]個のスレッドで並列に解析する。
+		Tools::Result read_text_book(const std::string& filename);
+
+		// バイナリ形式の定跡ファイルをmapする。read_book()の下請け。
+		Tools::Result read_binary_book(const std::string& filename);
+
+		// binary_bookからposの局面を二分探索する。find()の下請け。
+		BookMovesPtr find_binary(const Position& pos) const;
+
+		// --- コンパクトな形式
+
+		// set_compact(true)されているか。
+		bool compact = false;
+
+		// compact == trueのときの定跡本体。book_bodyのほうは使わない。
+		CompactBook compact_body;
+
+		// sfen文字列(trim()済み)から、compact_bodyのkeyを得る。
+		// USE_SFEN_PACKERがdefineされていなくてkeyが得られないときはfalseが返る。
+		bool compact_key(const std::string& sfen, PackedSfen& packed, u16& ply) const;
+		bool compact_key(const Position& pos, PackedSfen& packed, u16& ply) const;
+
+		// compact_bodyの局面をposに設定する。
+		void compact_position(const CompactBookEntry& entry, Position& pos, StateInfo* si) const;
+
+		// compact_bodyの局面のsfen文字列を得る。
+		std::string compact_sfen(const CompactBookEntry& entry) const;
+
+		// compact_bodyの局面sfenに指し手を追加する。insert()の下請け。
+		void insert_compact(const std::string& sfen, const std::vector<BookMove>& moves, bool overwrite);
+
+		// compact_bodyをテキスト形式で書き出す。write_book()の下請け。
+		Tools::Result write_compact_book(std::fstream& fs) const;
 	};
 
 #if defined (ENABLE_MAKEBOOK_CMD)
@@ -268,8 +552,7 @@ namespace Book
 		// ・ただしrootMoves[0].pv[1]が合法手である保証はない。合法手でなければGUI側が弾くと思う。
 		// ・limit.silent == falseのときには画面に何故その指し手が選ばれたのか理由を出力する。
 		// ・この関数自体はthread safeなのでread_book()したあとは非同期に呼び出して問題ない。
-		// 　ただし、on_the_flyのときは、ディスクアクセスが必要で、その部分がthread safeではないので
-		//   on_the_fly == falseでなければ、非同期にこの関数を呼び出してはならない。
+		// 　on_the_flyのときも定跡ファイルはmemory mapしてあるので非同期に呼び出して良い。
 		// ・Options["USI_OwnBook"]==trueにすることでエンジン側の定跡を有効化されていないなら、
 		// 　probe()には常に失敗する。(falseが返る)
 		bool probe(Thread& th , Search::LimitsType& limit);
@@ -280,8 +563,7 @@ namespace Book
 		// ・定跡にhitしなかった場合はMOVE_NONEが返る。
 		// ・画面には何も表示しない。
 		// ・この関数自体はthread safeなのでread_book()したあとは非同期に呼び出して問題ない。
-		// 　ただし、on_the_flyのときは、ディスクアクセスが必要で、その部分がthread safeではないので
-		//   on_the_fly == falseでなければ、非同期にこの関数を呼び出してはならない。
+		// 　on_the_flyのときも定跡ファイルはmemory mapしてあるので非同期に呼び出して良い。
 		Move probe(Position& pos);
 
 	protected:
@@ -0,0 +1,161 @@
+﻿#include "../config.h"
+
+#if defined(ENABLE_TEST_CMD)
+
+// ----------------------------------
+//      定跡関係のtestコマンド
+// ----------------------------------
+
+// "test bookbench ..."のように"test"コマンドの後続コマンドとして書く。
+
+#include <sstream>
+#include <thread>
+
+#include "book.h"
+
+#include "../position.h"
+#include "../usi.h"
+#include "../thread.h"
+#include "../misc.h"
+
+using namespace std;
+
+namespace {
+
+	// ----------------------------------
+	//      "test bookbench" command
+	// ----------------------------------
+
+	// 複数スレッドから同時に定跡をprobeして、そのスループットを計測する。
+	// MemoryBook::find()がlockを取らずに複数スレッドから呼び出せることの確認も兼ねている。
+	//
+	// BookDir,BookFile,BookOnTheFlyのオプションの値に従って定跡を読み込む。
+	// 各スレッドは平手の初期局面から、定跡にhitすればその指し手のなかからランダムに、
+	// hitしなければ合法手からランダムに指し手を選んで進めていき、各局面で定跡をprobeする。
+	//
+	// 例)
+	//   test bookbench threads 8 loop 100000 plies 32
+	//
+	//   threads : probeするスレッド数
+	//   loop    : 各スレッドがprobeする回数
+	//   plies   : 初期局面から何手目まで進めるか
+	void book_bench(Position& pos, std::istringstream& is)
+	{
+		size_t threads  = 4;
+		u64    loop_max = 100000;
+		int    max_ply  = 32;
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "threads")
+				is >> threads;
+			else if (token == "loop")
+				is >> loop_max;
+			else if (token == "plies")
+				is >> max_ply;
+		}
+
+		threads = std::max(threads, (size_t)1);
+		max_ply = std::clamp(max_ply, 1, MAX_PLY - 1);
+
+		Book::MemoryBook book;
+		auto book_name = Path::Combine((string)Options["BookDir"], (string)Options["BookFile"]);
+		if (book.read_book(book_name, (bool)Options["BookOnTheFly"]).is_not_ok())
+			return;
+
+		cout << "bookbench : book = " << book_name << " , on the fly = " << (bool)Options["BookOnTheFly"]
+			 << " , threads = " << threads << " , loop = " << loop_max << " , plies = " << max_ply << endl;
+
+		vector<u64> probes(threads), hits(threads);
+		auto th = Threads.main();
+
+		auto worker = [&](size_t thread_id)
+		{
+			PRNG prng(20210801 + thread_id);
+			Position p;
+			vector<StateInfo> si(MAX_PLY + 1);
+
+			u64 probe = 0, hit = 0;
+			while (probe < loop_max)
+			{
+				p.set_hirate(&si[0], th);
+
+				for (int ply = 0; ply < max_ply && probe < loop_max; ++ply)
+				{
+					Move m = MOVE_NONE;
+
+					auto moves = book.find(p);
+					++probe;
+					if (moves && moves->size())
+					{
+						++hit;
+						// 定跡の指し手のなかからランダムに選ぶ。(定跡DBには非合法手が混じっていることがあるので確認する)
+						m = p.to_move((*moves)[prng.rand(moves->size())].move);
+						if (!(p.pseudo_legal(m) && p.legal(m)))
+							m = MOVE_NONE;
+					}
+
+					if (m == MOVE_NONE)
+					{
+						MoveList<LEGAL> ml(p);
+						if (ml.size() == 0)
+							break;
+						m = ml.at(prng.rand(ml.size()));
+					}
+
+					p.do_move(m, si[ply + 1]);
+				}
+			}
+			probes[thread_id] = probe;
+			hits[thread_id] = hit;
+		};
+
+		TimePoint start = now();
+
+		vector<std::thread> workers;
+		for (size_t i = 0; i < threads; ++i)
+			workers.emplace_back(worker, i);
+		for (auto& w : workers)
+			w.join();
+
+		TimePoint elapsed = now() - start + 1; // 0除算を避けるために1を足しておく。
+
+		u64 probe_total = 0, hit_total = 0;
+		for (size_t i = 0; i < threads; ++i)
+		{
+			probe_total += probes[i];
+			hit_total   += hits[i];
+		}
+
+		cout << "\n==========================="
+			 << "\nTotal time (ms) : " << elapsed
+			 << "\nProbes          : " << probe_total
+			 << "\nHits            : " << hit_total << " (" << (probe_total ? hit_total * 100 / probe_total : 0) << "%)"
+			 << "\nProbes/second   : " << 1000 * probe_total / elapsed
+			 << endl;
+	}
+
+} // namespace
+
+
+// ----------------------------------
+//      "test" command Decorator
+// ----------------------------------
+
+namespace Test
+{
+	// 定跡関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool book_test_cmd(Position& pos, std::istringstream& is, const std::string& token)
+	{
+		if (token == "bookbench") book_bench(pos, is);  // 複数スレッドから定跡をprobeするbenchをとる。
+		else return false;                               // どのコマンドも処理することがなかった
+
+		// いずれかのコマンドを処理した。
+		return true;
+	}
+
+}
+
+
+#endif // defined(ENABLE_TEST_CMD)
@@ -77,6 +77,7 @@ namespace Book
 		cout << "> makebook merge book_src1.db book_src2.db book_merged.db" << endl;
 		cout << "> makebook sort book_src.db book_sorted.db" << endl;
 		cout << "> makebook convert_from_apery book_src.bin book_converted.db" << endl;
+		cout << "> makebook convert_binary book_src.db book_converted.db" << endl;
 		cout << "> makebook build_tree book2019.db user_book1.db" << endl;
 		cout << "> makebook mcts filename book2021.db" << endl;
 
@@ -126,9 +126,11 @@ namespace Book
 		bool book_sort = token == "sort";
 		// 定跡の変換
 		bool convert_from_apery = token == "convert_from_apery";
+		// バイナリ形式の定跡への変換
+		bool convert_binary = token == "convert_binary";
 		
 		// いずれのコマンドでもないなら、このtokenのコマンドを自分は処理できない。
-		if (!(from_sfen || from_thinking || book_merge || book_sort || convert_from_apery))
+		if (!(from_sfen || from_thinking || book_merge || book_sort || convert_from_apery || convert_binary))
 			return 0;
 
 		if (from_sfen || from_thinking)
@@ -181,6 +183,9 @@ namespace Book
 			// "makebook think"コマンド時の自動保存の間隔。デフォルト15分。
 			u64 book_save_interval = 15 * 60;
 
+			// 定跡をメモリ上でコンパクトな形式(CompactBookのコメント参照)で保持するか。
+			bool compact = false;
+
 			while (true)
 			{
 				token = "";
@@ -199,6 +204,8 @@ namespace Book
 					is >> cluster_id >> cluster_num;
 				else if (from_thinking && token == "book_save_interval")
 					is >> book_save_interval;
+				else if (token == "compact")
+					compact = true;
 				else
 				{
 					cout << "Error! : Illigal token = " << token << endl;
@@ -232,6 +239,9 @@ namespace Book
 					 << " cluster = " << cluster_id << "/" << cluster_num << endl
 					 << " book_save_interval = " << book_save_interval << endl;
 
+			if (compact)
+				cout << "compact book" << endl;
+
 			// 解析対象とするsfen集合。
 			// 読み込むべきsfenファイル名が2つ指定されている時は、
 			// 先手用と後手用の局面で個別のsfenファイルが指定されているということ。
@@ -272,6 +282,7 @@ namespace Book
 			cout << "..done" << endl;
 
 			MemoryBook book;
+			book.set_compact(compact);
 
 			if (from_thinking)
 			{
@@ -546,6 +557,7 @@ namespace Book
 
 #endif
 
+			book.print_memory_usage();
 			book.write_book(book_name);
 		}
 		else if (book_merge) {
@@ -559,6 +571,13 @@ namespace Book
 				cout << "Error! book name is empty." << endl;
 				return 1;
 			}
+
+			// 末尾に"compact"と指定されていれば、コンパクトな形式で保持する。
+			string option;
+			is >> option;
+			if (option == "compact")
+				for (auto& b : book)
+					b.set_compact(true);
 			cout << "book merge from " << book_name[0] << " and " << book_name[1] << " to " << book_name[2] << endl;
 			for (int i = 0; i < 2; ++i)
 			{
@@ -569,61 +588,84 @@ namespace Book
 			// 読み込めたので合体させる。
 			cout << "merge..";
 
+			// Options["Threads"]個のスレッドで局面を分担して調べる。
+			// find_unlocked()はlockを取らないので、book[0],book[1]を複数スレッドから同時に調べられる。
+			// (定跡ファイルに書かれているsfen文字列のまま調べる。Position::sfen()を経由すると、
+			//  持ち駒の順番などが正規の形でない局面が、もう片方の定跡で見つからなくなるため)
+			const size_t thread_num = std::max((size_t)Options["Threads"], (size_t)1);
+
+			// 各スレッドの結果。あとで1スレッドでbook2に突っ込む。
+			vector<vector<pair<string, BookMovesPtr>>> results(thread_num);
+
 			// 同一nodeと非同一nodeの統計用
 			// diffrent_nodes1 = book0側にのみあったnodeの数
 			// diffrent_nodes2 = book1側にのみあったnodeの数
-			u64 same_nodes = 0;
-			u64 diffrent_nodes1 = 0, diffrent_nodes2 = 0;
+			vector<u64> same_nodes_(thread_num), diffrent_nodes1_(thread_num), diffrent_nodes2_(thread_num);
 
 			// 1) 探索が深いほうを採用。
 			// 2) 同じ探索深さであれば、MultiPVの大きいほうを採用。
-			book[0].foreach([&](string sfen, BookMovesPtr it0)
+			book[0].foreach_parallel(thread_num, [&](size_t id, const string& sfen, BookMovesPtr it0)
 				{
 					// このエントリーがbook1のほうにないかを調べる。
-					auto it1 = book[1].find(sfen);
+					auto it1 = book[1].find_unlocked(sfen);
+					auto& result = results[id];
 					if (it1 != nullptr)
 					{
-						same_nodes++;
+						same_nodes_[id]++;
 
 						// あったので、良いほうをbook2に突っ込む。
 						// 1) 登録されている候補手の数がゼロならこれは無効なのでもう片方を登録
 						// 2) depthが深いほう
 						// 3) depthが同じならmulti pvが大きいほう(登録されている候補手が多いほう)
 						if (it0->size() == 0)
-							book[2].append(sfen, it1);
+							result.emplace_back(sfen, it1);
 						else if (it1->size() == 0)
-							book[2].append(sfen, it0);
+							result.emplace_back(sfen, it0);
 						else if ((*it0)[0].depth > (*it1)[0].depth)
-							book[2].append(sfen, it0);
+							result.emplace_back(sfen, it0);
 						else if ((*it0)[0].depth < (*it1)[0].depth)
-							book[2].append(sfen, it1);
+							result.emplace_back(sfen, it1);
 						else if (it0->size() >= it1->size())
-							book[2].append(sfen, it0);
+							result.emplace_back(sfen, it0);
 						else
-							book[2].append(sfen, it1);
+							result.emplace_back(sfen, it1);
 					}
 					else {
 						// なかったので無条件でbook2に突っ込む。
-						book[2].append(sfen, it0);
-						diffrent_nodes1++;
+						result.emplace_back(sfen, it0);
+						diffrent_nodes1_[id]++;
 					}
 				});
 
-			// book0の精査が終わったので、book1側で、まだ突っ込んでいないnodeを探して、それをbook2に突っ込む
-			book[1].foreach([&](string sfen, BookMovesPtr it1)
+			// book0の精査が終わったので、book1側で、まだ突っ込んでいないnode(book0にないnode)を探して、それをbook2に突っ込む
+			book[1].foreach_parallel(thread_num, [&](size_t id, const string& sfen, BookMovesPtr it1)
 				{
-					if (book[2].find(sfen) == nullptr)
+					if (book[0].find_unlocked(sfen) == nullptr)
 					{
-						book[2].append(sfen, it1);
-						diffrent_nodes2++;
+						results[id].emplace_back(sfen, it1);
+						diffrent_nodes2_[id]++;
 					}
 				});
 
+			u64 same_nodes = 0;
+			u64 diffrent_nodes1 = 0, diffrent_nodes2 = 0;
+			for (size_t id = 0; id < thread_num; ++id)
+			{
+				for (auto& it : results[id])
+					book[2].append(it.first, it.second);
+				results[id].clear();
+
+				same_nodes      += same_nodes_[id];
+				diffrent_nodes1 += diffrent_nodes1_[id];
+				diffrent_nodes2 += diffrent_nodes2_[id];
+			}
+
 			cout << "..done" << endl;
 
 			cout << "same nodes = " << same_nodes
 				<< " , different nodes =  " << diffrent_nodes1 << " + " << diffrent_nodes2 << endl;
 
+			book[2].print_memory_usage();
 			book[2].write_book(book_name[2]);
 
 		}
@@ -631,8 +673,12 @@ namespace Book
 			// 定跡のsort
 			MemoryBook book;
 			string book_src, book_dst;
-			is >> book_src >> book_dst;
+			string option;
+			is >> book_src >> book_dst >> option;
 			cout << "book sort from " << book_src << " , write to " << book_dst << endl;
+
+			// 末尾に"compact"と指定されていれば、コンパクトな形式で保持する。
+			book.set_compact(option == "compact");
 			book.read_book(book_src);
 
 			book.write_book(book_dst);
@@ -647,6 +693,23 @@ namespace Book
 
 			book.write_book(book_dst);
 		}
+		else if (convert_binary) {
+			// テキスト形式の定跡をバイナリ形式に変換する。
+			MemoryBook book;
+			string book_src, book_dst;
+			string option;
+			is >> book_src >> book_dst >> option;
+			cout << "convert book from " << book_src << " , write binary book to " << book_dst << endl;
+
+			// 末尾に"compact"と指定されていれば、コンパクトな形式で保持する。
+			book.set_compact(option == "compact");
+			if (book.read_book(book_src).is_not_ok())
+				return 1;
+
+			auto result = book.write_binary_book(book_dst);
+			if (result.is_not_ok())
+				cout << "Error! : " << result.to_string() << endl;
+		}
 
 		return 1;
 	}
@@ -168,13 +168,14 @@
 //#define USE_EVAL_LIST
 
 
-// 評価関数を計算したときに、それをHashTableに記憶しておく機能。KPPT評価関数においてのみサポート。
+// 評価関数を計算したときに、それをHashTableに記憶しておく機能。KPPT、KPP_KKPT、NNUE評価関数においてサポート。
 // #define USE_EVAL_HASH
 
 
 // 評価関数パラメーターを共有メモリを用いて他プロセスのものと共有する。
 // 少ないメモリのマシンで思考エンジンを何十個も立ち上げようとしたときにメモリ不足になるので
-// 評価関数をshared memoryを用いて他のプロセスと共有する機能。(対応しているのはいまのところKPPT評価関数のみ。かつWindows限定)
+// 評価関数をshared memoryを用いて他のプロセスと共有する機能。
+// (Windowsでは3駒型(KPPT,KPP_KKPT)のみ。Linux/MacではNNUEにも対応しているが、学習時(EVAL_LEARN)には用いない)
 // #define USE_SHARED_MEMORY_IN_EVAL
 
 
@@ -344,6 +345,7 @@
 
 // "Threads"オプション が 8以下の設定の時でも強制的に bindThisThread()を呼び出して、指定されたNUMAで動作するようにする。
 // "ThreadIdOffset"オプションと併用して、狙ったNUMAで動作することを強制することができる。
+// ※　Linuxでは、これを定義していても、Threadsが8以下のときは"ThreadIdOffset"を指定したときだけ割り当てる。(WinProcGroup::bindThisThread())
 //#define FORCE_BIND_THIS_THREAD
 
 
@@ -400,11 +402,16 @@ constexpr int MAX_PLY_NUM = 246;
 	#define USE_GENERATE_ALL_LEGAL_MOVES
 	#define USE_ENTERING_KING_WIN
 
-	#if defined(YANEURAOU_ENGINE_KPPT) || defined(YANEURAOU_ENGINE_KPP_KKPT)
-		// EvalHashを用いるのは3駒型のみ。それ以外は差分計算用の状態が大きすぎてhitしたところでどうしようもない。
+	#if defined(YANEURAOU_ENGINE_KPPT) || defined(YANEURAOU_ENGINE_KPP_KKPT) || defined(YANEURAOU_ENGINE_NNUE)
+		// 3駒型は差分計算用の状態(EvalSum)ごと、NNUEは評価値だけを保存する。
+		// NNUEでhitしたときはaccumulatorが計算されないままになるが、子局面では数手前の祖先局面から差分計算できる。
+		// NNUEではhit率が低くて割に合わないことが多いので、EvalHashオプションのデフォルトは0(用いない)にしてある。
 		#define USE_EVAL_HASH
+	#endif
 
-		// 評価関数を共用して複数プロセス立ち上げたときのメモリを節約。(いまのところWindows限定)
+	#if defined(YANEURAOU_ENGINE_KPPT) || defined(YANEURAOU_ENGINE_KPP_KKPT) || defined(YANEURAOU_ENGINE_NNUE)
+		// 評価関数を共用して複数プロセス立ち上げたときのメモリを節約。
+		// (WindowsのNNUEは未対応。末尾でundefされる)
 		#define USE_SHARED_MEMORY_IN_EVAL
 	#endif
 
@@ -757,6 +764,13 @@ constexpr bool pretty_jp = false;
 
 #endif
 
+// 評価関数の共有に対応していない組み合わせではオフにしておく。
+// ・WindowsのNNUEは未対応。
+// ・Windows以外では共有メモリを読み込み専用でmapするので、評価関数のパラメーターを書き換える学習時には使えない。
+#if defined(USE_SHARED_MEMORY_IN_EVAL) && ((defined(_WIN32) && defined(EVAL_NNUE)) || (!defined(_WIN32) && defined(EVAL_LEARN)))
+#undef USE_SHARED_MEMORY_IN_EVAL
+#endif
+
 // ----------------------------
 //     evaluate function
 // ----------------------------
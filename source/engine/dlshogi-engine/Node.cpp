@@ -1,11 +1,333 @@
 ﻿#include "Node.h"
 #if defined(YANEURAOU_ENGINE_DEEP)
 #include "../../misc.h"
+#include <vector>
 
 namespace dlshogi
 {
+	// --- class NodeAllocator
+
+	namespace
+	{
+		// NodeAllocatorが確保するメモリの単位。
+		struct NodeChunk
+		{
+			// 次に切り出す位置(dataの先頭からのoffset)。使用中のスレッドしか触らない。
+			size_t used;
+		};
+
+		// alloc()で切り出したメモリの直前に置く情報。
+		struct alignas(16) NodeAllocHeader
+		{
+			size_t size_class;
+			size_t count;
+		};
+
+		// 開放されたメモリ(free list)。切り出したメモリの先頭を次のblockへのポインタとして使う。
+		struct NodeFreeBlock
+		{
+			NodeFreeBlock* next;
+		};
+
+		// chunk一つのサイズ。ChildNodeの配列(最大でMAX_MOVES個)が余裕で入る大きさにしておく。
+		constexpr size_t NODE_CHUNK_SIZE = 1024 * 1024;
+
+		// chunkのうち、切り出しに使う領域の先頭のoffsetとサイズ。
+		constexpr size_t NODE_CHUNK_DATA_OFFSET = (sizeof(NodeChunk) + 15) & ~size_t(15);
+		constexpr size_t NODE_CHUNK_DATA_SIZE   = NODE_CHUNK_SIZE - NODE_CHUNK_DATA_OFFSET;
+
+		// 切り出すサイズ(headerを含む)の区分。
+		// 開放されたメモリは、同じ区分の大きさの確保に再利用する。
+		// 1024byteまでは16byte刻み、それより大きいものは2の累乗の区間を8等分した大きさに切り上げる。(無駄は1/8以下)
+		// ChildNodeの配列は合法手の数によって大きさが異なるので、ある程度まとめておかないと再利用されにくい。
+		constexpr size_t NODE_SIZE_CLASS_NUM = 64 + 8 * 10; // 1MB(2^20)まで
+
+		size_t size_class_of(size_t need)
+		{
+			if (need <= 1024)
+				return (need >> 4) - 1;
+
+			const int b = MSB64(need - 1);
+			return 64 + (b - 10) * 8 + ((need - 1) >> (b - 3)) - 8;
+		}
+
+		size_t size_of_class(size_t size_class)
+		{
+			if (size_class < 64)
+				return (size_class + 1) * 16;
+
+			const size_t k = size_class - 64;
+			return (8 + k % 8 + 1) << (k / 8 + 10 - 3);
+		}
+
+		// 区分ごとのfree list
+		struct NodeFreeList
+		{
+			std::mutex mutex;
+			NodeFreeBlock* head = nullptr;
+
+			// 空であるかをlockせずに調べるためにatomicにしておく。
+			std::atomic<size_t> count{ 0 };
+		};
+
+		// スレッドとfree listとの間で、開放されたメモリをまとめてやりとりする数。
+		// (1つずつやりとりするとfree listのmutexで競合するので)
+		constexpr size_t NODE_FREE_BATCH = 32;
+
+		struct NodeAllocatorState
+		{
+			std::mutex mutex;
+
+			// これまでに確保したすべてのchunk
+			std::vector<NodeChunk*> chunks;
+
+			// 再利用可能なchunk
+			std::vector<NodeChunk*> free_chunks;
+
+			// 区分ごとの、開放されたメモリ
+			NodeFreeList free_lists[NODE_SIZE_CLASS_NUM];
+
+			// free_listsにあるメモリの合計[byte]
+			std::atomic<size_t> free_size{ 0 };
+
+			// release_all()が呼び出されるごとにインクリメントされる。
+			// これより前に取得されたchunkや開放されたメモリは、各スレッドが保持していても、もう使ってはならない。
+			std::atomic<u64> epoch{ 0 };
+		};
+
+		// プログラムの終了時まで開放しない。
+		// (NodeTreeのデストラクタから呼び出されるので、静的オブジェクトの破棄順序に依存しないように)
+		NodeAllocatorState& allocator_state()
+		{
+			static NodeAllocatorState* state = new NodeAllocatorState();
+			return *state;
+		}
+
+		// NodeFreeBlockの単方向リスト
+		struct NodeFreeBlockList
+		{
+			NodeFreeBlock* head = nullptr;
+			size_t count = 0;
+
+			void push(NodeFreeBlock* block) { block->next = head; head = block; ++count; }
+			NodeFreeBlock* pop() { auto* block = head; head = block->next; --count; return block; }
+		};
+
+		// 各スレッドが保持している、chunkと開放されたメモリ。
+		struct NodeThreadCache
+		{
+			// 使用中のchunk
+			NodeChunk* chunk = nullptr;
+
+			// chunkや開放されたメモリを取得した時のNodeAllocatorState::epoch
+			// release_all()のあとは、chunkが他のスレッドに再利用されていることがあるので、
+			// 自分がまだそれらを使って良いかをこれで判定する。
+			u64 epoch = 0;
+
+			// 区分ごとの、このスレッドが開放したメモリ、またはfree listから取ってきたメモリ
+			NodeFreeBlockList free_blocks[NODE_SIZE_CLASS_NUM];
+
+			// release_all()のあとであれば、保持しているものを(触らずに)捨てる。
+			void sync_epoch(u64 current)
+			{
+				if (epoch == current)
+					return;
+
+				chunk = nullptr;
+				for (auto& list : free_blocks)
+					list = NodeFreeBlockList();
+				epoch = current;
+			}
+
+			// size_classのfree_blocksのうち、n個をfree listに戻す。
+			void flush(size_t size_class, size_t n)
+			{
+				auto& list = free_blocks[size_class];
+				if (list.count == 0)
+					return;
+
+				NodeFreeBlockList moved;
+				while (moved.count < n && list.count)
+					moved.push(list.pop());
+				n = moved.count;
+
+				auto& state = allocator_state();
+				auto& free_list = state.free_lists[size_class];
+				{
+					std::lock_guard<std::mutex> lock(free_list.mutex);
+					while (moved.count)
+					{
+						auto* block = moved.pop();
+						block->next = free_list.head;
+						free_list.head = block;
+					}
+					free_list.count += n;
+				}
+				state.free_size.fetch_add(n * size_of_class(size_class), std::memory_order_relaxed);
+			}
+
+			// スレッドの終了時に、保持しているメモリをfree listに戻す。
+			~NodeThreadCache()
+			{
+				if (epoch != allocator_state().epoch)
+					return;
+
+				for (size_t c = 0; c < NODE_SIZE_CLASS_NUM; ++c)
+					flush(c, free_blocks[c].count);
+			}
+		};
+
+		thread_local NodeThreadCache thread_cache;
+
+		// 新しいchunkを取得する。
+		NodeChunk* acquire_chunk()
+		{
+			auto& state = allocator_state();
+			std::lock_guard<std::mutex> lock(state.mutex);
+
+			NodeChunk* chunk;
+			if (!state.free_chunks.empty())
+			{
+				chunk = state.free_chunks.back();
+				state.free_chunks.pop_back();
+			}
+			else
+			{
+				chunk = new (::operator new(NODE_CHUNK_SIZE)) NodeChunk();
+				state.chunks.push_back(chunk);
+			}
+
+			chunk->used = 0;
+			return chunk;
+		}
+
+		// size_classのfree listから、NODE_FREE_BATCH個までのメモリをスレッドに移す。
+		void refill(NodeThreadCache& cache, size_t size_class)
+		{
+			auto& state = allocator_state();
+			auto& free_list = state.free_lists[size_class];
+
+			// 空であるかはlockせずに調べる。(空振りしても、chunkから切り出すだけなので問題ない)
+			if (free_list.count.load(std::memory_order_relaxed) == 0)
+				return;
+
+			auto& list = cache.free_blocks[size_class];
+			size_t n = 0;
+			{
+				std::lock_guard<std::mutex> lock(free_list.mutex);
+				while (n < NODE_FREE_BATCH && free_list.head)
+				{
+					auto* block = free_list.head;
+					free_list.head = block->next;
+					list.push(block);
+					++n;
+				}
+				free_list.count -= n;
+			}
+			state.free_size.fetch_sub(n * size_of_class(size_class), std::memory_order_relaxed);
+		}
+	}
+
+	// size [byte]のメモリを、呼び出したスレッドのchunkから切り出す。
+	void* NodeAllocator::alloc(size_t size, size_t count)
+	{
+		// 16byte単位に切り上げて、区分の大きさにする。
+		const size_t size_class = size_class_of(sizeof(NodeAllocHeader) + ((size + 15) & ~size_t(15)));
+		const size_t need = size_of_class(size_class);
+		ASSERT_LV3(size_class < NODE_SIZE_CLASS_NUM && need <= NODE_CHUNK_DATA_SIZE);
+
+		auto& cache = thread_cache;
+		cache.sync_epoch(allocator_state().epoch);
+
+		// 開放されたメモリがあれば、それを再利用する。
+		auto& list = cache.free_blocks[size_class];
+		if (list.count == 0)
+			refill(cache, size_class);
+
+		NodeAllocHeader* header;
+		if (list.count)
+			header = reinterpret_cast<NodeAllocHeader*>(list.pop()) - 1;
+		else
+		{
+			NodeChunk* chunk = cache.chunk;
+			if (chunk == nullptr || chunk->used + need > NODE_CHUNK_DATA_SIZE)
+				// 使い切ったchunkの残りは使わない。
+				chunk = cache.chunk = acquire_chunk();
+
+			header = reinterpret_cast<NodeAllocHeader*>(reinterpret_cast<u8*>(chunk) + NODE_CHUNK_DATA_OFFSET + chunk->used);
+			chunk->used += need;
+		}
+
+		header->size_class = size_class;
+		header->count      = count;
+		return header + 1;
+	}
+
+	// alloc()で確保したメモリを開放する。
+	void NodeAllocator::free(void* p)
+	{
+		const size_t size_class = (static_cast<NodeAllocHeader*>(p) - 1)->size_class;
+
+		auto& cache = thread_cache;
+		cache.sync_epoch(allocator_state().epoch);
+
+		// いったんこのスレッドで保持して、溜まったらまとめてfree listに戻す。
+		// (GC用のスレッドが開放したメモリを、探索スレッドが再利用できるように)
+		auto& list = cache.free_blocks[size_class];
+		list.push(static_cast<NodeFreeBlock*>(p));
+		if (list.count >= NODE_FREE_BATCH * 2)
+			cache.flush(size_class, NODE_FREE_BATCH);
+	}
+
+	// alloc()で確保したメモリの要素数を返す。
+	size_t NodeAllocator::count_of(const void* p)
+	{
+		return (static_cast<const NodeAllocHeader*>(p) - 1)->count;
+	}
+
+	// これまでにalloc()で確保したメモリをすべてまとめて開放する。
+	void NodeAllocator::release_all()
+	{
+		auto& state = allocator_state();
+		std::lock_guard<std::mutex> lock(state.mutex);
+
+		// epochが変わるので、各スレッドが使用中のchunkや保持しているメモリは次のalloc()/free()の時に(触らずに)捨てられる。
+		++state.epoch;
+		state.free_chunks = state.chunks;
+
+		for (auto& free_list : state.free_lists)
+		{
+			std::lock_guard<std::mutex> free_lock(free_list.mutex);
+			free_list.head  = nullptr;
+			free_list.count = 0;
+		}
+		state.free_size = 0;
+	}
+
+	// 確保しているchunkの合計サイズ[byte]
+	size_t NodeAllocator::memory_size()
+	{
+		auto& state = allocator_state();
+		std::lock_guard<std::mutex> lock(state.mutex);
+		return state.chunks.size() * NODE_CHUNK_SIZE;
+	}
+
+	// 開放されて再利用を待っているメモリの合計サイズ[byte]
+	size_t NodeAllocator::free_size()
+	{
+		return allocator_state().free_size;
+	}
+
 	// --- struct Node
 
+	NodeHashTable* Node::node_hash = nullptr;
+
+	Node::~Node()
+	{
+		if (hashed && node_hash)
+			node_hash->erase(this);
+	}
+
 	// 引数のmoveで指定した子ノード以外の子ノードをすべて開放する。
 	// 前回探索した局面からmoveの指し手を選んだ局面の以外の情報を開放するのに用いる。
 	Node* Node::ReleaseChildrenExceptOne(NodeGarbageCollector* gc, const Move move)
@@ -21,7 +343,7 @@ namespace dlshogi
 					// 子ノードへのedgeは見つかっているけど実体がまだ。
 					if (!child_node)
 	                    // 新しいノードを作成する
-	                    child_node = std::make_unique<Node>();
+	                    child_node = make_node_unique<Node>();
 
 					// 0番目の要素に移動させる。
 					if (i != 0) {
@@ -45,7 +367,7 @@ namespace dlshogi
 				// 子ノードが見つからなかった場合、新しいノードを作成する
 				CreateSingleChildNode(move);
 				InitChildNodes();
-				return (child_nodes[0] = std::make_unique<Node>()).get();
+				return (child_nodes[0] = make_node_unique<Node>()).get();
 			}
 		}
 		else {
@@ -53,8 +375,150 @@ namespace dlshogi
 			CreateSingleChildNode(move);
 			// 子ノードへのポインタ配列を初期化する
 			InitChildNodes();
-			return (child_nodes[0] = std::make_unique<Node>()).get();
+			return (child_nodes[0] = make_node_unique<Node>()).get();
+		}
+	}
+
+	// --- class NodeHashTable
+
+	// entry数を設定する。0ならば無効化する。
+	void NodeHashTable::resize(size_t entry_num)
+	{
+		// 2の累乗に切り捨てる。
+		u64 new_size = 0;
+		if (entry_num)
+			for (new_size = 1; new_size * 2 <= entry_num; new_size *= 2) {}
+
+		// 探索中ではないが、GCのスレッドがerase()を呼び出すかも知れないので全部lockしてから差し替える。
+		for (auto& m : mutexes)
+			m.lock();
+
+		if (new_size != (enabled() ? mask + 1 : 0))
+		{
+			entries.reset();
+			if (new_size)
+				entries = std::make_unique<Entry[]>(new_size);
+			mask = new_size ? new_size - 1 : 0;
+		}
+
+		// 以前のentryが指していたNodeが開放されていないとは限らないので、いずれにせよクリアしておく。
+		// (登録されていたNodeは開放される時にerase()を呼び出すが、見つからないので何もしない)
+		for (u64 i = 0; i < new_size; ++i)
+			entries[i] = Entry{ 0, nullptr, 0.0f };
+
+		for (auto& m : mutexes)
+			m.unlock();
+
+		reset_stats();
+	}
+
+	// keyに対応するentryのmutexをlockして、そのentryのindexを返す。
+	u64 NodeHashTable::lock_entry(Key key)
+	{
+		while (true)
+		{
+			const u64 m = mask;
+			const u64 index = key & m;
+			mutexes[index & (MUTEX_NUM - 1)].lock();
+			if (m == mask)
+				return index;
+
+			// lockするまでの間にresize()された。
+			unlock_entry(index);
+		}
+	}
+
+	// 評価済みのNodeを登録する。
+	void NodeHashTable::store(Key key, Node* node, float value)
+	{
+		if (!enabled())
+			return;
+
+		const u64 index = lock_entry(key);
+		if (enabled())
+		{
+			// 上書きされたNodeは、hashed == trueのままだが、erase()の時に見つからないだけなので問題ない。
+			node->key    = key;
+			node->hashed = true;
+			entries[index] = Entry{ key, node, value };
 		}
+		unlock_entry(index);
+	}
+
+	// keyに対応する評価済みのNodeを探し、見つかればそのpolicyをnodeにコピーする。
+	bool NodeHashTable::probe(Key key, Node* node, float& value)
+	{
+		if (!enabled())
+			return false;
+
+		probes.fetch_add(1, std::memory_order_relaxed);
+
+		const u64 index = lock_entry(key);
+		const bool found = enabled() && probe_entry(entries[index], key, node, value);
+		unlock_entry(index);
+
+		if (found)
+			hits.fetch_add(1, std::memory_order_relaxed);
+		return found;
+	}
+
+	// probe()の下請け。entryのmutexをlockした状態で呼び出す。
+	bool NodeHashTable::probe_entry(const Entry& entry, Key key, Node* node, float& value)
+	{
+		// lockしている間は、entry.nodeは開放されない。
+		const Node* hit = entry.node;
+		if (hit == nullptr || entry.key != key || hit == node || !hit->IsEvaled())
+			return false;
+
+		// hash keyの衝突と、NodeTree::ResetToPosition()で子ノードが1つに減らされたNodeを除外するために
+		// 子ノードの指し手がすべて一致することを確認する。(同じ局面なら同じ順番で指し手が生成されている)
+		const ChildNumType child_num = node->child_num;
+		if (hit->child_num != child_num)
+			return false;
+
+		constexpr u32 flags = VALUE_WIN | VALUE_LOSE | VALUE_DRAW;
+		const ChildNode* src = hit ->child.get();
+		      ChildNode* dst = node->child.get();
+		for (ChildNumType i = 0; i < child_num; ++i)
+			if ((src[i].move & ~flags) != (dst[i].move & ~flags))
+				return false;
+
+		for (ChildNumType i = 0; i < child_num; ++i)
+			dst[i].nnrate = src[i].nnrate;
+
+		// 合流先で探索が進んでいるなら、NNのvalueよりその探索結果のほうが精度が高いはず。
+		const NodeCountType move_count = hit->move_count;
+		value = move_count != 0 && move_count != NOT_EXPANDED
+			? (float)(hit->win / move_count)
+			: entry.value;
+
+		return true;
+	}
+
+	// nodeの登録を解除する。
+	void NodeHashTable::erase(const Node* node)
+	{
+		if (!enabled())
+			return;
+
+		const u64 index = lock_entry(node->key);
+		if (enabled() && entries[index].node == node)
+			entries[index] = Entry{ 0, nullptr, 0.0f };
+		unlock_entry(index);
+	}
+
+	// すべてのentryを空にする。
+	void NodeHashTable::clear()
+	{
+		for (auto& m : mutexes)
+			m.lock();
+
+		const u64 size = enabled() ? mask + 1 : 0;
+		for (u64 i = 0; i < size; ++i)
+			entries[i] = Entry{ 0, nullptr, 0.0f };
+
+		for (auto& m : mutexes)
+			m.unlock();
 	}
 
 	// --- class NodeTree
@@ -81,7 +545,7 @@ namespace dlshogi
 		{
 			// 新しい対局であり、一度目のこの関数の呼び出しであるから、現在の局面のために新規のNodeを作成し、
 			// このNodeが対局開始のnodeであり、かつ、探索のroot nodeであると設定しておく。
-			game_root_node = std::make_unique<Node>();
+			game_root_node = make_node_unique<Node>();
 			current_head = game_root_node.get();
 		}
 
@@ -118,7 +582,7 @@ namespace dlshogi
 				ASSERT_LV3(prev_head->child_num == 1);
 				auto& prev_uct_child_node = prev_head->child_nodes[0];
 				gc->AddToGcQueue(std::move(prev_uct_child_node));
-				prev_uct_child_node = std::make_unique<Node>();
+				prev_uct_child_node = make_node_unique<Node>();
 				current_head = prev_uct_child_node.get();
 			}
 			else {
@@ -135,8 +599,17 @@ namespace dlshogi
 	{
 		// ゲームツリーを保持しているならそれを開放する。
 		// (保持していない時は何もしない)
-		gc->AddToGcQueue(std::move(game_root_node));
-		game_root_node = std::make_unique<Node>();
+
+		// ゲーム木のNodeと、GC待ちのNodeがNodeAllocatorで確保したNodeのすべてなので、
+		// Nodeを一つずつ開放するのではなく、NodeAllocatorのchunkごとまとめて回収する。
+		// Nodeのデストラクタは呼び出されないので、node_hashに登録されているNodeは、node_hashごとクリアする。
+		gc->DiscardAll();
+		game_root_node.release();
+		if (Node::node_hash)
+			Node::node_hash->clear();
+		NodeAllocator::release_all();
+
+		game_root_node = make_node_unique<Node>();
 		current_head = game_root_node.get();
 	}
 
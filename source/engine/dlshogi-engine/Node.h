@@ -5,6 +5,9 @@
 #if defined(YANEURAOU_ENGINE_DEEP)
 
 #include <thread>
+#include <memory>
+#include <mutex>
+#include <new>
 #include "../../position.h"
 #include "dlshogi_types.h"
 
@@ -12,6 +15,88 @@ namespace dlshogi
 {
 	struct Node;
 	class NodeGarbageCollector;
+	class NodeHashTable;
+
+	// NodeとChildNodeの配列、子ノードへのポインタ配列を確保するためのallocator。
+	// ※　dlshogiにはない。やねうら王独自拡張。
+	//
+	// 探索スレッドごとに、大きめのchunkを確保して、その先頭から順番に切り出していく。(bump allocation)
+	// 展開のたびにmalloc()を呼び出すと、UCT_Threadsが多い時にmalloc内部のlockで競合するので、それを避ける。
+	// 開放されたメモリは、大きさの区分ごとのfree listに入れて、同じ区分の大きさの確保に再利用する。
+	// (root局面が進んだ時に再利用される部分木のNodeは多くのchunkに散らばっているので、
+	//  chunk単位で回収するのでは、生きているNodeが少し残っているだけのchunkが再利用されずに溜まっていく)
+	// chunk自体はOSに返さないので、確保しているメモリ量は、それまでで最大のゲーム木の大きさ(+区分ごとの端数)で頭打ちになる。
+	// ゲーム木を丸ごと捨てる時(NodeTree::DeallocateTree())には、release_all()でchunk単位でまとめて回収する。
+	class NodeAllocator
+	{
+	public:
+		// size [byte]のメモリを、呼び出したスレッドのchunkから切り出す。
+		// count : 配列として確保する時の要素数。free()の時に要素のデストラクタを呼び出すのに用いる。
+		static void* alloc(size_t size, size_t count = 1);
+
+		// alloc()で確保したメモリを開放する。(どのスレッドから呼び出しても良い)
+		static void free(void* p);
+
+		// alloc()で確保したメモリの要素数を返す。
+		static size_t count_of(const void* p);
+
+		// これまでにalloc()で確保したメモリをすべてまとめて開放する。
+		// 確保したメモリにあるオブジェクトのデストラクタは呼び出されないので、
+		// 生きているNode(やそれを指しているもの)が一つもない時に呼び出すこと。
+		static void release_all();
+
+		// 確保しているchunkの合計サイズ[byte]
+		static size_t memory_size();
+
+		// 開放されて再利用を待っているメモリの合計サイズ[byte]
+		// (各スレッドが一時的に保持している分は含まない)
+		static size_t free_size();
+	};
+
+	// NodeAllocatorで確保したオブジェクトを開放するためのdeleter
+	template <typename T>
+	struct NodeDeleter
+	{
+		void operator()(T* p) const {
+			p->~T();
+			NodeAllocator::free(p);
+		}
+	};
+
+	template <typename T>
+	struct NodeDeleter<T[]>
+	{
+		void operator()(T* p) const {
+			const size_t count = NodeAllocator::count_of(p);
+			for (size_t i = 0; i < count; ++i)
+				p[i].~T();
+			NodeAllocator::free(p);
+		}
+	};
+
+	// NodeAllocatorで確保したオブジェクトを保持するunique_ptr
+	template <typename T>
+	using NodeUniquePtr = std::unique_ptr<T, NodeDeleter<T>>;
+
+	// NodeAllocatorでTを一つ確保する。std::make_unique<T>()の代わりに用いる。
+	template <typename T>
+	NodeUniquePtr<T> make_node_unique()
+	{
+		return NodeUniquePtr<T>(new (NodeAllocator::alloc(sizeof(T))) T());
+	}
+
+	// NodeAllocatorでTの配列を確保する。std::make_unique<T[]>(n)の代わりに用いる。
+	template <typename T>
+	NodeUniquePtr<T[]> make_node_unique_array(size_t n)
+	{
+		T* p = static_cast<T*>(NodeAllocator::alloc(sizeof(T) * n, n));
+		for (size_t i = 0; i < n; ++i)
+			new (&p[i]) T();
+		return NodeUniquePtr<T[]>(p);
+	}
+
+	// Nodeを保持するポインタ
+	typedef NodeUniquePtr<Node> NodePtr;
 
 	// 子ノード(に至るEdge(辺))を表現する。
 	// あるノードから実際に子ノードにアクセスするとランダムアクセスになってしまうので
@@ -69,18 +154,22 @@ namespace dlshogi
 	struct Node
 	{
 		Node()
-			: move_count(NOT_EXPANDED), win(0), visited_nnrate(0.0f) , child_num(0) {}
+			: move_count(NOT_EXPANDED), win(0), visited_nnrate(0.0f) , child_num(0) , hashed(false) {}
+
+		// node_hashに登録されているなら、そこから削除する。
+		// ※　GCのスレッドから呼び出されることがあるので、NodeHashTable側でlockして削除する。
+		~Node();
 
 		// 子ノード作成
 		Node* CreateChildNode(int i) {
-			return (child_nodes[i] = std::make_unique<Node>()).get();
+			return (child_nodes[i] = make_node_unique<Node>()).get();
 		}
 
 		// 子ノード1つのみで初期化する。
 		void CreateSingleChildNode(const Move move)
 		{
 			child_num = 1;
-			child = std::make_unique<ChildNode[]>(1);
+			child = make_node_unique_array<ChildNode>(1);
 			child[0].move = move;
 		}
 
@@ -101,7 +190,7 @@ namespace dlshogi
 
 		// 子ノードへのポインタ配列の初期化
 		void InitChildNodes() {
-			child_nodes = std::make_unique<std::unique_ptr<Node>[]>(child_num);
+			child_nodes = make_node_unique_array<NodePtr>(child_num);
 		}
 
 		// 引数のmoveで指定した子ノード以外の子ノードをすべて開放する。
@@ -149,14 +238,28 @@ namespace dlshogi
 		ChildNumType child_num;
 
 		// 子ノード(に至るedge)
-		// child_numの数だけ、ChildNodeをnewして保持している。
-		std::unique_ptr<ChildNode[]> child;
+		// child_numの数だけ、ChildNodeをNodeAllocatorで確保して保持している。
+		NodeUniquePtr<ChildNode[]> child;
 
 		// 子ノードへのポインタ配列
-		// もったいないので必要になってからnewする。
+		// もったいないので必要になってから確保する。
 		// 展開した子ノード以外はnullptrのまま。
-		std::unique_ptr<std::unique_ptr<Node>[]> child_nodes;
+		NodeUniquePtr<NodePtr[]> child_nodes;
+
+		// --- やねうら王独自拡張
+
+		// node_hashに登録されているか。
+		// trueであれば、keyにこの局面のhash keyが格納されている。
+		bool hashed;
+
+		// この局面のhash key(Position::key())
+		// hashed == trueの時のみ有効。
+		Key key;
 
+		// 合流(transposition)検出用のhash table。
+		// DlshogiSearcherが保持しているものを指している。
+		// ~Node()で登録を解除するために必要。
+		static NodeHashTable* node_hash;
 
 	private:
 
@@ -169,13 +272,86 @@ namespace dlshogi
 			// 子ノードの数 = 生成された指し手の数
 			child_num = (ChildNumType)ml.size();
 
-			child = std::make_unique<ChildNode[]>(child_num);
+			child = make_node_unique_array<ChildNode>(child_num);
 			auto* child_node = child.get();
 			for (auto m : ml)
 				(child_node++)->move = m.move;
 		}
 	};
 
+	// 評価済みのNodeを局面のhash key(Position::key())で引くためのhash table。
+	// 手順前後などで同じ局面に合流した時に、新しく作ったNodeのためにNNを呼び出さず、
+	// 評価済みのNodeの policy(各ChildNodeのnnrate) と value(勝率) を流用する。
+	// ※　dlshogiにはない。やねうら王独自拡張。
+	//
+	// entryは生きているNodeのみを指す。Nodeが開放される時に~Node()から登録が解除される。
+	// このためentryを辿る時とNodeの開放の時は、keyに対応するmutexをlockしなければならない。
+	class NodeHashTable
+	{
+	public:
+		// entry数を設定する。0ならば無効化する。
+		// entry数は2の累乗に切り捨てられる。
+		// "isready"のタイミングで呼び出される。(探索中に呼び出してはならない)
+		void resize(size_t entry_num);
+
+		// このhash tableが有効であるか。
+		bool enabled() const { return mask != 0; }
+
+		// 評価済みのNodeを登録する。すでに同じslotに別のNodeがあれば上書きする。
+		//   key   : nodeの局面のhash key
+		//   node  : EvalNode()で評価が完了したNode
+		//   value : NNが返したこの局面のvalue(手番側から見た期待勝率)
+		void store(Key key, Node* node, float value);
+
+		// keyに対応する評価済みのNodeを探し、見つかればそのpolicyをnodeにコピーする。
+		//   key   : nodeの局面のhash key
+		//   node  : 新しく展開したNode。ExpandNode()は完了していること。
+		//   value : [Out] この局面の手番側から見た期待勝率。
+		//           合流先のNodeに訪問回数があれば、その探索結果(win / move_count)を用いる。
+		// 返し値 : 見つかればtrue。
+		bool probe(Key key, Node* node, float& value);
+
+		// nodeの登録を解除する。~Node()から呼び出される。
+		void erase(const Node* node);
+
+		// すべてのentryを空にする。
+		// NodeAllocator::release_all()でNodeをまとめて開放する時に、開放されたNodeを指しているentryを消すのに用いる。
+		void clear();
+
+		// 統計情報のリセット。"go"ごとに呼び出す。
+		void reset_stats() { probes = 0; hits = 0; }
+
+		// probe()の回数と、そのうちhitした回数。
+		std::atomic<u64> probes, hits;
+
+	private:
+		struct Entry
+		{
+			Key   key;
+			Node* node;
+			float value;
+		};
+
+		// keyに対応するentryのmutexをlockして、そのentryのindexを返す。
+		// resize()は全mutexをlockしてからmaskを変更するので、lockしたあとmaskが変わっていなければ良い。
+		u64 lock_entry(Key key);
+		void unlock_entry(u64 index) { mutexes[index & (MUTEX_NUM - 1)].unlock(); }
+
+		// probe()の下請け。entryのmutexをlockした状態で呼び出す。
+		bool probe_entry(const Entry& entry, Key key, Node* node, float& value);
+
+		static const u64 MUTEX_NUM = 4096; // must be 2^n
+		static_assert((MUTEX_NUM & (MUTEX_NUM - 1)) == 0);
+
+		std::unique_ptr<Entry[]> entries;
+
+		// entry数 - 1。無効ならば0。
+		// GCのスレッドがlockせずに参照するのでatomicにしておく。
+		std::atomic<u64> mask{ 0 };
+
+		std::mutex mutexes[MUTEX_NUM];
+	};
+
 	// 前回探索した局面から2手進んだ局面かを判定するための情報を保持しておくためのNodeTree。
 	// 1つのゲームに対して1つのインスタンス。
 	class NodeTree
@@ -207,7 +383,7 @@ namespace dlshogi
 
 		// ゲーム木のroot node = ゲームの開始局面
 		// ※　dlshogiでは、gamebegin_node_という変数名
-		std::unique_ptr<Node> game_root_node;
+		NodePtr game_root_node;
 
 		// ゲーム木のroot nodeのsfen文字列
 		// ※　dlshogiではhistory_starting_pos_key_というKey型の変数
@@ -234,7 +410,7 @@ namespace dlshogi
 
 		// GC対象に追加する。ここから辿れるNode,ChildNodeはすべて開放する。
 		// また、Nodeは循環していないものとする。
-		void AddToGcQueue(std::unique_ptr<Node> node) {
+		void AddToGcQueue(NodePtr node) {
 			if (!node) return;
 
 			std::lock_guard<std::mutex> lock(gc_mutex);
@@ -249,6 +425,17 @@ namespace dlshogi
 
 		// --- やねうら王独自拡張
 
+		// GC対象のTreeを、開放せずにすべて捨てる。GC中であれば、その完了を待つ。
+		// NodeAllocator::release_all()でまとめて開放する前に呼び出す。
+		void DiscardAll()
+		{
+			std::lock_guard<std::mutex> collecting(collect_mutex);
+			std::lock_guard<std::mutex> lock(gc_mutex);
+			for (auto& node : subtrees_to_gc)
+				node.release();
+			subtrees_to_gc.clear();
+		}
+
 		// GC用のスレッドのスレッドIDを設定する。
 		// これは、WinProcGroup::bindThisThread()を呼び出す時のID。
 		void set_thread_id(size_t thread_id) { next_thread_id = (int)thread_id; }
@@ -259,8 +446,11 @@ namespace dlshogi
 		{
 			while (!stop.load()) {
 
+				// 開放している間はcollect_mutexをlockしておく。(DiscardAll()と競合しないように)
+				std::lock_guard<std::mutex> collecting(collect_mutex);
+
 				// Node will be released in destructor when mutex is not locked.
-				std::unique_ptr<Node> node_to_gc;
+				NodePtr node_to_gc;
 				{
 					// Lock the mutex and move last subtree from subtrees_to_gc_ into
 					// node_to_gc.
@@ -297,9 +487,13 @@ namespace dlshogi
 		// subtrees_to_gc を変更する時のmutex
 		mutable std::mutex gc_mutex;
 
+		// GarbageCollect()でsubtreeを開放している間lockされるmutex
+		// ※　gc_threadより先に初期化されていなければならないので、ここに書く。
+		std::mutex collect_mutex;
+
 		// GC対象のTree。ここから数珠つなぎに開放していく。
 		// 一度にそんなにたくさん積まれないので、そこまで大きなコンテナにはならない。
-	    std::vector<std::unique_ptr<Node>> subtrees_to_gc;
+	    std::vector<NodePtr> subtrees_to_gc;
 
 		std::atomic<bool> stop{ false };
 		std::thread gc_thread;
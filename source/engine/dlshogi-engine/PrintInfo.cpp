@@ -251,6 +251,47 @@ namespace dlshogi::UctPrint
 		sync_cout << "Playout Limit : " << playout_limit << " PO"  << sync_endl;
 	}
 
+	// 合流検出用のhash tableのhit率の出力
+	void PrintNodeHashInformation(const NodeHashTable& node_hash)
+	{
+		const u64 probes = node_hash.probes;
+		const u64 hits   = node_hash.hits;
+		sync_cout << "info string node hash : probes = " << probes << " , hits = " << hits
+			<< " , hit rate = " << (probes ? hits * 1000 / probes : 0) / 10.0 << "%" << sync_endl;
+	}
+
+	// NNの出力のcacheのhit率の出力
+	void PrintNNCacheInformation(const NNCache& nn_cache)
+	{
+		const u64 hits   = nn_cache.hits;
+		const u64 misses = nn_cache.misses;
+		const u64 probes = hits + misses;
+		sync_cout << "info string nn cache : hits = " << hits << " , misses = " << misses
+			<< " , hit rate = " << (probes ? hits * 1000 / probes : 0) / 10.0 << "%" << sync_endl;
+	}
+
+	// NodeAllocatorが確保しているメモリ量の出力
+	void PrintNodeMemoryInformation()
+	{
+		sync_cout << "info string node memory = " << NodeAllocator::memory_size() / (1024 * 1024) << "MB"
+			<< " , free = " << NodeAllocator::free_size() / (1024 * 1024) << "MB" << sync_endl;
+	}
+
+	// 推論スレッドの統計情報の出力
+	void PrintInferenceInformation(const UctSearcherGroup::InferenceStats& stats, int gpu_id)
+	{
+		const u64 batches   = stats.batches;
+		const u64 positions = stats.positions;
+		const u64 capacity  = stats.capacity;
+
+		// batchの充填率 = 推論した局面数 / (推論したbatch数 × batch size)
+		// queue latency = 推論スレッドのqueueに積まれてから推論が始まるまでの平均時間
+		sync_cout << "info string gpu " << gpu_id << " : batches = " << batches
+			<< " , batch fill ratio = " << (capacity ? positions * 1000 / capacity : 0) / 10.0 << "%"
+			<< " , queue latency = " << (batches ? stats.queue_wait_us / batches : 0) << "us"
+			<< " , forward time = "  << (batches ? stats.forward_us    / batches : 0) << "us" << sync_endl;
+	}
+
 	// 再利用した探索回数の出力
 	void PrintReuseCount(const int count)
 	{
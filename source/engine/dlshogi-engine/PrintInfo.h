@@ -26,6 +26,19 @@ namespace dlshogi::UctPrint
 	// 再利用した探索回数の出力
 	void PrintReuseCount(const int count);
 
+	// 合流検出用のhash tableのhit率の出力
+	void PrintNodeHashInformation(const NodeHashTable& node_hash);
+
+	// NNの出力のcacheのhit率の出力
+	void PrintNNCacheInformation(const NNCache& nn_cache);
+
+	// NodeAllocatorが確保しているメモリ量の出力
+	void PrintNodeMemoryInformation();
+
+	// 推論スレッドの統計情報の出力
+	//   gpu_id : UctSearcherGroupに対応するGPU ID
+	void PrintInferenceInformation(const UctSearcherGroup::InferenceStats& stats, int gpu_id);
+
 	// --- bestなnodeの選択 ---
 
 	// あるNodeで選択すべき指し手とその時のponderの指し手(そのあとの相手の指し手)を表現する。
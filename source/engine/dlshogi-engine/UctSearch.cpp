@@ -12,6 +12,8 @@
 #include "../../mate/mate.h"
 
 #include <limits>           // max<T>()
+#include <cmath>            // std::nearbyint()
+#include <cstring>          // std::memcpy()
 
 // 完全なログ出力をしてdlshogiと比較する時用。
 //#define LOG_PRINT
@@ -123,6 +125,114 @@ namespace dlshogi
 		if constexpr (VIRTUAL_LOSS != 1) child  ->move_count += 1 - VIRTUAL_LOSS;
 	}
 
+	// --------------------------------------------------------------------
+	//  NNCache : NNの出力のcache
+	// --------------------------------------------------------------------
+
+	namespace {
+		// floatをIEEE 754 binary16に変換する。(最近接偶数丸め)
+		// F16C命令を前提にしないために自前で変換する。
+		u16 float_to_half(float f)
+		{
+			u32 x;
+			std::memcpy(&x, &f, sizeof(x));
+			const u16 sign = u16((x >> 16) & 0x8000);
+			x &= 0x7fffffff;
+
+			// 半精度で表現できない大きさ(NaN含む)は無限大にする。
+			if (x >= 0x47800000)
+				return sign | 0x7c00;
+
+			// 半精度の非正規化数(2^-14未満)は、2^-24単位で丸める。
+			// 丸めて1024(2^-14)になった場合も、そのまま最小の正規化数のbit表現になる。
+			if (x < 0x38800000)
+				return sign | u16(std::nearbyint(std::fabs(f) * 16777216.0f));
+
+			// 指数部のbiasを127から15にして、仮数部の下位13bitを最近接偶数丸めで落とす。
+			x += 0x0fff + ((x >> 13) & 1);
+			return sign | u16((x - 0x38000000) >> 13);
+		}
+
+		// IEEE 754 binary16をfloatに変換する。
+		float half_to_float(u16 h)
+		{
+			const u32 sign = u32(h & 0x8000) << 16;
+			const u32 exp  = (h >> 10) & 0x1f;
+			const u32 mant = h & 0x3ff;
+
+			// 非正規化数
+			if (exp == 0)
+				return (sign ? -1.0f : 1.0f) * (float)mant / 16777216.0f;
+
+			const u32 x = exp == 0x1f
+				? sign | 0x7f800000 | (mant << 13)
+				: sign | ((exp + 112) << 23) | (mant << 13);
+
+			float f;
+			std::memcpy(&f, &x, sizeof(f));
+			return f;
+		}
+	}
+
+	// cacheのサイズを[MB]で設定する。0ならば無効化する。
+	void NNCache::resize(size_t mb)
+	{
+		// entryのindexはmul_hi64()で求めるので、entry数は2の累乗でなくて良い。
+		const u64 new_size = mb * 1024 * 1024 / sizeof(Entry);
+
+		// 前回のモデルでの出力が残っていると困るので、サイズが同じでも確保しなおす。
+		entries.reset();
+		if (new_size)
+			entries = std::make_unique<Entry[]>(new_size);
+		entry_count = new_size;
+
+		reset_stats();
+	}
+
+	// keyに対応するNNの出力を探し、見つかればそのpolicyをnodeの各ChildNodeのnnrateにコピーする。
+	bool NNCache::probe(Key key, Node* node, float& value)
+	{
+		const u64 index = mul_hi64(key, entry_count);
+		{
+			std::lock_guard<std::mutex> lk(get_mutex(index));
+			const Entry& entry = entries[index];
+
+			// hash keyの衝突はchild_numでもある程度弾ける。
+			if (entry.key == key && entry.child_num == node->child_num && entry.child_num != 0)
+			{
+				ChildNode* uct_child = node->child.get();
+				for (ChildNumType i = 0; i < entry.child_num; ++i)
+					uct_child[i].nnrate = half_to_float(entry.policy[i]);
+				value = entry.value;
+
+				hits.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+		misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// NNの出力を登録する。
+	void NNCache::store(Key key, const Node* node, float value)
+	{
+		// 合法手が多すぎる局面はentryに収まらないのでcacheしない。(そのような局面は稀)
+		if (node->child_num > MAX_CHILDREN)
+			return;
+
+		const u64 index = mul_hi64(key, entry_count);
+		std::lock_guard<std::mutex> lk(get_mutex(index));
+		Entry& entry = entries[index];
+
+		entry.key       = key;
+		entry.value     = value;
+		entry.child_num = node->child_num;
+
+		const ChildNode* uct_child = node->child.get();
+		for (ChildNumType i = 0; i < node->child_num; ++i)
+			entry.policy[i] = float_to_half(uct_child[i].nnrate);
+	}
+
 	// --------------------------------------------------------------------
 	//  UCTSearcherGroup : UctSearcherをGPU一つ利用する分ずつひとまとめにしたもの。
 	// --------------------------------------------------------------------
@@ -154,6 +264,12 @@ namespace dlshogi
 
 			// 次回、このmodel_pathかalloced_policy_value_batch_maxsizeに変更があれば、再度NNをbuildする。
 			this->model_path = model_path;
+			this->model_key  = (Key)std::hash<std::string>()(model_path);
+
+			// 推論スレッドを開始する。(初回のみ)
+			// nnを作りなおした場合も、推論スレッドはmutex_gpuをlockしてからnnを使うので問題ない。
+			if (!inference_thread.joinable())
+				inference_thread = std::thread([this]() { InferenceWorker(); });
 		}
 
 		// スレッド数に変更があるか、batchサイズが前回から変更があったならばUctSearcherのインスタンス自体を生成しなおす。
@@ -169,6 +285,92 @@ namespace dlshogi
 		}
 	}
 
+	// 推論スレッドを停止させる。
+	UctSearcherGroup::~UctSearcherGroup()
+	{
+		{
+			std::lock_guard<std::mutex> lk(queue_mutex);
+			stop_inference = true;
+		}
+		queue_cv.notify_all();
+
+		if (inference_thread.joinable())
+			inference_thread.join();
+	}
+
+	// ニューラルネットのforward() (順方向の伝播 = 推論)を推論スレッドのqueueに積む。
+	void UctSearcherGroup::submit(InferenceRequest* req)
+	{
+		{
+			std::lock_guard<std::mutex> lk(queue_mutex);
+			req->done      = false;
+			req->submitted = std::chrono::steady_clock::now();
+			queue.push_back(req);
+		}
+		queue_cv.notify_one();
+	}
+
+	// submit()したreqの推論が完了するのを待つ。
+	void UctSearcherGroup::wait(InferenceRequest* req)
+	{
+		std::unique_lock<std::mutex> lk(queue_mutex);
+		done_cv.wait(lk, [req] { return req->done; });
+	}
+
+	// 推論の統計情報のリセット
+	void UctSearcherGroup::reset_stats()
+	{
+		stats.batches       = 0;
+		stats.positions     = 0;
+		stats.capacity      = 0;
+		stats.queue_wait_us = 0;
+		stats.forward_us    = 0;
+	}
+
+	// 推論スレッドが実行するworker
+	// queueに積まれた順にbatchを推論していく。
+	void UctSearcherGroup::InferenceWorker()
+	{
+		using namespace std::chrono;
+
+		// このスレッドとGPUとを紐付ける。
+		set_device();
+
+		while (true)
+		{
+			InferenceRequest* req;
+			{
+				std::unique_lock<std::mutex> lk(queue_mutex);
+				queue_cv.wait(lk, [this] { return stop_inference || !queue.empty(); });
+				if (stop_inference)
+					break;
+
+				req = queue.front();
+				queue.pop_front();
+			}
+
+			const auto start = steady_clock::now();
+
+			mutex_gpu.lock();
+			nn->forward(req->batch_size, req->x1, req->x2, req->y1, req->y2);
+			mutex_gpu.unlock();
+
+			const auto end = steady_clock::now();
+
+			stats.batches       += 1;
+			stats.positions     += req->batch_size;
+			stats.capacity      += policy_value_batch_maxsize;
+			stats.queue_wait_us += duration_cast<microseconds>(start - req->submitted).count();
+			stats.forward_us    += duration_cast<microseconds>(end   - start         ).count();
+
+			{
+				std::lock_guard<std::mutex> lk(queue_mutex);
+				req->done = true;
+			}
+			done_cv.notify_all();
+		}
+	}
+
 	// やねうら王では探索スレッドはThreadPoolが管理しているのでこれらは不要。
 #if 0
 	// スレッド開始
@@ -225,26 +427,37 @@ namespace dlshogi
 		logger.print("sfen "+pos->sfen(0));
 #endif		
 
-		//cout << "QueuingNode:" << index << ":" << current_policy_value_queue_index << ":" << current_policy_value_batch_index << endl;
+		//cout << "QueuingNode:" << index << ":" << current_policy_value_queue_index << ":" << batches[current_batch].size << endl;
 		//cout << pos->toSFEN() << endl;
 
-		/* if (current_policy_value_batch_index >= policy_value_batch_maxsize) {
+		/* if (batches[current_batch].size >= policy_value_batch_maxsize) {
 			std::cout << "error" << std::endl;
 		}*/
 
+		// 以前にNNで評価したことのある局面なら、その出力を流用してbatchには積まない。
+		// value_winに書き戻してnodeを評価済みにしておけば、呼び出し元からは
+		// EvalNode()で評価が完了したのと区別がつかない。
+		NNCache* nn_cache = grp->get_dlsearcher()->get_nn_cache();
+		if (nn_cache->enabled() && nn_cache->probe(pos->key() ^ grp->get_model_key(), node, *value_win))
+		{
+			node->SetEvaled();
+			return;
+		}
+
 		// 現在の局面に出現している特徴量を設定する。
-		// current_policy_value_batch_indexは、UctSearchThreadごとに持っているのでlock不要
+		// batchesは、UctSearchThreadごとに持っているのでlock不要
+		auto& b = batches[current_batch];
 
-		make_input_features(*pos, &features1[current_policy_value_batch_index], &features2[current_policy_value_batch_index]);
+		make_input_features(*pos, &b.features1[b.size], &b.features2[b.size]);
 
 		// 現在のNodeと手番を保存しておく。
-		policy_value_batch[current_policy_value_batch_index] = { node, pos->side_to_move() /* , pos->key() */ , value_win};
+		b.policy_value_batch[b.size] = { node, pos->side_to_move() , pos->key() , value_win};
 
 	#ifdef MAKE_BOOK
-		policy_value_book_key[current_policy_value_batch_index] = Book::bookKey(*pos);
+		b.policy_value_book_key[b.size] = Book::bookKey(*pos);
 	#endif
 
-		current_policy_value_batch_index++;
+		b.size++;
 		// これが、policy_value_batch_maxsize分だけ溜まったら、nn->forward()を呼び出す。
 	}
 
@@ -290,7 +503,6 @@ namespace dlshogi
 		// ルートノードを評価。これは最初にevaledでないことを見つけたスレッドが行えば良い。
 		LOCK_EXPAND;
 		if (!current_root->IsEvaled()) {
-			current_policy_value_batch_index = 0;
 			float value_win; // EvalNode()した時に、ここにvalueが書き戻される。ダミーの変数。
 			QueuingNode(&rootPos, current_root, &value_win);
 			EvalNode();
@@ -298,57 +510,26 @@ namespace dlshogi
 		UNLOCK_EXPAND;
 
 		// 探索経路のバッチ
-		vector<NodeVisitor> visitor_batch;
-		vector<NodeTrajectories> trajectories_batch_discarded;
-		visitor_batch.reserve(policy_value_batch_maxsize);
-		trajectories_batch_discarded.reserve(policy_value_batch_maxsize);
-
-		// 探索回数が閾値を超える, または探索が打ち切られたらループを抜ける
-		while ( ! stop() )
+		// batches[]と同じく、推論中のbatchの分と作成中のbatchの分が必要。
+		vector<NodeVisitor> visitor_batch[BATCH_BUFFER_NUM];
+		vector<NodeTrajectories> trajectories_batch_discarded[BATCH_BUFFER_NUM];
+		// そのbatchを推論スレッドに渡していて、まだ結果を反映させていないか。
+		bool pending[BATCH_BUFFER_NUM] = {};
+		for (int k = 0; k < BATCH_BUFFER_NUM; ++k)
 		{
-			visitor_batch.clear();
-			trajectories_batch_discarded.clear();
-			current_policy_value_batch_index = 0;
-
-			// バッチサイズ分探索を繰り返す
-			// stop()になったらなるべく早く終わりたいので終了判定のところに "&& !stop"を書いておく。
-			// TODO : VirtualLossを無くすなどして、stop()になったら直ちにリターンすべき。
-			for (int i = 0; i < policy_value_batch_maxsize && !stop(); i++) {
-
-				// 盤面のコピー
-
-				// rootPosはスレッドごとに用意されたもので、呼び出し元にインスタンスが存在しているので、
-				// 単純なコピーで問題ない。
-				Position pos;
-				memcpy(&pos, &rootPos, sizeof(Position));
-
-				// 1回プレイアウトする
-				visitor_batch.emplace_back();
-				const float result = UctSearch(&pos, nullptr, current_root, visitor_batch.back());
-
-				if (result != DISCARDED)
-				{
-					atomic_fetch_add(&search_limits.nodes_searched, 1);
-					//  →　ここで加算するとnpsの計算でまだEvalNodeしてないものまで加算されて
-					// 大きく見えてしまうのでもう少しあとで加算したいところだが…。
-				}
-				else {
-					// 破棄した探索経路を保存
-					trajectories_batch_discarded.emplace_back(std::move(visitor_batch.back().trajectories));
-				}
-
-				// 評価中の末端ノードに達した、もしくはバックアップ済みため破棄する
-				if (result == DISCARDED || result != QUEUING) {
-					visitor_batch.pop_back();
-				}
-
-			}
+			// NodeVisitor::value_winのアドレスをQueuingNode()で保持するので、reallocが起きてはならない。
+			visitor_batch[k].reserve(policy_value_batch_maxsize);
+			trajectories_batch_discarded[k].reserve(policy_value_batch_maxsize);
+		}
 
+		// k番目のbatchの推論の完了を待って、結果を木に反映させる。
+		auto backup = [&](int k)
+		{
 			// 評価
-			EvalNode();
+			EvalBatch(k);
 
 			// 破棄した探索経路のVirtual Lossを戻す
-			for (auto& trajectories : trajectories_batch_discarded) {
+			for (auto& trajectories : trajectories_batch_discarded[k]) {
 				for (auto it = trajectories.rbegin(); it != trajectories.rend(); ++it)
 				{
 					NodeTrajectory& current_next  = *it;
@@ -366,7 +547,7 @@ namespace dlshogi
 
 			// leaf nodeでの期待勝率(NNの返してきたvalue)。
 			// これをleaf nodeからrootに向かって、伝播していく。(Node::winに加算していく)
-			for (auto& visitor : visitor_batch) {
+			for (auto& visitor : visitor_batch[k]) {
 				// leaf nodeの一つ上のnode用にvisitor.value_winから取り出す。
 				float result = 1.0f - visitor.value_win;
 
@@ -377,7 +558,6 @@ namespace dlshogi
 					Node* current      = current_next.node;
 					const ChildNumType next_index = current_next.index;
 					ChildNode* uct_child = current->child.get();
-					const auto* uct_child_nodes = current->child_nodes.get();
 
 					UpdateResult(&uct_child[next_index], result, current);
 
@@ -385,8 +565,68 @@ namespace dlshogi
 					result = 1.0f - result;
 				}
 			}
+
+			pending[k] = false;
+		};
+
+		// 探索回数が閾値を超える, または探索が打ち切られたらループを抜ける
+		while ( ! stop() )
+		{
+			// このループで作成するbatch
+			const int k = current_batch;
+			auto& visitors  = visitor_batch[k];
+			auto& discarded = trajectories_batch_discarded[k];
+			visitors.clear();
+			discarded.clear();
+
+			// バッチサイズ分探索を繰り返す
+			// stop()になったらなるべく早く終わりたいので終了判定のところに "&& !stop"を書いておく。
+			// TODO : VirtualLossを無くすなどして、stop()になったら直ちにリターンすべき。
+			for (int i = 0; i < policy_value_batch_maxsize && !stop(); i++) {
+
+				// 盤面のコピー
+
+				// rootPosはスレッドごとに用意されたもので、呼び出し元にインスタンスが存在しているので、
+				// 単純なコピーで問題ない。
+				Position pos;
+				memcpy(&pos, &rootPos, sizeof(Position));
+
+				// 1回プレイアウトする
+				visitors.emplace_back();
+				const float result = UctSearch(&pos, nullptr, current_root, visitors.back());
+
+				if (result != DISCARDED)
+				{
+					atomic_fetch_add(&search_limits.nodes_searched, 1);
+					//  →　ここで加算するとnpsの計算でまだEvalNodeしてないものまで加算されて
+					// 大きく見えてしまうのでもう少しあとで加算したいところだが…。
+				}
+				else {
+					// 破棄した探索経路を保存
+					discarded.emplace_back(std::move(visitors.back().trajectories));
+				}
+
+				// 評価中の末端ノードに達した、もしくはバックアップ済みため破棄する
+				if (result == DISCARDED || result != QUEUING) {
+					visitors.pop_back();
+				}
+
+			}
+
+			// 作成したbatchを推論スレッドに渡す。current_batchは次のbatchに切り替わる。
+			SubmitBatch();
+			pending[k] = true;
+
+			// 次に作成するbatchは前回推論スレッドに渡したものなので、その結果を反映させてから再利用する。
+			// その間、いま渡したbatchは推論スレッドで推論されている。
+			if (pending[current_batch])
+				backup(current_batch);
 		}
 
+		// 推論中のbatchが残っていれば、その結果を反映させておく。(Virtual Lossを戻さなければならない)
+		for (int k = 0; k < BATCH_BUFFER_NUM; ++k)
+			if (pending[k])
+				backup(k);
 	}
 
 	// UCT探索を行う関数
@@ -525,6 +765,12 @@ namespace dlshogi
 							uct_child[next_index].SetLose();
 							result = 1.0f;
 						}
+						// 合流(transposition)した局面なら、評価済みのNodeのpolicyとvalueを流用する。
+						else if (Node::node_hash->probe(pos->key(), child_node, result))
+						{
+							// resultは、この局面の手番側から見た期待勝率なので、currentから見た値に反転させる。
+							result = 1.0f - result;
+						}
 						else
 						{
 							// ノードをキューに追加
@@ -703,37 +949,74 @@ namespace dlshogi
 		return max_child;
 	}
 
+	// 現在作成中のbatchを推論スレッドに渡して、次のbatchに切り替える。
+	void UctSearcher::SubmitBatch()
+	{
+		auto& b = batches[current_batch];
+
+		// 何もデータが積まれていないならforwardを呼び出してはならないので推論スレッドには渡さない。
+		if (b.size > 0)
+		{
+			b.request.batch_size = b.size;
+			b.request.x1 = b.features1;
+			b.request.x2 = b.features2;
+			b.request.y1 = b.y1;
+			b.request.y2 = b.y2;
+			grp->submit(&b.request);
+		}
+
+		current_batch = (current_batch + 1) % BATCH_BUFFER_NUM;
+	}
+
 	// 評価関数を呼び出す。
-	// batchに積まれていた入力特徴量をまとめてGPUに投げて、結果を得る。
+	// 現在作成中のbatchを推論スレッドに渡して、その完了を待つ。
 	void UctSearcher::EvalNode()
 	{
-		// 何もデータが積まれていないならこのあとforwardを呼び出してはならないので帰る。
-		if (current_policy_value_batch_index == 0)
+		const int k = current_batch;
+		SubmitBatch();
+		EvalBatch(k);
+	}
+
+	// SubmitBatch()したbatchの推論の完了を待ち、その結果をNodeに反映させる。
+	// batchに積まれていた入力特徴量をまとめてGPUに投げて、結果を得る。
+	void UctSearcher::EvalBatch(int batch_index)
+	{
+		auto& b = batches[batch_index];
+
+		// 何もデータが積まれていないならforwardは呼び出していないので帰る。
+		if (b.size == 0)
 			return;
 
 		// batchに積まれているデータの個数
-		const int policy_value_batch_size = current_policy_value_batch_index;
+		const int policy_value_batch_size = b.size;
 		auto ds = grp->get_dlsearcher();
+		const BatchElement* policy_value_batch = b.policy_value_batch;
+	#ifdef MAKE_BOOK
+		const Key* policy_value_book_key = b.policy_value_book_key;
+	#endif
 
 #if defined(LOG_PRINT)
 		// 入力特徴量
 		std::stringstream ss;
 		for (int i = 0; i < sizeof(NN_Input1) / sizeof(DType); ++i)
-			ss << ((DType*)features1)[i] << ",";
+			ss << ((DType*)b.features1)[i] << ",";
 		ss << endl << "Input2" << endl;
 		for (int i = 0; i < sizeof(NN_Input2) / sizeof(DType); ++i)
-			ss << ((DType*)features2)[i] << ",";
+			ss << ((DType*)b.features2)[i] << ",";
 		logger.print(ss.str());
 #endif
 
 		// predict
 		// policy_value_batch_sizeの数だけまとめて局面を評価する
-		grp->nn_forward(policy_value_batch_size, features1, features2, y1, y2);
+		// 推論はSubmitBatch()で推論スレッドに依頼してあるので、その完了を待つ。
+		grp->wait(&b.request);
 
 		//cout << *y2 << endl;
 
-		const NN_Output_Policy *logits = y1;
-		const NN_Output_Value  *value  = y2;
+		const NN_Output_Policy *logits = b.y1;
+		const NN_Output_Value  *value  = b.y2;
+
+		NNCache* nn_cache = ds->get_nn_cache();
 
 		for (int i = 0; i < policy_value_batch_size; i++, logits++, value++)
 		{
@@ -742,11 +1025,6 @@ namespace dlshogi
 			const ChildNumType child_num = node->child_num;
 			      ChildNode *  uct_child = node->child.get();
 
-			// 合法手それぞれに対する遷移確率
-			std::vector<float> legal_move_probabilities;
-			// いまからemplace_backしていく回数がchild_numであることはわかっているので事前に要素を確保しておく。
-			legal_move_probabilities.reserve(child_num);
-
 #if defined(LOG_PRINT)
 			// あとで消す
 			vector<int> move_labels;
@@ -765,21 +1043,16 @@ namespace dlshogi
 			}
 #endif
 
-			for (ChildNumType j = 0; j < child_num; j++) {
-				Move move = uct_child[j].move;
-				const int move_label = make_move_label(move, color);
-				const float logit = (*logits)[move_label];
-				legal_move_probabilities.emplace_back(logit);
-
-				// デバッグ用に出力させてみる。
-				//cout << uct_child[j].move << " " << move_label << " " << logit << endl;
-			}
+			// 合法手それぞれのmove label
+			for (ChildNumType j = 0; j < child_num; j++)
+				policy_move_labels[j] = make_move_label(uct_child[j].move, color);
 
+			// 合法手それぞれに対する遷移確率
 			// Boltzmann distribution
-			softmax_temperature_with_normalize(legal_move_probabilities);
+			softmax_policy(*logits, policy_move_labels, child_num, policy_probabilities);
 
 			for (ChildNumType j = 0; j < child_num; j++) {
-				uct_child[j].nnrate = legal_move_probabilities[j];
+				uct_child[j].nnrate = policy_probabilities[j];
 			}
 
 			// valueの値はここに返すことになっている。
@@ -822,7 +1095,17 @@ namespace dlshogi
 			}
 	#endif
 			node->SetEvaled();
+
+			// 次に同じ局面をQueuingNode()した時に流用できるように登録しておく。
+			if (nn_cache->enabled())
+				nn_cache->store(policy_value_batch[i].key ^ grp->get_model_key(), node, *value);
+
+			// 合流(transposition)した時に流用できるように登録しておく。
+			Node::node_hash->store(policy_value_batch[i].key, node, *value);
 		}
+
+		// このbatchは空になったので、次のbatchの作成に使える。
+		b.size = 0;
 	}
 }
 
@@ -6,6 +6,10 @@
 #include "../../position.h"
 #include "../../mate/mate.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+
 #include "Node.h"
 
 // この探索部は、NN専用なので直接読み込む。
@@ -21,12 +25,107 @@ namespace dlshogi
 	class DlshogiSearcher;
 	struct SearchOptions;
 
+	// NNの出力(合法手に対するpolicyとvalue)をcacheしておくためのhash table。
+	// GCで開放された部分木の局面や、前の手番の探索で評価した局面を再度展開した時に、NNを呼び出さずに済む。
+	// UctSearcher::QueuingNode()でbatchに積む前に調べる。
+	// ※　dlshogiにはない。やねうら王独自拡張。
+	//
+	// 局面のhash keyをindexとする固定サイズの配列で、複数の探索スレッドから参照されるので
+	// indexに対応するmutexでlockしてアクセスする。(lock striping)
+	class NNCache
+	{
+	public:
+		// cacheのサイズを[MB]で設定する。0ならば無効化する。
+		// entry数はmb * 1MB / sizeof(Entry)。(2の累乗でなくて良い) 以前の内容はクリアされる。
+		// "isready"のタイミングで呼び出される。(探索中に呼び出してはならない)
+		void resize(size_t mb);
+
+		// このcacheが有効であるか。
+		bool enabled() const { return entry_count != 0; }
+
+		// keyに対応するNNの出力を探し、見つかればそのpolicyをnodeの各ChildNodeのnnrateにコピーする。
+		//   key   : nodeの局面のhash key
+		//   node  : ExpandNode()が完了したNode
+		//   value : [Out] NNが返したvalue
+		// 返し値 : 見つかればtrue。
+		bool probe(Key key, Node* node, float& value);
+
+		// NNの出力を登録する。すでに同じslotに別の局面があれば上書きする。
+		// 合法手がMAX_CHILDREN個を超える局面は登録しない。
+		//   key   : nodeの局面のhash key
+		//   node  : NNのpolicyがnnrateに反映されたNode
+		//   value : NNが返したvalue
+		void store(Key key, const Node* node, float value);
+
+		// 統計情報のリセット。"go"ごとに呼び出す。
+		void reset_stats() { hits = 0; misses = 0; }
+
+		// probe()でhitした回数とhitしなかった回数。
+		std::atomic<u64> hits, misses;
+
+		// entryに格納できる合法手の数の上限。
+		// 合法手の最大数(MAX_MOVES == 600)だけ持つとentryの大半が使われない領域になるので、
+		// 通常の局面の合法手(80手前後)が収まる数にして、これを超える局面はcacheしない。
+		static constexpr ChildNumType MAX_CHILDREN = 128;
+
+	private:
+		// policyはentryの中に固定長で持つ。
+		// (探索中にメモリ確保をしないため。また、設定したサイズがそのまま実際のメモリ使用量になるように)
+		struct Entry
+		{
+			Key                key = 0;
+			float              value = 0.0f;
+			ChildNumType       child_num = 0;
+
+			// 各合法手のnnrateを半精度浮動小数点数(IEEE 754 binary16)にしたもの。先頭からchild_num個が有効。
+			// nnrateは0～1の確率なので、固定小数点にするより小さな値の相対精度が保たれる。
+			u16                policy[MAX_CHILDREN];
+		};
+
+		std::mutex& get_mutex(u64 index) { return mutexes[index & (MUTEX_NUM - 1)]; }
+
+		static const u64 MUTEX_NUM = 4096; // must be 2^n
+		static_assert((MUTEX_NUM & (MUTEX_NUM - 1)) == 0);
+
+		std::unique_ptr<Entry[]> entries;
+
+		// entry数。無効ならば0。
+		u64 entry_count = 0;
+
+		std::mutex mutexes[MUTEX_NUM];
+	};
+
+	// 推論スレッドに渡す、batch一つ分の推論の依頼。
+	// UctSearcherがbatchを作るごとにUctSearcherGroup::submit()で推論スレッドのqueueに積む。
+	struct InferenceRequest
+	{
+		int batch_size;
+		Eval::dlshogi::NN_Input1*        x1;
+		Eval::dlshogi::NN_Input2*        x2;
+		Eval::dlshogi::NN_Output_Policy* y1;
+		Eval::dlshogi::NN_Output_Value*  y2;
+
+		// queueに積んだ時刻。queueでの待ち時間の計測用。
+		std::chrono::steady_clock::time_point submitted;
+
+		// 推論が完了したか。UctSearcherGroup::queue_mutexで保護されている。
+		bool done = true;
+	};
+
 	// UctSearcher(探索用スレッド)をGPU一つ利用する分ずつひとまとめにしたもの。
 	// 一つのGPUにつき、UctSearchThreadGroupひとつが対応する。
+	//
+	// やねうら王独自拡張)
+	// 推論(nn->forward())はこのクラスが持つ専用の推論スレッドで行う。
+	// 探索スレッドはbatchをqueueに積んだら、推論の完了を待たずに次のbatchを作ることができるので、
+	// 木の探索・入力特徴量の作成と、推論とが並行して行われる。
 	class UctSearcherGroup
 	{
 	public:
-		UctSearcherGroup() :  threads(0) , gpu_id(-1) , policy_value_batch_maxsize(0){}
+		UctSearcherGroup() :  threads(0) , gpu_id(-1) , policy_value_batch_maxsize(0){ reset_stats(); }
+
+		// 推論スレッドを停止させる。
+		~UctSearcherGroup();
 
 		// 初期化
 		// "isready"に対して呼び出される。
@@ -37,15 +136,27 @@ namespace dlshogi
 		//   policy_value_batch_maxsize : このインスタンスが生成したスレッドがNNのforward()を呼び出す時のbatchsize
 		void Initialize(const std::string& model_path , const int new_thread, const int gpu_id, const int policy_value_batch_maxsize);
 
-		// ニューラルネットのforward() (順方向の伝播 = 推論)を呼び出す。
-		void nn_forward(const int batch_size, Eval::dlshogi::NN_Input1* x1, Eval::dlshogi::NN_Input2* x2, Eval::dlshogi::NN_Output_Policy* y1, Eval::dlshogi::NN_Output_Value* y2)
-		{
-			mutex_gpu.lock();
-			nn->forward(batch_size, x1, x2, y1, y2);
-			mutex_gpu.unlock();
-		}
+		// ニューラルネットのforward() (順方向の伝播 = 推論)を推論スレッドのqueueに積む。
+		// 推論の完了はwait()で待つ。reqは推論が完了するまで呼び出し元が保持していること。
+		void submit(InferenceRequest* req);
+
+		// submit()したreqの推論が完了するのを待つ。
+		void wait(InferenceRequest* req);
 
-		// 各探索スレッドは探索開始時に(nn_forward()の呼び出しまでに)、この関数を呼び出してスレッドとGPUとを紐付けないといけない。
+		// 推論の統計情報。"go"ごとにリセットされる。
+		struct InferenceStats
+		{
+			std::atomic<u64> batches;        // 推論したbatchの数
+			std::atomic<u64> positions;      // 推論した局面の数
+			std::atomic<u64> capacity;       // batchesごとのpolicy_value_batch_maxsizeの合計
+			std::atomic<u64> queue_wait_us;  // queueに積まれてから推論が始まるまでの時間の合計[us]
+			std::atomic<u64> forward_us;     // 推論にかかった時間の合計[us]
+		};
+		void reset_stats();
+		const InferenceStats& get_stats() const { return stats; }
+
+		// 推論スレッドは開始時に、この関数を呼び出してスレッドとGPUとを紐付けないといけない。
+		// (各探索スレッドも探索開始時にこれを呼び出している)
 		void set_device() { nn->set_device(gpu_id); }
 
 		// やねうら王では、スレッドの生成～解体はThreadクラスが行うので、これらはコメントアウト。
@@ -73,9 +184,16 @@ namespace dlshogi
 		DlshogiSearcher* get_dlsearcher() const { return dlshogi_searcher; }
 		void set_dlsearcher(DlshogiSearcher* ds) { dlshogi_searcher = ds; }
 
+		// このインスタンスが確保しているUctSearcherの数
+		size_t size() const { return searchers.size(); }
+
 		// 保持しているn番目のUctSearcherを返す。
 		UctSearcher* get_uct_searcher(int n) { return &searchers[n]; }
 
+		// NNCacheのkeyに加味する、モデルファイルごとの値。
+		// GPUごとに異なるモデルを使っている時に、異なるモデルの出力を流用しないようにするため。
+		Key get_model_key() const { return model_key; }
+
 	private:
 
 		// dlshogiではglobalだった変数
@@ -108,6 +226,23 @@ namespace dlshogi
 		// nnが保持しているモデルのpath。
 		// 異なるモデルになった時に前のものを開放して確保しなおす。
 		std::string model_path;
+
+		// model_pathから求めたhash値。
+		Key model_key = 0;
+
+		// 推論スレッドが実行するworker
+		void InferenceWorker();
+
+		// 推論スレッド。Initialize()で初めてnnが構築された時に開始する。
+		std::thread inference_thread;
+
+		// 推論の依頼のqueueと、それを保護するmutex、queueに積まれたことと推論の完了を通知するための条件変数
+		std::deque<InferenceRequest*> queue;
+		std::mutex queue_mutex;
+		std::condition_variable queue_cv, done_cv;
+		bool stop_inference = false;
+
+		InferenceStats stats;
 	};
 
 	// leaf nodeまでに辿ったNodeを記録しておく構造体。
@@ -147,6 +282,7 @@ namespace dlshogi
 	struct BatchElement {
 		Node*	node;     // どのNodeに対するEvalNode()なのか。
 		Color	color;    // その時の手番
+		Key		key;      // その局面のhash key(Node::node_hashへの登録に用いる)
 
 		// 通常の探索では、このポインターはNodeVisitor::value_win を指している。
 		float* value_win; // leaf nodeでのvalue_winの値(これを辿ってきたNodeに対して符号を反転させながら伝播させていく)
@@ -170,17 +306,21 @@ namespace dlshogi
 		{
 			// 推論(NN::forward())のためのメモリを動的に確保する。
 			// GPUを利用する場合は、GPU側のメモリを確保しなければならないので、alloc()は抽象化されている。
+			// 一方のbatchを推論している間にもう一方のbatchを作るので、2つ分確保する。
 
-			features1 = grp->gpu_memalloc<NN_Input1       >(policy_value_batch_maxsize);
-			features2 = grp->gpu_memalloc<NN_Input2       >(policy_value_batch_maxsize);
-			y1        = grp->gpu_memalloc<NN_Output_Policy>(policy_value_batch_maxsize);
-			y2        = grp->gpu_memalloc<NN_Output_Value >(policy_value_batch_maxsize);
+			for (auto& b : batches)
+			{
+				b.features1 = grp->gpu_memalloc<NN_Input1       >(policy_value_batch_maxsize);
+				b.features2 = grp->gpu_memalloc<NN_Input2       >(policy_value_batch_maxsize);
+				b.y1        = grp->gpu_memalloc<NN_Output_Policy>(policy_value_batch_maxsize);
+				b.y2        = grp->gpu_memalloc<NN_Output_Value >(policy_value_batch_maxsize);
 
-			policy_value_batch = new BatchElement[policy_value_batch_maxsize];
+				b.policy_value_batch = new BatchElement[policy_value_batch_maxsize];
 
 	#ifdef MAKE_BOOK
-			policy_value_book_key = new Key[policy_value_batch_maxsize];
+				b.policy_value_book_key = new Key[policy_value_batch_maxsize];
 	#endif
+			}
 		}
 
 		// move counstructor
@@ -188,25 +328,29 @@ namespace dlshogi
 			grp(o.grp),
 			thread_id(o.thread_id),
 			mt(std::move(o.mt)),
-			features1(o.features1),features2(o.features2),y1(o.y1),y2(o.y2)
+			policy_value_batch_maxsize(o.policy_value_batch_maxsize)
 		{
-			o.features1 = nullptr;
-			o.features2 = nullptr;
-			o.y1 = nullptr;
-			o.y2 = nullptr;
-			policy_value_batch = nullptr;
+			for (int i = 0; i < BATCH_BUFFER_NUM; ++i)
+			{
+				batches[i] = o.batches[i];
+				o.batches[i].features1 = nullptr;
+			}
 		}
 
 		~UctSearcher() { 
-			if (features1) // move counstructorによって解体後でないことをチェック
-			{
-				grp->gpu_memfree<NN_Input1       >(features1);
-				grp->gpu_memfree<NN_Input2       >(features2);
-				grp->gpu_memfree<NN_Output_Policy>(y1);
-				grp->gpu_memfree<NN_Output_Value >(y2);
-
-				delete[] policy_value_batch;
-			}
+			for (auto& b : batches)
+				if (b.features1) // move counstructorによって解体後でないことをチェック
+				{
+					grp->gpu_memfree<NN_Input1       >(b.features1);
+					grp->gpu_memfree<NN_Input2       >(b.features2);
+					grp->gpu_memfree<NN_Output_Policy>(b.y1);
+					grp->gpu_memfree<NN_Output_Value >(b.y2);
+
+					delete[] b.policy_value_batch;
+	#ifdef MAKE_BOOK
+					delete[] b.policy_value_book_key;
+	#endif
+				}
 		 }
 
 		// -- やねうら王ではこのクラスはスレッド生成～解体に関与しない。
@@ -247,9 +391,17 @@ namespace dlshogi
 		ChildNumType SelectMaxUcbChild(ChildNode* parent, Node* current);
 
 		// Evaluateを呼び出すリスト(queue)に追加する。
+		// 現在作成中のbatch(batches[current_batch])に追加される。
 		void QueuingNode(const Position* pos, Node* node, float* value_win);
 
+		// 現在作成中のbatchを推論スレッドに渡して、次のbatchに切り替える。
+		void SubmitBatch();
+
+		// SubmitBatch()したbatchの推論の完了を待ち、その結果をNodeに反映させる。
+		void EvalBatch(int batch_index);
+
 		// ノードを評価
+		// 現在作成中のbatchを推論して、その完了を待つ。
 		void EvalNode();
 
 		// 自分の所属するグループ
@@ -275,24 +427,43 @@ namespace dlshogi
 		// コンストラクタで渡された、このスレッドが扱う、NNへのbatchの個数。
 		int policy_value_batch_maxsize;
 
-		// これは、policy_value_batch_maxsize分、事前に確保されている。
-		Eval::dlshogi::NN_Input1* features1;
-		Eval::dlshogi::NN_Input2* features2;
+		// NNに渡すbatch一つ分
+		struct BatchBuffer
+		{
+			// これは、policy_value_batch_maxsize分、事前に確保されている。
+			Eval::dlshogi::NN_Input1* features1 = nullptr;
+			Eval::dlshogi::NN_Input2* features2 = nullptr;
 
-		Eval::dlshogi::NN_Output_Policy* y1;
-		Eval::dlshogi::NN_Output_Value * y2;
+			Eval::dlshogi::NN_Output_Policy* y1 = nullptr;
+			Eval::dlshogi::NN_Output_Value * y2 = nullptr;
 
-		// EvalNode()ごとにどのNodeとColorから呼び出されたのかを記録しておく配列
-		// NNから返し値がもらえた時に、ここに記録されているNodeについて、その情報を更新する。
-		BatchElement* policy_value_batch;
+			// EvalNode()ごとにどのNodeとColorから呼び出されたのかを記録しておく配列
+			// NNから返し値がもらえた時に、ここに記録されているNodeについて、その情報を更新する。
+			BatchElement* policy_value_batch = nullptr;
 
 	#ifdef MAKE_BOOK
-		Key* policy_value_book_key;
+			Key* policy_value_book_key = nullptr;
 	#endif
 
-		// features1[],features2[],policy_value_batch[],policy_value_book_key[],の次に使用するindexを示している。
-		// batch分溜まったら、まとめてGPUに投げてEvalする。
-		int current_policy_value_batch_index;
+			// features1[],features2[],policy_value_batch[],policy_value_book_key[],の次に使用するindexを示している。
+			// batch分溜まったら、まとめてGPUに投げてEvalする。
+			int size = 0;
+
+			// 推論スレッドへの依頼
+			InferenceRequest request;
+		};
+
+		// 一方を推論スレッドに渡している間に、もう一方を作成する。(double buffering)
+		static constexpr int BATCH_BUFFER_NUM = 2;
+		BatchBuffer batches[BATCH_BUFFER_NUM];
+
+		// 現在作成中のbatchのindex
+		int current_batch = 0;
+
+		// EvalBatch()でPolicy Networkの出力を各ChildNodeのnnrateに展開する時の作業領域。
+		// 1局面の合法手はMAX_MOVES以下なので、これだけあれば足りる。(heap allocationをしないために事前に確保しておく)
+		int   policy_move_labels   [MAX_MOVES];
+		float policy_probabilities [MAX_MOVES];
 
 		// NodeTreeを取得
 		NodeTree* get_node_tree() const;
@@ -52,7 +52,13 @@ void USI::extra_option(USI::OptionsMap& o)
 #endif // !MAKE_BOOK
 
 	o["UCT_NodeLimit"]				 << USI::Option(10000000, 100000, 1000000000); // UCTノードの上限
-																				   // デバッグ用のメッセージ出力の有無
+
+	// 合流(transposition)検出用のhash tableを使うか。
+	// 手順前後で同じ局面に合流した時に、評価済みのNodeのpolicyとvalueを流用してNNの呼び出しを省く。
+	// UCT_NodeLimitの数だけ(2の累乗に切り捨てて)entryを確保する。1 entryあたり24バイト。
+	o["UCT_NodeHash"]                << USI::Option(false);
+
+	// デバッグ用のメッセージ出力の有無
 	o["DebugMessage"]                << USI::Option(false);
 
 	// ノードを再利用するか。
@@ -131,6 +137,10 @@ void USI::extra_option(USI::OptionsMap& o)
     o["DNN_Batch_Size7"]             << USI::Option(0, 0, 65536);
     o["DNN_Batch_Size8"]             << USI::Option(0, 0, 65536);
 
+	// NNの出力(policyとvalue)のcacheのサイズ[MB]。0ならcacheしない。
+	// 一度NNで評価した局面を再度展開した時に、NNを呼び出さずに済む。"isready"のたびにクリアされる。
+	o["DNN_Cache_Size"]              << USI::Option(128, 0, 65536);
+
 #if defined(ORT_MKL)
 	// nn_onnx_runtime.cpp の NNOnnxRuntime::load() で使用するオプション。 
 	// グラフ全体のスレッド数?（default値1）ORT_MKLでは効果が無いかもしれない。
@@ -147,6 +157,10 @@ void USI::extra_option(USI::OptionsMap& o)
 
 	// root nodeでのdf-pn詰将棋探索の最大ノード数
 	o["RootMateSearchNodesLimit"]    << USI::Option(1000000, 0, UINT32_MAX);
+
+	// root nodeでのdf-pn詰将棋探索に用いるスレッド数
+	// 2以上を指定すると並列探索版のdf-pnを用いる。
+	o["RootMateSearchThreads"]       << USI::Option(1, 1, 256);
 }
 
 // "isready"コマンドに対する初回応答
@@ -205,7 +219,7 @@ void Search::clear()
 	}
 
 	// ※　InitGPU()に先だってSetMateLimits()でのmate solverの初期化が必要。この呼出をInitGPU()のあとにしないこと！
-	searcher.SetMateLimits((int)Options["MaxMovesToDraw"] , (u32)Options["RootMateSearchNodesLimit"] , (int)Options["MateSearchPly"]);
+	searcher.SetMateLimits((int)Options["MaxMovesToDraw"] , (u32)Options["RootMateSearchNodesLimit"] , (int)Options["MateSearchPly"] , (int)Options["RootMateSearchThreads"]);
 	searcher.InitGPU(Eval::dlshogi::ModelPaths , thread_nums, policy_value_batch_maxsizes);
 
 	// その他、dlshogiにはあるけど、サポートしないもの。
@@ -239,6 +253,8 @@ void Search::clear()
 
 	searcher.SetPonderingMode(Options["USI_Ponder"]);
 
+	searcher.SetNodeHash(Options["UCT_NodeHash"]);
+	searcher.SetNNCacheSize((size_t)Options["DNN_Cache_Size"]);
 	searcher.InitializeUctSearch((NodeCountType)Options["UCT_NodeLimit"]);
 
 #if 0
@@ -21,9 +21,14 @@ namespace dlshogi
 	DlshogiSearcher::DlshogiSearcher()
 	{
 		search_groups        = std::make_unique<UctSearcherGroup[]>(max_gpu);
+		node_hash            = std::make_unique<NodeHashTable>();
 		gc                   = std::make_unique<NodeGarbageCollector>();
+		nn_cache             = std::make_unique<NNCache>();
 		interruption_checker = std::make_unique<SearchInterruptionChecker>(this);
 		root_dfpn_searcher   = std::make_unique<RootDfpnSearcher>(this);
+
+		// ~Node()から登録解除できるように。
+		Node::node_hash = node_hash.get();
 	}
 
 	// エンジンオプションの"USI_Ponder"の値をセットする。
@@ -38,12 +43,14 @@ namespace dlshogi
 	// 　　root_mate_search_nodes_limit : root nodeでのdf-pn探索のノード数上限。 (Options["RootMateSearchNodesLimit"]の値)
 	// 　　max_moves_to_draw            : 引き分けになる最大手数。               (Options["MaxMovesToDraw"]の値)
 	//     mate_search_ply              : leaf nodeで奇数手詰めを呼び出す時の手数(Options["MateSearchPly"]の値)
+	// 　　root_mate_search_threads     : root nodeでのdf-pn探索のスレッド数。   (Options["RootMateSearchThreads"]の値)
 	// それぞれの引数の値は、同名のsearch_optionsのメンバ変数に代入される。
-	void DlshogiSearcher::SetMateLimits(int max_moves_to_draw, u32 root_mate_search_nodes_limit, int mate_search_ply)
+	void DlshogiSearcher::SetMateLimits(int max_moves_to_draw, u32 root_mate_search_nodes_limit, int mate_search_ply, int root_mate_search_threads)
 	{
 		search_options.root_mate_search_nodes_limit = root_mate_search_nodes_limit;
 		search_options.max_moves_to_draw            = max_moves_to_draw;
 		search_options.mate_search_ply              = mate_search_ply;
+		search_options.root_mate_search_threads     = root_mate_search_threads;
 	}
 
 	// root nodeでの詰め将棋ルーチンの呼び出しに関する条件を設定し、メモリを確保する。
@@ -51,6 +58,9 @@ namespace dlshogi
 	{
 		// -- root nodeでdf-pn solverを呼び出す時。
 
+		// スレッド数の設定(solverの種類が変わることがあるので、メモリの確保より先に行う)
+		root_dfpn_searcher->set_thread_num  (search_options.root_mate_search_threads);
+
 		// メモリを確保(探索ノード数を設定してそれに応じたメモリを確保する)
 		root_dfpn_searcher->alloc           (search_options.root_mate_search_nodes_limit);
 
@@ -242,6 +252,12 @@ namespace dlshogi
 		search_options.uct_node_limit = uct_node_limit;
 
 		if (!tree) tree = std::make_unique<NodeTree>(gc.get());
+
+		// 合流検出用のhash tableの確保。UCT_NodeLimitを超えるentryは不要。
+		node_hash->resize(search_options.node_hash ? (size_t)uct_node_limit : 0);
+
+		// NNの出力のcacheの確保。モデルが変更されているかも知れないので、毎回クリアされる。
+		nn_cache->resize(search_options.nn_cache_size);
 		//search_groups = std::make_unique<UctSearcherGroup[]>(max_gpu);
 		// →　これもっと早い段階で行わないと間に合わない。コンストラクタに移動させる。
 
@@ -338,6 +354,7 @@ namespace dlshogi
 		search_groups.release();
 		tree.release(); // treeの開放を行う時にGCが必要なのでCGをあとから開放
 		gc.release();
+		node_hash.release(); // GCがNodeを開放する時に参照するのでGCよりあとに開放
 	}
 
 
@@ -385,6 +402,14 @@ namespace dlshogi
 		// 探索ノード数のクリア
 		search_limits.nodes_searched = 0;
 
+		// 合流検出用のhash tableの統計情報のクリア
+		node_hash->reset_stats();
+		nn_cache->reset_stats();
+
+		// 推論スレッドの統計情報のクリア
+		for (int i = 0; i < max_gpu; ++i)
+			search_groups[i].reset_stats();
+
 		// UCTの初期化。
 		// 探索開始局面の初期化
 		ExpandRoot(pos , search_options.generate_all_legal_moves );
@@ -474,8 +499,24 @@ namespace dlshogi
 
 			// 探索の情報を出力(探索回数, 勝敗, 思考時間, 勝率, 探索速度)
 			UctPrint::PrintPlayoutInformation(current_root, &search_limits, finish_time, pre_simulated);
+
+			// 推論スレッドの統計情報(batchの充填率、queueでの待ち時間)を出力
+			for (int i = 0; i < max_gpu; ++i)
+				if (search_groups[i].size() > 0)
+					UctPrint::PrintInferenceInformation(search_groups[i].get_stats(), i);
+
+			// Node用に確保しているメモリ量を出力
+			UctPrint::PrintNodeMemoryInformation();
 		}
 
+		// 合流検出用のhash tableのhit率の出力
+		if (node_hash->enabled() && !search_limits.silent)
+			UctPrint::PrintNodeHashInformation(*node_hash);
+
+		// NNの出力のcacheのhit率の出力
+		if (nn_cache->enabled() && !search_limits.silent)
+			UctPrint::PrintNNCacheInformation(*nn_cache);
+
 		// ---------------------
 		//     root nodeでのdf-pn
 		// ---------------------
@@ -850,6 +891,18 @@ namespace dlshogi
 #endif
 	}
 
+	// 詰み探索に用いるスレッド数を設定する。
+	// 2以上なら並列探索版のsolverに切り替える。このあとalloc()を呼び出すこと。
+	void RootDfpnSearcher::set_thread_num(int thread_num)
+	{
+#if !defined(DEV)
+		solver->ChangeSolverType(thread_num > 1 ? Mate::Dfpn::DfpnSolverType::Node32bitParallel         : Mate::Dfpn::DfpnSolverType::Node32bit);
+#else
+		solver->ChangeSolverType(thread_num > 1 ? Mate::Dfpn::DfpnSolverType::Node48bitOrderingParallel : Mate::Dfpn::DfpnSolverType::Node48bitOrdering);
+#endif
+		solver->set_thread_num(thread_num);
+	}
+
 	// 詰み探索用のメモリを確保する。
 	// 確保するメモリ量ではなくノード数を指定するので注意。
 	void RootDfpnSearcher::alloc(u32 nodes_limit)
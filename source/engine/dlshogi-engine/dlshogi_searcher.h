@@ -16,6 +16,8 @@ namespace dlshogi
 	struct Node;
 	class NodeTree;
 	class NodeGarbageCollector;
+	class NodeHashTable;
+	class NNCache;
 	class UctSearcher;
 	class UctSearcherGroup;
 	class SearchInterruptionChecker;
@@ -163,6 +165,15 @@ namespace dlshogi
 		// (歩の不成、敵陣2段目の香の不成など)全合法手を生成するのか。
 		bool generate_all_legal_moves = false;
 
+		// 合流(transposition)検出用のhash tableを使うか。
+		// エンジンオプションの"UCT_NodeHash"の値。
+		// trueならUCT_NodeLimitの数(を2の累乗に切り捨てたもの)だけentryを確保する。
+		bool node_hash = false;
+
+		// NNの出力のcacheのサイズ[MB]。0ならcacheしない。
+		// エンジンオプションの"DNN_Cache_Size"の値。
+		size_t nn_cache_size = 0;
+
 		// leaf node(探索の末端の局面)での奇数手詰みルーチンを呼び出す時の手数
 		// 0 = 奇数手詰めを呼び出さない。
 		// エンジンオプションの"MateSearchPly"の値。
@@ -176,6 +187,10 @@ namespace dlshogi
 		// デフォルトは100万
 		// 不詰が証明できた場合はそこで詰み探索は終了する。
 		u32 root_mate_search_nodes_limit;
+
+		// root nodeでのdf-pn探索に用いるスレッド数。
+		// 2以上なら並列探索版のdf-pnを用いる。
+		int root_mate_search_threads = 1;
 	};
 
 	// ノードのlock用。
@@ -212,6 +227,10 @@ namespace dlshogi
 	public:
 		RootDfpnSearcher(DlshogiSearcher* dlshogi_searcher);
 
+		// 詰み探索に用いるスレッド数を設定する。
+		// 2以上なら並列探索版のsolverに切り替える。このあとalloc()を呼び出すこと。
+		void set_thread_num(int thread_num);
+
 		// 詰み探索用のメモリを確保する。
 		// 確保するメモリ量ではなくノード数を指定するので注意。
 		void alloc(u32 nodes_limit);
@@ -258,8 +277,9 @@ namespace dlshogi
 		// 　　root_mate_search_nodes_limit : root nodeでのdf-pn探索のノード数上限。 (Options["RootMateSearchNodesLimit"]の値)
 		// 　　max_moves_to_draw            : 引き分けになる最大手数。               (Options["MaxMovesToDraw"]の値)
 		//     mate_search_ply              : leaf nodeで奇数手詰めを呼び出す時の手数(Options["MateSearchPly"]の値)
+		// 　　root_mate_search_threads     : root nodeでのdf-pn探索のスレッド数。   (Options["RootMateSearchThreads"]の値)
 		// それぞれの引数の値は、同名のsearch_optionsのメンバ変数に代入される。
-		void SetMateLimits(int max_moves_to_draw, u32 root_mate_search_nodes_limit, int mate_search_ply);
+		void SetMateLimits(int max_moves_to_draw, u32 root_mate_search_nodes_limit, int mate_search_ply, int root_mate_search_threads);
 			
 		// root nodeでの詰め将棋ルーチンの呼び出しに関する条件を設定し、メモリを確保する。
 		void InitMateSearcher();
@@ -324,6 +344,16 @@ namespace dlshogi
 		// (歩の不成、敵陣2段目の香の不成など)全合法手を生成するのか。
 		void SetGetnerateAllLegalMoves(bool flag) { search_options.generate_all_legal_moves = flag; }
 
+		// 合流(transposition)検出用のhash tableを使うか。
+		// エンジンオプションの"UCT_NodeHash"の値をセットする。
+		// InitializeUctSearch()でhash tableが確保される。
+		void SetNodeHash(bool flag) { search_options.node_hash = flag; }
+
+		// NNの出力のcacheのサイズ[MB]。
+		// エンジンオプションの"DNN_Cache_Size"の値をセットする。
+		// InitializeUctSearch()でcacheが確保される。
+		void SetNNCacheSize(size_t mb) { search_options.nn_cache_size = mb; }
+
 		// UCT探索の初期設定
 		//    node_limit : 探索ノード数の制限 0 = 無制限
 		//  →　これ、SetLimitsで反映するから、ここでは設定しない。
@@ -367,6 +397,9 @@ namespace dlshogi
 		// NodeTreeを取得。
 		NodeTree* get_node_tree() const { return tree.get(); }
 
+		// NNの出力のcacheを取得。
+		NNCache* get_nn_cache() const { return nn_cache.get(); }
+
 		// 並列探索を行う。
 		//   rootPos   : 探索開始局面
 		//   thread_id : スレッドID
@@ -420,12 +453,20 @@ namespace dlshogi
 		// UCT探索を行う、GPUに対応するスレッドグループの集合
 		std::unique_ptr<UctSearcherGroup[]> search_groups;
 
-		// 前回の探索開始局面などを保持するためのtree
-		std::unique_ptr<NodeTree> tree;
-		
+		// 合流(transposition)検出用のhash table
+		// GCのスレッドがNodeを開放する時に参照するので、gcより先に宣言しておく。
+		std::unique_ptr<NodeHashTable> node_hash;
+
 		// ガーベジコレクタ
 		std::unique_ptr<NodeGarbageCollector> gc;
 
+		// 前回の探索開始局面などを保持するためのtree
+		// デストラクタでgcとnode_hashを用いてゲーム木を開放するので、それらより後に宣言しておく。
+		std::unique_ptr<NodeTree> tree;
+
+		// NNの出力のcache
+		std::unique_ptr<NNCache> nn_cache;
+
 		// 探索停止チェック用
 		std::unique_ptr<SearchInterruptionChecker> interruption_checker;
 
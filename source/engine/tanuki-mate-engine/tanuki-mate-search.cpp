@@ -142,15 +142,29 @@ namespace MateEngine
 
 		// TTEntryを束ねたもの。
 		struct Cluster {
-			// TTEntry 20バイト×3 + 4(padding) == 64
+			// TTEntry 20バイト×3 + 4(lock) == 64
 			static constexpr int kNumEntries = 3;
-			int padding;
+
+			// このClusterのentryを読み書きする間だけ取るspin lock。0ならlockされていない。
+			// (置換表はゼロクリアして使うので、初期状態はlockされていない)
+			std::atomic<uint32_t> lock;
 
 			TTEntry entries[kNumEntries];
 		};
 		// Clusterのサイズは、CacheLineSizeの整数倍であること。
 		static_assert((sizeof(Cluster) % CacheLineSize) == 0, "");
 
+		// Clusterのlockを、スコープを抜けるまで取る。
+		struct ClusterLock {
+			ClusterLock(Cluster& cluster_) : cluster(cluster_) {
+				while (cluster.lock.exchange(1, std::memory_order_acquire))
+					while (cluster.lock.load(std::memory_order_relaxed))
+						;
+			}
+			~ClusterLock() { cluster.lock.store(0, std::memory_order_release); }
+			Cluster& cluster;
+		};
+
 		virtual ~TranspositionTable() {
 			Release();
 		}
@@ -160,9 +174,38 @@ namespace MateEngine
 			return sizeof(Cluster) * num_clusters;
 		}
 
-		// 指定したKeyのTTEntryを返す。見つからなければ初期化された新規のTTEntryを返す。
-		TTEntry& LookUp(Key key, Color root_color) {
-			auto& entries = tt[key & clusters_mask];
+		// 指定したKeyのTTEntryのコピーを返す。見つからなければ初期化された新規のTTEntryを作って、そのコピーを返す。
+		// 並列探索の時は、返したあとにentryが他のスレッドによって別の局面用に置き換えられることがあるので、参照は返さない。
+		TTEntry LookUp(Key key, Color root_color) {
+			auto& cluster = tt[key & clusters_mask];
+			ClusterLock lock(cluster);
+			return LookUpInCluster(cluster, key, root_color);
+		}
+
+		TTEntry LookUp(Position& n, Color root_color) {
+			return LookUp(n.key(), root_color);
+		}
+
+		// moveを指した後の子ノードの置換表エントリを返す
+		TTEntry LookUpChildEntry(Position& n, Move move, Color root_color) {
+			return LookUp(n.key_after(move), root_color);
+		}
+
+		// 指定したKeyのTTEntryを(見つからなければ新規に作って)、Clusterのlockを取った状態でf(entry)を呼び出す。
+		// entryへの書き込みは、必ずこれを通して行うこと。
+		// entryの参照を持ったまま子ノードを探索すると、その間にentryが別の局面用に置き換えられて、
+		// 証明(反証)済みという結果を別の局面(hash_high)のものとして書き込んでしまうことがあるため。
+		template <typename Func>
+		void Update(Key key, Color root_color, Func f) {
+			auto& cluster = tt[key & clusters_mask];
+			ClusterLock lock(cluster);
+			f(LookUpInCluster(cluster, key, root_color));
+		}
+
+		// clusterから指定したKeyのTTEntryを探して返す。見つからなければ初期化された新規のTTEntryを返す。
+		// clusterのlockを取った状態で呼び出すこと。
+		TTEntry& LookUpInCluster(Cluster& cluster, Key key, Color root_color) {
+			auto& entries = cluster;
 			uint32_t hash_high = ((key >> 32) & ~1) | root_color;
 
 			// 検索条件に合致するエントリを返す
@@ -204,15 +247,6 @@ namespace MateEngine
 			return *best_entry;
 		}
 
-		TTEntry& LookUp(Position& n, Color root_color) {
-			return LookUp(n.key(), root_color);
-		}
-
-		// moveを指した後の子ノードの置換表エントリを返す
-		TTEntry& LookUpChildEntry(Position& n, Move move, Color root_color) {
-			return LookUp(n.key_after(move), root_color);
-		}
-
 		// 置換表を確保する。
 		// 現在のOptions["USI_Hash"]の値だけ確保する。
 		void Resize()
@@ -313,18 +347,71 @@ namespace MateEngine
 	static const constexpr char* kMorePreciseMatePv = "MorePreciseMatePv";
 
 	// 置換表クラスの実体
+	// 並列探索(Threads > 1)の時は、全スレッドでこの置換表を共有する。
+	// entryの読み書きはClusterごとのlockを取って行うので、壊れたentryや、別の局面の証明結果が読めてしまうことはない。
 	TranspositionTable transposition_table;
 
+	// 並列探索の時に、各局面をいま何スレッドが探索しているかを数えておくためのtable。
+	// 子ノードを選ぶ時に、他のスレッドが探索中の子ノードは証明数(ORノード)・反証数(ANDノード)を
+	// その分だけ大きいものとみなして(virtual proof number)、スレッドが同じ子ノードに集中しないようにする。
+	// hash keyの下位bitでindexするので、別の局面と衝突することがあるが、子ノードの選択順が変わるだけなので問題ない。
+	struct SearchingTable
+	{
+		static constexpr size_t kSize = 1 << 16; // must be 2^n
+
+		// keyの局面を探索しているスレッド数を返す。
+		uint32_t count(Key key) const {
+			return counts[key & (kSize - 1)].load(std::memory_order_relaxed);
+		}
+
+		// keyの局面の探索を開始する/終了する時に呼び出す。
+		void enter(Key key) { counts[key & (kSize - 1)].fetch_add(1, std::memory_order_relaxed); }
+		void leave(Key key) { counts[key & (kSize - 1)].fetch_sub(1, std::memory_order_relaxed); }
+
+		std::atomic<uint16_t> counts[kSize];
+	};
+	SearchingTable searching_table;
+
+	// 並列探索をしているか。(Threads > 1)
+	// dfpn()の開始時に設定する。
+	bool parallel_search = false;
+
+	// main threadの探索が終わった時に、helper threadを停止させるためのフラグ。
+	// (main threadは探索終了後にponderhitやstopを待つことがあるので、Threads.stopとは別に用意する)
+	std::atomic<bool> stop_helpers;
+
+	// 探索を中断すべきか。
+	bool search_stopped() {
+		return Threads.stop.load(std::memory_order_relaxed) || stop_helpers.load(std::memory_order_relaxed);
+	}
+
+	// 子ノードを選ぶ時の証明数/反証数に、他のスレッドが探索中であることを加味する。
+	// 0(証明済み/反証済み)とkInfinitePnDnはそのまま。
+	// threshold : この子ノードを選んだ時の閾値(ORノードならthpn、ANDノードならthdn)
+	// 本来の値が閾値未満の子ノードは、加味したあとも閾値未満に抑える。
+	// (そうしないと、閾値を超えている子ノードが選ばれてすぐに返ってくるのを繰り返し、探索が進まなくなる)
+	uint32_t virtual_pn_dn(uint32_t pn_dn, Key child_key, uint32_t threshold) {
+		if (!parallel_search || pn_dn == 0 || pn_dn >= kInfinitePnDn)
+			return pn_dn;
+
+		const uint64_t v = uint64_t(pn_dn) * (1 + searching_table.count(child_key));
+		const uint64_t limit = pn_dn < threshold ? uint64_t(threshold - 1) : uint64_t(kInfinitePnDn - 1);
+		return (uint32_t)std::min(v, limit);
+	}
+
 	// TODO(tanuki-): ネガマックス法的な書き方に変更する
 	void DFPNwithTCA(Position& n, uint32_t thpn, uint32_t thdn, bool inc_flag, bool or_node, uint16_t depth,
 		Color root_color, const std::chrono::system_clock::time_point& start_time, bool& timeup) {
-		if (Threads.stop.load(std::memory_order_relaxed)) {
+		if (search_stopped()) {
 			return;
 		}
 
 		auto nodes_searched = n.this_thread()->nodes.load(memory_order_relaxed);
 
-		if (nodes_searched && (nodes_searched % 1000000) == 0)
+		// 時間・ノード数のチェックと読み筋の出力は、main threadだけが行う。
+		const bool is_main = n.this_thread() == Threads.main();
+
+		if (is_main && nodes_searched && (nodes_searched % 1000000) == 0)
 		{
 			// このタイミングで置換表の世代を進める
 			//++transposition_table.now_time;
@@ -333,16 +420,17 @@ namespace MateEngine
 			auto time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
 				current_time - start_time).count();
 			time_ms = std::max(time_ms, decltype(time_ms)(1));
-			int64_t nps = nodes_searched * 1000LL / time_ms;
+			const uint64_t nodes_total = parallel_search ? Threads.nodes_searched() : nodes_searched;
+			int64_t nps = nodes_total * 1000LL / time_ms;
 
-			sync_cout << "info  time " << time_ms << " nodes " << nodes_searched << " nps "
+			sync_cout << "info  time " << time_ms << " nodes " << nodes_total << " nps "
 				<< nps << " hashfull " << transposition_table.hashfull() << sync_endl;
 		}
 
 		// 制限時間をチェックする
 		// 頻繁にチェックすると遅くなるため、4096回に1回の割合でチェックする
 		// go mate infiniteの場合、Limits.mateにはINT32MAXが代入されている点に注意する
-		if (Limits.mate != INT32_MAX && nodes_searched % 4096 == 0) {
+		if (is_main && Limits.mate != INT32_MAX && nodes_searched % 4096 == 0) {
 			auto elapsed_ms = Time.elapsed_from_ponderhit();
 			if (elapsed_ms > Limits.mate)
 			{
@@ -353,21 +441,34 @@ namespace MateEngine
 		}
 
 		// 探索ノード数のチェック。
-		// 探索をマルチスレッドでやっていないので、nodes_searchedを求めるコストがなく、
-		// 毎回チェックしてもどうということはないはず。
-		if (Limits.nodes != 0 && nodes_searched >= (uint64_t)Limits.nodes)
+		// シングルスレッドならnodes_searchedを求めるコストがなく、毎回チェックしてもどうということはないはず。
+		// 並列探索の時は、全スレッドの合計を求めるのにコストがかかるので4096回に1回の割合でチェックする。
+		if (is_main && Limits.nodes != 0
+			&& (parallel_search
+				? nodes_searched % 4096 == 0 && Threads.nodes_searched() >= (uint64_t)Limits.nodes
+				: nodes_searched >= (uint64_t)Limits.nodes))
 		{
 			timeup = true;
 			Threads.stop = true;
 			return;
 		}
 
-		auto& entry = transposition_table.LookUp(n, root_color);
+		const Key key = n.key();
+
+		// このノードのentryにpn,dnを書き込む。
+		// entryは、子ノードのLookUp()や他のスレッドによって別の局面用に置き換えられているかも知れないので、書き込むたびに引き直す。
+		auto store = [&](uint32_t pn, uint32_t dn) {
+			transposition_table.Update(key, root_color, [&](TranspositionTable::TTEntry& e) {
+				e.pn = pn;
+				e.dn = dn;
+				e.minimum_distance = std::min(e.minimum_distance, depth);
+			});
+		};
+
+		const auto entry = transposition_table.LookUp(key, root_color);
 
 		if (depth > kMaxDepth) {
-			entry.pn = kInfinitePnDn;
-			entry.dn = 0;
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			store(kInfinitePnDn, 0);
 			return;
 		}
 
@@ -375,9 +476,7 @@ namespace MateEngine
 
 		// 1手読みルーチンによるチェック
 		if (or_node && !n.in_check() && Mate::mate_1ply(n)) {
-			entry.pn = 0;
-			entry.dn = kInfinitePnDn;
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			store(0, kInfinitePnDn);
 			return;
 		}
 
@@ -412,14 +511,10 @@ namespace MateEngine
 			// 連続王手の千日手による勝ち
 			if (or_node) {
 				// ここは通らないはず
-				entry.pn = 0;
-				entry.dn = kInfinitePnDn;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				store(0, kInfinitePnDn);
 			}
 			else {
-				entry.pn = kInfinitePnDn;
-				entry.dn = 0;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				store(kInfinitePnDn, 0);
 			}
 			return;
 
@@ -429,24 +524,18 @@ namespace MateEngine
 		  break; 
 			// 連続王手の千日手による負け
 			if (or_node) {
-				entry.pn = kInfinitePnDn;
-				entry.dn = 0;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				store(kInfinitePnDn, 0);
 			}
 			else {
 				// ここは通らないはず
-				entry.pn = 0;
-				entry.dn = kInfinitePnDn;
-				entry.minimum_distance = std::min(entry.minimum_distance, depth);
+				store(0, kInfinitePnDn);
 			}
 			return;
 
 		case REPETITION_DRAW:
 			// 普通の千日手
 			// ここは通らないはず
-			entry.pn = kInfinitePnDn;
-			entry.dn = 0;
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
+			store(kInfinitePnDn, 0);
 			return;
 
 		default:
@@ -459,26 +548,39 @@ namespace MateEngine
 
 			if (or_node) {
 				// 自分の手番でここに到達した場合は王手の手が無かった、
-				entry.pn = kInfinitePnDn;
-				entry.dn = 0;
+				store(kInfinitePnDn, 0);
 			}
 			else {
 				// 相手の手番でここに到達した場合は王手回避の手が無かった、
-				entry.pn = 0;
-				entry.dn = kInfinitePnDn;
+				store(0, kInfinitePnDn);
 			}
-
-			entry.minimum_distance = std::min(entry.minimum_distance, depth);
 			return;
 		}
 
 		// minimum distanceを保存する
 		// TODO(nodchip): このタイミングでminimum distanceを保存するのが正しいか確かめる
-		entry.minimum_distance = std::min(entry.minimum_distance, depth);
+		transposition_table.Update(key, root_color, [&](TranspositionTable::TTEntry& e) {
+			e.minimum_distance = std::min(e.minimum_distance, depth);
+		});
+
+		// この局面を探索中であることを他のスレッドに知らせる。(virtual proof number用)
+		struct SearchingGuard {
+			SearchingGuard(Key key) : key(key) { if (parallel_search) searching_table.enter(key); }
+			~SearchingGuard() { if (parallel_search) searching_table.leave(key); }
+			Key key;
+		} searching_guard(key);
 
 		bool first_time = true;
-		while (!Threads.stop.load(std::memory_order_relaxed)) {
-			++entry.num_searched;
+		while (!search_stopped()) {
+			// 子ノードを探索している間に、このノードのentryが(子ノードのLookUp()や他のスレッドによって)
+			// 別の局面のentryとして再利用されているかも知れないので、毎回引き直す。
+			// 以下ではこのコピーに対してpn,dnを求め、求め終わってからstore()で書き込む。
+			TranspositionTable::TTEntry entry;
+			transposition_table.Update(key, root_color, [&](TranspositionTable::TTEntry& e) {
+				e.minimum_distance = std::min(e.minimum_distance, depth);
+				++e.num_searched;
+				entry = e;
+			});
 
 			// determine whether thpn and thdn are increased.
 			// if (n is a leaf) inc flag = false;
@@ -540,6 +642,8 @@ namespace MateEngine
 				}
 			}
 
+			store(entry.pn, entry.dn);
+
 			// if (first time && inc flag) {
 			//   // increase thresholds
 			//   thpn = max(thpn, pn(n) + 1);
@@ -579,20 +683,23 @@ namespace MateEngine
 				uint32_t best_dn = 0;
 				uint32_t best_num_search = UINT32_MAX;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
+					const Key child_key = n.key_after(move);
+					const auto& child_entry = transposition_table.LookUp(child_key, root_color);
 					if(avoid_loop && entry.minimum_distance > child_entry.minimum_distance && child_entry.pn != 0){
 					  continue;
 					}
-					if (child_entry.pn < best_pn ||
-						(child_entry.pn == best_pn && best_num_search > child_entry.num_searched)) {
+					// 並列探索時は、他のスレッドが探索中の子ノードを選びにくくする。
+					const uint32_t child_pn = virtual_pn_dn(child_entry.pn, child_key, thpn);
+					if (child_pn < best_pn ||
+						(child_pn == best_pn && best_num_search > child_entry.num_searched)) {
 						second_best_pn = best_pn;
-						best_pn = child_entry.pn;
+						best_pn = child_pn;
 						best_dn = child_entry.dn;
 						best_move = move;
 						best_num_search = child_entry.num_searched;
 					}
-					else if (child_entry.pn < second_best_pn) {
-						second_best_pn = child_entry.pn;
+					else if (child_pn < second_best_pn) {
+						second_best_pn = child_pn;
 					}
 				}
 				thpn_child = std::min(thpn, second_best_pn + 1);
@@ -605,16 +712,19 @@ namespace MateEngine
 				uint32_t best_pn = 0;
 				uint32_t best_num_search = UINT32_MAX;
 				for (const auto& move : move_picker) {
-					const auto& child_entry = transposition_table.LookUpChildEntry(n, move, root_color);
-					if (child_entry.dn < best_dn ||
-						(child_entry.dn == best_dn && best_num_search > child_entry.num_searched)) {
+					const Key child_key = n.key_after(move);
+					const auto& child_entry = transposition_table.LookUp(child_key, root_color);
+					// 並列探索時は、他のスレッドが探索中の子ノードを選びにくくする。
+					const uint32_t child_dn = virtual_pn_dn(child_entry.dn, child_key, thdn);
+					if (child_dn < best_dn ||
+						(child_dn == best_dn && best_num_search > child_entry.num_searched)) {
 						second_best_dn = best_dn;
-						best_dn = child_entry.dn;
+						best_dn = child_dn;
 						best_pn = child_entry.pn;
 						best_move = move;
 					}
-					else if (child_entry.dn < second_best_dn) {
-						second_best_dn = child_entry.dn;
+					else if (child_dn < second_best_dn) {
+						second_best_dn = child_dn;
 					}
 				}
 
@@ -623,8 +733,7 @@ namespace MateEngine
 			}
 
 			if (best_move == MOVE_NONE && or_node){
-			  entry.pn = kInfinitePnDn;
-			  entry.dn = 0;
+			  store(kInfinitePnDn, 0);
 			  return;
 			}
 			StateInfo state_info;
@@ -856,12 +965,22 @@ namespace MateEngine
 
 		auto start = std::chrono::system_clock::now();
 
+		// Threads > 1なら、main thread以外のスレッドも同じ置換表を用いて同じ局面を探索する。(helper_dfpn())
+		parallel_search = Threads.size() > 1;
+		stop_helpers = false;
+		Threads.start_searching();
+
 		bool timeup = false;
 		Color root_color = r.side_to_move();
 		DFPNwithTCA(r, kInfinitePnDn, kInfinitePnDn, false, true, 0, root_color, start, timeup);
+
+		// main threadの探索が終わったので、helper threadを停止させる。
+		stop_helpers = true;
+		Threads.wait_for_search_finished();
+
 		const auto& entry = transposition_table.LookUp(r, root_color);
 
-		auto nodes_searched = r.this_thread()->nodes.load(memory_order_relaxed);
+		auto nodes_searched = Threads.nodes_searched();
 		sync_cout << "info string" <<
 			" pn " << entry.pn <<
 			" dn " << entry.dn <<
@@ -945,6 +1064,14 @@ namespace MateEngine
 		Threads.stop = true;
 	}
 
+	// main thread以外のスレッドの詰将棋探索のエントリポイント
+	// main threadのdfpn()から起動され、stop_helpersがtrueになるまで、main threadと同じ局面を探索する。
+	// main threadとの探索の重複は、置換表の共有とvirtual proof numberによって避ける。
+	void helper_dfpn(Position& r) {
+		bool timeup = false;
+		DFPNwithTCA(r, kInfinitePnDn, kInfinitePnDn, false, true, 0, r.side_to_move(),
+			std::chrono::system_clock::now(), timeup);
+	}
 
 }
 
@@ -968,11 +1095,8 @@ void Search::clear()
 #endif
 
 }
-void MainThread::search() { Thread::search(); }
-
-void Thread::search()
+void MainThread::search()
 {
-
 	if (Search::Limits.pv_check.size() != 0){
 		MateEngine::pv_check_from_table(rootPos, Limits.pv_check);
 		return;
@@ -991,4 +1115,10 @@ void Thread::search()
 	MateEngine::dfpn(rootPos);
 }
 
+// main thread以外のスレッドは、MateEngine::dfpn()のなかから起動される。
+void Thread::search()
+{
+	MateEngine::helper_dfpn(rootPos);
+}
+
 #endif
@@ -0,0 +1,293 @@
+﻿#include "../../config.h"
+
+#if defined(ENABLE_TEST_CMD) && defined(YANEURAOU_ENGINE_DEEP)
+
+// ----------------------------------
+//      ふかうら王のNN関係のtestコマンド
+// ----------------------------------
+
+// "test nnfeatures ..."のように"test"コマンドの後続コマンドとして書く。
+
+#include <sstream>
+#include <cstring> // memcmp
+#include <cmath>   // abs
+
+#include "nn_types.h"
+
+#include "../../position.h"
+#include "../../usi.h"
+#include "../../thread.h"
+#include "../../misc.h"
+
+using namespace std;
+using namespace Eval::dlshogi;
+
+namespace {
+
+	// ----------------------------------
+	//      "test nnfeatures" command
+	// ----------------------------------
+
+	// NNの入力特徴量を生成するmake_input_features()が、make_input_features_reference()と
+	// bit単位で一致するかを、ランダムに指し進めた局面で確認する。そのあと、両者の速度を比較する。
+	//
+	// 例)
+	//   test nnfeatures positions 10000 loop 20
+	//
+	//   positions : 確認に用いる局面数
+	//   loop      : benchで、各局面について特徴量を生成する回数
+	void nn_features(Position& pos, std::istringstream& is)
+	{
+		u64 positions = 10000;
+		u64 loop_max  = 20;
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "positions")
+				is >> positions;
+			else if (token == "loop")
+				is >> loop_max;
+		}
+		positions = std::max(positions, (u64)1);
+
+		// 初期局面からランダムに指し進めて、局面をsfenで集める。
+		// (王手がかかっている局面や手駒の多い局面も含まれるように、詰むか最大手数まで進める)
+		vector<string> sfens;
+		sfens.reserve(positions);
+		{
+			PRNG prng(20211001);
+			auto states = std::make_unique<StateInfo[]>(MAX_PLY + 1);
+			Position p;
+			while (sfens.size() < positions)
+			{
+				p.set_hirate(&states[0], Threads.main());
+				for (int ply = 0; ply < MAX_PLY && sfens.size() < positions; ++ply)
+				{
+					MoveList<LEGAL> ml(p);
+					if (ml.size() == 0)
+						break;
+					p.do_move(ml.at(prng.rand(ml.size())), states[ply + 1]);
+					sfens.push_back(p.sfen());
+				}
+			}
+		}
+
+		auto features1     = std::make_unique<NN_Input1[]>(1);
+		auto features2     = std::make_unique<NN_Input2[]>(1);
+		auto ref_features1 = std::make_unique<NN_Input1[]>(1);
+		auto ref_features2 = std::make_unique<NN_Input2[]>(1);
+
+		// make_input_features()はバッファのゼロクリアを前提としないので、ゴミで埋めておいて確認する。
+		std::fill_n((u8*)features1.get(), sizeof(NN_Input1), (u8)0xcc);
+		std::fill_n((u8*)features2.get(), sizeof(NN_Input2), (u8)0xcc);
+
+		// 局面をsetし直したものを保持しておく。(benchではPosition::set()の時間を含めたくないので)
+		vector<Position> poss(sfens.size());
+		vector<StateInfo> si(sfens.size());
+		for (size_t i = 0; i < sfens.size(); ++i)
+			poss[i].set(sfens[i], &si[i], Threads.main());
+
+		// 一致するかの確認
+		u64 mismatch = 0;
+		for (size_t i = 0; i < poss.size(); ++i)
+		{
+			make_input_features          (poss[i], features1.get()    , features2.get()    );
+			make_input_features_reference(poss[i], ref_features1.get(), ref_features2.get());
+
+			if (memcmp(features1.get(), ref_features1.get(), sizeof(NN_Input1))
+			 || memcmp(features2.get(), ref_features2.get(), sizeof(NN_Input2)))
+			{
+				if (mismatch++ == 0)
+					cout << "Error! : features mismatch , sfen " << sfens[i] << endl;
+			}
+		}
+
+		cout << "nnfeatures : positions = " << poss.size() << " , mismatch = " << mismatch << endl;
+
+		// 速度の比較
+		auto bench = [&](auto func)
+		{
+			TimePoint start = now();
+			for (u64 loop = 0; loop < loop_max; ++loop)
+				for (auto& p : poss)
+					func(p, features1.get(), features2.get());
+			return now() - start + 1; // 0除算を避けるために1を足しておく。
+		};
+
+		const u64 total = loop_max * poss.size();
+		const TimePoint elapsed_ref = bench(make_input_features_reference);
+		const TimePoint elapsed_new = bench(make_input_features);
+
+		cout << "\n==========================="
+			 << "\nTotal positions          : " << total
+			 << "\nreference (positions/s)  : " << 1000 * total / elapsed_ref
+			 << "\ncurrent   (positions/s)  : " << 1000 * total / elapsed_new
+			 << "\nSpeedup                  : " << (double)elapsed_ref / elapsed_new
+			 << endl;
+	}
+
+	// ----------------------------------
+	//      "test nnpolicy" command
+	// ----------------------------------
+
+	// Policy Networkの出力を合法手の確率に展開する処理(UctSearcher::EvalBatch()で行っているもの)の確認とbench。
+	// 従来の方法(合法手ごとにstd::vectorにlogitを積んでからsoftmax_temperature_with_normalize()を呼び出す)と、
+	// softmax_policy()とで、結果の誤差と、1秒間に展開できる局面数(nodes/s)を比較する。
+	// NNは用いず、logitは乱数で生成する。
+	//
+	// 例)
+	//   test nnpolicy positions 10000 loop 20
+	//
+	//   positions : 用いる局面数
+	//   loop      : benchで、各局面について展開する回数
+	void nn_policy(Position& pos, std::istringstream& is)
+	{
+		u64 positions = 10000;
+		u64 loop_max  = 20;
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "positions")
+				is >> positions;
+			else if (token == "loop")
+				is >> loop_max;
+		}
+		positions = std::max(positions, (u64)1);
+
+		PRNG prng(20211002);
+
+		// 初期局面からランダムに指し進めて、合法手が2手以上ある局面の指し手を集める。
+		struct Leaf
+		{
+			Color        color;
+			vector<Move> moves;
+		};
+		vector<Leaf> leaves;
+		leaves.reserve(positions);
+		{
+			auto states = std::make_unique<StateInfo[]>(MAX_PLY + 1);
+			Position p;
+			while (leaves.size() < positions)
+			{
+				p.set_hirate(&states[0], Threads.main());
+				for (int ply = 0; ply < MAX_PLY && leaves.size() < positions; ++ply)
+				{
+					MoveList<LEGAL> ml(p);
+					if (ml.size() == 0)
+						break;
+					if (ml.size() >= 2)
+					{
+						Leaf leaf;
+						leaf.color = p.side_to_move();
+						for (auto m : ml)
+							leaf.moves.push_back(m.move);
+						leaves.emplace_back(std::move(leaf));
+					}
+					p.do_move(ml.at(prng.rand(ml.size())), states[ply + 1]);
+				}
+			}
+		}
+
+		// NNの出力の代わりに乱数で生成したlogit。(局面ごとに用意するとメモリが大きくなるので使いまわす)
+		constexpr size_t LOGITS_NUM = 64;
+		auto logits = std::make_unique<NN_Output_Policy[]>(LOGITS_NUM);
+		for (size_t i = 0; i < LOGITS_NUM; ++i)
+			for (auto& x : logits[i])
+				x = (float)((double)prng.rand(1000000) / 100000.0 - 5.0); // -5.0 ～ 5.0
+
+		// ChildNode::nnrateの代わり
+		vector<float> nnrate(MAX_MOVES);
+
+		// 従来の方法
+		auto expand_reference = [&](size_t i)
+		{
+			const auto& leaf = leaves[i];
+			const auto& y1   = logits[i % LOGITS_NUM];
+
+			std::vector<float> legal_move_probabilities;
+			legal_move_probabilities.reserve(leaf.moves.size());
+			for (auto move : leaf.moves)
+				legal_move_probabilities.emplace_back(y1[make_move_label(move, leaf.color)]);
+
+			softmax_temperature_with_normalize(legal_move_probabilities);
+
+			for (size_t j = 0; j < leaf.moves.size(); ++j)
+				nnrate[j] = legal_move_probabilities[j];
+		};
+
+		// softmax_policy()を用いる方法
+		int   move_labels  [MAX_MOVES];
+		float probabilities[MAX_MOVES];
+		auto expand = [&](size_t i)
+		{
+			const auto& leaf = leaves[i];
+			const int n = (int)leaf.moves.size();
+
+			for (int j = 0; j < n; ++j)
+				move_labels[j] = make_move_label(leaf.moves[j], leaf.color);
+
+			softmax_policy(logits[i % LOGITS_NUM], move_labels, n, probabilities);
+
+			for (int j = 0; j < n; ++j)
+				nnrate[j] = probabilities[j];
+		};
+
+		// 誤差の確認
+		double max_error = 0;
+		vector<float> expected(MAX_MOVES);
+		for (size_t i = 0; i < leaves.size(); ++i)
+		{
+			expand_reference(i);
+			std::copy(nnrate.begin(), nnrate.end(), expected.begin());
+			expand(i);
+			for (size_t j = 0; j < leaves[i].moves.size(); ++j)
+				max_error = std::max(max_error, (double)std::abs(nnrate[j] - expected[j]));
+		}
+
+		cout << "nnpolicy : positions = " << leaves.size() << " , max abs error = " << max_error << endl;
+
+		auto bench = [&](auto func)
+		{
+			TimePoint start = now();
+			for (u64 loop = 0; loop < loop_max; ++loop)
+				for (size_t i = 0; i < leaves.size(); ++i)
+					func(i);
+			return now() - start + 1; // 0除算を避けるために1を足しておく。
+		};
+
+		const u64 total = loop_max * leaves.size();
+		const TimePoint elapsed_ref = bench(expand_reference);
+		const TimePoint elapsed_new = bench(expand);
+
+		cout << "\n==========================="
+			 << "\nTotal nodes              : " << total
+			 << "\nreference (nodes/s)      : " << 1000 * total / elapsed_ref
+			 << "\ncurrent   (nodes/s)      : " << 1000 * total / elapsed_new
+			 << "\nSpeedup                  : " << (double)elapsed_ref / elapsed_new
+			 << endl;
+	}
+
+} // namespace
+
+
+// ----------------------------------
+//      "test" command Decorator
+// ----------------------------------
+
+namespace Test
+{
+	// ふかうら王のNN関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool nn_test_cmd(Position& pos, std::istringstream& is, const std::string& token)
+	{
+		if (token == "nnfeatures") nn_features(pos, is);  // NNの入力特徴量の生成の確認とbench。
+		else if (token == "nnpolicy") nn_policy(pos, is); // Policy Networkの出力の展開の確認とbench。
+		else return false;                                 // どのコマンドも処理することがなかった
+
+		// いずれかのコマンドを処理した。
+		return true;
+	}
+}
+
+#endif // defined(ENABLE_TEST_CMD) && defined(YANEURAOU_ENGINE_DEEP)
@@ -4,35 +4,181 @@
 
 #include <cstring> // memset,wchar_t
 #include <cmath>   // expf,logf
+#include <algorithm> // fill_n
+#include <type_traits>
 
 #include "../../usi.h"
 
 using namespace std;
 using namespace Tools;
 
-namespace
-{
-	// 指し手に対して、Policy Networkの返してくる配列のindexを返すためのテーブル
-	// Eval::init()で初期化する。
-	u16 MoveLabel[0x10000][COLOR_NB];
-}
-
 
 namespace Eval::dlshogi
 {
 	// モデルファイル名へのpath
 	std::vector<std::string> ModelPaths;
 
+	// 指し手に対して、Policy Networkの返してくる配列のindexを返すためのテーブル
+	// Eval::init()で初期化する。
+	u16 MoveLabel[0x10000][COLOR_NB];
+
 	// Aperyの手駒は、GOLDが末尾になっていないので変換テーブルを用意する。
 	PieceType HandPiece2PieceType[HandPieceNum ] = { PAWN , LANCE , KNIGHT , SILVER , GOLD , BISHOP , ROOK };
 	//int       PieceType2HandPiece[PIECE_TYPE_NB] = { 0 , 1 , 2 , 3 , 4 , 6 , 7 , 5 };
 
 
+	// 64bitのbit順を反転させる。
+	static u64 bit_reverse64(u64 x)
+	{
+		x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+		x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+		x = ((x >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((x & 0x0f0f0f0f0f0f0f0fULL) << 4);
+		x = ((x >> 8) & 0x00ff00ff00ff00ffULL) | ((x & 0x00ff00ff00ff00ffULL) << 8);
+		x = ((x >>16) & 0x0000ffff0000ffffULL) | ((x & 0x0000ffff0000ffffULL) <<16);
+		return (x >> 32) | (x << 32);
+	}
+
+	// 入力特徴量の1枚(SQ_NB個)に書き出す順にBitboardの各bitを並べなおしたもの。
+	// bit i が、書き出す先のi番目(sq2 = i)に対応する。
+	struct PlaneBits
+	{
+		u64 lo; // bit 0..63
+		u64 hi; // bit 64..80
+
+		// flip : 盤面を180度回転させるか。(手番が後手の時)
+		PlaneBits(const Bitboard& bb, bool flip)
+		{
+			// Bitboardは、p[0]のbit0..62がSQ_11..SQ_79、p[1]のbit0..17がSQ_81..SQ_99。
+			// これを81bitの連続したbit列にする。
+			const u64 p0 = bb.extract64<0>();
+			const u64 p1 = bb.extract64<1>();
+			lo = p0 | (p1 << 63);
+			hi = p1 >> 1;
+
+			if (flip)
+			{
+				// Flip(sq) == SQ_NB - 1 - sq なので、81bitのbit列を反転させれば良い。
+				// 128bitとして反転させてから、余分な47bit分シフトする。
+				const u64 rlo = bit_reverse64(lo);
+				const u64 rhi = bit_reverse64(hi);
+				lo = (rhi >> 47) | (rlo << 17);
+				hi = rlo >> 47;
+			}
+		}
+	};
+
+	// 入力特徴量の1枚(SQ_NB個)を、bitが1の升はdtype_one、0の升はdtype_zeroで埋める。
+	// 書き出し先をゼロクリアしておく必要がない。
+	static void write_plane(DType* dst, const PlaneBits& bits)
+	{
+		static_assert(std::is_same<DType, float>::value, "write_plane() assumes DType == float");
+
+#if defined(USE_AVX512)
+		// 16bitずつmaskとして用いて、16要素ずつ書き出す。
+		const __m512 ones = _mm512_set1_ps(dtype_one);
+		for (int i = 0; i < 4; ++i)
+			_mm512_storeu_ps(dst + i * 16, _mm512_maskz_mov_ps((__mmask16)(bits.lo >> (i * 16)), ones));
+		_mm512_storeu_ps(dst + 64, _mm512_maskz_mov_ps((__mmask16)bits.hi, ones));
+		dst[80] = (bits.hi >> 16) & 1 ? dtype_one : dtype_zero;
+
+#elif defined(USE_AVX2)
+		// 8bitずつ各laneにbroadcastして、そのlaneに対応するbitが立っているかで8要素ずつ書き出す。
+		const __m256  ones = _mm256_set1_ps(dtype_one);
+		const __m256i sel  = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+		for (int i = 0; i < 10; ++i)
+		{
+			const u32 b = (u32)((i < 8 ? bits.lo >> (i * 8) : bits.hi >> ((i - 8) * 8)) & 0xff);
+			const __m256i m = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(b), sel), sel);
+			_mm256_storeu_ps(dst + i * 8, _mm256_and_ps(_mm256_castsi256_ps(m), ones));
+		}
+		dst[80] = (bits.hi >> 16) & 1 ? dtype_one : dtype_zero;
+
+#else
+		for (int i = 0; i < 64; ++i)
+			dst[i] = (bits.lo >> i) & 1 ? dtype_one : dtype_zero;
+		for (int i = 64; i < (int)SQ_NB; ++i)
+			dst[i] = (bits.hi >> (i - 64)) & 1 ? dtype_one : dtype_zero;
+#endif
+	}
+
 	// 入力特徴量を生成する。
 	//   position  : このあとEvalNode()を呼び出したい局面
 	//   features1 : ここに書き出す。(事前に呼び出し元でバッファを確保しておくこと)
 	//   features2 : ここに書き出す。(事前に呼び出し元でバッファを確保しておくこと)
+	//
+	// 升ごと・駒種ごとにbitを調べるのではなく、Bitboard単位で計算して、特徴量の1枚ずつを
+	// write_plane()でまとめて書き出す。make_input_features_reference()と同じ結果になる。
 	void make_input_features(const Position& position, NN_Input1* features1, NN_Input2* features2)
+	{
+		const Bitboard occupied_bb = position.pieces();
+
+		// 手番が後手の場合、色を反転させ、盤面を180度回転させて考える。
+		const bool flip = position.side_to_move() == WHITE;
+
+		for (Color c = BLACK; c < COLOR_NB; ++c)
+		{
+			const Color c2 = flip ? ~c : c;
+
+			// 駒種ごとの利き
+			Bitboard attacks[PieceTypeNum];
+
+			// 利きの数を升ごとにbitごとに分けて数える。(MAX_ATTACK_NUMで飽和する)
+			// attack_num[k]は、k+1個以上の利きがある升が1になっているBitboard。
+			// ※　position.attackers_to(c, sq, occupied_bb).pop_count()を全升について求めるのと同じ。
+			Bitboard attack_num[MAX_ATTACK_NUM];
+			for (auto& bb : attack_num)
+				bb = ZERO_BB;
+
+			for (PieceType pt = PAWN; pt < (u32)PieceTypeNum; ++pt)
+			{
+				const Bitboard pieces = position.pieces(c, pt);
+				const Piece pc = make_piece(c, pt);
+
+				Bitboard bb = pieces;
+				attacks[pt] = ZERO_BB;
+				while (bb)
+				{
+					const Bitboard effect = effects_from(pc, bb.pop(), occupied_bb);
+					attacks[pt] |= effect;
+
+					for (int k = MAX_ATTACK_NUM - 1; k > 0; --k)
+						attack_num[k] |= attack_num[k - 1] & effect;
+					attack_num[0] |= effect;
+				}
+
+				// 駒の配置
+				write_plane((*features1)[c2][pt - 1], PlaneBits(pieces, flip));
+
+				// 駒種ごとの利き(有るか無いか)
+				write_plane((*features1)[c2][PIECETYPE_NUM + pt - 1], PlaneBits(attacks[pt], flip));
+			}
+
+			// ある升に対する利き数。MAX_ATTACK_NUM以上の利きは、MAX_ATTACK_NUM個であるとみなす。
+			for (int k = 0; k < MAX_ATTACK_NUM; ++k)
+				write_plane((*features1)[c2][PIECETYPE_NUM + PIECETYPE_NUM + k], PlaneBits(attack_num[k], flip));
+
+			// 手駒
+			// 並び順などについては、make_input_features_reference()の説明を参照のこと。
+			auto features2_hand = reinterpret_cast<DType(*)[COLOR_NB][MAX_PIECES_IN_HAND_SUM][SQ_NB]>(features2);
+			const Hand hand = position.hand_of(c);
+			int p = 0;
+			for (int hp = 0; hp < HandPieceNum; ++hp)
+			{
+				const PieceType pt = HandPiece2PieceType[hp];
+				const int num = std::min(hand_count(hand, pt), MAX_PIECES_IN_HAND[hp]);
+				std::fill_n((*features2_hand)[c2][p      ], (int)SQ_NB * num                            , dtype_one );
+				std::fill_n((*features2_hand)[c2][p + num], (int)SQ_NB * (MAX_PIECES_IN_HAND[hp] - num), dtype_zero);
+				p += MAX_PIECES_IN_HAND[hp];
+			}
+		}
+
+		// 王手がかかっているか(のlayerが1枚)
+		std::fill_n((*features2)[MAX_FEATURES2_HAND_NUM], SQ_NB, position.in_check() ? dtype_one : dtype_zero);
+	}
+
+	// 入力特徴量を生成する。(dlshogiのmake_input_features()をそのまま移植したもの)
+	// make_input_features()と同じ結果になることを確認するためのもの。"test nnfeatures"コマンドで用いる。
+	void make_input_features_reference(const Position& position, NN_Input1* features1, NN_Input2* features2)
 	{
 		// set all zero
 		// 特徴量の配列をゼロ初期化
@@ -254,12 +400,6 @@ namespace Eval::dlshogi
 
 	}
 
-	// 指し手に対して、Policy Networkの返してくる配列のindexを返す。
-	int make_move_label(Move move, Color color)
-	{
-		return MoveLabel[move & 0xffff][color];
-	}
-
 	// Boltzmann distribution
 	// see: Reinforcement Learning : An Introduction 2.3.SOFTMAX ACTION SELECTION
 	// →　第二版が無料で公開されているので、そちらを参照するようにしたほうが良いのでは。
@@ -293,6 +433,119 @@ namespace Eval::dlshogi
 		}
 	}
 
+#if defined(USE_AVX2)
+	// 8要素まとめてexpf()を計算する。(Cephesのexpfと同じ多項式近似。相対誤差は2e-7程度)
+	// ※　AVX2のtargetでもFMAは有効になっていない(-mfmaを指定していない)ので、mul + addで計算する。
+	// xは-87.3～88.3の範囲にclampされる。この範囲より小さいものは0になる。
+	static __m256 exp256_ps(__m256 x)
+	{
+		const __m256 one = _mm256_set1_ps(1.0f);
+
+		x = _mm256_min_ps(x, _mm256_set1_ps( 88.3762626647949f));
+		x = _mm256_max_ps(x, _mm256_set1_ps(-87.3365478515625f));
+
+		// exp(x) = 2^n * exp(r) , n = round(x / log(2)) , r = x - n * log(2)
+		__m256 fx = _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)), _mm256_set1_ps(0.5f));
+		fx = _mm256_floor_ps(fx);
+
+		x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(0.693359375f    )));
+		x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(-2.12194440e-4f )));
+
+		__m256 y = _mm256_set1_ps(1.9875691500E-4f);
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.3981999507E-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(8.3334519073E-3f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(4.1665795894E-2f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(1.6666665459E-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, x), _mm256_set1_ps(5.0000001201E-1f));
+		y = _mm256_add_ps(_mm256_mul_ps(y, _mm256_mul_ps(x, x)), _mm256_add_ps(x, one));
+
+		// 2^nを指数部に直接作る。
+		const __m256i n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(0x7f)), 23);
+		return _mm256_mul_ps(y, _mm256_castsi256_ps(n));
+	}
+
+	// 8要素の最大値/合計を求める。
+	static float hmax256_ps(__m256 v)
+	{
+		__m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+		m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+		m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+		return _mm_cvtss_f32(m);
+	}
+	static float hsum256_ps(__m256 v)
+	{
+		__m128 m = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+		m = _mm_add_ps(m, _mm_movehl_ps(m, m));
+		m = _mm_add_ss(m, _mm_shuffle_ps(m, m, 1));
+		return _mm_cvtss_f32(m);
+	}
+#endif
+
+	// Policy Networkの出力(logits)から、move_labels[0..n-1]の指すlogitを集めてきて、
+	// それにsoftmax(ボルツマン温度はset_softmax_temperature()で設定したもの)を適用した確率をprobabilities[0..n-1]に書き出す。
+	// softmax_temperature_with_normalize()と違い、heap allocationを行わない。
+	void softmax_policy(const NN_Output_Policy& logits, const int* move_labels, int n, float* probabilities)
+	{
+#if defined(USE_AVX2)
+		// 端数はmaskして読み書きする。(配列の末尾を越えて読み書きしない)
+		const __m256i lane  = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		auto mask_of = [&](int i) { return _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), lane); };
+
+		const __m256 vbeta = _mm256_set1_ps(beta);
+		// maskされたlaneに入れておく値。exp()すると0になる。(-ffast-mathでも大丈夫なようにinfinityは使わない)
+		const __m256 lowest = _mm256_set1_ps(-1e30f);
+
+		// logitを集めてきて、betaを掛ける。ついでに最大値を求める。
+		__m256 vmax = lowest;
+		for (int i = 0; i < n; i += 8)
+		{
+			const __m256i mask = mask_of(i);
+			const __m256i idx  = _mm256_maskload_epi32(move_labels + i, mask);
+			__m256 x = _mm256_mask_i32gather_ps(lowest, logits, idx, _mm256_castsi256_ps(mask), sizeof(float));
+			x = _mm256_blendv_ps(lowest, _mm256_mul_ps(x, vbeta), _mm256_castsi256_ps(mask));
+			vmax = _mm256_max_ps(vmax, x);
+			_mm256_maskstore_ps(probabilities + i, mask, x);
+		}
+
+		// オーバーフローを防止するため最大値で引いてからexp()する。
+		const __m256 max = _mm256_set1_ps(hmax256_ps(vmax));
+		__m256 vsum = _mm256_setzero_ps();
+		for (int i = 0; i < n; i += 8)
+		{
+			const __m256i mask = mask_of(i);
+			__m256 x = _mm256_maskload_ps(probabilities + i, mask);
+			x = _mm256_and_ps(exp256_ps(_mm256_sub_ps(x, max)), _mm256_castsi256_ps(mask));
+			vsum = _mm256_add_ps(vsum, x);
+			_mm256_maskstore_ps(probabilities + i, mask, x);
+		}
+
+		// normalize
+		const __m256 inv_sum = _mm256_set1_ps(1.0f / hsum256_ps(vsum));
+		for (int i = 0; i < n; i += 8)
+		{
+			const __m256i mask = mask_of(i);
+			_mm256_maskstore_ps(probabilities + i, mask, _mm256_mul_ps(_mm256_maskload_ps(probabilities + i, mask), inv_sum));
+		}
+#else
+		float max = -1e30f;
+		for (int i = 0; i < n; ++i)
+		{
+			const float x = logits[move_labels[i]] * beta;
+			probabilities[i] = x;
+			max = std::max(max, x);
+		}
+		float sum = 0.0f;
+		for (int i = 0; i < n; ++i)
+		{
+			probabilities[i] = expf(probabilities[i] - max);
+			sum += probabilities[i];
+		}
+		const float inv_sum = 1.0f / sum;
+		for (int i = 0; i < n; ++i)
+			probabilities[i] *= inv_sum;
+#endif
+	}
+
 	Result init_model_paths()
 	{
 		const std::string model_paths[max_gpu] = {
@@ -119,12 +119,29 @@ namespace Eval::dlshogi
 	//   features2 : ここに書き出す。(事前に呼び出し元でバッファを確保しておくこと)
 	void make_input_features(const Position& position, NN_Input1* features1, NN_Input2* features2);
 
+	// make_input_features()と同じ入力特徴量を、升ごと・駒種ごとに1bitずつ調べて生成する。(dlshogiの実装)
+	// make_input_features()の結果の検証用。"test nnfeatures"コマンドで用いる。
+	void make_input_features_reference(const Position& position, NN_Input1* features1, NN_Input2* features2);
+
+	// 指し手に対して、Policy Networkの返してくる配列のindexを返すためのテーブル
+	// Eval::init()で初期化する。
+	extern u16 MoveLabel[0x10000][COLOR_NB];
+
 	// 指し手に対して、Policy Networkの返してくる配列のindexを返す。
-	int make_move_label(Move move, Color color);
+	// 探索中、展開する局面の合法手すべてに対して呼び出されるのでinlineにしておく。
+	inline int make_move_label(Move move, Color color)
+	{
+		return MoveLabel[move & 0xffff][color];
+	}
 
 	// Softmax関数
 	void softmax_temperature_with_normalize(std::vector<float>& log_probabilities);
 
+	// Policy Networkの出力から、n個の指し手のmove label(make_move_label()の値)に対応するlogitを集めてきて、
+	// softmaxを適用した確率をprobabilities[0..n-1]に書き出す。(AVX2ならgatherとexpをSIMDで行う)
+	// 探索中にNNの出力を展開する時に使う。heap allocationを伴わない。
+	void softmax_policy(const NN_Output_Policy& logits, const int* move_labels, int n, float* probabilities);
+
 	// Softmaxの時のボルツマン温度の設定。
 	void set_softmax_temperature(const float temperature);
 
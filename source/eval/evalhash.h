@@ -10,8 +10,16 @@ template <typename T>
 struct HashTable
 {
 	// 配列のresize。単位は[MB]
+	// 0を指定すると解放する。(empty()がtrueになる)
 	void resize(size_t mbSize)
 	{
+		if (mbSize == 0)
+		{
+			release();
+			size = 0;
+			return;
+		}
+
 		size_t newClusterCount = mbSize * 1024 * 1024 / sizeof(T);
 		newClusterCount = (size_t)1 << MSB64(newClusterCount); // msbだけ取り、2**nであることを保証する
 
@@ -38,7 +46,10 @@ struct HashTable
 	~HashTable() { release(); }
 
 	T* operator[] (const Key k) { return entries_ + (static_cast<size_t>(k) & (size - 1)); }
-	void clear() { Tools::memclear("eHash", entries_, size * sizeof(T)); }
+	void clear() { if (entries_) Tools::memclear("eHash", entries_, size * sizeof(T)); }
+
+	// 確保されていないか。(resize(0)されたとき)
+	bool empty() const { return size == 0; }
 
 private:
 
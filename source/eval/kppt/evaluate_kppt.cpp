@@ -286,6 +286,52 @@ namespace Eval
 		// が必要であるが、1),2)がプロセスが解体されるときに自動でなされるので、この処理は特に入れない。
 	}
 
+#elif defined (USE_SHARED_MEMORY_IN_EVAL)
+	// Windows以外の環境での評価関数の共有。POSIX shared memoryを用いる。(SharedMemoryクラス)
+	// 評価関数ファイルのfull pathと更新日時が同じ場合に限り共有される。
+
+	SharedMemory shared_eval_memory;
+
+	void load_eval()
+	{
+		// 評価関数を共有するのか
+		if ((bool)Options["EvalShare"])
+		{
+			auto make_name = [&](std::string filename) { return Path::Combine((string)Options["EvalDir"], filename); };
+			auto name = SharedMemory::make_name("YANEURAOU_KPPT_" ENGINE_VERSION, { make_name(KK_BIN), make_name(KKP_BIN), make_name(KPP_BIN) });
+
+			bool created;
+			auto result = shared_eval_memory.open(name, size_of_eval, [](void* ptr) {
+				// 共有メモリを作成したので、このタイミングで評価関数バイナリを読み込む。
+				// (読み込みに失敗したときはload_eval_impl()のなかで終了する)
+				eval_assign(ptr);
+				load_eval_impl();
+				return true;
+			}, created);
+
+			if (result.is_ok())
+			{
+				eval_assign(shared_eval_memory.data());
+
+				if (created)
+					sync_cout << "info string created shared eval memory." << sync_endl;
+				else
+					// 評価関数バイナリは他のプロセスによって読み込まれている。
+					sync_cout << "info string use shared eval memory." << sync_endl;
+				return;
+			}
+
+			sync_cout << "info string can't open shared eval memory , " << result.to_string() << sync_endl;
+		}
+
+		shared_eval_memory.close();
+		eval_malloc();
+		load_eval_impl();
+
+		// 共有されていないメモリを用いる。
+		sync_cout << "info string use non-shared eval_memory." << sync_endl;
+	}
+
 #else
 
 	// 評価関数のプロセス間共有を行わないときは、普通に
@@ -15,7 +15,12 @@
 #include "../evalhash.h"
 #endif
 
+#if defined(USE_EVAL_HASH) || defined(USE_CPU_DISPATCH)
+#include "../../thread.h"
+#endif
+
 #include "evaluate_nnue.h"
+#include "nnue_test_command.h"
 
 namespace Eval {
 
@@ -123,6 +128,81 @@ namespace Eval {
             return !stream.fail();
         }
 
+#if defined(USE_SHARED_MEMORY_IN_EVAL)
+
+        // 評価関数パラメータを他のプロセスと共有するための共有メモリ
+        SharedMemory shared_eval_memory;
+
+        // 共有メモリ上の領域を評価関数パラメータに割り当てる。
+        template <typename T>
+        static void AssignShared(AlignedPtr<T>& pointer, void* ptr) {
+            pointer.reset(reinterpret_cast<T*>(ptr));
+
+            // 共有メモリはshared_eval_memoryが開放するので、deleterでは開放しない。
+            pointer.get_deleter().mem = nullptr;
+        }
+
+        // feature_transformerとnetworkを共有メモリ上に配置して、評価関数ファイルを読み込む。
+        // 他のプロセスが同じ評価関数ファイルを読み込み済みであれば、それをそのまま用いる。
+        // 共有メモリが使えなかったときはfalseを返す。
+        static bool LoadShared(const std::string& file_name) {
+
+            // networkはpage境界から配置する。
+            const size_t network_offset = (sizeof(FeatureTransformer) + 4095) & ~size_t(4095);
+            const size_t size = network_offset + sizeof(Network);
+
+            auto assign = [&](void* ptr) {
+                AssignShared(feature_transformer, ptr);
+                AssignShared(network, (u8*)ptr + network_offset);
+            };
+
+            // 前回の共有メモリ上に配置されているかも知れないので、先に開放しておく。
+            feature_transformer.reset();
+            network.reset();
+
+            // 共有メモリの名前には、評価関数ファイルのほかにTARGET_CPUとパラメータのサイズも含める。
+            // networkは命令セットに依存するデータ(sparse_weights_、canSaturate16)を持つので、
+            // 異なるTARGET_CPU用のビルドが同じ共有メモリを使ってはならない。
+            const std::string prefix = std::string("YANEURAOU_NNUE_" ENGINE_VERSION "_" TARGET_CPU "_")
+                + std::to_string(sizeof(FeatureTransformer)) + "_" + std::to_string(sizeof(Network));
+
+            bool created;
+            auto result = shared_eval_memory.open(SharedMemory::make_name(prefix, { file_name }), size,
+                [&](void* ptr) {
+                    // 共有メモリを作成したので、このタイミングで評価関数ファイルを読み込む。
+                    assign(ptr);
+                    std::ifstream stream(file_name, std::ios::binary);
+                    const bool ok = ReadParameters(stream);
+
+                    // 読み込みに失敗した場合、この共有メモリは削除される。
+                    if (!ok) {
+                        feature_transformer.reset();
+                        network.reset();
+                    }
+                    return ok;
+                }, created);
+
+            if (result.is_not_ok()) {
+                sync_cout << "info string can't open shared eval memory , " << result.to_string() << sync_endl;
+                return false;
+            }
+
+            assign(shared_eval_memory.data());
+
+            // 他のプロセスが読み込んだパラメータに差し替わったかも知れない。
+            FeatureTransformer::InvalidateRefreshCache();
+
+            if (created)
+                sync_cout << "info string created shared eval memory." << sync_endl;
+            else
+                // 評価関数ファイルは他のプロセスによって読み込まれている。
+                sync_cout << "info string use shared eval memory." << sync_endl;
+
+            return true;
+        }
+
+#endif
+
         // 差分計算ができるなら進める
         static void UpdateAccumulatorIfPossible(const Position& pos) {
             feature_transformer->UpdateAccumulatorIfPossible(pos);
@@ -169,41 +249,19 @@ namespace Eval {
 #if defined(USE_EVAL_HASH)
 
 // HashTableに評価値を保存するために利用するクラス
+    // 複数スレッドから同時に読み書きされるが、lockはしない。
+    // keyをscoreとxorして保存しておけば、読み書きが競合してkeyとscoreの組が壊れていたときには
+    // (ほぼ確実に)keyが一致しなくなるので、壊れたentryを使ってしまうことはない。
     struct alignas(16) ScoreKeyValue {
-#if defined(USE_SSE2)
-        ScoreKeyValue() = default;
-        ScoreKeyValue(const ScoreKeyValue & other) {
-            static_assert(sizeof(ScoreKeyValue) == sizeof(__m128i),
-                "sizeof(ScoreKeyValue) should be equal to sizeof(__m128i)");
-            _mm_store_si128(&as_m128i, other.as_m128i);
-        }
-        ScoreKeyValue& operator=(const ScoreKeyValue & other) {
-            _mm_store_si128(&as_m128i, other.as_m128i);
-            return *this;
-        }
-#endif
-
         // evaluate hashでatomicに操作できる必要があるのでそのための操作子
-        void encode() {
-#if defined(USE_SSE2)
-            // ScoreKeyValue は atomic にコピーされるので key が合っていればデータも合っている。
-#else
-            key ^= score;
-#endif
-        }
+        void encode() { key ^= score; }
         // decode()はencode()の逆変換だが、xorなので逆変換も同じ変換。
         void decode() { encode(); }
 
-        union {
-            struct {
-                std::uint64_t key;
-                std::uint64_t score;
-            };
-#if defined(USE_SSE2)
-            __m128i as_m128i;
-#endif
-        };
+        std::uint64_t key;
+        std::uint64_t score;
     };
+    static_assert(sizeof(ScoreKeyValue) == 16, "");
 
     // evaluateしたものを保存しておくHashTable(俗にいうehash)
 
@@ -214,9 +272,17 @@ namespace Eval {
     void EvalHash_Clear() { g_evalTable.clear(); };
 
     // prefetchする関数も用意しておく。
+    // Position::do_move()で局面のhash keyが確定した時点で呼び出される。
+    // NNUEのEvalHashは手番込みのkeyで引くので、do_null_move()からも呼び出される。
     void prefetch_evalhash(const Key key) {
-        constexpr auto mask = ~((u64)0x1f);
-        prefetch((void*)((u64)g_evalTable[key] & mask));
+        if (!g_evalTable.empty())
+            prefetch(g_evalTable[key]);
+    }
+
+    // 探索スレッドごとのEvalHashの統計を1増やす。
+    // 書き込むのはそのスレッドだけなので、lock付きの加算(fetch_add)は用いない。
+    static void count_up(std::atomic<uint64_t>& counter) {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
     }
 #endif
 
@@ -224,6 +290,25 @@ namespace Eval {
     // benchコマンドなどでOptionsを保存して復元するのでこのときEvalDirが変更されたことになって、
     // 評価関数の再読込の必要があるというフラグを立てるため、この関数は2度呼び出されることがある。
     void load_eval() {
+
+#if defined(USE_SHARED_MEMORY_IN_EVAL)
+        // 評価関数を共有するのか
+        if ((bool)Options["EvalShare"])
+        {
+            auto full_dir_name = Path::Combine(Directory::GetCurrentFolder(), (std::string)Options["EvalDir"]);
+            sync_cout << "info string EvalDirectory = " << full_dir_name << sync_endl;
+
+            const std::string file_name = Path::Combine((std::string)Options["EvalDir"], NNUE::kFileName);
+            sync_cout << "info string loading eval file : " << file_name << sync_endl;
+
+            if (NNUE::LoadShared(file_name))
+                return;
+
+            // 共有されていないメモリを用いる。
+            sync_cout << "info string use non-shared eval_memory." << sync_endl;
+        }
+#endif
+
         NNUE::Initialize();
 
 #if defined(EVAL_LEARN)
@@ -280,13 +365,27 @@ namespace Eval {
 #endif
 
 #if defined(USE_EVAL_HASH)
+        // EvalHashのサイズが0(デフォルト)なら用いない。
+        // 探索部は静的評価値を置換表にも保存しているので、EvalHashにhitするのは置換表から追い出された局面だけで、
+        // hit率は1%未満であった。それに対してランダムなメモリアクセスが1回増えるので、通常は無効のほうが速い。
+        if (g_evalTable.empty())
+            return NNUE::ComputeScore(pos);
+
         // evaluate hash tableにはあるかも。
         const Key key = pos.state()->key();
+        Thread* th = pos.this_thread();
+        count_up(th->evalHashProbes);
         ScoreKeyValue entry = *g_evalTable[key];
         entry.decode();
         if (entry.key == key) {
             // あった！
-            return Value(entry.score);
+            // 同じ局面でもう一度呼び出されたときのために、accumulatorにも評価値を記録しておく。
+            // (accumulationは計算していないので、computed_accumulationはそのまま)
+            count_up(th->evalHashHits);
+            auto& accumulator = pos.state()->accumulator;
+            accumulator.score = Value(entry.score);
+            accumulator.computed_score = true;
+            return accumulator.score;
         }
 #endif
 
@@ -314,4 +413,29 @@ namespace Eval {
 
 }  // namespace Eval
 
+#if defined(USE_CPU_DISPATCH)
+
+// CPU dispatch用のビルドでは、このファイルはTARGET_CPUごとにコンパイルされる。
+// このファイルで定義しているシンボルには、Makefileで"_AVX2"のようにTARGET_CPUの名前が付与されるので、
+// evaluate_nnue_dispatch.cppからはyaneuraou_nnue_kernel_AVX2のような名前で参照する。
+extern "C" const Eval::NNUE::Kernel yaneuraou_nnue_kernel = {
+    TARGET_CPU,
+    sizeof(Position), sizeof(StateInfo), sizeof(Thread),
+    Eval::load_eval,
+    Eval::compute_eval,
+    Eval::evaluate,
+    Eval::evaluate_with_no_return,
+    Eval::print_eval_stat,
+#if defined(USE_EVAL_HASH)
+    Eval::EvalHash_Resize,
+    Eval::EvalHash_Clear,
+    Eval::prefetch_evalhash,
+#endif
+#if defined(ENABLE_TEST_CMD)
+    Eval::NNUE::TestCommand,
+#endif
+};
+
+#endif
+
 #endif  // defined(EVAL_NNUE)
@@ -35,6 +35,7 @@ namespace Eval::NNUE {
 	    }
 	
 	    // operator()で開放すべきメモリ(LargeMemory::static_alloc()で確保するときの引数に指定したmem)
+	    // 共有メモリ上に配置したときなど、開放する必要がないときはnullptr。
 	    void* mem = nullptr;
 	};
 
@@ -67,6 +68,34 @@ namespace Eval::NNUE {
 	// 評価関数パラメータを書き込む
 	bool WriteParameters(std::ostream& stream);
 
+#if defined(USE_CPU_DISPATCH)
+	// CPU dispatch用のビルドで、TARGET_CPUごとにコンパイルしたNNUE評価関数の計算部(kernel)。
+	// evaluate_nnue.cppでkernelごとに定義して、evaluate_nnue_dispatch.cppが起動時にこのなかから1つ選ぶ。
+	struct Kernel {
+
+		// このkernelのTARGET_CPU
+		const char* target_cpu;
+
+		// kernelとそれ以外の部分とで、layoutが一致しているかの確認用。
+		size_t position_size, state_info_size, thread_size;
+
+		// Eval::load_eval()などの、このkernelでの実装
+		void  (*load_eval)();
+		Value (*compute_eval)(const Position& pos);
+		Value (*evaluate)(const Position& pos);
+		void  (*evaluate_with_no_return)(const Position& pos);
+		void  (*print_eval_stat)(Position& pos);
+#if defined(USE_EVAL_HASH)
+		void  (*eval_hash_resize)(size_t mbSize);
+		void  (*eval_hash_clear)();
+		void  (*prefetch_evalhash)(const Key key);
+#endif
+#if defined(ENABLE_TEST_CMD)
+		void  (*test_command)(Position& pos, std::istream& stream);
+#endif
+	};
+#endif
+
 }  // namespace Eval::NNUE
 
 #endif  // defined(EVAL_NNUE)
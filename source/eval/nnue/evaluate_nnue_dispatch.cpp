@@ -0,0 +1,158 @@
+﻿// CPU dispatch用のビルド(USE_CPU_DISPATCH)で、NNUE評価関数の計算部をCPUに応じて切り替えるコード
+
+#include "../../config.h"
+
+#if defined(EVAL_NNUE) && defined(USE_CPU_DISPATCH)
+
+#if defined(EVAL_LEARN)
+#error "USE_CPU_DISPATCH can't be used with EVAL_LEARN."
+#endif
+
+#include "../../evaluate.h"
+#include "../../position.h"
+#include "../../thread.h"
+#include "../../misc.h"
+#include "../evaluate_common.h"
+
+#include "evaluate_nnue.h"
+#include "nnue_test_command.h"
+
+// "make dispatch"では、evaluate_nnue.cppなどをDISPATCH_CPUSのCPUごとにコンパイルしてリンクする。(Makefile参照)
+// それぞれのkernelは、yaneuraou_nnue_kernel_AVX2のように、TARGET_CPUの名前の付いたシンボルで参照できる。
+// また、kernelの静的変数の初期化子は、そのkernelを選んだときにだけ呼び出すように、
+// Makefileで.init_arrayからnnue_init_AVX2のようなsectionに移してある。(リンカがその範囲を__start_,__stop_のシンボルで提供する)
+// 初期化子を持たないkernelもありうるのでweakで参照する。
+#define NNUE_KERNEL(cpu)                                                                       \
+    extern "C" const Eval::NNUE::Kernel yaneuraou_nnue_kernel_##cpu;                          \
+    extern "C" void (* const __start_nnue_init_##cpu[])() __attribute__((weak));               \
+    extern "C" void (* const __stop_nnue_init_##cpu[])() __attribute__((weak));
+
+#define NNUE_KERNEL_ENTRY(cpu) { &yaneuraou_nnue_kernel_##cpu, __start_nnue_init_##cpu, __stop_nnue_init_##cpu },
+
+#if defined(NNUE_KERNEL_AVX512VNNI)
+NNUE_KERNEL(AVX512VNNI)
+#endif
+#if defined(NNUE_KERNEL_AVX512)
+NNUE_KERNEL(AVX512)
+#endif
+#if defined(NNUE_KERNEL_AVXVNNI)
+NNUE_KERNEL(AVXVNNI)
+#endif
+#if defined(NNUE_KERNEL_AVX2)
+NNUE_KERNEL(AVX2)
+#endif
+#if defined(NNUE_KERNEL_SSE42)
+NNUE_KERNEL(SSE42)
+#endif
+#if defined(NNUE_KERNEL_SSE41)
+NNUE_KERNEL(SSE41)
+#endif
+#if defined(NNUE_KERNEL_SSSE3)
+NNUE_KERNEL(SSSE3)
+#endif
+#if defined(NNUE_KERNEL_SSE2)
+NNUE_KERNEL(SSE2)
+#endif
+
+namespace Eval {
+
+    namespace {
+
+        struct KernelEntry {
+            const NNUE::Kernel* kernel;
+            void (* const* init_begin)();
+            void (* const* init_end)();
+        };
+
+        // リンクされているkernel。上位のCPU向けのものから順に。
+        const KernelEntry kernels[] = {
+#if defined(NNUE_KERNEL_AVX512VNNI)
+            NNUE_KERNEL_ENTRY(AVX512VNNI)
+#endif
+#if defined(NNUE_KERNEL_AVX512)
+            NNUE_KERNEL_ENTRY(AVX512)
+#endif
+#if defined(NNUE_KERNEL_AVXVNNI)
+            NNUE_KERNEL_ENTRY(AVXVNNI)
+#endif
+#if defined(NNUE_KERNEL_AVX2)
+            NNUE_KERNEL_ENTRY(AVX2)
+#endif
+#if defined(NNUE_KERNEL_SSE42)
+            NNUE_KERNEL_ENTRY(SSE42)
+#endif
+#if defined(NNUE_KERNEL_SSE41)
+            NNUE_KERNEL_ENTRY(SSE41)
+#endif
+#if defined(NNUE_KERNEL_SSSE3)
+            NNUE_KERNEL_ENTRY(SSSE3)
+#endif
+#if defined(NNUE_KERNEL_SSE2)
+            NNUE_KERNEL_ENTRY(SSE2)
+#endif
+        };
+
+        // 実行中のCPUで動作する最上位のkernelを選んで、その静的変数を初期化する。
+        // 選ばなかったkernelのコードは(静的変数の初期化子も含めて)一切実行しない。
+        const NNUE::Kernel* select_kernel() {
+            for (auto& entry : kernels) {
+                const auto* kernel = entry.kernel;
+                if (!CpuId::dispatch_supports(kernel->target_cpu))
+                    continue;
+
+                // Position等のlayoutがTARGET_CPUによって変わるとkernelに渡せない。(ビルドの設定の誤り)
+                if (kernel->position_size != sizeof(Position)
+                    || kernel->state_info_size != sizeof(StateInfo)
+                    || kernel->thread_size != sizeof(Thread)) {
+                    std::cout << "info string Error! : layout mismatch in NNUE kernel " << kernel->target_cpu << std::endl;
+                    continue;
+                }
+
+                if (entry.init_begin != nullptr)
+                    for (auto init = entry.init_begin; init != entry.init_end; ++init)
+                        (*init)();
+
+                CpuId::set_dispatched("NNUE", kernel->target_cpu);
+                return kernel;
+            }
+
+            // DISPATCH_BASE_CPU向けのkernelは必ずリンクされていて、それが選ばれるはず。
+            std::cout << "info string Error! : no NNUE kernel for this CPU" << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+
+        // 選択したkernel
+        const NNUE::Kernel* const kernel = select_kernel();
+
+    }  // namespace
+
+    void load_eval() { kernel->load_eval(); }
+
+    // 初期化
+    void init() {}
+
+    Value compute_eval(const Position& pos) { return kernel->compute_eval(pos); }
+
+    Value evaluate(const Position& pos) { return kernel->evaluate(pos); }
+
+    void evaluate_with_no_return(const Position& pos) { kernel->evaluate_with_no_return(pos); }
+
+    void print_eval_stat(Position& pos) { kernel->print_eval_stat(pos); }
+
+#if defined(USE_EVAL_HASH)
+    void EvalHash_Resize(size_t mbSize) { kernel->eval_hash_resize(mbSize); }
+
+    void EvalHash_Clear() { kernel->eval_hash_clear(); }
+
+    void prefetch_evalhash(const Key key) { kernel->prefetch_evalhash(key); }
+#endif
+
+#if defined(ENABLE_TEST_CMD)
+    namespace NNUE {
+        void TestCommand(Position& pos, std::istream& stream) { kernel->test_command(pos, stream); }
+    }
+#endif
+
+}  // namespace Eval
+
+#endif  // defined(EVAL_NNUE) && defined(USE_CPU_DISPATCH)
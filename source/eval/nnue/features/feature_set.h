@@ -83,7 +83,15 @@ class FeatureSetBase {
   static void AppendChangedIndices(
       const PositionType& pos, TriggerEvent trigger,
       IndexListType removed[2], IndexListType added[2], bool reset[2]) {
-    const auto& dp = pos.state()->dirtyPiece;
+    AppendChangedIndices(pos, pos.state()->dirtyPiece, trigger, removed, added, reset);
+  }
+
+  // 特徴量のうち、dp(posに至るまでのいずれかの指し手で動いた駒)によって値が変化したインデックスのリストを取得する
+  // kSupportsMultiPlyUpdateがfalseの特徴量を含むときは、dpはpos.state()->dirtyPieceでなければならない。
+  template <typename PositionType, typename IndexListType>
+  static void AppendChangedIndices(
+      const PositionType& pos, const Eval::DirtyPiece& dp, TriggerEvent trigger,
+      IndexListType removed[2], IndexListType added[2], bool reset[2]) {
     if (dp.dirty_num == 0) return;
 
     for (const auto perspective : COLOR) {
@@ -114,7 +122,7 @@ class FeatureSetBase {
             pos, trigger, perspective, &added[perspective]);
       } else {
         Derived::CollectChangedIndices(
-            pos, trigger, perspective,
+            pos, dp, trigger, perspective,
             &removed[perspective], &added[perspective]);
       }
     }
@@ -146,6 +154,9 @@ class FeatureSet<FirstFeatureType, RemainingFeatureTypes...> :
   using SortedTriggerSet = typename InsertToSet<TriggerEvent,
       typename Tail::SortedTriggerSet, Head::kRefreshTrigger>::Result;
   static constexpr auto kRefreshTriggers = SortedTriggerSet::kValues;
+  // 計算済みの祖先局面から、各局面のDirtyPieceを順に適用して差分計算できるか
+  static constexpr bool kSupportsMultiPlyUpdate =
+      Head::kSupportsMultiPlyUpdate && Tail::kSupportsMultiPlyUpdate;
 
   // 特徴量名を取得する
   static std::string GetName() {
@@ -171,13 +182,13 @@ class FeatureSet<FirstFeatureType, RemainingFeatureTypes...> :
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
   template <typename IndexListType>
   static void CollectChangedIndices(
-      const Position& pos, const TriggerEvent trigger, const Color perspective,
+      const Position& pos, const Eval::DirtyPiece& dp, const TriggerEvent trigger, const Color perspective,
       IndexListType* const removed, IndexListType* const added) {
-    Tail::CollectChangedIndices(pos, trigger, perspective, removed, added);
+    Tail::CollectChangedIndices(pos, dp, trigger, perspective, removed, added);
     if (Head::kRefreshTrigger == trigger) {
       const auto start_removed = removed->size();
       const auto start_added = added->size();
-      Head::AppendChangedIndices(pos, perspective, removed, added);
+      Head::AppendChangedIndices(pos, dp, perspective, removed, added);
       for (auto i = start_removed; i < removed->size(); ++i) {
         (*removed)[i] += Tail::kDimensions;
       }
@@ -216,6 +227,10 @@ class FeatureSet<FeatureType> : public FeatureSetBase<FeatureSet<FeatureType>> {
       CompileTimeList<TriggerEvent, FeatureType::kRefreshTrigger>;
   static constexpr auto kRefreshTriggers = SortedTriggerSet::kValues;
 
+  // Whether the accumulator can be updated from an ancestor several plies back
+  // 計算済みの祖先局面から、各局面のDirtyPieceを順に適用して差分計算できるか
+  static constexpr bool kSupportsMultiPlyUpdate = FeatureType::kSupportsMultiPlyUpdate;
+
   // 特徴量名を取得する
   static std::string GetName() {
     return FeatureType::kName;
@@ -233,10 +248,10 @@ class FeatureSet<FeatureType> : public FeatureSetBase<FeatureSet<FeatureType>> {
 
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
   static void CollectChangedIndices(
-      const Position& pos, const TriggerEvent trigger, const Color perspective,
+      const Position& pos, const Eval::DirtyPiece& dp, const TriggerEvent trigger, const Color perspective,
       IndexList* const removed, IndexList* const added) {
     if (FeatureType::kRefreshTrigger == trigger) {
-      FeatureType::AppendChangedIndices(pos, perspective, removed, added);
+      FeatureType::AppendChangedIndices(pos, dp, perspective, removed, added);
     }
   }
 
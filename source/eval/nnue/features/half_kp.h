@@ -35,13 +35,15 @@ class HalfKP {
   static constexpr TriggerEvent kRefreshTrigger =
       (AssociatedKing == Side::kFriend) ?
       TriggerEvent::kFriendKingMoved : TriggerEvent::kEnemyKingMoved;
+  // 計算済みの祖先局面から、各局面のDirtyPieceを順に適用して差分計算できるか
+  static constexpr bool kSupportsMultiPlyUpdate = true;
 
   // 特徴量のうち、値が1であるインデックスのリストを取得する
   static void AppendActiveIndices(const Position& pos, Color perspective,
                                   IndexList* active);
 
-  // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
-  static void AppendChangedIndices(const Position& pos, Color perspective,
+  // 特徴量のうち、dp(その局面に至る指し手で動いた駒)によって値が変化したインデックスのリストを取得する
+  static void AppendChangedIndices(const Position& pos, const Eval::DirtyPiece& dp, Color perspective,
                                    IndexList* removed, IndexList* added);
 
   // 玉の位置とBonaPieceから特徴量のインデックスを求める
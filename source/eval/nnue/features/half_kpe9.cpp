@@ -96,12 +96,11 @@ void HalfKPE9<AssociatedKing>::AppendActiveIndices(
 // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
 template <Side AssociatedKing>
 void HalfKPE9<AssociatedKing>::AppendChangedIndices(
-    const Position& pos, Color perspective,
+    const Position& pos, const Eval::DirtyPiece& dp, Color perspective,
     IndexList* removed, IndexList* added) {
   BonaPiece* pieces;
   Square sq_target_k;
   GetPieces(pos, perspective, &pieces, &sq_target_k);
-  const auto& dp = pos.state()->dirtyPiece;
 
   for (int i = 0; i < dp.dirty_num; ++i) {
     if (dp.pieceNo[i] >= PIECE_NUMBER_KING) continue;
@@ -31,9 +31,8 @@ void K::AppendActiveIndices(
 
 // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
 void K::AppendChangedIndices(
-    const Position& pos, Color perspective,
+    const Position& pos, const Eval::DirtyPiece& dp, Color perspective,
     IndexList* removed, IndexList* added) {
-  const auto& dp = pos.state()->dirtyPiece;
   if (dp.pieceNo[0] >= PIECE_NUMBER_KING) {
     removed->push_back(
         dp.changed_piece[0].old_piece.from[perspective] - fe_end);
@@ -29,9 +29,8 @@ void P::AppendActiveIndices(
 
 // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
 void P::AppendChangedIndices(
-    const Position& pos, Color perspective,
+    const Position& pos, const Eval::DirtyPiece& dp, Color perspective,
     IndexList* removed, IndexList* added) {
-  const auto& dp = pos.state()->dirtyPiece;
   for (int i = 0; i < dp.dirty_num; ++i) {
     if (dp.pieceNo[i] >= PIECE_NUMBER_KING) continue;
     removed->push_back(dp.changed_piece[i].old_piece.from[perspective]);
@@ -9,9 +9,16 @@
 #if defined(EVAL_NNUE)
 
 #include "../nnue_common.h"
+#include "input_slice.h"
 
 namespace Eval::NNUE::Layers {
 
+// 直前の層がInputSlice(=入力特徴量変換器の出力)であるか
+template <typename T>
+struct IsInputSlice : std::false_type {};
+template <IndexType OutputDimensions, IndexType Offset>
+struct IsInputSlice<InputSlice<OutputDimensions, Offset>> : std::true_type {};
+
 // Affine transformation layer
 // アフィン変換層
 template <typename PreviousLayer, IndexType OutputDimensions>
@@ -29,6 +36,18 @@ class AffineTransform {
 	static constexpr IndexType kOutputDimensions      = OutputDimensions;
 	static constexpr IndexType kPaddedInputDimensions = CeilToMultiple<IndexType>(kInputDimensions, kMaxSimdWidth);
 
+	// Whether to propagate sparsely (only the non-zero inputs)
+	// 入力特徴量変換器の出力(ClippedReLU済みで大半が0)を受ける最初の隠れ層では、
+	// 0でない入力だけを積和する疎な順伝播を行う。(0でない入力が多い局面では密な順伝播を行う)
+	static constexpr bool kIsSparseInput =
+#if defined(USE_AVX2)
+	    IsInputSlice<PreviousLayer>::value && kOutputDimensions % 8 == 0;
+#elif defined(USE_SSSE3) || (defined(USE_NEON) && defined(__aarch64__))
+	    IsInputSlice<PreviousLayer>::value && kOutputDimensions % 4 == 0;
+#else
+	    false;
+#endif
+
 	// Size of forward propagation buffer used in this layer
 	// この層で使用する順伝播用バッファのサイズ
 	static constexpr std::size_t kSelfBufferSize =
@@ -63,6 +82,7 @@ class AffineTransform {
 			biases_[i] = read_little_endian<BiasType>(stream);
 		for (std::size_t i = 0; i < kOutputDimensions * kPaddedInputDimensions; ++i)
 			weights_[i] = read_little_endian<WeightType>(stream);
+		PrepareParameters();
 		return !stream.fail();
 	}
 
@@ -291,6 +311,118 @@ class AffineTransform {
 
 #endif
 
+#if defined(USE_SSSE3) || (defined(USE_NEON) && defined(__aarch64__))
+		if constexpr (kIsSparseInput) {
+			const auto output = reinterpret_cast<OutputType*>(buffer);
+
+			// 0でない入力を、4個(4byte)ずつのブロック単位で調べる。
+			// 入力は0～127なので、ブロックをint32として見て正であれば0ではない。
+			// 密な入力のときにこの判定が無駄にならないよう、まずビットマスクを作って数えるだけにしておき、
+			// 0でないブロックの列挙は疎な順伝播を行うと決まってからにする。
+#if defined(USE_AVX2)
+			constexpr IndexType kBlocksPerMask = 8;
+#else
+			constexpr IndexType kBlocksPerMask = 4;
+#endif
+			constexpr IndexType kNumMasks = kPaddedInputDimensions / 4 / kBlocksPerMask;
+			std::uint32_t       masks[kNumMasks];
+			IndexType           num_nnz = 0;
+#if defined(USE_AVX2)
+			const __m256i kZero256 = _mm256_setzero_si256();
+			for (IndexType j = 0; j < kNumMasks; ++j) {
+				const __m256i in = reinterpret_cast<const __m256i*>(input)[j];
+				masks[j]         = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(in, kZero256)));
+				num_nnz += POPCNT32(masks[j]);
+			}
+#elif defined(USE_SSSE3)
+			const __m128i kZero128 = _mm_setzero_si128();
+			for (IndexType j = 0; j < kNumMasks; ++j) {
+				const __m128i in = reinterpret_cast<const __m128i*>(input)[j];
+				masks[j]         = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(in, kZero128)));
+				num_nnz += POPCNT32(masks[j]);
+			}
+#else
+			const uint32x4_t kBits = {1, 2, 4, 8};
+			for (IndexType j = 0; j < kNumMasks; ++j) {
+				const uint32x4_t in = reinterpret_cast<const uint32x4_t*>(input)[j];
+				masks[j]            = vaddvq_u32(vandq_u32(vtstq_u32(in, in), kBits));
+				num_nnz += POPCNT32(masks[j]);
+			}
+#endif
+
+			// 0でないブロックが多いときは、下の密な順伝播のほうが速いのでそちらを用いる。
+			if (num_nnz <= kMaxSparseChunks) {
+				std::uint16_t nnz[kPaddedInputDimensions / 4];
+				IndexType     k = 0;
+				for (IndexType j = 0; j < kNumMasks; ++j) {
+					std::uint32_t mask = masks[j];
+					while (mask) nnz[k++] = std::uint16_t(j * kBlocksPerMask + pop_lsb(mask));
+				}
+
+				// 列挙したブロックごとに、その4個の入力を全レーンにbroadcastして、
+				// [ブロック][出力][4]の順に並べ替えてある重み(sparse_weights_)と積和する。
+				// 1レーン(int32)が1つの出力に対応する。
+				const auto input32 = reinterpret_cast<const std::int32_t*>(input);
+#if defined(USE_AVX512)
+				if constexpr (kOutputDimensions % 16 == 0) {
+					constexpr IndexType kNumRegs = kOutputDimensions / 16;
+					__m512i             acc[kNumRegs];
+					for (IndexType k = 0; k < kNumRegs; ++k)
+						acc[k] = *reinterpret_cast<const __m512i*>(&biases_[k * 16]);
+					for (IndexType n = 0; n < num_nnz; ++n) {
+						const IndexType c   = nnz[n];
+						const __m512i   in  = _mm512_set1_epi32(input32[c]);
+						const auto      col = reinterpret_cast<const __m512i*>(&sparse_weights_[c * kOutputDimensions * 4]);
+						for (IndexType k = 0; k < kNumRegs; ++k) m512_add_dpbusd_epi32(acc[k], in, col[k]);
+					}
+					for (IndexType k = 0; k < kNumRegs; ++k) reinterpret_cast<__m512i*>(output)[k] = acc[k];
+					return output;
+				}
+#endif
+#if defined(USE_AVX2)
+				constexpr IndexType kNumRegs = kOutputDimensions / 8;
+				__m256i             acc[kNumRegs];
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = *reinterpret_cast<const __m256i*>(&biases_[k * 8]);
+				for (IndexType n = 0; n < num_nnz; ++n) {
+					const IndexType c   = nnz[n];
+					const __m256i   in  = _mm256_set1_epi32(input32[c]);
+					const auto      col = reinterpret_cast<const __m256i*>(&sparse_weights_[c * kOutputDimensions * 4]);
+					for (IndexType k = 0; k < kNumRegs; ++k) m256_add_dpbusd_epi32(acc[k], in, col[k]);
+				}
+				for (IndexType k = 0; k < kNumRegs; ++k) reinterpret_cast<__m256i*>(output)[k] = acc[k];
+#elif defined(USE_SSSE3)
+				constexpr IndexType kNumRegs = kOutputDimensions / 4;
+				__m128i             acc[kNumRegs];
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = *reinterpret_cast<const __m128i*>(&biases_[k * 4]);
+				for (IndexType n = 0; n < num_nnz; ++n) {
+					const IndexType c   = nnz[n];
+					const __m128i   in  = _mm_set1_epi32(input32[c]);
+					const auto      col = reinterpret_cast<const __m128i*>(&sparse_weights_[c * kOutputDimensions * 4]);
+					for (IndexType k = 0; k < kNumRegs; ++k) m128_add_dpbusd_epi32(acc[k], in, col[k]);
+				}
+				for (IndexType k = 0; k < kNumRegs; ++k) reinterpret_cast<__m128i*>(output)[k] = acc[k];
+#else
+				constexpr IndexType kNumRegs = kOutputDimensions / 4;
+				int32x4_t           acc[kNumRegs];
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = *reinterpret_cast<const int32x4_t*>(&biases_[k * 4]);
+				for (IndexType n = 0; n < num_nnz; ++n) {
+					const IndexType c   = nnz[n];
+					const int8x16_t in  = vreinterpretq_s8_s32(vdupq_n_s32(input32[c]));
+					const auto      col = reinterpret_cast<const int8x16_t*>(&sparse_weights_[c * kOutputDimensions * 4]);
+					for (IndexType k = 0; k < kNumRegs; ++k) {
+						// 1つのint8x16_tに4出力×4入力分の重みがある。
+						const int16x8_t product0 = vmull_s8(vget_low_s8(in), vget_low_s8(col[k]));
+						const int16x8_t product1 = vmull_s8(vget_high_s8(in), vget_high_s8(col[k]));
+						acc[k] = vaddq_s32(acc[k], vpaddq_s32(vpaddlq_s16(product0), vpaddlq_s16(product1)));
+					}
+				}
+				for (IndexType k = 0; k < kNumRegs; ++k) reinterpret_cast<int32x4_t*>(output)[k] = acc[k];
+#endif
+				return output;
+			}
+		}
+#endif
+
 #if defined(USE_AVX512)
 
 		constexpr IndexType kNumChunks512 = kPaddedInputDimensions / (kSimdWidth * 2);
@@ -702,6 +834,54 @@ class AffineTransform {
 	using BiasType   = OutputType;
 	using WeightType = std::int8_t;
 
+	// 疎な順伝播を行う、0でない入力ブロック(4byte)の数の上限
+	// 1ブロックあたりの計算量は密な順伝播の1.3倍程度なので、3/4を超えるなら密な順伝播のほうが速い。
+	static constexpr IndexType kMaxSparseChunks = kPaddedInputDimensions / 4 * 3 / 4;
+
+	// weights_から、順伝播用の補助的なデータ(sparse_weights_, canSaturate16)を作る。
+	// パラメータを読み込む/学習で書き換えるごとに呼び出すこと。
+	void PrepareParameters() {
+		// 疎な順伝播用の重み
+		// weights_[出力i][入力j] を [入力j / 4][出力i][入力j % 4] の順に並べ替えて、
+		// 入力4個ごとのブロックに全出力分の重みが連続するようにする。
+		if constexpr (kIsSparseInput) {
+			for (IndexType i = 0; i < kOutputDimensions; ++i)
+				for (IndexType j = 0; j < kPaddedInputDimensions; ++j)
+					sparse_weights_[(j / 4) * kOutputDimensions * 4 + i * 4 + j % 4] =
+					    weights_[i * kPaddedInputDimensions + j];
+		}
+
+		// VNNIが使えないときの密な順伝播では、隣接する2つのベクトル分の積(maddubsの結果)をint16のまま足してから
+		// int32に広げているので、int16で飽和することがある。入力がすべて0か127である最悪の場合に飽和しうる出力には
+		// canSaturate16を立てて、1ベクトルずつ計算させる。(これで疎な順伝播とも結果が一致する)
+		// VNNI(dpbusd)では飽和しないので、すべてfalseのままでよい。
+		std::memset(canSaturate16, 0, sizeof(canSaturate16));
+#if !defined(USE_VNNI)
+#if defined(USE_AVX512)
+		constexpr IndexType kChunkSize = kPaddedInputDimensions % (kSimdWidth * 2) == 0 ? kSimdWidth * 2 : kSimdWidth;
+#elif defined(USE_SSSE3)
+		constexpr IndexType kChunkSize = kSimdWidth;
+#else
+		constexpr IndexType kChunkSize = kPaddedInputDimensions;
+#endif
+		for (IndexType i = 0; i < kOutputDimensions; ++i) {
+			bool can_saturate = false;
+			for (IndexType j = 0; j + kChunkSize < kPaddedInputDimensions; j += kChunkSize * 2) {
+				// 各int16のレーンには、2つのベクトルのそれぞれ2byte分の積が足される。
+				for (IndexType l = 0; l < kChunkSize; l += 2) {
+					int positive = 0, negative = 0;
+					for (IndexType k : {j + l, j + l + 1, j + kChunkSize + l, j + kChunkSize + l + 1}) {
+						const int w = weights_[i * kPaddedInputDimensions + k];
+						(w > 0 ? positive : negative) += w * 127;
+					}
+					if (positive > INT16_MAX || negative < INT16_MIN) can_saturate = true;
+				}
+			}
+			canSaturate16[i] = can_saturate;
+		}
+#endif
+	}
+
 	// 学習用クラスをfriendにする
 	friend class Trainer<AffineTransform>;
 
@@ -711,6 +891,7 @@ class AffineTransform {
 	// パラメータ
 	alignas(kCacheLineSize) BiasType biases_[kOutputDimensions];
 	alignas(kCacheLineSize) WeightType weights_[kOutputDimensions * kPaddedInputDimensions];
+	alignas(kCacheLineSize) WeightType sparse_weights_[kIsSparseInput ? kOutputDimensions * kPaddedInputDimensions : 1];
 	union {
 		uint32_t canSaturate16x4[(kOutputDimensions + 3) / 4];
 		bool     canSaturate16[kOutputDimensions];
@@ -15,7 +15,8 @@ namespace NNUE {
 
 // 入力特徴量をアフィン変換した結果を保持するクラス
 // 最終的な出力である評価値も一緒に持たせておく
-struct alignas(32) Accumulator {
+// AVX-512ではaccumulationを64byte単位でalignedなload/storeをするので、cache lineにalignしておく。
+struct alignas(kCacheLineSize) Accumulator {
   std::int16_t
       accumulation[2][kRefreshTriggers.size()][kTransformedFeatureDimensions];
   Value score = VALUE_ZERO;
@@ -13,6 +13,11 @@
 #include "features/index_list.h"
 
 #include <cstring>  // std::memset()
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace Eval::NNUE {
 
@@ -118,9 +123,15 @@ class FeatureTransformer {
 		for (std::size_t i = 0; i < kHalfDimensions; ++i) biases_[i] = read_little_endian<BiasType>(stream);
 		for (std::size_t i = 0; i < kHalfDimensions * kInputDimensions; ++i)
 			weights_[i] = read_little_endian<WeightType>(stream);
+		InvalidateRefreshCache();
 		return !stream.fail();
 	}
 
+	// Invalidate the refresh cache of all threads (call after the parameters are changed)
+	// パラメータを書き換えたときに全スレッドのrefresh cacheを無効化する。
+	// 各entryは次回の参照時に、versionの不一致を検出して作り直される。
+	static void InvalidateRefreshCache() { refresh_cache_version_.fetch_add(1, std::memory_order_relaxed); }
+
 	// Write network parameters
 	// パラメータを書き込む
 	bool WriteParameters(std::ostream& stream) const {
@@ -129,21 +140,58 @@ class FeatureTransformer {
 		return !stream.fail();
 	}
 
+	// Maximum number of plies to walk back to find a computed accumulator
+	// 差分計算のために、計算済みのaccumulatorを探して遡る最大の手数
+	// 1手あたり高々2駒の差分なので、これくらいまでなら全計算(38駒分)より軽い。
+	static constexpr int kMaxUpdatePlies = RawFeatures::kSupportsMultiPlyUpdate ? 8 : 1;
+
 	// Proceed with the difference calculation if possible
 	// 可能なら差分計算を進める
+	// 1手前の局面が評価されていなくても(枝刈りやqsearchで評価をskipした場合など)、
+	// kMaxUpdatePlies手前までに計算済みの局面があれば、そこからの差分計算でまとめて求める。
 	bool UpdateAccumulatorIfPossible(const Position& pos) const {
 		const auto now = pos.state();
 		if (now->accumulator.computed_accumulation) {
 			return true;
 		}
-		const auto prev = now->previous;
-		if (prev && prev->accumulator.computed_accumulation) {
-			update_accumulator(pos);
-			return true;
+		const StateInfo* st = now;
+		for (int ply = 1; ply <= kMaxUpdatePlies; ++ply) {
+			st = st->previous;
+			if (!st) break;
+			if (st->accumulator.computed_accumulation) {
+				update_accumulator(pos, st, ply);
+				return true;
+			}
 		}
 		return false;
 	}
 
+	// Statistics of accumulator updates (shown by "test nn stats")
+	// accumulatorの計算方法ごとの回数。("test nn stats"で表示する)
+	struct UpdateStats {
+		std::uint64_t refreshes;          // 計算済みの祖先局面がなく、全計算した回数
+		std::uint64_t updates;            // 1手前の局面から差分計算した回数
+		std::uint64_t multi_ply_updates;  // 2手以上前の局面から差分計算した回数
+		std::uint64_t multi_ply_plies;    // multi_ply_updatesのときに遡った手数の合計
+		std::uint64_t king_refreshes;     // 差分計算中に、玉が移動していたので片側を全計算した回数
+	};
+
+	// 全スレッド分を合計して返す。
+	static UpdateStats GetUpdateStats() {
+		auto&                       registry = stats_registry();
+		std::lock_guard<std::mutex> lk(registry.mutex);
+		UpdateStats                 total = registry.retired;
+		for (const auto* counters : registry.counters) counters->add_to(total);
+		return total;
+	}
+
+	static void ResetUpdateStats() {
+		auto&                       registry = stats_registry();
+		std::lock_guard<std::mutex> lk(registry.mutex);
+		registry.retired = UpdateStats{};
+		for (auto* counters : registry.counters) counters->reset();
+	}
+
 	// Convert input features
 	// 入力特徴量を変換する
 	void Transform(const Position& pos, OutputType* output, bool refresh) const {
@@ -275,10 +323,14 @@ class FeatureTransformer {
 	// 差分計算を用いずに累積値を計算する
 	void refresh_accumulator(const Position& pos) const {
 		auto& accumulator = pos.state()->accumulator;
+		thread_counters().refreshes.add(1);
 		for (IndexType i = 0; i < kRefreshTriggers.size(); ++i) {
 			Features::IndexList active_indices[2];
 			RawFeatures::AppendActiveIndices(pos, kRefreshTriggers[i], active_indices);
 			for (Color perspective : {BLACK, WHITE}) {
+				if (refresh_from_cache(pos, i, perspective, active_indices[perspective],
+				                       accumulator.accumulation[perspective][i]))
+					continue;
 #if defined(VECTOR)
 				if (i == 0) {
 					std::memcpy(accumulator.accumulation[perspective][i], biases_, kHalfDimensions * sizeof(BiasType));
@@ -289,7 +341,7 @@ class FeatureTransformer {
 					const IndexType offset = kHalfDimensions * index;
 					auto accumulation      = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][0]);
 					auto column            = reinterpret_cast<const vec_t*>(&weights_[offset]);
-					constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
+					constexpr IndexType kNumChunks = kHalfDimensions / (sizeof(vec_t) / 2);
 					for (IndexType j = 0; j < kNumChunks; ++j) {
 						accumulation[j] = vec_add_16(accumulation[j], column[j]);
 					}
@@ -318,26 +370,70 @@ class FeatureTransformer {
 
 	// Calculate cumulative value using difference calculation
 	// 差分計算を用いて累積値を計算する
-	void update_accumulator(const Position& pos) const {
-		const auto prev_accumulator = pos.state()->previous->accumulator;
-		auto&      accumulator      = pos.state()->accumulator;
+	// from : accumulationが計算済みである、plies手前の局面のStateInfo
+	void update_accumulator(const Position& pos, const StateInfo* from, int plies) const {
+		// fromの次の局面から現局面までのStateInfo(新しい順)
+		const StateInfo* path[kMaxUpdatePlies] = {};
+		{
+			const StateInfo* st = pos.state();
+			for (int k = 0; k < plies; ++k, st = st->previous) path[k] = st;
+		}
+		auto& counters = thread_counters();
+		if (plies == 1) {
+			counters.updates.add(1);
+		} else {
+			counters.multi_ply_updates.add(1);
+			counters.multi_ply_plies.add(plies);
+		}
+
+		const auto& prev_accumulator = from->accumulator;
+		auto&       accumulator      = pos.state()->accumulator;
 		for (IndexType i = 0; i < kRefreshTriggers.size(); ++i) {
-			Features::IndexList removed_indices[2], added_indices[2];
-			bool                reset[2];
-			RawFeatures::AppendChangedIndices(pos, kRefreshTriggers[i], removed_indices, added_indices, reset);
+			// 各局面で変化した特徴量を、古い局面から順に集める。
+			ChangedIndexList    removed_indices[2], added_indices[2];
+			Features::IndexList active_indices[2];
+			bool                reset[2] = {false, false};
+			for (int k = plies - 1; k >= 0; --k) {
+				Features::IndexList removed[2], added[2];
+				bool                reset_k[2] = {false, false};
+				RawFeatures::AppendChangedIndices(pos, path[k]->dirtyPiece, kRefreshTriggers[i], removed, added,
+				                                  reset_k);
+				for (Color perspective : {BLACK, WHITE}) {
+					if (reset[perspective]) continue;
+					if (reset_k[perspective]) {
+						// 玉が移動して全計算になるとき、addedはこの局面(pos)のactiveな特徴量すべてである。
+						reset[perspective]          = true;
+						active_indices[perspective] = added[perspective];
+						continue;
+					}
+					for (const auto index : removed[perspective]) removed_indices[perspective].push_back(index);
+					for (const auto index : added[perspective]) added_indices[perspective].push_back(index);
+				}
+			}
+
 			for (Color perspective : {BLACK, WHITE}) {
 #if defined(VECTOR)
-				constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
+				constexpr IndexType kNumChunks = kHalfDimensions / (sizeof(vec_t) / 2);
 				auto accumulation              = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][0]);
 #endif
 				if (reset[perspective]) {
+					counters.king_refreshes.add(1);
+					if (refresh_from_cache(pos, i, perspective, active_indices[perspective],
+					                       accumulator.accumulation[perspective][i]))
+						continue;
 					if (i == 0) {
 						std::memcpy(accumulator.accumulation[perspective][i], biases_,
 						            kHalfDimensions * sizeof(BiasType));
 					} else {
 						std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
 					}
+					removed_indices[perspective].resize(0);
+					added_indices[perspective].resize(0);
+					for (const auto index : active_indices[perspective]) added_indices[perspective].push_back(index);
 				} else {
+					// 何手かの間に動いて元に戻った駒などは、差分が打ち消し合うので取り除いておく。
+					if (plies > 1) cancel_out(removed_indices[perspective], added_indices[perspective]);
+
 					// Difference calculation for the feature amount changed from 1 to 0
 					// 1から0に変化した特徴量に関する差分計算
 					std::memcpy(accumulator.accumulation[perspective][i], prev_accumulator.accumulation[perspective][i],
@@ -381,11 +477,183 @@ class FeatureTransformer {
 		accumulator.computed_score = false;
 	}
 
+	// 何手分かの差分を集めたリスト。1手あたり、特徴量ごとに高々2駒(動いた駒と取られた駒)の差分
+	using ChangedIndexList = Features::ValueList<IndexType, RawFeatures::kMaxActiveDimensions * kMaxUpdatePlies>;
+
+	// removedとaddedの両方に現れるindexを取り除く。
+	static void cancel_out(ChangedIndexList& removed, ChangedIndexList& added) {
+		std::size_t removed_size = removed.size();
+		std::size_t added_size   = added.size();
+		for (std::size_t r = 0; r < removed_size;) {
+			std::size_t a = 0;
+			while (a < added_size && added[a] != removed[r]) ++a;
+			if (a == added_size) {
+				++r;
+				continue;
+			}
+			// 順序は関係ないので末尾の要素で埋める。
+			added[a]   = added[--added_size];
+			removed[r] = removed[--removed_size];
+		}
+		removed.resize(removed_size);
+		added.resize(added_size);
+	}
+
+	// スレッドごとのaccumulator計算の回数
+	// 書き込むのはそのスレッドだけなので、fetch_addではなくload/storeで足す。(集計時の読み出し用にatomicにしてある)
+	struct Counter {
+		std::atomic<std::uint64_t> value {0};
+		void add(std::uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+		std::uint64_t get() const { return value.load(std::memory_order_relaxed); }
+	};
+	struct ThreadCounters {
+		Counter refreshes, updates, multi_ply_updates, multi_ply_plies, king_refreshes;
+
+		ThreadCounters() {
+			auto&                       registry = stats_registry();
+			std::lock_guard<std::mutex> lk(registry.mutex);
+			registry.counters.push_back(this);
+		}
+		// スレッドが終了するときに、それまでの回数をretiredに移す。
+		~ThreadCounters() {
+			auto&                       registry = stats_registry();
+			std::lock_guard<std::mutex> lk(registry.mutex);
+			add_to(registry.retired);
+			registry.counters.erase(std::find(registry.counters.begin(), registry.counters.end(), this));
+		}
+		void add_to(UpdateStats& s) const {
+			s.refreshes += refreshes.get();
+			s.updates += updates.get();
+			s.multi_ply_updates += multi_ply_updates.get();
+			s.multi_ply_plies += multi_ply_plies.get();
+			s.king_refreshes += king_refreshes.get();
+		}
+		void reset() {
+			for (auto* c : {&refreshes, &updates, &multi_ply_updates, &multi_ply_plies, &king_refreshes})
+				c->value.store(0, std::memory_order_relaxed);
+		}
+	};
+	static ThreadCounters& thread_counters() {
+		thread_local ThreadCounters counters;
+		return counters;
+	}
+	struct StatsRegistry {
+		std::mutex                   mutex;
+		std::vector<ThreadCounters*> counters;  // 生きているスレッドの分
+		UpdateStats                  retired {};  // 終了したスレッドの分
+	};
+	// プログラム終了時のスレッドの破棄からも参照されるので、開放しない。
+	static StatsRegistry& stats_registry() {
+		static auto* registry = new StatsRegistry;
+		return *registry;
+	}
+
 	// parameter type
 	// パラメータの型
 	using BiasType   = std::int16_t;
 	using WeightType = std::int16_t;
 
+	// Refresh cache ("Finny table")
+	// 玉の升ごとに、最後にその升で全計算したときのaccumulationとactiveな特徴量を覚えておき、
+	// 玉が移動して全計算が必要になったとき、そこからの差分だけを計算する。
+	// 玉の升に依存する特徴量(HalfKP等)では、玉が移動すると全特徴量のindexが変わるので、
+	// 前の局面のaccumulatorは使えないが、同じ升に玉がいた過去の局面とは駒数個程度しか違わない。
+	struct alignas(kCacheLineSize) RefreshCacheEntry {
+		BiasType             accumulation[kHalfDimensions];
+		Features::IndexList  active_indices;  // 昇順
+		std::uint32_t        version = 0;     // refresh_cache_version_と一致しなければ無効
+	};
+
+	// スレッドごとに持つ。[kRefreshTriggersのindex][視点][玉の升]
+	// 1スレッドあたり kRefreshTriggers.size() * 2 * 81 * sizeof(RefreshCacheEntry) (HalfKP 256次元で約110KB)
+	struct RefreshCache {
+		RefreshCacheEntry entries[kRefreshTriggers.size()][COLOR_NB][SQ_NB];
+	};
+
+	static RefreshCache& refresh_cache() {
+		// 探索スレッドや学習スレッドから初めて呼び出されたときに確保する。
+		thread_local std::unique_ptr<RefreshCache> cache;
+		if (!cache) cache = std::make_unique<RefreshCache>();
+		return *cache;
+	}
+
+	// refresh cacheを用いて、accumulationの全計算を行う。
+	// trigger_index番目のtriggerが玉の移動でない(玉の升で索けない)ときは何もせずにfalseを返す。
+	// active : この局面のactiveな特徴量のリスト
+	bool refresh_from_cache(const Position& pos, IndexType trigger_index, Color perspective,
+	                        const Features::IndexList& active, BiasType* accumulation) const {
+		Square king;
+		switch (kRefreshTriggers[trigger_index]) {
+		case Features::TriggerEvent::kFriendKingMoved: king = pos.king_square(perspective); break;
+		case Features::TriggerEvent::kEnemyKingMoved : king = pos.king_square(~perspective); break;
+		default                                      : return false;
+		}
+		// 詰将棋など、玉がいない局面
+		if (!is_ok(king)) return false;
+
+		auto& entry = refresh_cache().entries[trigger_index][perspective][king];
+		const auto version = refresh_cache_version_.load(std::memory_order_relaxed);
+		auto reset_entry = [&]() {
+			if (trigger_index == 0) {
+				std::memcpy(entry.accumulation, biases_, kHalfDimensions * sizeof(BiasType));
+			} else {
+				std::memset(entry.accumulation, 0, kHalfDimensions * sizeof(BiasType));
+			}
+			entry.active_indices.resize(0);
+			entry.version = version;
+		};
+		if (entry.version != version) reset_entry();
+
+		// entryに記録されているリストとの差分を求める。
+		// activeな特徴量のリストは駒番号順に並んでいるので(駒は盤上と手駒の間を移動するだけで消えない)、
+		// 同じ位置同士を比較すれば、そのあいだに動いた駒の分だけが差分として出てくる。
+		// (順番が揃っていなくても、集合としての差分計算は正しく行われる。)
+		Features::IndexList removed, added;
+		const std::size_t old_size = entry.active_indices.size();
+		const std::size_t new_size = active.size();
+		for (std::size_t k = 0; k < std::max(old_size, new_size); ++k) {
+			if (k < old_size && k < new_size && entry.active_indices[k] == active[k]) continue;
+			if (k < old_size) removed.push_back(entry.active_indices[k]);
+			if (k < new_size) added.push_back(active[k]);
+		}
+		// 差分のほうが多くつくなら(前回から局面が大きく変わっているとき)entryを作り直したほうが速い。
+		if (old_size == 0 || removed.size() + added.size() >= new_size) {
+			reset_entry();
+			removed.resize(0);
+			added = active;
+		}
+
+#if defined(VECTOR)
+		constexpr IndexType kNumChunks = kHalfDimensions / (sizeof(vec_t) / 2);
+		auto acc = reinterpret_cast<vec_t*>(entry.accumulation);
+		for (const auto index : removed) {
+			auto column = reinterpret_cast<const vec_t*>(&weights_[kHalfDimensions * index]);
+			for (IndexType j = 0; j < kNumChunks; ++j) acc[j] = vec_sub_16(acc[j], column[j]);
+		}
+		for (const auto index : added) {
+			auto column = reinterpret_cast<const vec_t*>(&weights_[kHalfDimensions * index]);
+			for (IndexType j = 0; j < kNumChunks; ++j) acc[j] = vec_add_16(acc[j], column[j]);
+		}
+#else
+		for (const auto index : removed) {
+			const IndexType offset = kHalfDimensions * index;
+			for (IndexType j = 0; j < kHalfDimensions; ++j) entry.accumulation[j] -= weights_[offset + j];
+		}
+		for (const auto index : added) {
+			const IndexType offset = kHalfDimensions * index;
+			for (IndexType j = 0; j < kHalfDimensions; ++j) entry.accumulation[j] += weights_[offset + j];
+		}
+#endif
+		std::memcpy(entry.active_indices.begin(), active.begin(), active.size() * sizeof(IndexType));
+		entry.active_indices.resize(active.size());
+		std::memcpy(accumulation, entry.accumulation, kHalfDimensions * sizeof(BiasType));
+		return true;
+	}
+
+	// パラメータの世代。パラメータを読み込む/学習で書き換えるごとに加算する。
+	// (refresh cacheのentryは0で初期化されるので、1から始める)
+	static inline std::atomic<std::uint32_t> refresh_cache_version_ {1};
+
 	// Make the learning class a friend
 	// 学習用クラスをfriendにする
 	friend class Trainer<FeatureTransformer>;
@@ -8,7 +8,10 @@
 #include "evaluate_nnue.h"
 #include "nnue_test_command.h"
 
+#include <algorithm>
+#include <iomanip>
 #include <set>
+#include <sstream>
 
 namespace Eval {
 
@@ -138,6 +141,134 @@ void TestFeatures(Position& pos) {
             << ") features" << std::endl;
 }
 
+// 差分計算(何手か前の局面からの差分計算、玉の升ごとのrefresh cacheを含む)の結果が
+// 全計算と一致するかのテスト
+// 一部の局面だけ評価することで、探索中に評価がskipされた局面を模擬する。
+// 評価関数パラメータが0だと意味がないので、評価関数を読み込んでから実行すること。
+void TestUpdateAccumulator(Position& pos) {
+  const std::uint64_t num_games = 300;
+  StateInfo si;
+  pos.set_hirate(&si,Threads.main());
+  const int MAX_PLY = 256; // 256手までテスト
+
+  StateInfo state[MAX_PLY]; // StateInfoを最大手数分だけ
+  int ply; // 初期局面からの手数
+
+  PRNG prng(20201024);
+
+  alignas(kCacheLineSize) TransformedFeatureType transformed_features[FeatureTransformer::kBufferSize];
+  alignas(32) std::int16_t accumulation[sizeof(Accumulator::accumulation) / sizeof(std::int16_t)];
+
+  FeatureTransformer::ResetUpdateStats();
+  std::uint64_t num_checks = 0;
+  std::cout << "start testing with random games";
+
+  for (std::uint64_t i = 0; i < num_games; ++i) {
+    for (ply = 0; ply < MAX_PLY; ++ply) {
+      // たまにnull moveを挟む
+      if (!pos.checkers() && prng.rand(16) == 0) {
+        pos.do_null_move(state[ply]);
+      } else {
+        MoveList<LEGAL_ALL> mg(pos); // 全合法手の生成
+
+        // 合法な指し手がなかった == 詰み
+        if (mg.size() == 0)
+          break;
+
+        // 生成された指し手のなかからランダムに選び、その指し手で局面を進める。
+        Move m = mg.begin()[prng.rand(mg.size())];
+        pos.do_move(m, state[ply]);
+      }
+
+      // 1/4の局面だけ評価する。
+      if (prng.rand(4) != 0)
+        continue;
+
+      feature_transformer->Transform(pos, transformed_features, false);
+      std::memcpy(accumulation, pos.state()->accumulator.accumulation, sizeof(accumulation));
+
+      // refresh cacheも使わずに全計算した結果と比較する。
+      FeatureTransformer::InvalidateRefreshCache();
+      feature_transformer->Transform(pos, transformed_features, true);
+      if (std::memcmp(accumulation, pos.state()->accumulator.accumulation, sizeof(accumulation)) != 0) {
+        std::cout << std::endl << "Error! : accumulator mismatch , game = " << i << " , ply = " << ply
+                  << " , sfen = " << pos.sfen() << std::endl;
+        return;
+      }
+      ++num_checks;
+    }
+
+    pos.set_hirate(&si,Threads.main());
+
+    // 100回に1回ごとに'.'を出力(進んでいることがわかるように)
+    if ((i % 100) == 0)
+      std::cout << "." << std::flush;
+  }
+  std::cout << "passed." << std::endl;
+  std::cout << num_games << " games, " << num_checks << " positions checked" << std::endl;
+
+  // 比較用の全計算の分は除いて表示する。
+  auto stats = FeatureTransformer::GetUpdateStats();
+  stats.refreshes -= num_checks;
+  std::cout << "refresh = " << stats.refreshes << " , update (1 ply) = " << stats.updates
+            << " , update (multi ply) = " << stats.multi_ply_updates << std::endl;
+}
+
+// 入力特徴量変換器より後ろ(network)の順伝播の速度を計測する。
+// ランダムな棋譜の局面の入力特徴量変換器の出力を用意しておき、それらを繰り返しPropagate()する。
+// 例) test nn propagatebench positions 1000 loop 1000
+void BenchPropagate(Position& pos, std::istream& stream) {
+  std::uint64_t num_positions = 1000, loop = 1000;
+  std::string token;
+  while (stream >> token) {
+    if (token == "positions") stream >> num_positions;
+    else if (token == "loop") stream >> loop;
+  }
+
+  StateInfo si;
+  pos.set_hirate(&si,Threads.main());
+  const int MAX_PLY = 256;
+  StateInfo state[MAX_PLY];
+  int ply = 0;
+  PRNG prng(20201025);
+
+  // ランダムな棋譜の局面の、入力特徴量変換器の出力
+  struct alignas(kCacheLineSize) Features {
+    TransformedFeatureType data[FeatureTransformer::kBufferSize];
+  };
+  std::vector<Features> features(num_positions);
+  std::uint64_t num_nonzero = 0;
+  for (std::uint64_t i = 0; i < num_positions; ++i) {
+    MoveList<LEGAL_ALL> mg(pos);
+    if (mg.size() == 0 || ply == MAX_PLY) {
+      pos.set_hirate(&si,Threads.main());
+      ply = 0;
+    } else {
+      pos.do_move(mg.begin()[prng.rand(mg.size())], state[ply++]);
+    }
+    auto transformed = features[i].data;
+    feature_transformer->Transform(pos, transformed, true);
+    num_nonzero += std::count_if(transformed, transformed + FeatureTransformer::kBufferSize,
+                                 [](TransformedFeatureType x) { return x != 0; });
+  }
+  pos.set_hirate(&si,Threads.main());
+
+  alignas(kCacheLineSize) char buffer[Network::kBufferSize];
+  std::int64_t sum = 0;
+  const auto start = now();
+  for (std::uint64_t l = 0; l < loop; ++l)
+    for (std::uint64_t i = 0; i < num_positions; ++i)
+      sum += network->Propagate(features[i].data, buffer)[0];
+  const auto elapsed = std::max<TimePoint>(now() - start, 1);
+
+  const double count = double(num_positions) * loop;
+  std::cout << "network: " << Network::GetStructureString() << std::endl
+            << "non-zero inputs of the first layer = "
+            << (100.0 * num_nonzero / (num_positions * FeatureTransformer::kBufferSize)) << "%" << std::endl
+            << count << " propagations, " << elapsed << " ms, "
+            << (elapsed * 1000000.0 / count) << " ns/propagation (checksum " << sum << ")" << std::endl;
+}
+
 // 評価関数の構造を表す文字列を出力する
 void PrintInfo(std::istream& stream) {
   std::cout << "network architecture: " << GetArchitectureString() << std::endl;
@@ -173,6 +304,34 @@ void PrintInfo(std::istream& stream) {
   }
 }
 
+// accumulatorの計算方法ごとの回数を表示する
+// 例) "go depth 15"などで探索させたあとに "test nn stats"
+//     "test nn stats reset" で0に戻す。
+void PrintUpdateStats(std::istream& stream) {
+  std::string option;
+  stream >> option;
+  if (option == "reset") {
+    FeatureTransformer::ResetUpdateStats();
+    std::cout << "accumulator stats cleared." << std::endl;
+    return;
+  }
+
+  const auto stats = FeatureTransformer::GetUpdateStats();
+  const std::uint64_t total = stats.refreshes + stats.updates + stats.multi_ply_updates;
+  auto percent = [&](std::uint64_t n) { return total ? 100.0 * n / total : 0.0; };
+  // std::coutの書式を変えないように、いったん文字列にする。
+  std::ostringstream ss;
+  ss << std::fixed << std::setprecision(2)
+     << "refresh            : " << stats.refreshes << " (" << percent(stats.refreshes) << "%)" << std::endl
+     << "update (1 ply)     : " << stats.updates << " (" << percent(stats.updates) << "%)" << std::endl
+     << "update (multi ply) : " << stats.multi_ply_updates << " (" << percent(stats.multi_ply_updates) << "%)"
+     << ", average plies = "
+     << (stats.multi_ply_updates ? double(stats.multi_ply_plies) / stats.multi_ply_updates : 0.0) << std::endl
+     << "king moved (refresh one side while updating) : " << stats.king_refreshes << std::endl
+     << "max update plies   : " << FeatureTransformer::kMaxUpdatePlies << std::endl;
+  std::cout << ss.str();
+}
+
 }  // namespace
 
 // NNUE評価関数に関するUSI拡張コマンド
@@ -184,10 +343,19 @@ void TestCommand(Position& pos, std::istream& stream) {
     TestFeatures(pos);
   } else if (sub_command == "info") {
     PrintInfo(stream);
+  } else if (sub_command == "test_update") {
+    TestUpdateAccumulator(pos);
+  } else if (sub_command == "propagatebench") {
+    BenchPropagate(pos, stream);
+  } else if (sub_command == "stats") {
+    PrintUpdateStats(stream);
   } else {
     std::cout << "usage:" << std::endl;
     std::cout << " test nn test_features" << std::endl;
+    std::cout << " test nn test_update" << std::endl;
     std::cout << " test nn info [path/to/" << kFileName << "...]" << std::endl;
+    std::cout << " test nn stats [reset]" << std::endl;
+    std::cout << " test nn propagatebench [positions N] [loop N]" << std::endl;
   }
 }
 
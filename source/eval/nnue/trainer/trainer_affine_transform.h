@@ -222,6 +222,7 @@ class Trainer<Layers::AffineTransform<PreviousLayer, OutputDimensions>> {
                 weights_[offset + j] * kWeightScale);
       }
     }
+    target_layer_->PrepareParameters();
   }
 
   // 整数化されたパラメータの読み込み
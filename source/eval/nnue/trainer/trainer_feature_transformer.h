@@ -268,6 +268,8 @@ class Trainer<FeatureTransformer> {
             Round<typename LayerType::WeightType>(sum * kWeightScale);
       }
     }
+    // パラメータが変わったので、各スレッドのrefresh cacheを作り直させる。
+    LayerType::InvalidateRefreshCache();
   }
 
   // 整数化されたパラメータの読み込み
@@ -326,9 +326,10 @@ namespace Eval {
 
 	private:
 
-	#if defined(USE_AVX2)
+	#if defined(USE_AVX2) || defined(USE_CPU_DISPATCH)
 		// AVX2を用いたKPPT評価関数は高速化できるので特別扱い。
 		// Skylake以降でないとほぼ効果がないが…。
+		// CPU dispatch用のビルドでは、TARGET_CPUごとにコンパイルしたNNUEの計算部とPositionのlayoutを揃えるために常にこちら。
 
 		// AVX2の命令でアクセスするのでalignas(32)が必要。
 		alignas(32) BonaPiece pieceListFb[MAX_LENGTH];
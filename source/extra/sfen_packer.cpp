@@ -136,6 +136,9 @@ HuffmanedPiece huffman_table[] =
 //
 // 内部フォーマット = 手番1bit+王の位置7bit*2 + 盤上の駒(ハフマン符号化) + 手駒(ハフマン符号化)
 //
+// ※　これは1bitずつ読み書きする従来の実装。Positionクラスからは、下のテーブル引きによる高速版(FastSfenPacker)を用いる。
+//    こちらは、高速版と結果が一致するかを確かめるテストコマンド(test sfenpackfuzz)のために残してある。
+//
 struct SfenPacker
 {
   // sfenをpackしてdata[32]に格納する。
@@ -336,6 +339,252 @@ struct SfenPacker
 };
 
 
+// -----------------------------------
+//   局面の圧縮・解凍(テーブル引きによる高速版)
+// -----------------------------------
+
+// SfenPackerは1bitずつ読み書きするので遅い。
+// 学習時には教師局面1つごとにset_from_packed_sfen()が呼び出されるので、ここがボトルネックになる。
+// そこで、256bitを64bit単位で読み書きして、ハフマン符号の復号はテーブル引きで行うようにしたもの。
+// 生成されるPackedSfenは、SfenPackerのものとbit単位で一致する。
+//
+// 盤上の駒1枚の符号は(成りフラグ・先後フラグ込みで)最大8bit、手駒1枚の符号は最大7bitであり、
+// ハフマン符号は語頭符号なので、streamの次の8bitを見れば駒1枚が確定する。
+// なので、次の8bit(256通り)から、駒とその符号のbit数を引くテーブルを用意しておく。
+
+namespace {
+
+	// 駒1枚の符号。成りフラグ、先後フラグも含む。
+	struct HuffmanCode
+	{
+		u8 code; // 符号(下位bitから順にstreamに書き出す)
+		u8 bits; // 何bit専有するのか
+	};
+
+	// streamの次の8bitを復号した駒
+	struct HuffmanDecoded
+	{
+		u8 piece; // Piece
+		u8 bits;  // 符号が何bit専有していたのか
+	};
+
+	// 符号化・復号用のテーブル
+	struct HuffmanTables
+	{
+		HuffmanCode    board_code[PIECE_NB]; // 盤上の駒 → 符号
+		HuffmanCode    hand_code [PIECE_NB]; // 手駒     → 符号
+		HuffmanDecoded board_decode[256];    // 次の8bit → 盤上の駒
+		HuffmanDecoded hand_decode [256];    // 次の8bit → 手駒
+
+		// huffman_table[]からテーブルを構築する。
+		HuffmanTables()
+		{
+			memset(this, 0, sizeof(*this));
+
+			// 空の升
+			add(board_code, board_decode, NO_PIECE, huffman_table[NO_PIECE_TYPE].code, huffman_table[NO_PIECE_TYPE].bits, true);
+
+			for (PieceType pr = PAWN; pr < KING; ++pr)
+			{
+				const auto h = huffman_table[pr];
+				for (auto c : COLOR)
+					for (int promote = 0; promote <= 1; ++promote)
+					{
+						// 盤上の駒 = 駒種 + 成りフラグ(金以外) + 先後フラグ
+						if (pr != GOLD || !promote)
+						{
+							int code = h.code, bits = h.bits;
+							if (pr != GOLD)
+								code |= promote << bits++;
+							code |= c << bits++;
+							add(board_code, board_decode, make_piece(c, pr + (promote ? PIECE_TYPE_PROMOTE : NO_PIECE_TYPE)), code, bits, true);
+						}
+
+						// 手駒 = 駒種(盤上の駒より1bit短い) + 成りフラグ(金以外。書き出す時は常に0で、読み込む時は読み捨てる) + 先後フラグ
+						int code = h.code >> 1, bits = h.bits - 1;
+						if (pr != GOLD)
+							code |= promote << bits++;
+						else if (promote)
+							continue;
+						code |= c << bits++;
+						add(hand_code, hand_decode, make_piece(c, pr), code, bits, !promote);
+					}
+			}
+		}
+
+	private:
+		// pcの符号がcode(bits bit)であることをテーブルに登録する。
+		// encode == falseなら復号用のテーブルにだけ登録する。
+		static void add(HuffmanCode* codes, HuffmanDecoded* decoded, Piece pc, int code, int bits, bool encode)
+		{
+			ASSERT_LV3(bits <= 8);
+
+			if (encode)
+				codes[pc] = HuffmanCode{ (u8)code, (u8)bits };
+
+			// 下位bits bitがcodeであるような8bitの値すべてに登録する。
+			for (int i = 0; i < 256; ++i)
+				if ((i & ((1 << bits) - 1)) == code)
+					decoded[i] = HuffmanDecoded{ (u8)pc, (u8)bits };
+		}
+	};
+
+	const HuffmanTables huffman_tables;
+
+	// PackedSfenの256bitを64bit単位で読み書きするためのbuffer
+	// (little endianを前提としている)
+	struct PackedSfenBits
+	{
+		// 256bit + 読み書きし過ぎた時のための余白
+		u64 words[6];
+
+		// cursorのbit位置から(少なくとも)56bitを下位bitに詰めて返す。
+		// cursor <= 256であること。
+		u64 peek(int cursor) const
+		{
+			u64 v;
+			memcpy(&v, (const u8*)words + (cursor >> 3), sizeof(v));
+			return v >> (cursor & 7);
+		}
+
+		// cursorのbit位置にcodeの下位bits bitを書き出す。
+		// 書き出す先はゼロクリアされていること。
+		void write(int cursor, u64 code, int bits)
+		{
+			const int index = cursor >> 6, shift = cursor & 63;
+			if (index + 1 >= (int)std::size(words))
+				return; // 256bitを大きく超えている。(普通の局面ではありえない)
+
+			words[index] |= code << shift;
+			if (shift + bits > 64)
+				words[index + 1] |= code >> (64 - shift);
+		}
+	};
+
+	// sfenを圧縮/解凍する。SfenPackerのテーブル引きによる高速版。
+	struct FastSfenPacker
+	{
+		// posをpackしてsfenに格納する。SfenPacker::pack()と同じ結果になる。
+		static void pack(const Position& pos, PackedSfen& sfen)
+		{
+			const Hand hands[COLOR_NB] = { pos.hand_of(BLACK), pos.hand_of(WHITE) };
+			const Square king_sq[COLOR_NB] = { pos.king_square(BLACK), pos.king_square(WHITE) };
+			pack([&](Square sq) { return pos.piece_on(sq); }, hands, pos.side_to_move(), king_sq, sfen);
+		}
+
+		// 盤面(玉を含む)、手駒、手番をpackしてsfenに格納する。
+		// 玉がいない時は、その玉の位置はSQ_NBとしてpackされる。
+		static void pack(const Piece board[SQ_NB], const Hand hands[COLOR_NB], Color turn, PackedSfen& sfen)
+		{
+			Square king_sq[COLOR_NB] = { SQ_NB, SQ_NB };
+			for (auto sq : SQ)
+				if (type_of(board[sq]) == KING && king_sq[color_of(board[sq])] == SQ_NB)
+					king_sq[color_of(board[sq])] = sq;
+
+			pack([&](Square sq) { return board[sq]; }, hands, turn, king_sq, sfen);
+		}
+
+		// piece_on(sq)で升sqの駒が得られる盤面と、手駒、手番、玉の位置をpackしてsfenに格納する。
+		template <typename PieceOn>
+		static void pack(PieceOn piece_on, const Hand hands[COLOR_NB], Color turn, const Square king_sq[COLOR_NB], PackedSfen& sfen)
+		{
+			PackedSfenBits bits = {};
+			int cursor = 0;
+
+			auto write = [&](int code, int n) { bits.write(cursor, code, n); cursor += n; };
+
+			// 手番
+			write(turn, 1);
+
+			// 先手玉、後手玉の位置、それぞれ7bit
+			for (auto c : COLOR)
+				write(king_sq[c], 7);
+
+			// 盤上の玉以外の駒
+			for (auto sq : SQ)
+			{
+				Piece pc = piece_on(sq);
+				if (type_of(pc) == KING)
+					continue;
+
+				const auto h = huffman_tables.board_code[pc];
+				write(h.code, h.bits);
+			}
+
+			// 手駒
+			for (auto c : COLOR)
+				for (PieceType pr = PAWN; pr < KING; ++pr)
+				{
+					const auto h = huffman_tables.hand_code[make_piece(c, pr)];
+					for (int n = hand_count(hands[c], pr); n > 0; --n)
+						write(h.code, h.bits);
+				}
+
+			// 全部で256bitのはず。(普通の盤面であれば)
+			ASSERT_LV3(cursor == 256);
+
+			memcpy(&sfen, bits.words, sizeof(PackedSfen));
+		}
+
+		// sfenを解凍して、盤面(玉を含む)、手駒、手番を返す。
+		// board[SQ_NB]には何も置かない。(玉がいない時は、玉の位置がSQ_NBになっている)
+		// 不正なデータ(256bitにぴったり収まっていないなど)であればfalseを返す。
+		static bool unpack(const PackedSfen& sfen, Piece board[SQ_NB_PLUS1], Hand hand[COLOR_NB], Color& turn)
+		{
+			PackedSfenBits bits;
+			memcpy(bits.words, &sfen, sizeof(PackedSfen));
+			bits.words[4] = bits.words[5] = 0;
+
+			std::fill_n(board, SQ_NB_PLUS1, NO_PIECE);
+			hand[BLACK] = hand[WHITE] = HAND_ZERO;
+
+			// 手番
+			turn = (Color)(bits.peek(0) & 1);
+			int cursor = 1;
+
+			// まず玉の位置
+			for (auto c : COLOR)
+			{
+				Square sq = (Square)(bits.peek(cursor) & 0x7f);
+				cursor += 7;
+
+				if (sq > SQ_NB)
+					return false;
+				if (sq != SQ_NB)
+					board[sq] = make_piece(c, KING);
+			}
+
+			// 盤上の駒
+			for (auto sq : SQ)
+			{
+				// すでに玉がいるようだ
+				if (type_of(board[sq]) == KING)
+					continue;
+
+				const auto d = huffman_tables.board_decode[bits.peek(cursor) & 0xff];
+				board[sq] = (Piece)d.piece;
+				cursor += d.bits;
+
+				if (cursor > 256)
+					return false;
+			}
+
+			// 手駒
+			// 256になるまで手駒が格納されているはず
+			while (cursor < 256)
+			{
+				const auto d = huffman_tables.hand_decode[bits.peek(cursor) & 0xff];
+				const Piece pc = (Piece)d.piece;
+				add_hand(hand[color_of(pc)], type_of(pc));
+				cursor += d.bits;
+			}
+
+			return cursor == 256;
+		}
+	};
+
+} // namespace
+
 // -----------------------------------
 //        Positionクラスに追加
 // -----------------------------------
@@ -344,16 +593,20 @@ struct SfenPacker
 // packer::unpack()とPosition::set()とを合体させて書く。
 Tools::Result Position::set_from_packed_sfen(const PackedSfen& sfen , StateInfo * si, Thread* th, bool mirror , int gamePly_ /* = 0 */)
 {
-	SfenPacker packer;
-	auto& stream = packer.stream;
-	stream.set_data((u8*)&sfen);
+	// まず盤面(玉を含む)と手駒と手番を解凍する。
+	// 不正なデータであれば、この局面には何も変更を加えずにエラーを返す。
+	Piece packed_board[SQ_NB_PLUS1];
+	Hand  packed_hand[COLOR_NB];
+	Color turn;
+	if (!FastSfenPacker::unpack(sfen, packed_board, packed_hand, turn))
+		return Tools::Result(Tools::ResultCode::SomeError);
 
 	std::memset(this, 0, sizeof(Position));
 	std::memset(si, 0, sizeof(StateInfo));
 	st = si;
 
 	// 手番
-	sideToMove = (Color)stream.read_one_bit();
+	sideToMove = turn;
 
 #if defined(USE_EVAL_LIST)
 
@@ -368,42 +621,20 @@ Tools::Result Position::set_from_packed_sfen(const PackedSfen& sfen , StateInfo
 
 	kingSquare[BLACK] = kingSquare[WHITE] = SQ_NB;
 
-	// まず玉の位置
-	if (mirror)
-	{
-		for (auto c : COLOR)
-			board[Mir((Square)stream.read_n_bit(7))] = make_piece(c, KING);
-	}
-	else
-	{
-		for (auto c : COLOR)
-			board[stream.read_n_bit(7)] = make_piece(c, KING);
-	}
-
 	// 盤上の駒
+	// (mirrorの時は、packされている升をミラーした升に置く)
 	for (auto sq : SQ)
 	{
-		if (mirror)
-			sq = Mir(sq);
-
-		// すでに玉がいるようだ
-		Piece pc;
-		if (type_of(board[sq]) != KING)
-		{
-			ASSERT_LV3(board[sq] == NO_PIECE);
-			pc = packer.read_board_piece_from_stream();
-		}
-		else
-		{
-			pc = board[sq];
-			board[sq] = NO_PIECE; // いっかい取り除いておかないとput_piece()でASSERTに引っかかる。
-		}
+		Piece pc = packed_board[sq];
 
 		// 駒がない場合もあるのでその場合はスキップする。
 		if (pc == NO_PIECE)
 			continue;
 
-		put_piece(sq, Piece(pc));
+		if (mirror)
+			sq = Mir(sq);
+
+		put_piece(sq, pc);
 
 #if defined(USE_EVAL_LIST)
 		// evalListの更新
@@ -414,48 +645,24 @@ Tools::Result Position::set_from_packed_sfen(const PackedSfen& sfen , StateInfo
 
 		evalList.put_piece(piece_no, sq, pc); // sqの升にpcの駒を配置する
 #endif
-
-		//cout << sq << ' ' << board[sq] << ' ' << stream.get_cursor() << endl;
-
-		if (stream.get_cursor() > 256)
-			return Tools::Result(Tools::ResultCode::SomeError);
-		//ASSERT_LV3(stream.get_cursor() <= 256);
 	}
 
 	// 手駒
-	hand[BLACK] = hand[WHITE] = (Hand)0;
-
-	int i = 0;
-	Piece lastPc = NO_PIECE;
-
-	while (stream.get_cursor() < 256)
-	{
-		// 256になるまで手駒が格納されているはず
-		auto pc = packer.read_hand_piece_from_stream();
-		add_hand(hand[(int)color_of(pc)], type_of(pc));
+	hand[BLACK] = packed_hand[BLACK];
+	hand[WHITE] = packed_hand[WHITE];
 
 #if defined(USE_EVAL_LIST)
-		// 何枚目のその駒であるかをカウントしておく。
-		if (lastPc != pc)
-			i = 0;
-		lastPc = pc;
-
-		// FV38などではこの個数分だけpieceListに突っ込まないといけない。
-		PieceType rpc = raw_type_of(pc);
-
-        PieceNumber piece_no = piece_no_count[rpc]++;
-		ASSERT_LV1(is_ok(piece_no));
-		evalList.put_piece(piece_no, color_of(pc), rpc, i++);
+	// FV38などではこの個数分だけpieceListに突っ込まないといけない。
+	// (packされている順 = 先手の歩、香、…、後手の歩、香、…の順に番号を振る)
+	for (auto c : COLOR)
+		for (PieceType rpc = PAWN; rpc < KING; ++rpc)
+			for (int i = 0; i < hand_count(hand[c], rpc); ++i)
+			{
+				PieceNumber piece_no = piece_no_count[rpc]++;
+				ASSERT_LV1(is_ok(piece_no));
+				evalList.put_piece(piece_no, c, rpc, i);
+			}
 #endif
-	}
-
-	if (stream.get_cursor() != 256)
-	{
-		// こんな局面はおかしい。デバッグ用。
-		//cout << "Error : set_from_packed_sfen() , position = " << endl << *this << endl;
-		//ASSERT_LV1(false);
-		return Tools::Result(Tools::ResultCode::SomeError);
-	}
 
 	gamePly = gamePly_;
 
@@ -509,19 +716,329 @@ std::string Position::sfen_from_rawdata(Piece board[81], Hand hands[2], Color tu
 // packされたsfenを得る。引数に指定したバッファに返す。
 void Position::sfen_pack(PackedSfen& sfen)
 {
-  SfenPacker sp;
-  sp.data = (u8*)&sfen;
-  sp.pack(*this);
+  FastSfenPacker::pack(*this, sfen);
 }
 
 // packされたsfenを解凍する。sfen文字列が返る。
 std::string Position::sfen_unpack(const PackedSfen& sfen)
 {
-  SfenPacker sp;
-  sp.data = (u8*)&sfen;
-  return sp.unpack();
+  Piece board[SQ_NB_PLUS1];
+  Hand hand[COLOR_NB];
+  Color turn;
+  FastSfenPacker::unpack(sfen, board, hand, turn);
+  return Position::sfen_from_rawdata(board, hand, turn, 0);
+}
+
+// 盤面と手駒、手番を与えて、それをpackしたものを返す。
+void Position::sfen_pack_from_rawdata(const Piece board[81], const Hand hands[2], Color turn, PackedSfen& sfen)
+{
+  FastSfenPacker::pack(board, hands, turn, sfen);
+}
+
+// packされたsfenを、盤面と手駒、手番に解凍する。
+bool Position::sfen_unpack_to_rawdata(const PackedSfen& sfen, Piece board[81], Hand hands[2], Color& turn)
+{
+  Piece b[SQ_NB_PLUS1];
+  const bool ok = FastSfenPacker::unpack(sfen, b, hands, turn);
+  std::copy_n(b, SQ_NB, board);
+  return ok;
+}
+
+
+// -----------------------------------
+//        テスト用のコマンド
+// -----------------------------------
+
+#if defined(ENABLE_TEST_CMD)
+
+#include "../thread.h"
+
+namespace Test
+{
+	// SfenPacker(従来の1bitずつ読み込む実装)で解凍する。FastSfenPacker::unpack()と同じ仕様。
+	// 結果が一致するかの確認用。
+	static bool unpack_reference(const PackedSfen& sfen, Piece board[SQ_NB_PLUS1], Hand hand[COLOR_NB], Color& turn)
+	{
+		// 不正なデータだと256bitを超えて読むことがあるので、余白をつけたbufferにコピーしておく。
+		u8 data[128] = {};
+		memcpy(data, &sfen, sizeof(PackedSfen));
+
+		SfenPacker packer;
+		auto& stream = packer.stream;
+		stream.set_data(data);
+
+		std::fill_n(board, SQ_NB_PLUS1, NO_PIECE);
+		hand[BLACK] = hand[WHITE] = HAND_ZERO;
+
+		turn = (Color)stream.read_one_bit();
+
+		for (auto c : COLOR)
+		{
+			Square sq = (Square)stream.read_n_bit(7);
+			if (sq > SQ_NB)
+				return false;
+			if (sq != SQ_NB)
+				board[sq] = make_piece(c, KING);
+		}
+
+		for (auto sq : SQ)
+		{
+			if (type_of(board[sq]) == KING)
+				continue;
+
+			board[sq] = packer.read_board_piece_from_stream();
+			if (stream.get_cursor() > 256)
+				return false;
+		}
+
+		while (stream.get_cursor() < 256)
+		{
+			Piece pc = packer.read_hand_piece_from_stream();
+			add_hand(hand[color_of(pc)], type_of(pc));
+		}
+
+		return stream.get_cursor() == 256;
+	}
+
+	// SfenPacker(従来の実装)でpackする。
+	static void pack_reference(const Position& pos, PackedSfen& sfen)
+	{
+		memset(&sfen, 0, sizeof(PackedSfen));
+		SfenPacker sp;
+		sp.data = (u8*)&sfen;
+		sp.pack(pos);
+	}
+
+	// 初期局面からランダムに指し進めた局面をsfenで集める。
+	// (王手がかかっている局面や手駒の多い局面も含まれるように、詰むか最大手数まで進める)
+	static vector<string> random_sfens(u64 positions, u64 seed)
+	{
+		vector<string> sfens;
+		sfens.reserve(positions);
+
+		PRNG prng(seed);
+		auto states = std::make_unique<StateInfo[]>(MAX_PLY + 1);
+		Position p;
+		while (sfens.size() < positions)
+		{
+			p.set_hirate(&states[0], Threads.main());
+			for (int ply = 0; ply < MAX_PLY && sfens.size() < positions; ++ply)
+			{
+				MoveList<LEGAL> ml(p);
+				if (ml.size() == 0)
+					break;
+				p.do_move(ml.at(prng.rand(ml.size())), states[ply + 1]);
+				sfens.push_back(p.sfen());
+			}
+		}
+		return sfens;
+	}
+
+	// ----------------------------------
+	//      "test sfenpackfuzz" command
+	// ----------------------------------
+
+	// テーブル引きによる局面の圧縮・解凍(FastSfenPacker)が、従来の実装(SfenPacker)と一致するかを確認する。
+	//  1. ランダムに指し進めた局面について、packした結果がbit単位で一致すること、
+	//     sfen_unpack()とset_from_packed_sfen()(mirrorありとなし)で元の局面に戻ること。
+	//  2. ランダムな32bytesについて、解凍した結果(エラーになるかどうかも含めて)が一致すること。
+	//
+	// 例)
+	//   test sfenpackfuzz positions 100000 random 1000000
+	//
+	//   positions : 1.で用いる局面数
+	//   random    : 2.で用いるランダムなデータの数
+	void sfen_pack_fuzz(Position& pos, std::istringstream& is)
+	{
+		u64 positions = 100000;
+		u64 randoms   = 1000000;
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "positions")
+				is >> positions;
+			else if (token == "random")
+				is >> randoms;
+		}
+
+		// 1. ランダムに指し進めた局面
+		u64 mismatch_pack = 0, mismatch_unpack = 0, mismatch_set = 0, mismatch_mirror = 0;
+		{
+			auto sfens = random_sfens(positions, 20211003);
+
+			Position p, q, r;
+			StateInfo si_p, si_q, si_r;
+			for (auto& sfen : sfens)
+			{
+				p.set(sfen, &si_p, Threads.main());
+				const string expected = p.sfen(0);
+
+				PackedSfen ref, fast;
+				pack_reference(p, ref);
+				memset(&fast, 0xcc, sizeof(fast)); // ゼロクリアを前提としないことの確認
+				p.sfen_pack(fast);
+
+				if (memcmp(&ref, &fast, sizeof(PackedSfen)) && mismatch_pack++ == 0)
+					cout << "Error! : sfen_pack() mismatch , sfen " << sfen << endl;
+
+				if (Position::sfen_unpack(fast) != expected && mismatch_unpack++ == 0)
+					cout << "Error! : sfen_unpack() mismatch , sfen " << sfen << endl;
+
+				if (q.set_from_packed_sfen(fast, &si_q, Threads.main()).is_not_ok()
+					|| q.sfen(0) != expected || q.key() != p.key())
+					if (mismatch_set++ == 0)
+						cout << "Error! : set_from_packed_sfen() mismatch , sfen " << sfen << endl;
+
+				// mirrorした局面
+				Piece board[SQ_NB_PLUS1];
+				Hand hands[COLOR_NB] = { p.hand_of(BLACK), p.hand_of(WHITE) };
+				for (auto sq : SQ)
+					board[Mir(sq)] = p.piece_on(sq);
+				r.set(Position::sfen_from_rawdata(board, hands, p.side_to_move(), 0), &si_r, Threads.main());
+
+				if (q.set_from_packed_sfen(fast, &si_q, Threads.main(), true).is_not_ok()
+					|| q.sfen(0) != r.sfen(0) || q.key() != r.key())
+					if (mismatch_mirror++ == 0)
+						cout << "Error! : set_from_packed_sfen(mirror) mismatch , sfen " << sfen << endl;
+			}
+		}
+
+		cout << "sfenpackfuzz : positions = " << positions
+			 << " , mismatch pack = " << mismatch_pack
+			 << " , unpack = " << mismatch_unpack
+			 << " , set = " << mismatch_set
+			 << " , mirror = " << mismatch_mirror << endl;
+
+		// 2. ランダムなデータ
+		u64 mismatch_random = 0, valid = 0;
+		{
+			PRNG prng(20211004);
+			for (u64 i = 0; i < randoms; ++i)
+			{
+				PackedSfen sfen;
+				for (auto& w : sfen.data)
+					w = (u8)prng.rand<u32>();
+
+				// そこそこの割合でvalidなデータになるように、玉の位置は盤上にしておく。
+				if (i & 1)
+				{
+					const u32 bk = prng.rand(SQ_NB), wk = prng.rand(SQ_NB);
+					const u32 head = (sfen.data[0] & 1) | (bk << 1) | (wk << 8);
+					sfen.data[0] = (u8)head;
+					sfen.data[1] = (u8)(head >> 8);
+				}
+
+				Piece board1[SQ_NB_PLUS1], board2[SQ_NB_PLUS1];
+				Hand hand1[COLOR_NB], hand2[COLOR_NB];
+				Color turn1, turn2;
+				const bool ok1 = unpack_reference(sfen, board1, hand1, turn1);
+				const bool ok2 = FastSfenPacker::unpack(sfen, board2, hand2, turn2);
+				valid += ok1;
+
+				if (ok1 != ok2
+					|| (ok1 && (memcmp(board1, board2, sizeof(board1)) || memcmp(hand1, hand2, sizeof(hand1)) || turn1 != turn2)))
+					if (mismatch_random++ == 0)
+						cout << "Error! : unpack mismatch , random data #" << i << endl;
+			}
+		}
+
+		cout << "sfenpackfuzz : random = " << randoms
+			 << " , valid = " << valid
+			 << " , mismatch = " << mismatch_random << endl;
+	}
+
+	// ----------------------------------
+	//      "test sfenpackbench" command
+	// ----------------------------------
+
+	// 局面の圧縮・解凍の速度を、従来の実装(SfenPacker)とテーブル引きによる実装(FastSfenPacker)とで比較する。
+	// また、学習時の教師局面の読み込みで用いるset_from_packed_sfen()の速度も計測する。
+	//
+	// 例)
+	//   test sfenpackbench positions 100000 loop 10
+	//
+	//   positions : benchに用いる局面数
+	//   loop      : 各局面について圧縮・解凍する回数
+	void sfen_pack_bench(Position& pos, std::istringstream& is)
+	{
+		u64 positions = 100000;
+		u64 loop_max  = 10;
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "positions")
+				is >> positions;
+			else if (token == "loop")
+				is >> loop_max;
+		}
+		positions = std::max(positions, (u64)1);
+
+		auto sfens = random_sfens(positions, 20211005);
+
+		// 局面をsetし直したものを保持しておく。(benchではPosition::set()の時間を含めたくないので)
+		vector<Position> poss(sfens.size());
+		vector<StateInfo> si(sfens.size());
+		vector<PackedSfen> packed(sfens.size());
+		for (size_t i = 0; i < sfens.size(); ++i)
+		{
+			poss[i].set(sfens[i], &si[i], Threads.main());
+			poss[i].sfen_pack(packed[i]);
+		}
+
+		// 最適化で消されないように結果を足し合わせておく。
+		u64 checksum = 0;
+
+		auto bench = [&](auto func)
+		{
+			TimePoint start = now();
+			for (u64 loop = 0; loop < loop_max; ++loop)
+				for (size_t i = 0; i < poss.size(); ++i)
+					func(i);
+			return now() - start + 1; // 0除算を避けるために1を足しておく。
+		};
+
+		const TimePoint pack_ref = bench([&](size_t i) { PackedSfen s; pack_reference(poss[i], s); checksum += s.data[31]; });
+		const TimePoint pack_new = bench([&](size_t i) { PackedSfen s; poss[i].sfen_pack(s); checksum += s.data[31]; });
+
+		Piece board[SQ_NB_PLUS1];
+		Hand hand[COLOR_NB];
+		Color turn;
+		const TimePoint unpack_ref = bench([&](size_t i) { checksum += unpack_reference     (packed[i], board, hand, turn) + board[i % SQ_NB]; });
+		const TimePoint unpack_new = bench([&](size_t i) { checksum += FastSfenPacker::unpack(packed[i], board, hand, turn) + board[i % SQ_NB]; });
+
+		Position p;
+		StateInfo si_p;
+		const TimePoint set_packed = bench([&](size_t i) { p.set_from_packed_sfen(packed[i], &si_p, Threads.main()); checksum += p.key(); });
+
+		const u64 total = loop_max * poss.size();
+		cout << "\n==========================="
+			 << "\nTotal positions                   : " << total
+			 << "\npack   reference (positions/s)    : " << 1000 * total / pack_ref
+			 << "\npack   current   (positions/s)    : " << 1000 * total / pack_new
+			 << "\npack   Speedup                    : " << (double)pack_ref / pack_new
+			 << "\nunpack reference (positions/s)    : " << 1000 * total / unpack_ref
+			 << "\nunpack current   (positions/s)    : " << 1000 * total / unpack_new
+			 << "\nunpack Speedup                    : " << (double)unpack_ref / unpack_new
+			 << "\nset_from_packed_sfen (positions/s): " << 1000 * total / set_packed
+			 << "\n(checksum = " << checksum << ")"
+			 << endl;
+	}
+
+	// 局面の圧縮・解凍関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool sfen_packer_test_cmd(Position& pos, std::istringstream& is, const std::string& token)
+	{
+		if (token == "sfenpackfuzz")       sfen_pack_fuzz(pos, is);  // 局面の圧縮・解凍が従来の実装と一致するかの確認。
+		else if (token == "sfenpackbench") sfen_pack_bench(pos, is); // 局面の圧縮・解凍の速度の計測。
+		else return false;                                           // どのコマンドも処理することがなかった
+
+		// いずれかのコマンドを処理した。
+		return true;
+	}
 }
 
+#endif // defined(ENABLE_TEST_CMD)
 
 #endif // USE_SFEN_PACKER
 
@@ -0,0 +1,776 @@
+﻿#include "compressed_sfen.h"
+
+#if defined(EVAL_LEARN)
+
+#include <cstring> // memcpy()
+#include <iostream>
+
+using namespace std;
+
+namespace Learner
+{
+	namespace CompressedSfen
+	{
+		namespace
+		{
+			// -----------------------------------
+			//   range coder
+			// -----------------------------------
+
+			// LZMAと同じ方式の、適応型の二値算術符号。
+			// 各bitは、それが0である確率(PROB_BITS bitの固定小数)とともに符号化され、確率は符号化するごとに更新される。
+
+			constexpr int PROB_BITS = 11;
+			constexpr u16 PROB_INIT = 1 << (PROB_BITS - 1);
+			constexpr int MOVE_BITS = 5;      // 確率の更新の速さ
+			constexpr u32 RANGE_TOP = 1 << 24;
+
+			struct RangeEncoder
+			{
+				RangeEncoder(vector<u8>& out_) : out(out_) {}
+
+				// probの確率でbitを符号化する。
+				void encode(u16& prob, int bit)
+				{
+					const u32 bound = (range >> PROB_BITS) * prob;
+					if (!bit)
+					{
+						range = bound;
+						prob += ((1 << PROB_BITS) - prob) >> MOVE_BITS;
+					}
+					else {
+						low += bound;
+						range -= bound;
+						prob -= prob >> MOVE_BITS;
+					}
+					while (range < RANGE_TOP)
+					{
+						range <<= 8;
+						shift_low();
+					}
+				}
+
+				// 符号化の終わりに呼び出す。
+				void flush()
+				{
+					for (int i = 0; i < 5; ++i)
+						shift_low();
+				}
+
+			private:
+				void shift_low()
+				{
+					// 繰り上がりが確定するまで、0xffのbyteは書き出さずに数だけ数えておく。
+					if ((u32)low < 0xff000000 || (low >> 32) != 0)
+					{
+						const u8 carry = (u8)(low >> 32);
+						u8 temp = cache;
+						do {
+							out.push_back((u8)(temp + carry));
+							temp = 0xff;
+						} while (--cache_size != 0);
+						cache = (u8)(low >> 24);
+					}
+					++cache_size;
+					low = (low & 0x00ffffff) << 8;
+				}
+
+				vector<u8>& out;
+				u64 low = 0;
+				u32 range = 0xffffffff;
+				u8 cache = 0;
+				u64 cache_size = 1;
+			};
+
+			struct RangeDecoder
+			{
+				RangeDecoder(const u8* data, size_t size) : cur(data), end(data + size)
+				{
+					for (int i = 0; i < 5; ++i)
+						code = (code << 8) | next();
+				}
+
+				// probの確率で符号化されたbitを復号する。
+				int decode(u16& prob)
+				{
+					const u32 bound = (range >> PROB_BITS) * prob;
+					int bit;
+					if (code < bound)
+					{
+						range = bound;
+						prob += ((1 << PROB_BITS) - prob) >> MOVE_BITS;
+						bit = 0;
+					}
+					else {
+						code -= bound;
+						range -= bound;
+						prob -= prob >> MOVE_BITS;
+						bit = 1;
+					}
+					while (range < RANGE_TOP)
+					{
+						range <<= 8;
+						code = (code << 8) | next();
+					}
+					return bit;
+				}
+
+				// 符号の終端を超えて読もうとしたか。(符号が壊れている)
+				bool overrun() const { return over; }
+
+			private:
+				u8 next()
+				{
+					if (cur < end)
+						return *cur++;
+					over = true;
+					return 0;
+				}
+
+				const u8* cur;
+				const u8* end;
+				u32 range = 0xffffffff;
+				u32 code = 0;
+				bool over = false;
+			};
+
+			// N bitの値を、上位bitから、それまでのbitを文脈として符号化するための確率。
+			template <int N>
+			struct BitTree
+			{
+				u16 probs[1 << N];
+
+				void encode(RangeEncoder& rc, u32 value)
+				{
+					u32 m = 1;
+					for (int i = N - 1; i >= 0; --i)
+					{
+						const int bit = (value >> i) & 1;
+						rc.encode(probs[m], bit);
+						m = (m << 1) | bit;
+					}
+				}
+
+				u32 decode(RangeDecoder& rc)
+				{
+					u32 m = 1;
+					for (int i = 0; i < N; ++i)
+						m = (m << 1) | rc.decode(probs[m]);
+					return m - (1 << N);
+				}
+			};
+
+			// 0以上の整数(u32)を、Exp-Golomb符号のように、bit長とそれ以下のbitに分けて符号化するための確率。
+			// 小さな値ほど短く符号化される。
+			struct NumberModel
+			{
+				u16 length[33];
+				u16 bits[33][32];
+
+				void encode(RangeEncoder& rc, u32 value)
+				{
+					// n = value + 1のbit長 - 1 (0～32)
+					const u64 n = (u64)value + 1;
+					int k = 0;
+					while ((n >> (k + 1)) != 0)
+						++k;
+
+					for (int i = 0; i < k; ++i)
+						rc.encode(length[i], 1);
+					if (k < 32)
+						rc.encode(length[k], 0);
+
+					for (int i = k - 1; i >= 0; --i)
+						rc.encode(bits[k][i], (int)((n >> i) & 1));
+				}
+
+				u32 decode(RangeDecoder& rc)
+				{
+					int k = 0;
+					while (k < 32 && rc.decode(length[k]))
+						++k;
+
+					u64 n = 1;
+					for (int i = k - 1; i >= 0; --i)
+						n = (n << 1) | rc.decode(bits[k][i]);
+					return (u32)(n - 1);
+				}
+			};
+
+			// 符号つき整数 ⇔ 0以上の整数
+			u32 zigzag(s32 v) { return ((u32)v << 1) ^ (u32)(v >> 31); }
+			s32 unzigzag(u32 v) { return (s32)(v >> 1) ^ -(s32)(v & 1); }
+
+			// -----------------------------------
+			//   局面の差分
+			// -----------------------------------
+
+			// 局面をどう表現したか。
+			enum RecordMode : int {
+				MODE_FORWARD  = 0, // 直前の局面で、直前の局面のmove(PVの初手)を指した局面
+				MODE_BACKWARD = 1, // この局面でこの局面のmoveを指すと直前の局面になる。(逆順に書き出された棋譜)
+				MODE_DIFF     = 2, // 直前の局面から変化した升と手駒、手番
+				MODE_RAW      = 3, // PackedSfenそのもの
+				MODE_NB       = 4,
+			};
+
+			// 解凍した盤面
+			struct BoardState
+			{
+				Piece board[SQ_NB];
+				Hand hands[COLOR_NB];
+				Color turn;
+
+				void clear()
+				{
+					std::fill_n(board, SQ_NB, NO_PIECE);
+					hands[BLACK] = hands[WHITE] = HAND_ZERO;
+					turn = BLACK;
+				}
+
+				void unpack(const PackedSfen& sfen)
+				{
+					// 不正なデータであった時は空の盤面とする。(符号化と解凍とで同じになりさえすれば良い)
+					if (!Position::sfen_unpack_to_rawdata(sfen, board, hands, turn))
+						clear();
+				}
+
+				void pack(PackedSfen& sfen) const
+				{
+					Position::sfen_pack_from_rawdata(board, hands, turn, sfen);
+				}
+			};
+
+			// 盤面sで、手番側が指し手m(Move16)を指す。指せない指し手であればfalseを返す。
+			// 合法手であるかまでは確認しない。(符号化の時に、結果が一致するかで確認する)
+			bool do_move(BoardState& s, u16 m)
+			{
+				const Square to = (Square)(m & 0x7f);
+				const Color us = s.turn;
+				if (to >= SQ_NB)
+					return false;
+
+				if (m & MOVE_DROP)
+				{
+					const PieceType pt = (PieceType)((m >> 7) & 0x7f);
+					if (pt < PAWN || pt > GOLD || s.board[to] != NO_PIECE || hand_count(s.hands[us], pt) == 0)
+						return false;
+
+					sub_hand(s.hands[us], pt);
+					s.board[to] = make_piece(us, pt);
+				}
+				else {
+					const Square from = (Square)((m >> 7) & 0x7f);
+					if (from >= SQ_NB || from == to)
+						return false;
+
+					Piece pc = s.board[from];
+					const Piece captured = s.board[to];
+					if (pc == NO_PIECE || color_of(pc) != us
+						|| (captured != NO_PIECE && (color_of(captured) == us || type_of(captured) == KING)))
+						return false;
+
+					if (captured != NO_PIECE)
+						add_hand(s.hands[us], raw_type_of(captured));
+					if (m & MOVE_PROMOTE)
+						pc = (Piece)(pc | PIECE_PROMOTE);
+
+					s.board[from] = NO_PIECE;
+					s.board[to] = pc;
+				}
+
+				s.turn = ~us;
+				return true;
+			}
+
+			// 盤面sは、指し手m(Move16)を指した後の盤面。これを指す前の盤面に戻す。
+			// capturedは、その指し手で取られた駒。戻せない指し手であればfalseを返す。
+			bool undo_move(BoardState& s, u16 m, Piece captured)
+			{
+				const Square to = (Square)(m & 0x7f);
+				const Color us = ~s.turn; // mを指した側
+				if (to >= SQ_NB)
+					return false;
+
+				if (m & MOVE_DROP)
+				{
+					const PieceType pt = (PieceType)((m >> 7) & 0x7f);
+					if (pt < PAWN || pt > GOLD || s.board[to] != make_piece(us, pt))
+						return false;
+
+					s.board[to] = NO_PIECE;
+					add_hand(s.hands[us], pt);
+				}
+				else {
+					const Square from = (Square)((m >> 7) & 0x7f);
+					if (from >= SQ_NB || from == to)
+						return false;
+
+					Piece pc = s.board[to];
+					if (pc == NO_PIECE || color_of(pc) != us || s.board[from] != NO_PIECE)
+						return false;
+
+					if (m & MOVE_PROMOTE)
+					{
+						if (!(pc & PIECE_PROMOTE))
+							return false;
+						pc = (Piece)(pc & ~PIECE_PROMOTE);
+					}
+
+					if (captured != NO_PIECE)
+					{
+						const PieceType pr = raw_type_of(captured);
+						if (color_of(captured) == us || type_of(captured) == KING || hand_count(s.hands[us], pr) == 0)
+							return false;
+						sub_hand(s.hands[us], pr);
+					}
+
+					s.board[from] = pc;
+					s.board[to] = captured;
+				}
+
+				s.turn = us;
+				return true;
+			}
+
+			// -----------------------------------
+			//   局面の符号化
+			// -----------------------------------
+
+			// 各フィールドを符号化するための確率。(すべてu16の配列なので、まとめて初期化する)
+			struct Model
+			{
+				BitTree<2> move_flags;          // 指し手の駒打ち・成りフラグ
+				BitTree<7> move_to;             // 指し手の移動先
+				BitTree<7> move_from[2];        // 指し手の移動元(駒打ちなら打つ駒)。駒打ちかどうかごと。
+				BitTree<2> mode[MODE_NB];       // 局面をどう表現したか。直前の局面をどう表現したかごと。
+				BitTree<5> captured;            // MODE_BACKWARDで、その指し手で取られた駒
+				u16        changed[2];          // MODE_DIFFで、升の駒が変化したか。直前の局面でその升が空であったかごと。
+				BitTree<5> piece[2];            // MODE_DIFFで、変化した升の駒。直前の局面でその升が空であったかごと。
+				u16        hand_changed;        // MODE_DIFFで、手駒が変化したか。
+				BitTree<5> hand_count[PIECE_HAND_NB]; // MODE_DIFFで、手駒の枚数
+				u16        turn;                // MODE_DIFFで、手番が変化したか。
+				BitTree<8> raw;                 // MODE_RAWで、PackedSfenの各byte
+				NumberModel score[2];           // 評価値の予測との差。MODE_FORWARD/MODE_BACKWARDであるかどうかごと。
+				NumberModel game_ply[2];        // 手数の予測との差。同上。
+				u16        result_predicted[2]; // 勝敗が予測通りであったか。同上。
+				BitTree<8> result;              // 予測通りでなかった時の勝敗
+				BitTree<8> padding;
+
+				Model() { std::fill_n((u16*)this, sizeof(*this) / sizeof(u16), PROB_INIT); }
+			};
+
+			// 直前の局面から、評価値・手数・勝敗を予測する。
+			struct Prediction
+			{
+				s32 score;
+				s32 game_ply;
+				s32 game_result;
+			};
+
+			Prediction predict(const PackedSfenValue& prev, Color prev_turn, Color turn, int mode)
+			{
+				// 手番が変わったなら、評価値と勝敗は符号が反転するはず。
+				const bool flip = prev_turn != turn;
+				return Prediction{
+					flip ? -prev.score : prev.score,
+					prev.gamePly + (mode == MODE_FORWARD ? 1 : mode == MODE_BACKWARD ? -1 : 0),
+					flip ? -prev.game_result : prev.game_result
+				};
+			}
+
+			// 1つのブロックを圧縮するクラス。
+			struct BlockEncoder
+			{
+				BlockEncoder(vector<u8>& out) : rc(out)
+				{
+					state.clear();
+					prev = PackedSfenValue();
+				}
+
+				void encode(const PackedSfenValue& psv)
+				{
+					// 指し手
+					const u16 m = psv.move;
+					model.move_flags.encode(rc, m >> 14);
+					model.move_to.encode(rc, m & 0x7f);
+					model.move_from[(m & MOVE_DROP) ? 1 : 0].encode(rc, (m >> 7) & 0x7f);
+
+					// 局面 : 解凍した時に元のPackedSfenと一致するものを、MODE_FORWARDから順に試す。
+					const Color prev_turn = state.turn;
+					PackedSfen packed;
+					int mode = MODE_RAW;
+					Piece captured = NO_PIECE;
+
+					BoardState next = state;
+					if (do_move(next, prev.move) && (next.pack(packed), packed_equal(packed, psv.sfen)))
+						mode = MODE_FORWARD;
+					else
+					{
+						next.unpack(psv.sfen);
+						next.pack(packed);
+						if (packed_equal(packed, psv.sfen))
+						{
+							// この局面でmを指すと直前の局面になるか。
+							// 解凍側と同じ盤面を次の局面の予測に用いるために、undo_move()した盤面の方を採用する。
+							BoardState s = state;
+							if (!(m & MOVE_DROP) && (m & 0x7f) < SQ_NB)
+								captured = next.board[m & 0x7f];
+							if (undo_move(s, m, captured) && (s.pack(packed), packed_equal(packed, psv.sfen)))
+							{
+								mode = MODE_BACKWARD;
+								next = s;
+							}
+							else
+								mode = MODE_DIFF;
+						}
+					}
+
+					model.mode[prev_mode].encode(rc, mode);
+
+					switch (mode)
+					{
+					case MODE_FORWARD:
+						break;
+
+					case MODE_BACKWARD:
+						if (!(m & MOVE_DROP))
+							model.captured.encode(rc, captured);
+						break;
+
+					case MODE_DIFF:
+						for (auto sq : SQ)
+						{
+							const int empty = state.board[sq] == NO_PIECE;
+							const bool changed = next.board[sq] != state.board[sq];
+							rc.encode(model.changed[empty], changed);
+							if (changed)
+								model.piece[empty].encode(rc, next.board[sq]);
+						}
+						{
+							const bool changed = next.hands[BLACK] != state.hands[BLACK] || next.hands[WHITE] != state.hands[WHITE];
+							rc.encode(model.hand_changed, changed);
+							if (changed)
+								for (auto c : COLOR)
+									for (PieceType pr = PAWN; pr < KING; ++pr)
+										model.hand_count[pr].encode(rc, hand_count(next.hands[c], pr));
+						}
+						rc.encode(model.turn, next.turn != state.turn);
+						break;
+
+					case MODE_RAW:
+						for (auto b : psv.sfen.data)
+							model.raw.encode(rc, b);
+						next.unpack(psv.sfen);
+						break;
+					}
+
+					// 評価値・手数・勝敗・padding
+					const auto pred = predict(prev, prev_turn, next.turn, mode);
+					const int ctx = mode <= MODE_BACKWARD ? 0 : 1;
+					model.score[ctx].encode(rc, zigzag(psv.score - pred.score));
+					model.game_ply[ctx].encode(rc, zigzag((s16)(psv.gamePly - pred.game_ply)));
+					const bool predicted = psv.game_result == pred.game_result;
+					rc.encode(model.result_predicted[ctx], predicted);
+					if (!predicted)
+						model.result.encode(rc, (u8)psv.game_result);
+					model.padding.encode(rc, psv.padding);
+
+					state = next;
+					prev = psv;
+					prev_mode = mode;
+				}
+
+				void flush() { rc.flush(); }
+
+			private:
+				static bool packed_equal(const PackedSfen& a, const PackedSfen& b) { return memcmp(&a, &b, sizeof(PackedSfen)) == 0; }
+
+				RangeEncoder rc;
+				Model model;
+				BoardState state;
+				PackedSfenValue prev;
+				int prev_mode = MODE_RAW;
+			};
+
+			// 1つのブロックを解凍するクラス。BlockEncoderと対になっている。
+			struct BlockDecoder
+			{
+				BlockDecoder(const u8* data, size_t size) : rc(data, size)
+				{
+					state.clear();
+					prev = PackedSfenValue();
+				}
+
+				void decode(PackedSfenValue& psv)
+				{
+					// 指し手
+					const u16 flags = (u16)model.move_flags.decode(rc);
+					const u16 to = (u16)model.move_to.decode(rc);
+					const u16 from = (u16)model.move_from[(flags << 14) & MOVE_DROP ? 1 : 0].decode(rc);
+					const u16 m = (u16)((flags << 14) | (from << 7) | to);
+
+					// 局面
+					const Color prev_turn = state.turn;
+					const int mode = (int)model.mode[prev_mode].decode(rc);
+					BoardState next = state;
+
+					switch (mode)
+					{
+					case MODE_FORWARD:
+						do_move(next, prev.move);
+						next.pack(psv.sfen);
+						break;
+
+					case MODE_BACKWARD:
+						undo_move(next, m, (m & MOVE_DROP) ? NO_PIECE : (Piece)model.captured.decode(rc));
+						next.pack(psv.sfen);
+						break;
+
+					case MODE_DIFF:
+						for (auto sq : SQ)
+						{
+							const int empty = state.board[sq] == NO_PIECE;
+							if (rc.decode(model.changed[empty]))
+								next.board[sq] = (Piece)model.piece[empty].decode(rc);
+						}
+						if (rc.decode(model.hand_changed))
+							for (auto c : COLOR)
+							{
+								next.hands[c] = HAND_ZERO;
+								for (PieceType pr = PAWN; pr < KING; ++pr)
+									add_hand(next.hands[c], pr, (int)model.hand_count[pr].decode(rc));
+							}
+						if (rc.decode(model.turn))
+							next.turn = ~next.turn;
+						next.pack(psv.sfen);
+						break;
+
+					case MODE_RAW:
+						for (auto& b : psv.sfen.data)
+							b = (u8)model.raw.decode(rc);
+						next.unpack(psv.sfen);
+						break;
+					}
+
+					// 評価値・手数・勝敗・padding
+					const auto pred = predict(prev, prev_turn, next.turn, mode);
+					const int ctx = mode <= MODE_BACKWARD ? 0 : 1;
+					psv.move = m;
+					psv.score = (s16)(pred.score + unzigzag(model.score[ctx].decode(rc)));
+					psv.gamePly = (u16)(pred.game_ply + unzigzag(model.game_ply[ctx].decode(rc)));
+					psv.game_result = rc.decode(model.result_predicted[ctx]) ? (s8)pred.game_result : (s8)model.result.decode(rc);
+					psv.padding = (u8)model.padding.decode(rc);
+
+					state = next;
+					prev = psv;
+					prev_mode = mode;
+				}
+
+				bool overrun() const { return rc.overrun(); }
+
+			private:
+				RangeDecoder rc;
+				Model model;
+				BoardState state;
+				PackedSfenValue prev;
+				int prev_mode = MODE_RAW;
+			};
+
+			// 解凍した局面のchecksum (FNV-1a)
+			u64 checksum(const PackedSfenValue* records, size_t count)
+			{
+				u64 h = 0xcbf29ce484222325ULL;
+				const u8* p = (const u8*)records;
+				for (size_t i = 0; i < count * sizeof(PackedSfenValue); i += sizeof(u64))
+				{
+					u64 w;
+					memcpy(&w, p + i, sizeof(u64));
+					h = (h ^ w) * 0x100000001b3ULL;
+				}
+				return h;
+			}
+
+			// ブロックの列を、thread_num個のスレッドで並列に解凍してoutの末尾に追加する。
+			// blocks[i]はi番目のブロックのheaderの先頭を指している。
+			Tools::Result decode_block_list(const vector<const u8*>& blocks, size_t thread_num, vector<PackedSfenValue>& out)
+			{
+				// 各ブロックを解凍する位置
+				vector<size_t> offsets(blocks.size() + 1);
+				offsets[0] = out.size();
+				for (size_t i = 0; i < blocks.size(); ++i)
+				{
+					BlockHeader header;
+					memcpy(&header, blocks[i], sizeof(BlockHeader));
+					offsets[i + 1] = offsets[i] + header.count;
+				}
+				out.resize(offsets.back());
+				if (blocks.empty())
+					return Tools::Result::Ok();
+
+				std::atomic<size_t> next_block(0);
+				std::atomic<bool> error(false);
+				Tools::parallel_run(std::min(thread_num, blocks.size()), [&](size_t) {
+					for (size_t i = next_block++; i < blocks.size(); i = next_block++)
+					{
+						BlockHeader header;
+						memcpy(&header, blocks[i], sizeof(BlockHeader));
+						if (decode_block(header, blocks[i] + sizeof(BlockHeader), &out[offsets[i]]).is_not_ok())
+							error = true;
+					}
+				});
+
+				return error ? Tools::Result(Tools::ResultCode::FileReadError) : Tools::Result::Ok();
+			}
+		}
+
+		// ファイルがこの形式であるかを判定する。
+		bool is_compressed_file(const std::string& filename)
+		{
+			ifstream fs(filename, ios::in | ios::binary);
+			char magic[sizeof(FILE_MAGIC)];
+			return fs.read(magic, sizeof(magic)) && memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0;
+		}
+
+		// records[0..count-1]を1つのブロックに圧縮して、BlockHeaderとともにbufの末尾に追加する。
+		void encode_block(const PackedSfenValue* records, size_t count, std::vector<u8>& buf)
+		{
+			ASSERT_LV1(count <= MAX_BLOCK_SIZE);
+
+			const size_t header_pos = buf.size();
+			buf.resize(header_pos + sizeof(BlockHeader));
+
+			BlockEncoder encoder(buf);
+			for (size_t i = 0; i < count; ++i)
+				encoder.encode(records[i]);
+			encoder.flush();
+
+			const BlockHeader header = { (u32)count, (u32)(buf.size() - header_pos - sizeof(BlockHeader)), checksum(records, count) };
+			memcpy(&buf[header_pos], &header, sizeof(BlockHeader));
+		}
+
+		// 1つのブロックを解凍して、records[0..header.count-1]に書き出す。
+		Tools::Result decode_block(const BlockHeader& header, const u8* data, PackedSfenValue* records)
+		{
+			if (header.count > MAX_BLOCK_SIZE)
+				return Tools::Result(Tools::ResultCode::FileReadError);
+
+			BlockDecoder decoder(data, header.size);
+			for (size_t i = 0; i < header.count; ++i)
+				decoder.decode(records[i]);
+
+			if (decoder.overrun() || checksum(records, header.count) != header.checksum)
+				return Tools::Result(Tools::ResultCode::FileReadError);
+
+			return Tools::Result::Ok();
+		}
+
+		// メモリ上のブロックの列を、合計max_records局面を超えない範囲で並列に解凍する。
+		Tools::Result decode_blocks(const u8* data, u64 size, u64& offset, u64 max_records, size_t thread_num, std::vector<PackedSfenValue>& out)
+		{
+			vector<const u8*> blocks;
+			u64 records = 0;
+			while (offset < size)
+			{
+				// 末尾の書きかけのブロックは無視する。(生成の途中で停止させた時などに出来る)
+				BlockHeader header;
+				if (offset + sizeof(BlockHeader) > size
+					|| (memcpy(&header, data + offset, sizeof(BlockHeader)), offset + sizeof(BlockHeader) + header.size > size))
+				{
+					offset = size;
+					break;
+				}
+				if (header.count > MAX_BLOCK_SIZE)
+					return Tools::Result(Tools::ResultCode::FileReadError);
+
+				if (!blocks.empty() && records + header.count > max_records)
+					break;
+
+				blocks.push_back(data + offset);
+				records += header.count;
+				offset += sizeof(BlockHeader) + header.size;
+			}
+
+			return decode_block_list(blocks, thread_num, out);
+		}
+
+		// ファイルを開く。
+		Tools::Result Reader::open(const std::string& filename)
+		{
+			fs.close();
+			fs.clear();
+			pending.clear();
+			pending_pos = 0;
+			end_of_file = true;
+
+			fs.open(filename, ios::in | ios::binary);
+			if (!fs)
+				return Tools::Result(Tools::ResultCode::FileOpenError);
+
+			char magic[sizeof(FILE_MAGIC)];
+			if (!fs.read(magic, sizeof(magic)) || memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0)
+				return Tools::Result(Tools::ResultCode::FileReadError);
+
+			end_of_file = false;
+			return Tools::Result::Ok();
+		}
+
+		// 最大max_records局面を読み込んでoutの末尾に追加する。
+		Tools::Result Reader::read(std::vector<PackedSfenValue>& out, u64 max_records, size_t thread_num)
+		{
+			u64 done = 0;
+			while (true)
+			{
+				// 前回解凍したブロックの残りから返す。
+				const size_t n = (size_t)std::min((u64)(pending.size() - pending_pos), max_records - done);
+				out.insert(out.end(), pending.begin() + pending_pos, pending.begin() + pending_pos + n);
+				pending_pos += n;
+				done += n;
+
+				if (done == max_records || end_of_file)
+					return Tools::Result::Ok();
+
+				// 残りの局面数分のブロックを読み込む。
+				vector<u8> buf;
+				vector<size_t> block_pos;
+				for (u64 records = 0; records < max_records - done; )
+				{
+					BlockHeader header;
+					const size_t pos = buf.size();
+					if (!fs.read((char*)&header, sizeof(BlockHeader)))
+					{
+						end_of_file = true;
+						break;
+					}
+					if (header.count > MAX_BLOCK_SIZE)
+						return Tools::Result(Tools::ResultCode::FileReadError);
+
+					buf.resize(pos + sizeof(BlockHeader) + header.size);
+					memcpy(&buf[pos], &header, sizeof(BlockHeader));
+					if (!fs.read((char*)&buf[pos + sizeof(BlockHeader)], header.size))
+					{
+						// 末尾の書きかけのブロックは無視する。(生成の途中で停止させた時などに出来る)
+						buf.resize(pos);
+						end_of_file = true;
+						break;
+					}
+
+					block_pos.push_back(pos);
+					records += header.count;
+				}
+
+				vector<const u8*> blocks;
+				for (auto pos : block_pos)
+					blocks.push_back(&buf[pos]);
+
+				pending.clear();
+				pending_pos = 0;
+				auto result = decode_block_list(blocks, thread_num, pending);
+				if (result.is_not_ok())
+					return result;
+			}
+		}
+	}
+}
+
+#endif // defined(EVAL_LEARN)
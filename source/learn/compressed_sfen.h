@@ -0,0 +1,93 @@
+﻿#ifndef _COMPRESSED_SFEN_H_
+#define _COMPRESSED_SFEN_H_
+
+#include "../config.h"
+
+#if defined(EVAL_LEARN)
+
+#include "learn.h"
+#include "../misc.h"
+
+#include <fstream>
+#include <vector>
+
+// =====================
+//  圧縮された教師局面ファイル(.binz)
+// =====================
+
+// gensfenで生成される教師局面(PackedSfenValue)は、同じ対局の局面が1手ずつ進めた順(あるいは戻した順)に連続して並んでいる。
+// そこで、各局面を直前の局面からの差分(1手分の指し手、あるいは変化した升)として表現し、それを適応型の二値算術符号(range coder)で
+// エントロピー符号化する。外部のライブラリは用いない。
+//
+// ファイル形式 :
+//   ファイルheader : FILE_MAGIC(8bytes)
+//   ブロック×N     : BlockHeader(16bytes) + 符号(BlockHeader::size bytes)
+//
+// ・各ブロックは独立して解凍できるので、複数のブロックを複数スレッドで並列に解凍できる。
+// ・ファイルにはブロックを追記していくだけなので、gensfenで既存のファイルに追記できる。
+// ・どのような局面データであっても、元のPackedSfenValueとbit単位で一致するように解凍できる。
+//   (差分で表現できない局面は、PackedSfenをそのまま符号化する)
+// ・little endianを前提としている。
+
+namespace Learner
+{
+	namespace CompressedSfen
+	{
+		// ファイル先頭のmagic
+		constexpr char FILE_MAGIC[8] = { 'Y','O','S','F','E','N','Z','1' };
+
+		// 1つのブロックに格納する局面数の上限
+		constexpr size_t MAX_BLOCK_SIZE = 1 << 20;
+
+		// ブロックのheader
+		struct BlockHeader
+		{
+			u32 count;    // このブロックに格納されている局面数
+			u32 size;     // このheaderに続く符号のbyte数
+			u64 checksum; // 解凍した局面のchecksum。(壊れたファイルの検出用)
+		};
+
+		// ファイルがこの形式であるか(先頭がFILE_MAGICであるか)を判定する。
+		bool is_compressed_file(const std::string& filename);
+
+		// records[0..count-1]を1つのブロックに圧縮して、BlockHeaderとともにbufの末尾に追加する。
+		// count <= MAX_BLOCK_SIZEであること。
+		void encode_block(const PackedSfenValue* records, size_t count, std::vector<u8>& buf);
+
+		// 1つのブロック(headerに続く符号data[0..header.size-1])を解凍して、records[0..header.count-1]に書き出す。
+		// 符号が壊れていればエラーを返す。
+		Tools::Result decode_block(const BlockHeader& header, const u8* data, PackedSfenValue* records);
+
+		// メモリ上のブロックの列data[0..size-1]のoffsetから、合計max_records局面を超えない範囲で(少なくとも1ブロックは)
+		// ブロックをthread_num個のスレッドで並列に解凍してoutの末尾に追加し、offsetを進める。
+		// mmapしたファイルから読み込む時に用いる。offsetはファイルheaderの直後から始めること。
+		Tools::Result decode_blocks(const u8* data, u64 size, u64& offset, u64 max_records, size_t thread_num, std::vector<PackedSfenValue>& out);
+
+		// ファイルからブロック単位で読み込んで、複数スレッドで並列に解凍するクラス。
+		struct Reader
+		{
+			// ファイルを開く。この形式のファイルでなければエラー。
+			Tools::Result open(const std::string& filename);
+
+			// 最大max_records局面を読み込んでoutの末尾に追加する。ブロックはthread_num個のスレッドで並列に解凍する。
+			// ファイルの終端に達していれば、max_recordsより少なくなる。
+			Tools::Result read(std::vector<PackedSfenValue>& out, u64 max_records, size_t thread_num);
+
+			// すべての局面を読み込み終わったか。
+			bool eof() const { return pending_pos == pending.size() && end_of_file; }
+
+		private:
+			std::ifstream fs;
+
+			// 解凍したブロックのうち、まだ返していない局面
+			std::vector<PackedSfenValue> pending;
+			size_t pending_pos = 0;
+
+			bool end_of_file = true;
+		};
+	}
+}
+
+#endif // defined(EVAL_LEARN)
+
+#endif // ifndef _COMPRESSED_SFEN_H_
@@ -67,6 +67,7 @@
 #include "../tt.h"
 #include "../mate/mate.h"
 #include "multi_think.h"
+#include "compressed_sfen.h"
 
 #if defined(EVAL_NNUE)
 #include "../eval/nnue/evaluate_nnue_learner.h"
@@ -113,9 +114,10 @@ struct SfenWriter
 		sfen_buffers_pool.reserve((size_t)thread_num * 10);
 		sfen_buffers.resize(thread_num);
 
-		// 追加学習するとき、評価関数の学習後も生成される教師の質はあまり変わらず、教師局面数を稼ぎたいので
-		// 古い教師も使うのが好ましいのでこういう仕様にしてある。
-		fs.open(filename, ios::out | ios::binary | ios::app);
+		// ファイル名の拡張子が".binz"なら圧縮して書き出す。
+		compress = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".binz") == 0;
+
+		open_file(filename);
 		filename_ = filename;
 
 		finished = false;
@@ -218,7 +220,15 @@ struct SfenWriter
 			{
 				for (auto ptr : buffers)
 				{
-					fs.write((const char*)&((*ptr)[0]), sizeof(PackedSfenValue) * ptr->size());
+					if (compress)
+					{
+						// 1つのバッファを1つのブロックに圧縮して書き出す。
+						std::vector<u8> block;
+						CompressedSfen::encode_block(&((*ptr)[0]), ptr->size(), block);
+						fs.write((const char*)&block[0], block.size());
+					}
+					else
+						fs.write((const char*)&((*ptr)[0]), sizeof(PackedSfenValue) * ptr->size());
 
 					sfen_write_count += ptr->size();
 
@@ -236,7 +246,7 @@ struct SfenWriter
 						int n = (int)(sfen_write_count / save_every);
 						// ファイル名を変更して再度openする。上書き考慮してios::appをつけておく。(運用によっては、ないほうがいいかも..)
 						string filename = filename_ + "_" + std::to_string(n);
-						fs.open(filename, ios::out | ios::binary | ios::app);
+						open_file(filename);
 						cout << endl << "output sfen file = " << filename << endl;
 					}
 #endif
@@ -265,8 +275,34 @@ struct SfenWriter
 
 private:
 
+	// 書き出すファイルを開く。
+	void open_file(const string& filename)
+	{
+		// 圧縮して書き出す時、ファイルが空であればファイルheaderを書き出す。
+		// 既存のファイルがこの形式でなければ、追記すると読み込めないファイルになってしまうので警告を出しておく。
+		bool need_header = false;
+		if (compress)
+		{
+			ifstream ifs(filename, ios::in | ios::binary | ios::ate);
+			if (!ifs || ifs.tellg() == 0)
+				need_header = true;
+			else if (!CompressedSfen::is_compressed_file(filename))
+				cout << "Warning! : " << filename << " is not a compressed sfen file." << endl;
+		}
+
+		// 追加学習するとき、評価関数の学習後も生成される教師の質はあまり変わらず、教師局面数を稼ぎたいので
+		// 古い教師も使うのが好ましいのでこういう仕様にしてある。
+		fs.open(filename, ios::out | ios::binary | ios::app);
+
+		if (need_header)
+			fs.write(CompressedSfen::FILE_MAGIC, sizeof(CompressedSfen::FILE_MAGIC));
+	}
+
 	fstream fs;
 
+	// 圧縮して書き出すのか。(ファイル名の拡張子が".binz")
+	bool compress;
+
 	// コンストラクタで渡されたファイル名
 	std::string filename_;
 
@@ -1169,6 +1205,7 @@ struct SfenReader
 	SfenReader(int thread_num)
 	{
 		packed_sfens.resize(thread_num);
+		mapped_ranges.resize(thread_num);
 		total_read = 0;
 		total_done = 0;
 		last_done = 0;
@@ -1176,6 +1213,7 @@ struct SfenReader
 		save_count = 0;
 		end_of_files = false;
 		no_shuffle = false;
+		use_mmap = false;
 		stop_flag = false;
 
 		hash.resize(READ_SFEN_HASH_SIZE);
@@ -1258,6 +1296,9 @@ struct SfenReader
 	// [ASYNC] スレッドが局面を一つ返す。なければfalseが返る。
 	bool read_to_thread_buffer(size_t thread_id, PackedSfenValue& ps)
 	{
+		if (use_mmap)
+			return read_from_mapped_range(thread_id, ps);
+
 		// スレッドバッファに局面が残っているなら、それを1つ取り出して返す。
 		auto& thread_ps = packed_sfens[thread_id];
 
@@ -1290,8 +1331,23 @@ struct SfenReader
 		{
 			{
 				std::unique_lock<std::mutex> lk(mutex);
+
+				// mmapで読み込んでいる時は、mapされた教師局面の範囲を受け取る。
+				if (use_mmap)
+				{
+					if (mapped_ranges_pool.size() != 0)
+					{
+						mapped_ranges[thread_id] = std::move(mapped_ranges_pool.front());
+						mapped_ranges_pool.pop_front();
+
+						total_read += mapped_ranges[thread_id].size();
+
+						return true;
+					}
+				}
+
 				// ファイルバッファから充填できたなら、それで良し。
-				if (packed_sfens_pool.size() != 0)
+				else if (packed_sfens_pool.size() != 0)
 				{
 					// 充填可能なようなので充填して終了。
 
@@ -1315,10 +1371,153 @@ struct SfenReader
 
 	}
 	
+	// [ASYNC] mapされた教師局面の範囲から局面を一つ返す。なければfalseが返る。
+	// read_to_thread_buffer()のuse_mmapの時の処理。
+	bool read_from_mapped_range(size_t thread_id, PackedSfenValue& ps)
+	{
+		auto& range = mapped_ranges[thread_id];
+
+		// 範囲に残りがなかったらpoolから受け取るが、それすらなかったらもう終了。
+		if (range.size() == 0 && !read_to_thread_buffer_impl(thread_id))
+			return false;
+
+		// mapされた領域から直接コピーする。(packed_sfensのように中間バッファを介さない)
+		ps = range.chunk->at(--range.end);
+
+		// 範囲を使いきったのであればchunkへの参照を手放す。
+		// (すべてのスレッドが手放した時点で、chunkの範囲の物理メモリはOSに返される)
+		if (range.size() == 0)
+			range.chunk.reset();
+
+		return true;
+	}
+
 	// 局面ファイルをバックグラウンドで読み込むスレッドを起動する。
 	void start_file_read_worker()
 	{
-		file_worker_thread = std::thread([&] { this->file_read_worker(); });
+		if (use_mmap)
+			file_worker_thread = std::thread([&] { this->file_map_worker(); });
+		else
+			file_worker_thread = std::thread([&] { this->file_read_worker(); });
+	}
+
+	// ファイルをmapして、その範囲をpoolに積むスレッド用。(use_mmapの時)
+	// file_read_worker()と違って局面のコピーはせず、SFEN_READ_SIZE局面ずつ、読み出す順番(添字)だけをshuffleする。
+	void file_map_worker()
+	{
+		// いまmapしているファイルと、その局面数、どこまでpoolに積んだか。
+		// 圧縮されたファイルであれば、局面数の代わりにファイルのbyte数、cursorはbyte単位の位置。
+		std::shared_ptr<MemoryMappedFile> file;
+		u64 file_sfens = 0;
+		u64 cursor = 0;
+		bool file_compressed = false;
+
+		while (true)
+		{
+			// poolが減ってくるのを待つ。
+			// このsize()の読み取りはread onlyなのでlockしなくていいだろう。
+			while (!stop_flag && mapped_ranges_pool.size() >= SFEN_READ_SIZE / THREAD_BUFFER_SIZE)
+				Tools::sleep(100);
+			if (stop_flag)
+				return;
+
+			// いまのファイルをすべて積んだなら次のファイルをmapする。
+			while (cursor == file_sfens)
+			{
+				// このファイルのunmapは、このファイルの範囲をすべてのスレッドが使いきった時に行われる。
+				file.reset();
+
+				// もう無い
+				if (filenames.size() == 0)
+				{
+					cout << "..end of files." << endl;
+					end_of_files = true;
+					return;
+				}
+
+				// 次のファイル名ひとつ取得。
+				string filename = *filenames.rbegin();
+				filenames.pop_back();
+
+				cout << "map filename = " << filename << endl;
+				auto f = std::make_shared<MemoryMappedFile>();
+				if (f->open(filename).is_not_ok())
+				{
+					cout << "Error! : can't map file , filename = " << filename << endl;
+					continue;
+				}
+
+				// 圧縮されたファイルは、ブロック単位で解凍する。
+				file_compressed = f->size() >= sizeof(CompressedSfen::FILE_MAGIC)
+					&& memcmp(f->data(), CompressedSfen::FILE_MAGIC, sizeof(CompressedSfen::FILE_MAGIC)) == 0;
+				if (file_compressed)
+				{
+					file_sfens = f->size();
+					cursor = sizeof(CompressedSfen::FILE_MAGIC);
+				}
+				else
+				{
+					// 末尾の、局面に満たない端数は無視する。
+					file_sfens = f->size() / sizeof(PackedSfenValue);
+					cursor = 0;
+				}
+
+				// ファイル全体としては先頭から順番に読むので、OSに先読みを多めにしてもらう。
+				f->advise(MemoryMappedFile::Advice::Sequential);
+				file = f;
+			}
+
+			std::shared_ptr<MappedSfenChunk> chunk;
+			if (file_compressed)
+			{
+				// ファイルのcursorからSFEN_READ_SIZE局面を超えない分のブロックを、学習に用いるスレッド数で並列に解凍する。
+				// 解凍した局面はchunkが保持するので、mapされた領域はすぐにOSに返して良い。
+				PSVector sfens;
+				const u64 begin = cursor;
+				if (CompressedSfen::decode_blocks((const u8*)file->data(), file_sfens, cursor, SFEN_READ_SIZE, packed_sfens.size(), sfens).is_not_ok())
+				{
+					// 壊れたファイルであれば、そのファイルの残りは読み飛ばす。
+					cout << "Error! : broken compressed sfen file." << endl;
+					sfens.clear();
+					cursor = file_sfens;
+				}
+				file->advise(MemoryMappedFile::Advice::DontNeed, begin, cursor - begin);
+				if (sfens.empty())
+					continue;
+
+				chunk = std::make_shared<MappedSfenChunk>(std::move(sfens));
+			}
+			else
+			{
+				// ファイルのcursorからSFEN_READ_SIZE局面
+				const u64 count = std::min((u64)SFEN_READ_SIZE, file_sfens - cursor);
+				chunk = std::make_shared<MappedSfenChunk>(file, cursor, count);
+				cursor += count;
+
+				// この範囲は、すぐに各スレッドからランダムにアクセスされるので、非同期で読み込みを開始してもらう。
+				file->advise(MemoryMappedFile::Advice::WillNeed, chunk->first * sizeof(PackedSfenValue), count * sizeof(PackedSfenValue));
+			}
+			const u64 count = chunk->order.size();
+
+			// この範囲を読み出す順番をshuffleする。
+			// random shuffle by Fisher-Yates algorithm
+			auto& order = chunk->order;
+			if (!no_shuffle)
+				for (size_t i = 0; i < order.size(); ++i)
+					swap(order[i], order[(size_t)(prng.rand((u64)order.size() - i) + i)]);
+
+			// これをTHREAD_BUFFER_SIZEごとの細切れにする。(ファイル末尾のchunkでは、最後の1つはTHREAD_BUFFER_SIZEより小さい)
+			std::list<MappedSfenRange> ranges;
+			for (u64 i = 0; i < count; i += THREAD_BUFFER_SIZE)
+				ranges.push_back(MappedSfenRange{ chunk, (u32)i, (u32)std::min(i + THREAD_BUFFER_SIZE, count) });
+
+			// 範囲の用意が出来たので、poolに積む。
+			// mapped_ranges_poolの内容を変更するのでmutexのlockが必要。
+			{
+				std::unique_lock<std::mutex> lk(mutex);
+				mapped_ranges_pool.splice(mapped_ranges_pool.end(), ranges);
+			}
+		}
 	}
 
 	// ファイルの読み込み専用スレッド用
@@ -1337,6 +1536,16 @@ struct SfenReader
 			string filename = *filenames.rbegin();
 			filenames.pop_back();
 
+			// 圧縮された教師局面ファイルであれば、ブロック単位で読み込んで解凍する。
+			compressed = CompressedSfen::is_compressed_file(filename);
+			if (compressed)
+			{
+				cout << "open filename = " << filename << " (compressed)" << endl;
+				if (compressed_reader.open(filename).is_not_ok())
+					cout << "Error! : can't open file , filename = " << filename << endl;
+				return true;
+			}
+
 			fs.open(filename, ios::in | ios::binary);
 			cout << "open filename = " << filename << endl;
 			ASSERT(fs);
@@ -1360,7 +1569,23 @@ struct SfenReader
 			while (sfens.size() < SFEN_READ_SIZE)
 			{
 				PackedSfenValue p;
-				if (fs.read((char*)&p, sizeof(PackedSfenValue)))
+				if (compressed)
+				{
+					// 解凍はこのスレッドだけでなく、学習に用いるスレッド数で並列に行う。
+					// 壊れたファイルであれば、そのファイルの残りは読み飛ばす。
+					if (compressed_reader.read(sfens, SFEN_READ_SIZE - sfens.size(), packed_sfens.size()).is_not_ok())
+						cout << "Error! : broken compressed sfen file." << endl;
+					else if (!compressed_reader.eof())
+						continue;
+
+					if (!open_next_file())
+					{
+						cout << "..end of files." << endl;
+						end_of_files = true;
+						return;
+					}
+				}
+				else if (fs.read((char*)&p, sizeof(PackedSfenValue)))
 				{
 					sfens.push_back(p);
 				} else
@@ -1437,6 +1662,10 @@ struct SfenReader
 	// 局面読み込み時のシャッフルを行わない。
 	bool no_shuffle;
 
+	// 教師局面ファイルをmmapで読み込む。
+	// ifstreamで読み込んでバッファにコピーする代わりに、mapされた領域を各スレッドが直接読む。
+	bool use_mmap;
+
 	bool stop_flag;
 
 	// rmseの計算用の局面であるかどうかを判定する。
@@ -1470,6 +1699,10 @@ protected:
 	// sfenファイルのハンドル
 	std::fstream fs;
 
+	// 圧縮された教師局面ファイルを読み込んでいるのか。その時はfsの代わりにcompressed_readerから読み込む。
+	bool compressed = false;
+	CompressedSfen::Reader compressed_reader;
+
 	// 各スレッド用のsfen
 	// (使いきったときにスレッドが自らdeleteを呼び出して開放すべし。)
 	std::vector<PSVector*> packed_sfens;
@@ -1484,6 +1717,69 @@ protected:
 
 	// mse計算用の局面を学習に用いないためにhash keyを保持しておく。
 	std::unordered_set<Key> sfen_for_mse_hash;
+
+	// --- use_mmapの時に用いる
+
+	// mapした教師局面ファイルのうち、SFEN_READ_SIZE局面分の範囲。
+	// 局面そのものはコピーせず、読み出す順番(添字)だけを持ち、それをshuffleする。
+	// これを細切れにしたMappedSfenRangeが各スレッドに渡され、それらがすべて解放された時点で、
+	// この範囲の物理メモリはOSに返される。(ファイルも、すべての範囲が解放された時点でunmapされる)
+	struct MappedSfenChunk
+	{
+		MappedSfenChunk(const std::shared_ptr<MemoryMappedFile>& file_, u64 first_, u64 count)
+			: file(file_), records((const PackedSfenValue*)file_->data() + first_), first(first_), order(count)
+		{
+			for (u32 i = 0; i < (u32)count; ++i)
+				order[i] = i;
+		}
+
+		// 圧縮されたファイルから解凍した局面の時は、局面そのものを保持する。
+		MappedSfenChunk(PSVector&& sfens_)
+			: sfens(std::move(sfens_)), records(sfens.data()), first(0), order(sfens.size())
+		{
+			for (u32 i = 0; i < (u32)order.size(); ++i)
+				order[i] = i;
+		}
+
+		~MappedSfenChunk()
+		{
+			if (file)
+				file->advise(MemoryMappedFile::Advice::DontNeed, first * sizeof(PackedSfenValue), order.size() * sizeof(PackedSfenValue));
+		}
+
+		// i番目に読み出す局面
+		const PackedSfenValue& at(size_t i) const { return records[order[i]]; }
+
+		std::shared_ptr<MemoryMappedFile> file;
+
+		// 解凍した局面(圧縮されたファイルの時のみ)
+		PSVector sfens;
+
+		// この範囲の先頭の局面(mapされた領域か、sfensを指している)
+		const PackedSfenValue* records;
+
+		// この範囲の先頭がファイルの何局面目であるか。
+		u64 first;
+
+		// 読み出す順番。
+		std::vector<u32> order;
+	};
+
+	// MappedSfenChunkの[begin,end)番目に読み出す局面。スレッドはendの側から1局面ずつ取り出す。
+	struct MappedSfenRange
+	{
+		std::shared_ptr<const MappedSfenChunk> chunk;
+		u32 begin = 0, end = 0;
+
+		size_t size() const { return end - begin; }
+	};
+
+	// 各スレッド用の範囲
+	std::vector<MappedSfenRange> mapped_ranges;
+
+	// 範囲のpool。file_map_worker()はここに補充する。
+	// ※　mutexをlockしてアクセスすること。
+	std::list<MappedSfenRange> mapped_ranges_pool;
 };
 
 // 複数スレッドでsfenを生成するためのクラス
@@ -2407,6 +2703,282 @@ void shuffle_files_on_memory(const vector<string>& filenames,const string output
 	std::cout << "..shuffle_on_memory done." << std::endl;
 }
 
+// 教師局面のシャッフル "learn shufflex"コマンドの下請け。
+// メモリに乗り切らない(メモリの何倍もある)教師局面を、複数スレッドで外部シャッフルする。
+//
+// 1. 各局面を、ランダムに選んだbucket(tmp/フォルダの一時ファイル)に振り分けて書き出す。(scatter)
+//    入力ファイルはmmapして、UNIT_SIZE局面ずつの単位で各スレッドが並列に処理する。
+//    各スレッドはbucketごとのバッファに溜めて、まとめて書き出す。
+//    bucketのファイルを同時にopenする数には上限を設けて、bucketが多い時は、bucketの範囲を分けて複数passで書き出す。
+// 2. bucketごとに並列に、bucketをメモリに読み込んでFisher-Yatesでshuffleし、出力ファイルのそのbucketの位置に書き出す。
+//
+// 各単位の局面の振り分けは、その単位に固有のseedの乱数で行い、各単位が各bucketのどの位置に書き出すかも事前に求めておく。
+// bucketの数も局面数とbuffer_sizeだけから決めるので、スレッド数や処理の順番によらず、同じseedからは同じファイルが出力される。
+//
+// buffer_size : 2.で、各スレッドがメモリに読み込むbucketの局面数。bucketの数は、bucketがこれに収まるように決める。
+//               (1.での各スレッドのバッファの合計も、これを超えないようにする)
+// seed        : 乱数seed。
+void shuffle_files_external(const vector<string>& filenames, const string& output_file_name, u64 buffer_size, u64 seed, size_t thread_num)
+{
+	thread_num = std::max(thread_num, (size_t)1);
+	buffer_size = std::max(buffer_size, (u64)1);
+
+	// seedと、単位やbucketの番号から、それに固有の乱数seedを作る。(splitmix64)
+	auto make_seed = [seed](u64 salt)
+	{
+		u64 z = seed + (salt + 1) * 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return (z ^ (z >> 31)) | 1; // PRNGのseedは0であってはならない。
+	};
+
+	// 入力ファイルをmapする。
+	vector<unique_ptr<MemoryMappedFile>> files;
+	for (auto& filename : filenames)
+	{
+		auto file = make_unique<MemoryMappedFile>();
+		if (file->open(filename).is_not_ok())
+		{
+			cout << "Error! : can't map file , filename = " << filename << endl;
+			continue;
+		}
+		cout << filename << " = " << file->size() / sizeof(PackedSfenValue) << " sfens." << endl;
+
+		// 入力ファイルは先頭から順番に読む。
+		file->advise(MemoryMappedFile::Advice::Sequential);
+		files.emplace_back(std::move(file));
+	}
+
+	// 入力をUNIT_SIZE局面ずつの単位に分ける。
+	// (ファイルの末尾の、局面に満たない端数は無視する)
+	const u64 UNIT_SIZE = 1024 * 1024;
+	struct Unit
+	{
+		MemoryMappedFile* file;
+		u64 first; // ファイルの何局面目からか
+		u64 count; // 何局面か
+	};
+	vector<Unit> units;
+	u64 total = 0;
+	for (auto& file : files)
+	{
+		const u64 count = file->size() / sizeof(PackedSfenValue);
+		for (u64 first = 0; first < count; first += UNIT_SIZE)
+			units.push_back(Unit{ file.get(), first, std::min(UNIT_SIZE, count - first) });
+		total += count;
+	}
+	if (total == 0)
+	{
+		cout << "Error! : no sfens." << endl;
+		return;
+	}
+
+	// bucketの数。bucketに入る局面数がbuffer_sizeに収まるように。
+	// (bucketに入る局面数はばらつくので、1割ほど余裕を持たせておく)
+	// 出力ファイルがスレッド数によって変わらないように、スレッド数には依存させない。
+	const u64 bucket_target = std::max(buffer_size * 9 / 10, (u64)1);
+	const size_t bucket_num = (size_t)((total + bucket_target - 1) / bucket_target);
+
+	// 1.でbucketのファイルを同時にopenする数の上限。これを超える時は、bucketの範囲を分けて複数passで書き出す。
+	// (WindowsのCランタイムでは、同時にopenできるファイルの数は標準で512まで)
+	const size_t MAX_OPEN_BUCKETS = 256;
+	const size_t pass_num = (bucket_num + MAX_OPEN_BUCKETS - 1) / MAX_OPEN_BUCKETS;
+
+	cout << "total sfens     : " << total << endl
+		 << "threads         : " << thread_num << endl
+		 << "buckets         : " << bucket_num << endl
+		 << "scatter passes  : " << pass_num << endl
+		 << "seed            : " << seed << endl;
+
+	// 各単位の局面が各bucketに何局面入るかを数えて、それぞれの書き出し位置を求める。
+	// offsets[u * bucket_num + b] = 単位uの局面をbucket bに書き出す位置(bucketの先頭から何局面目か)
+	TimePoint start = now();
+	vector<u64> offsets(units.size() * bucket_num);
+	Tools::parallel_run(thread_num, [&](size_t id) {
+		for (size_t u = id; u < units.size(); u += thread_num)
+		{
+			PRNG prng(make_seed(u * 2));
+			u64* count = &offsets[u * bucket_num];
+			for (u64 i = 0; i < units[u].count; ++i)
+				count[prng.rand(bucket_num)]++;
+		}
+	});
+
+	// bucket_sizes[b] = bucket bの局面数
+	vector<u64> bucket_sizes(bucket_num);
+	for (size_t u = 0; u < units.size(); ++u)
+		for (size_t b = 0; b < bucket_num; ++b)
+		{
+			u64& offset = offsets[u * bucket_num + b];
+			const u64 count = offset;
+			offset = bucket_sizes[b];
+			bucket_sizes[b] += count;
+		}
+
+	// 1. scatter
+
+	Directory::CreateFolder("tmp");
+	auto bucket_filename = [](size_t b) { return "tmp/shufflex_" + to_string(b) + ".bin"; };
+
+	std::atomic<bool> write_error(false);
+	for (size_t pass = 0; pass < pass_num && !write_error; ++pass)
+	{
+		// このpassで書き出すbucketの範囲 [bucket_begin, bucket_end)
+		const size_t bucket_begin = pass * MAX_OPEN_BUCKETS;
+		const size_t bucket_end   = std::min(bucket_begin + MAX_OPEN_BUCKETS, bucket_num);
+		const size_t open_num     = bucket_end - bucket_begin;
+
+		// 各スレッドがbucketごとに溜めるバッファの局面数
+		const size_t flush_size = (size_t)std::clamp(buffer_size / open_num, (u64)64, (u64)8192);
+
+		vector<fstream> buckets(open_num);
+		auto bucket_mutexes = make_unique<std::mutex[]>(open_num);
+		for (size_t i = 0; i < open_num; ++i)
+		{
+			buckets[i].open(bucket_filename(bucket_begin + i), ios::out | ios::binary | ios::trunc);
+			if (!buckets[i])
+			{
+				cout << "Error! : can't open file , filename = " << bucket_filename(bucket_begin + i) << endl;
+				return;
+			}
+		}
+
+		std::atomic<size_t> next_unit(0);
+		Tools::parallel_run(thread_num, [&](size_t) {
+			vector<PSVector> bufs(open_num);
+			for (auto& buf : bufs)
+				buf.reserve(flush_size);
+
+			// 今の単位の局面をbucketに書き出す位置
+			vector<u64> cursors(open_num);
+
+			auto flush = [&](size_t i)
+			{
+				auto& buf = bufs[i];
+				if (buf.empty())
+					return;
+				{
+					std::unique_lock<std::mutex> lk(bucket_mutexes[i]);
+					buckets[i].seekp(cursors[i] * sizeof(PackedSfenValue));
+					if (!buckets[i].write((const char*)buf.data(), buf.size() * sizeof(PackedSfenValue)))
+						write_error = true;
+				}
+				cursors[i] += buf.size();
+				buf.clear();
+			};
+
+			for (size_t u = next_unit++; u < units.size(); u = next_unit++)
+			{
+				const auto& unit = units[u];
+				const auto records = (const PackedSfenValue*)unit.file->data() + unit.first;
+
+				for (size_t i = 0; i < open_num; ++i)
+					cursors[i] = offsets[u * bucket_num + bucket_begin + i];
+
+				// 局面数を数えた時と同じseedの乱数で振り分ける。このpassの範囲外のbucketに入る局面は読み飛ばす。
+				PRNG prng(make_seed(u * 2));
+				for (u64 j = 0; j < unit.count; ++j)
+				{
+					const size_t b = (size_t)prng.rand(bucket_num);
+					if (b < bucket_begin || b >= bucket_end)
+						continue;
+					const size_t i = b - bucket_begin;
+					bufs[i].push_back(records[j]);
+					if (bufs[i].size() == flush_size)
+						flush(i);
+				}
+				for (size_t i = 0; i < open_num; ++i)
+					flush(i);
+
+				// この単位はこのpassではもう読まないので物理メモリを解放してもらう。
+				unit.file->advise(MemoryMappedFile::Advice::DontNeed, unit.first * sizeof(PackedSfenValue), unit.count * sizeof(PackedSfenValue));
+			}
+		});
+
+		for (auto& bucket : buckets)
+			bucket.close();
+	}
+	files.clear();
+
+	if (write_error)
+	{
+		cout << "Error! : write error in tmp/ folder." << endl;
+		return;
+	}
+
+	const TimePoint scatter_time = now() - start + 1; // 0除算を避けるために1を足しておく。
+	cout << "scatter         : " << scatter_time / 1000.0 << "[s] , " << total * 1000 / scatter_time << " sfens/s" << endl;
+
+	// 2. bucketごとにshuffleして書き出す。
+
+	start = now();
+
+	// 出力ファイルを作っておく。各スレッドは、これを開いてそれぞれのbucketの位置に書き出す。
+	{
+		fstream fs(output_file_name, ios::out | ios::binary | ios::trunc);
+		if (!fs)
+		{
+			cout << "Error! : can't open file , filename = " << output_file_name << endl;
+			return;
+		}
+	}
+
+	// bucket_offsets[b] = bucket bを出力ファイルに書き出す位置(何局面目からか)
+	vector<u64> bucket_offsets(bucket_num);
+	for (size_t b = 1; b < bucket_num; ++b)
+		bucket_offsets[b] = bucket_offsets[b - 1] + bucket_sizes[b - 1];
+
+	std::atomic<size_t> next_bucket(0);
+	std::atomic<bool> error(false);
+	Tools::parallel_run(thread_num, [&](size_t) {
+		fstream fs(output_file_name, ios::in | ios::out | ios::binary);
+		PSVector buf;
+
+		for (size_t b = next_bucket++; b < bucket_num && !error; b = next_bucket++)
+		{
+			const u64 size = bucket_sizes[b];
+			if (size != 0)
+			{
+				buf.resize(size);
+				if (FileOperator::ReadFileToMemory(bucket_filename(b), [&](u64 file_size) {
+						return file_size == size * sizeof(PackedSfenValue) ? (void*)buf.data() : nullptr;
+					}).is_not_ok())
+				{
+					cout << "Error! : can't read file , filename = " << bucket_filename(b) << endl;
+					error = true;
+					break;
+				}
+
+				// random shuffle by Fisher-Yates algorithm
+				PRNG prng(make_seed(b * 2 + 1));
+				for (u64 i = 0; i < size; ++i)
+					swap(buf[i], buf[(u64)(prng.rand(size - i) + i)]);
+
+				// fstream::write一発では2GB以上書き出せないことがあるので、分割して書き出す。
+				fs.seekp(bucket_offsets[b] * sizeof(PackedSfenValue));
+				const u64 bytes = size * sizeof(PackedSfenValue);
+				for (u64 pos = 0; pos < bytes && fs; pos += 64 * 1024 * 1024)
+					fs.write((const char*)buf.data() + pos, (std::streamsize)std::min(bytes - pos, (u64)64 * 1024 * 1024));
+				if (!fs)
+				{
+					cout << "Error! : write error , filename = " << output_file_name << endl;
+					error = true;
+					break;
+				}
+			}
+
+			std::remove(bucket_filename(b).c_str());
+		}
+	});
+	if (error)
+		return;
+
+	const TimePoint shuffle_time = now() - start + 1;
+	cout << "shuffle & write : " << shuffle_time / 1000.0 << "[s] , " << total * 1000 / shuffle_time << " sfens/s" << endl
+		 << "total           : " << (scatter_time + shuffle_time) / 1000.0 << "[s] , " << total * 1000 / (scatter_time + shuffle_time) << " sfens/s" << endl
+		 << "..shuffle_external done." << endl;
+}
+
 void convert_bin(const vector<string>& filenames , const string& output_file_name)
 {
 	std::fstream fs;
@@ -2499,6 +3071,142 @@ void convert_plain(const vector<string>& filenames , const string& output_file_n
 	std::cout << "all done" << std::endl;
 }
 
+// 教師局面ファイル(.bin)を圧縮して、圧縮された教師局面ファイル(.binz)に書き出す。
+// "learn compress_bin"コマンドの下請け。ブロックはthread_num個のスレッドで並列に圧縮し、
+// 解凍すると元の局面に戻ることを確認してから書き出す。
+void compress_bin(const vector<string>& filenames, const string& output_file_name, size_t thread_num)
+{
+	// 1ブロックあたりの局面数。大きいほど圧縮率は上がるが、解凍の並列度は下がる。
+	const size_t BLOCK_SIZE = 100000;
+
+	fstream fs;
+	const bool need_header = !CompressedSfen::is_compressed_file(output_file_name);
+	fs.open(output_file_name, ios::out | ios::binary | ios::app);
+	if (!fs)
+	{
+		cout << "Error! : can't open file , filename = " << output_file_name << endl;
+		return;
+	}
+	if (need_header)
+		fs.write(CompressedSfen::FILE_MAGIC, sizeof(CompressedSfen::FILE_MAGIC));
+
+	u64 total = 0, total_bytes = 0;
+	TimePoint encode_time = 0;
+	for (auto filename : filenames)
+	{
+		cout << "compress " << filename << " ... ";
+
+		MemoryMappedFile file;
+		if (file.open(filename).is_not_ok())
+		{
+			cout << "Error! : can't map file , filename = " << filename << endl;
+			continue;
+		}
+		file.advise(MemoryMappedFile::Advice::Sequential);
+		auto records = (const PackedSfenValue*)file.data();
+		const u64 size = file.size() / sizeof(PackedSfenValue);
+
+		// thread_num * 4ブロックずつ並列に圧縮して、順番に書き出す。
+		for (u64 begin = 0; begin < size; begin += thread_num * 4 * BLOCK_SIZE)
+		{
+			const size_t block_num = (size_t)((std::min(size - begin, (u64)thread_num * 4 * BLOCK_SIZE) + BLOCK_SIZE - 1) / BLOCK_SIZE);
+			vector<vector<u8>> blocks(block_num);
+			std::atomic<size_t> next_block(0);
+			std::atomic<bool> error(false);
+
+			const TimePoint start = now();
+			Tools::parallel_run(std::min(thread_num, block_num), [&](size_t) {
+				PSVector decoded;
+				for (size_t i = next_block++; i < block_num; i = next_block++)
+				{
+					const u64 first = begin + i * BLOCK_SIZE;
+					const size_t count = (size_t)std::min((u64)BLOCK_SIZE, size - first);
+					CompressedSfen::encode_block(records + first, count, blocks[i]);
+
+					// 解凍して元に戻ることを確認する。
+					CompressedSfen::BlockHeader header;
+					memcpy(&header, blocks[i].data(), sizeof(header));
+					decoded.resize(count);
+					if (CompressedSfen::decode_block(header, blocks[i].data() + sizeof(header), decoded.data()).is_not_ok()
+						|| memcmp(decoded.data(), records + first, count * sizeof(PackedSfenValue)) != 0)
+						error = true;
+				}
+			});
+			encode_time += now() - start;
+
+			if (error)
+			{
+				cout << "Error! : verify failed." << endl;
+				return;
+			}
+
+			for (auto& block : blocks)
+			{
+				fs.write((const char*)block.data(), block.size());
+				total_bytes += block.size();
+			}
+		}
+		total += size;
+		cout << "done" << endl;
+	}
+	fs.close();
+
+	cout << "sfens           : " << total << endl
+		 << "bytes/sfen      : " << (total ? (double)total_bytes / total : 0) << " (" << sizeof(PackedSfenValue) << " bytes/sfen before)" << endl
+		 << "encode & verify : " << (encode_time + 1) / 1000.0 << "[s] , " << total * 1000 / (encode_time + 1) << " sfens/s" << endl
+		 << "all done" << endl;
+}
+
+// 圧縮された教師局面ファイル(.binz)を解凍して、教師局面ファイル(.bin)に書き出す。
+// "learn decompress_bin"コマンドの下請け。ブロックはthread_num個のスレッドで並列に解凍する。
+void decompress_bin(const vector<string>& filenames, const string& output_file_name, size_t thread_num)
+{
+	fstream fs;
+	fs.open(output_file_name, ios::out | ios::binary | ios::app);
+	if (!fs)
+	{
+		cout << "Error! : can't open file , filename = " << output_file_name << endl;
+		return;
+	}
+
+	u64 total = 0;
+	TimePoint decode_time = 0;
+	for (auto filename : filenames)
+	{
+		cout << "decompress " << filename << " ... ";
+
+		CompressedSfen::Reader reader;
+		if (reader.open(filename).is_not_ok())
+		{
+			cout << "Error! : not a compressed sfen file , filename = " << filename << endl;
+			continue;
+		}
+
+		PSVector sfens;
+		while (!reader.eof())
+		{
+			sfens.clear();
+			const TimePoint start = now();
+			auto result = reader.read(sfens, 1000000, thread_num);
+			decode_time += now() - start;
+			if (result.is_not_ok())
+			{
+				cout << "Error! : broken compressed sfen file , filename = " << filename << endl;
+				break;
+			}
+			if (sfens.size())
+				fs.write((const char*)&sfens[0], sizeof(PackedSfenValue) * sfens.size());
+			total += sfens.size();
+		}
+		cout << "done" << endl;
+	}
+	fs.close();
+
+	cout << "sfens           : " << total << endl
+		 << "decode          : " << (decode_time + 1) / 1000.0 << "[s] , " << total * 1000 / (decode_time + 1) << " sfens/s" << endl
+		 << "all done" << endl;
+}
+
 // 生成した棋譜からの学習
 void learn(Position&, istringstream& is)
 {
@@ -2544,10 +3252,17 @@ void learn(Position&, istringstream& is)
 	bool shuffle_quick = false;
 	// メモリにファイルを丸読みしてシャッフルする機能。(要、ファイルサイズのメモリ)
 	bool shuffle_on_memory = false;
+	// メモリに乗り切らない教師局面を複数スレッドでシャッフルする機能。(buffer_size局面分のメモリで済む)
+	bool shuffle_external = false;
+	// shuffle_externalの乱数seed。0ならランダムに決める。
+	u64 shuffle_seed = 0;
 	// packed sfenの変換。plainではsfen(string), 評価値(整数), 指し手(例：7g7f, string)、結果(負け-1、勝ち1、引き分け0)からなる
 	bool use_convert_plain = false;
 	// plain形式の教師をやねうら王のbinに変換する
 	bool use_convert_bin = false;
+	// 教師局面ファイル(.bin)を圧縮する/圧縮された教師局面ファイル(.binz)を解凍する
+	bool use_compress_bin = false;
+	bool use_decompress_bin = false;
 	// それらのときに書き出すファイル名(デフォルトでは"shuffled_sfen.bin")
 	string output_file_name = "shuffled_sfen.bin";
 
@@ -2561,6 +3276,9 @@ void learn(Position&, istringstream& is)
 	// 事前にシャッフルされているファイルを渡すならオンにすれば良い。
 	bool no_shuffle = false;
 
+	// 教師局面ファイルをmmapで読み込む。(巨大な教師局面ファイルで、読み込みがボトルネックにならないように)
+	bool use_mmap = false;
+
 #if defined (LOSS_FUNCTION_IS_ELMO_METHOD)
 	// elmo lambda
 	ELMO_LAMBDA = 0.33;
@@ -2650,11 +3368,14 @@ void learn(Position&, istringstream& is)
 		else if (option == "buffer_size") is >> buffer_size;
 		else if (option == "shuffleq")	shuffle_quick = true;
 		else if (option == "shufflem")	shuffle_on_memory = true;
+		else if (option == "shufflex")	shuffle_external = true;
+		else if (option == "shuffle_seed") is >> shuffle_seed;
 		else if (option == "output_file_name") is >> output_file_name;
 
 		else if (option == "eval_limit") is >> eval_limit;
 		else if (option == "save_only_once") save_only_once = true;
 		else if (option == "no_shuffle") no_shuffle = true;
+		else if (option == "use_mmap") use_mmap = true;
 
 #if defined(EVAL_NNUE)
 		else if (option == "nn_batch_size") is >> nn_batch_size;
@@ -2670,6 +3391,8 @@ void learn(Position&, istringstream& is)
 		// 雑巾のconvert関連
 		else if (option == "convert_plain") use_convert_plain = true;
 		else if (option == "convert_bin") use_convert_bin = true;
+		else if (option == "compress_bin") use_compress_bin = true;
+		else if (option == "decompress_bin") use_decompress_bin = true;
 		// さもなくば、それはファイル名である。
 		else
 			filenames.push_back(option);
@@ -2691,6 +3414,10 @@ void learn(Position&, istringstream& is)
 		
 		// このフォルダのファイルを根こそぎ取る。base_dir相対にしておく。
 		filenames = Directory::EnumerateFiles(kif_base_dir, ".bin");
+
+		// 圧縮された教師局面ファイルも対象とする。
+		for (auto filename : Directory::EnumerateFiles(kif_base_dir, ".binz"))
+			filenames.push_back(filename);
 	}
 
 	cout << "learn from ";
@@ -2725,6 +3452,13 @@ void learn(Position&, istringstream& is)
 		shuffle_files_on_memory(filenames,output_file_name);
 		return;
 	}
+	if (shuffle_external)
+	{
+		cout << "buffer_size     : " << buffer_size << endl;
+		cout << "external shuffle mode.." << endl;
+		shuffle_files_external(filenames, output_file_name, buffer_size, shuffle_seed ? shuffle_seed : PRNG().rand<u64>() | 1, thread_num);
+		return;
+	}
 	if (use_convert_plain)
 	{
 	  	is_ready(true);
@@ -2741,11 +3475,24 @@ void learn(Position&, istringstream& is)
 		return;
 		
 	}
+	if (use_compress_bin)
+	{
+		cout << "compress_bin.." << endl;
+		compress_bin(filenames, output_file_name, thread_num);
+		return;
+	}
+	if (use_decompress_bin)
+	{
+		cout << "decompress_bin.." << endl;
+		decompress_bin(filenames, output_file_name, thread_num);
+		return;
+	}
 
 	cout << "loop              : " << loop << endl;
 	cout << "eval_limit        : " << eval_limit << endl;
 	cout << "save_only_once    : " << (save_only_once ? "true" : "false") << endl;
 	cout << "no_shuffle        : " << (no_shuffle ? "true" : "false") << endl;
+	cout << "use_mmap          : " << (use_mmap ? "true" : "false") << endl;
 
 	// ループ回数分だけファイル名を突っ込む。
 	for (int i = 0; i < loop; ++i)
@@ -2834,6 +3581,7 @@ void learn(Position&, istringstream& is)
 	learn_think.eval_limit = eval_limit;
 	learn_think.save_only_once = save_only_once;
 	learn_think.sr.no_shuffle = no_shuffle;
+	learn_think.sr.use_mmap = use_mmap;
 	learn_think.freeze = freeze;
 	learn_think.reduction_gameply = reduction_gameply;
 #if defined(EVAL_NNUE)
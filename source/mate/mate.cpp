@@ -388,6 +388,21 @@ namespace {
 	{
 		return std::make_unique<Mate::Dfpn64::MateDfpnPn<u64,true /* 指し手Orderingあり*/, true /* with hash*/>>();
 	}
+
+	std::unique_ptr<Mate::Dfpn::MateDfpnSolverInterface> BuildNode32bitParallelSolver()
+	{
+		return std::make_unique<Mate::Dfpn32::MateDfpnPn<u32 , false /* 指し手Orderingなし*/, false /* no hash */, true /* parallel */>>();
+	}
+
+	std::unique_ptr<Mate::Dfpn::MateDfpnSolverInterface> BuildNode64bitParallelSolver()
+	{
+		return std::make_unique<Mate::Dfpn64::MateDfpnPn<u64 , false /* 指し手Orderingなし*/, false /* no hash */, true /* parallel */>>();
+	}
+
+	std::unique_ptr<Mate::Dfpn::MateDfpnSolverInterface> BuildNode48bitOrderingParallelSolver()
+	{
+		return std::make_unique<Mate::Dfpn64::MateDfpnPn<u64,true /* 指し手Orderingあり*/, false /* no hash */, true /* parallel */>>();
+	}
 }
 
 namespace Mate::Dfpn
@@ -411,6 +426,9 @@ namespace Mate::Dfpn
 		case DfpnSolverType::Node16bitOrderingWithHash: impl = BuildNode16bitOrderingWithHashSolver(); break;
 		case DfpnSolverType::Node64bitWithHash        : impl = BuildNode64bitWithHashSolver();         break;
 		case DfpnSolverType::Node48bitOrderingWithHash: impl = BuildNode48bitOrderingWithHashSolver(); break;
+		case DfpnSolverType::Node32bitParallel        : impl = BuildNode32bitParallelSolver();         break;
+		case DfpnSolverType::Node64bitParallel        : impl = BuildNode64bitParallelSolver();         break;
+		case DfpnSolverType::Node48bitOrderingParallel: impl = BuildNode48bitOrderingParallelSolver(); break;
 		}
 	}
 
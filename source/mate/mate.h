@@ -257,6 +257,11 @@ namespace Mate::Dfpn
 		// 0を指定すると制限なし。デフォルトは0。
 		virtual void set_max_game_ply(int max_game_ply) = 0;
 
+		// 探索に用いるスレッド数の設定。
+		// Node32bitParallelのような"Parallel"とついているインスタンスに対して有効。デフォルトは1。
+		// mate_dfpn()を呼び出したスレッドに加えて、(thread_num - 1)個のスレッドを生成して探索する。
+		virtual void set_thread_num(size_t thread_num) = 0;
+
 		// mate_dfpn()がMOVE_NULL,MOVE_NONE以外を返した場合にその手順を取得する。
 		// ※　最短手順である保証はない。
 		virtual std::vector<Move> get_pv() const = 0;
@@ -296,6 +301,11 @@ namespace Mate::Dfpn
 		Node64bitWithHash,
 		Node48bitOrderingWithHash,
 
+		// ガーベジなし、並列探索版(set_thread_num()でスレッド数を指定する)
+		Node32bitParallel,
+		Node64bitParallel,
+		Node48bitOrderingParallel,
+
 		// ガーベジあり
 
 		// 未実装。気が向いたら実装するが、ふかうら王で使わないと思われるのであまり気が進まない…。
@@ -335,6 +345,10 @@ namespace Mate::Dfpn
 		// 0を指定すると制限なし。デフォルトは0。
 		virtual void set_max_game_ply(int max_game_ply) { impl->set_max_game_ply(max_game_ply); }
 
+		// 探索に用いるスレッド数の設定。
+		// Node32bitParallelのような"Parallel"とついているインスタンスに対して有効。デフォルトは1。
+		virtual void set_thread_num(size_t thread_num) { impl->set_thread_num(thread_num); }
+
 		// mate_dfpn()がMOVE_NULL,MOVE_NONE以外を返した場合にその手順を取得する。
 		// ※　最短手順である保証はない。
 		virtual std::vector<Move> get_pv() const { return impl->get_pv(); }
@@ -32,6 +32,14 @@
 
 	そもそも、Node構造体は無限に増えていくので、そんなところに同期化のためのデータを保持しているのが設計上の誤り。
 	mutex事前に65536個ほどどこかに確保しておいて、Positionのhash keyの下位16bitを使って、そのmutex選んで使うなどすれば良い。
+
+	// →　並列版(MateDfpnPnのテンプレート引数Parallel == true)を実装した。
+	
+	・mutexは65536個事前に確保しておき、Node番号の下位16bitで選ぶ。(striped lock)
+	  子ノードの展開(ExpandNode)とpn,dnの集計(SummarizeNode)はこのlockを取って行う。
+	  pn,dnの読み出しはlockしない。(古い値を読むことはあるが、探索の効率が少し落ちるだけ)
+	・各スレッドは、rootから同じ木を最良優先探索する。他のスレッドが探索中の子ノードは、
+	  そのスレッド数に応じてpn(ORノード)/dn(ANDノード)を大きく見せて(virtual pn/dn)、別の子ノードを選ばせる。
 */
 
 //#define DFPN64
@@ -39,6 +47,7 @@
 #if defined(DFPN64) || defined(DFPN32)
 
 #include <mutex>
+#include <thread>
 #include "../position.h"
 #include "../thread.h"
 #include "mate_move_picker.h"
@@ -326,17 +335,18 @@ namespace Mate::Dfpn32
 
 		// Nodeをsize個分確保して、その先頭のアドレスを返す。
 		// 確保できない時はnullptrが返る。
+		// 複数スレッドから同時に呼び出しても良い。
 		NodeType* new_node(size_t size = 1)
 		{
-			//std::lock_guard<std::mutex> lk(mutex);
-			// 並列化対応はまたの機会に…。
-
 			if (is_out_of_memory())
 				return nullptr;
 
-			NodeType* node = &nodes[node_index];
-			node_index += (NodeCountType)size;
-			return node;
+			// 複数スレッドが同時にis_out_of_memory()を通過することがあるので、確保したあとにも範囲を確認する。
+			NodeCountType index = node_index.fetch_add((NodeCountType)size);
+			if ((u64)index + size > (u64)nodes_num)
+				return nullptr;
+
+			return &nodes[index];
 		}
 
 		// 内部カウンターのリセット。
@@ -351,7 +361,10 @@ namespace Mate::Dfpn32
 		}
 
 		// hash使用率を1000分率で返す。
-		int hashfull() const { return (int)((u64)node_index * 1000 / nodes_num); }
+		int hashfull() const { return (int)(std::min((u64)node_index, (u64)nodes_num) * 1000 / nodes_num); }
+
+		// Nodeのバッファ上での通し番号を返す。(並列探索の時に、Nodeに対応するmutexなどを選ぶのに使う)
+		size_t node_id(const NodeType* node) const { return size_t(node - nodes.get()); }
 
 
 #if defined(DFPN32)
@@ -419,7 +432,8 @@ namespace Mate::Dfpn32
 
 	// df-pn詰将棋ルーチン本体
 	// 事前にメモリ確保やら何やらしないといけないのでクラス化してある。
-	template <typename NodeCountType , bool MoveOrdering , bool WithHash >
+	// Parallel : trueならset_thread_num()で設定したスレッド数で並列探索する。
+	template <typename NodeCountType , bool MoveOrdering , bool WithHash , bool Parallel = false>
 	class MateDfpnPn : public Mate::Dfpn::MateDfpnSolverInterface
 	{
 	public:
@@ -462,6 +476,13 @@ namespace Mate::Dfpn32
 			node_manager.release();
 		}
 
+		// 探索に用いるスレッド数の設定。
+		// Parallel == trueのインスタンスに対してのみ有効。デフォルトは1。
+		virtual void set_thread_num(size_t thread_num)
+		{
+			this->thread_num = std::max(thread_num, (size_t)1);
+		}
+
 		// 最大探索深さ。これを超えた局面は不詰扱いとする。
 		// Position::game_ply()がこれを超えた時点で不詰扱い。
 		// 0を指定すると制限なし。デフォルトは0。
@@ -490,7 +511,43 @@ namespace Mate::Dfpn32
 			ExpandRoot(pos);
 
 			// あとはrootから良さげなところを最良優先探索するのを繰り返すだけで解けるのでは…。
-			ParallelSearch(pos);
+			// 並列探索用のlockとvirtual pn/dn用のカウンターを初回だけ確保する。
+			if (Parallel && !node_mutexes)
+			{
+				node_mutexes = std::make_unique<std::mutex[]>(NodeMutexNum);
+				node_visits  = std::make_unique<std::atomic<u16>[]>(NodeMutexNum);
+				for (size_t i = 0; i < NodeMutexNum; ++i)
+					node_visits[i] = 0;
+			}
+
+			if (Parallel && thread_num > 1)
+			{
+				// 2スレッド目以降は、それぞれが別のPositionを持ってrootから探索する。
+				// Threads.start_thinking()と同じく、rootのStateInfoをコピーして、それ以前の局面は共有する。
+				// (千日手の判定にroot以前の局面が必要なので)
+				// main threadはすぐにposで探索を始めるので、rootの局面の情報はスレッドを起動する前に取り出しておく。
+				const std::string root_sfen  = pos.sfen();
+				const StateInfo   root_state = *pos.state();
+				Thread* const     root_thread = pos.this_thread();
+
+				std::vector<std::thread> helpers;
+				for (size_t i = 1; i < thread_num; ++i)
+					helpers.emplace_back([&]() {
+						Position helper_pos;
+						StateInfo helper_state;
+						helper_pos.set(root_sfen, &helper_state, root_thread);
+						helper_state = root_state;
+
+						ParallelSearch(helper_pos);
+					});
+
+				ParallelSearch(pos);
+
+				for (auto& th : helpers)
+					th.join();
+			}
+			else
+				ParallelSearch(pos);
 
 			// 詰んだ
 			if (current_root->pn == 0 && current_root->dn >= NodeType::DNPN_MATE)
@@ -702,6 +759,7 @@ namespace Mate::Dfpn32
 				 && !out_of_memory
 				 && (!nodes_limit || nodes_searched < nodes_limit)
 				 && !Threads.stop // スレッド停止命令が来たら即座に終了する。
+				 && (!Parallel || (current_root->pn && current_root->dn)) // 他のスレッドが解いた。
 				)
 			{
 #if 0
@@ -709,12 +767,19 @@ namespace Mate::Dfpn32
 				 std::cout << pos << std::endl;
 #endif
 
-				u8 child_num = node->child_num;
-				if (child_num == NodeType::CHILDNUM_NOT_INIT)
+				// 並列探索の時は、他のスレッドが同時に同じnodeを展開しないようにlockしてから調べる。
+				bool expanded = false;
+				{
+					auto lk = lock_node(node);
+					if (node->child_num == NodeType::CHILDNUM_NOT_INIT)
+					{
+						ExpandNode<or_node>(pos, node);
+						expanded = true;
+					}
+				}
+				if (expanded)
 				{
-					ExpandNode<or_node>(pos, node);
 					// 今回はこれを展開しただけで良しとする。
-
 					continue;
 				}
 
@@ -728,10 +793,20 @@ namespace Mate::Dfpn32
 				pos.do_move(m, si);
 
 				// 再帰的に呼び出す。
+				// 並列探索の時は、このスレッドがbest_child以下を探索中であることを他のスレッドに知らせる。(virtual pn/dn用)
+				if (Parallel)
+					node_visits[node_manager.node_id(best_child) & (NodeMutexNum - 1)].fetch_add(1, std::memory_order_relaxed);
+
 				ParallelSearch<!or_node>(pos, best_child ,second_pn2 , second_dn2);
 
+				if (Parallel)
+					node_visits[node_manager.node_id(best_child) & (NodeMutexNum - 1)].fetch_sub(1, std::memory_order_relaxed);
+
 				// 子ノードから返ってきたので、子ノードのdn,pnを集計する。
-				SummarizeNode<or_node>(node);
+				{
+					auto lk = lock_node(node);
+					SummarizeNode<or_node>(node);
+				}
 
 				pos.undo_move(m);
 
@@ -758,10 +833,31 @@ namespace Mate::Dfpn32
 			 }
 		}
 
+		// 並列探索の時に、他のスレッドが探索中の子ノードのpn(ORノード)/dn(ANDノード)を、そのスレッド数に応じて大きく見せる。
+		// 並列探索でなければ、vをそのまま返す。
+		//   child : 子ノード
+		//   v     : その子ノードのpn(ORノード)/dn(ANDノード)
+		//   bound : 親nodeのsecond_pn(ORノード)/second_dn(ANDノード)
+		// v <= boundである子ノードは、大きく見せたあともbound以下に抑える。
+		// (そうしないと、boundを超えている子ノードが選ばれて即座に返ってくるのを繰り返し、探索が進まなくなる)
+		NodeCountType virtual_pn_dn(const NodeType* child, NodeCountType v, NodeCountType bound) const
+		{
+			if (!Parallel || v == 0 || v >= NodeType::DNPN_MATE)
+				return v;
+
+			u32 visits = node_visits[node_manager.node_id(child) & (NodeMutexNum - 1)].load(std::memory_order_relaxed);
+			if (visits == 0)
+				return v;
+
+			NodeCountType limit = (v <= bound) ? bound : NodeCountType(NodeType::DNPN_MATE - 1);
+			return (v > limit / (visits + 1)) ? limit : std::min(NodeCountType(v * (visits + 1)), limit);
+		}
+
 		// あるnodeの子ノードのなかから、一番良さげなNodeを選択する。
 		// OR ノードであれば、一番pnが小さい子を選ぶ。(詰みを証明しやすそうなので)
 		// ANDノードであれば、一番dnが小さい子を選ぶ。(不詰を証明しやすそうなので)
 		// second_pn , second_dn : 2番目によさげな子ノードのpn,dnの値
+		// 並列探索の時は、pn,dnの代わりにvirtual_pn_dn()の値を用いて選ぶ。
 		template <bool or_node>
 		NodeType* select_the_best_child(NodeType* node,NodeCountType& second_pn,NodeCountType& second_dn)
 		{
@@ -775,17 +871,25 @@ namespace Mate::Dfpn32
 			if (or_node)
 			{
 				// 攻め方は、一番詰やすそうな(pn最小)のところを選ぶ。
+				NodeCountType best_pn = virtual_pn_dn(&children[0], children[0].pn, second_pn);
 				for (u32 i = 1; i < child_num; ++i)
-					if (children[i].pn < children[selected_index].pn)
+				{
+					NodeCountType pn = virtual_pn_dn(&children[i], children[i].pn, second_pn);
+					if (pn < best_pn)
+					{
+						best_pn = pn;
 						selected_index = i;
+					}
+				}
 
 				// 2つ目に小さなpnを探す。selected_indexを除いて最小を探す。
 				// ※　次のノードのpnが、second_pn2を上回ったら、この2番目の子を調べたい。
 				for (u32 i = 0; i < child_num; ++i)
 					if (i != selected_index)
 					{
-						if (children[i].pn < second_pn)
-							pn2 = children[i].pn;
+						NodeCountType pn = virtual_pn_dn(&children[i], children[i].pn, second_pn);
+						if (pn < second_pn)
+							pn2 = pn;
 
 						// dnは、子ノードのdnの和になるから、次に進む子ノードのdnをdn_nextとして、残りの子ノードのdnの和が dn_sumが
 						// dn_next + dn_sum > second_dn になったら子ノードの探索を終わりたいので、
@@ -804,15 +908,23 @@ namespace Mate::Dfpn32
 			}
 			else {
 				// 受け方は、一番詰みにくそうな(dn最小)のところを選ぶ
+				NodeCountType best_dn = virtual_pn_dn(&children[0], children[0].dn, second_dn);
 				for (u32 i = 1; i < child_num; ++i)
-					if (children[i].dn < children[selected_index].dn)
+				{
+					NodeCountType dn = virtual_pn_dn(&children[i], children[i].dn, second_dn);
+					if (dn < best_dn)
+					{
+						best_dn = dn;
 						selected_index = i;
+					}
+				}
 
 				for (u32 i = 0; i < child_num; ++i)
 					if (i != selected_index)
 					{
-						if (children[i].dn < second_dn)
-							dn2 = children[i].dn;
+						NodeCountType dn = virtual_pn_dn(&children[i], children[i].dn, second_dn);
+						if (dn < second_dn)
+							dn2 = dn;
 
 						if (children[i].pn < NodeType::DNPN_MATE)
 							pn2 -= children[i].pn;
@@ -1204,6 +1316,16 @@ namespace Mate::Dfpn32
 			return node;
 		}
 
+		// 並列探索の時に、nodeに対応するmutexをlockして返す。
+		// 並列探索でなければ何もlockしない。
+		std::unique_lock<std::mutex> lock_node(const NodeType* node)
+		{
+			if (!Parallel)
+				return std::unique_lock<std::mutex>();
+
+			return std::unique_lock<std::mutex>(node_mutexes[node_manager.node_id(node) & (NodeMutexNum - 1)]);
+		}
+
 	private:
 		// 探索開始局面
 		NodeType* current_root;
@@ -1231,6 +1353,18 @@ namespace Mate::Dfpn32
 		// 詰み/不詰を証明済みの局面をcacheしておくtable
 		MateHashTable* hash_table;
 
+		// 探索に用いるスレッド数。set_thread_num()で設定された値。
+		size_t thread_num = 1;
+
+		// 並列探索の時に用いるNodeのlock。
+		// Nodeごとにmutexを持たせるとメモリを消費しすぎるので、Node番号の下位bitでこの配列の要素を選んで使う。
+		static constexpr size_t NodeMutexNum = 65536; // 2のべき乗であること。
+		std::unique_ptr<std::mutex[]> node_mutexes;
+
+		// 並列探索の時に、各Node以下をいま何スレッドが探索しているか。(virtual pn/dn用)
+		// node_mutexesと同じくNode番号の下位bitで選ぶ。
+		std::unique_ptr<std::atomic<u16>[]> node_visits;
+
 	private:
 		// Node,Childのcustom allocatorみたいなもん。
 		NodeManager<NodeCountType,MoveOrdering> node_manager;
@@ -494,6 +494,147 @@ namespace {
 #endif
 	}
 
+	// ----------------------------------
+	//      "test dfpnscalebench" command
+	// ----------------------------------
+
+	// df-pn詰将棋ルーチン(Mate::Dfpn)の並列探索版のスレッド数に対するスケーリングのbench。
+	// 問題ファイルの各局面を、スレッド数を変えながら解かせて、解くのにかかった時間とnodes/sを出力する。
+	// 1つ目のスレッド数での結果と矛盾する結果(詰みと不詰)になった局面の数も出力する。
+	//
+	// 例)
+	//   test dfpnscalebench file mate.sfen threads 1,2,4,8 nodes 10000000 mem 4096 type 32
+	//
+	//   file    : 問題ファイル。1行に1局面のsfen文字列(先頭に"sfen "が付いていても良い)。省略時は現在の局面。
+	//   threads : 計測するスレッド数をカンマ区切りで。
+	//   nodes   : 1局面あたりの探索ノード数の上限
+	//   mem     : df-pn用のメモリ[MB]
+	//   type    : solverの種類。32 : Node32bitParallel , 64 : Node64bitParallel , 48ordering : Node48bitOrderingParallel
+	void dfpn_scale_bench(Position& pos, std::istringstream& is)
+	{
+#if !defined(USE_MATE_DFPN)
+		cout << "Error! : define USE_MATE_DFPN" << endl;
+		return;
+#else
+		string filename;
+		string threads_list = "1,2,4,8";
+		size_t nodes = 10000000;
+		size_t mem = 1024;
+		string type = "32";
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "file")
+				is >> filename;
+			else if (token == "threads")
+				is >> threads_list;
+			else if (token == "nodes")
+				is >> nodes;
+			else if (token == "mem")
+				is >> mem;
+			else if (token == "type")
+				is >> type;
+		}
+
+		auto solver_type =
+			  type == "64"         ? Mate::Dfpn::DfpnSolverType::Node64bitParallel
+			: type == "48ordering" ? Mate::Dfpn::DfpnSolverType::Node48bitOrderingParallel
+			:                        Mate::Dfpn::DfpnSolverType::Node32bitParallel;
+
+		// 問題の読み込み
+		vector<string> sfens;
+		if (filename.empty())
+			sfens.push_back(pos.sfen());
+		else
+		{
+			vector<string> lines;
+			if (FileOperator::ReadAllLines(filename, lines, true).is_not_ok())
+			{
+				cout << "Error! : can't read " << filename << endl;
+				return;
+			}
+			for (auto line : lines)
+			{
+				if (StringExtension::StartsWith(line, "position "))
+					line = line.substr(9);
+				if (StringExtension::StartsWith(line, "sfen "))
+					line = line.substr(5);
+				if (!line.empty() && line[0] != '#')
+					sfens.push_back(line);
+			}
+		}
+
+		vector<size_t> threads;
+		{
+			std::istringstream ts(threads_list);
+			string t;
+			while (std::getline(ts, t, ','))
+				threads.push_back(std::max(StringExtension::to_int(t, 1), 1));
+		}
+
+		cout << "df-pn scale bench :" << endl
+			 << " problems = " << sfens.size() << endl
+			 << " threads  = " << threads_list << endl
+			 << " nodes    = " << nodes << endl
+			 << " mem      = " << mem << "[MB]" << endl
+			 << " type     = " << type << endl
+			 ;
+
+		Mate::Dfpn::MateDfpnSolver dfpn(solver_type);
+		dfpn.alloc(mem);
+
+		// 1つ目のスレッド数での各局面の結果。(MOVE_NONE : 不明 , MOVE_NULL : 不詰 , それ以外 : 詰み)
+		vector<Move> first_results;
+
+		struct Result { size_t threads; TimePoint elapsed; u64 nodes; size_t solved; size_t mismatch; };
+		vector<Result> results;
+
+		for (auto t : threads)
+		{
+			dfpn.set_thread_num(t);
+
+			Result r = { t, 0, 0, 0, 0 };
+			for (size_t i = 0; i < sfens.size(); ++i)
+			{
+				Position p;
+				StateInfo si;
+				p.set(sfens[i], &si, Threads.main());
+
+				Timer timer;
+				timer.reset();
+				Move m = dfpn.mate_dfpn(p, nodes);
+				r.elapsed += timer.elapsed();
+				r.nodes   += dfpn.get_nodes_searched();
+
+				if (m != MOVE_NONE)
+					++r.solved;
+
+				// 詰みか不詰かだけ比較する。(詰みの手順はスレッド数によって変わりうるし、
+				// ノード数の上限付近の問題は探索順によって解けたり解けなかったりするので、不明は比較しない)
+				if (results.empty())
+					first_results.push_back(m);
+				else if (m != MOVE_NONE && first_results[i] != MOVE_NONE
+					&& (m == MOVE_NULL) != (first_results[i] == MOVE_NULL))
+					++r.mismatch;
+			}
+
+			cout << "threads = " << t << " , time = " << r.elapsed << "ms , nodes = " << r.nodes
+				 << " , solved = " << r.solved << "/" << sfens.size() << endl;
+
+			results.push_back(r);
+		}
+
+		cout << "===========================" << endl
+			 << "threads , time(ms) , nodes , nodes/second , speedup(time) , solved , mismatch" << endl;
+		for (auto& r : results)
+			cout << r.threads << " , " << r.elapsed << " , " << r.nodes
+				 << " , " << 1000 * r.nodes / (r.elapsed + 1)
+				 << " , " << (double)(results[0].elapsed + 1) / (r.elapsed + 1)
+				 << " , " << r.solved << " , " << r.mismatch << endl;
+#endif
+	}
+
 	// ----------------------------------
 	//      "test matebench2" command
 	// ----------------------------------
@@ -602,6 +743,133 @@ namespace {
 
 		cout << sync_endl;
 
+#endif // !defined (TANUKI_MATE_ENGINE) && !defined(YANEURAOU_MATE_ENGINE)
+	}
+
+	// MATE ENGINEのスレッド数に対するスケーリングのbench。
+	// 問題ファイルの各局面を、スレッド数を変えながら"go mate"で解かせて、解くのにかかった時間とnodes/sを出力する。
+	//
+	// 例)
+	//   test matescalebench file mate.sfen threads 1,2,4,8 hash 1024 time 100000
+	//
+	//   file    : 問題ファイル。1行に1局面のsfen文字列(先頭に"sfen "が付いていても良い)。
+	//             省略時はmatebench2と同じ局面を用いる。
+	//   threads : 計測するスレッド数をカンマ区切りで。
+	//   hash    : 置換表のサイズ[MB]
+	//   time    : 1局面あたりの制限時間[ms]
+	void mate_scale_bench(Position& pos, std::istringstream& is)
+	{
+#if !defined (TANUKI_MATE_ENGINE) && !defined(YANEURAOU_MATE_ENGINE)
+		cout << "Error! : define TANUKI_MATE_ENGINE or YANEURAOU_MATE_ENGINE" << endl;
+#else
+		string filename;
+		string threads_list = "1,2,4,8";
+		string ttSize = "1024";
+		int time_limit = 100000;
+
+		string token;
+		while (is >> token)
+		{
+			if (token == "file")
+				is >> filename;
+			else if (token == "threads")
+				is >> threads_list;
+			else if (token == "hash")
+				is >> ttSize;
+			else if (token == "time")
+				is >> time_limit;
+		}
+
+		// 問題の読み込み
+		vector<string> sfens;
+		if (filename.empty())
+		{
+			for (const char* sfen : TestMateEngineSfen)
+				sfens.push_back(sfen);
+		}
+		else
+		{
+			vector<string> lines;
+			if (FileOperator::ReadAllLines(filename, lines, true).is_not_ok())
+			{
+				cout << "Error! : can't read " << filename << endl;
+				return;
+			}
+			for (auto line : lines)
+			{
+				if (StringExtension::StartsWith(line, "position "))
+					line = line.substr(9);
+				if (StringExtension::StartsWith(line, "sfen "))
+					line = line.substr(5);
+				if (!line.empty() && line[0] != '#')
+					sfens.push_back(line);
+			}
+		}
+
+		vector<size_t> threads;
+		{
+			std::istringstream ts(threads_list);
+			string t;
+			while (std::getline(ts, t, ','))
+				threads.push_back(std::max(StringExtension::to_int(t, 1), 1));
+		}
+
+		Options["USI_Hash"] = ttSize;
+
+		Search::LimitsType limits;
+
+		// ベンチマークモードにしておかないとPVの出力のときに置換表を漁られて探索に影響がある。
+		limits.bench = true;
+		limits.nodes = 0;
+		limits.mate = time_limit;
+		limits.enteringKingRule = EKR_NONE;
+
+		struct Result { size_t threads; TimePoint elapsed; u64 nodes; };
+		vector<Result> results;
+
+		for (auto t : threads)
+		{
+			// スレッド数を変更して、置換表などを初期化する。
+			Options["Threads"] = std::to_string(t);
+			is_ready();
+
+			u64 nodes = 0;
+			TimePoint elapsed = 0;
+
+			for (size_t i = 0; i < sfens.size(); ++i)
+			{
+				Position p;
+				StateListPtr st(new StateList(1));
+				p.set(sfens[i], &st->back(), Threads.main());
+
+				Time.reset();
+				Timer timer;
+				timer.reset();
+
+				Threads.start_thinking(p, st, limits);
+				Threads.main()->wait_for_search_finished();
+
+				const TimePoint e = timer.elapsed();
+				const u64 n = Threads.nodes_searched();
+				elapsed += e;
+				nodes   += n;
+
+				sync_cout << "matescalebench : threads = " << t << " , problem = " << (i + 1) << "/" << sfens.size()
+					<< " , time = " << e << "ms , nodes = " << n << sync_endl;
+			}
+
+			results.push_back(Result{ t, elapsed, nodes });
+		}
+
+		sync_cout << "\n==========================="
+			<< "\nProblems : " << sfens.size()
+			<< "\nthreads , time(ms) , nodes , nodes/second , speedup(time)";
+		for (auto& r : results)
+			cout << "\n" << r.threads << " , " << r.elapsed << " , " << r.nodes
+				<< " , " << 1000 * r.nodes / (r.elapsed + 1)
+				<< " , " << (double)(results[0].elapsed + 1) / (r.elapsed + 1);
+		cout << sync_endl;
+
 #endif // !defined (TANUKI_MATE_ENGINE) && !defined(YANEURAOU_MATE_ENGINE)
 	}
 
@@ -620,7 +888,9 @@ namespace Test
 		if (token == "genmate")         gen_mate(pos, is);         // N手詰みの局面を生成する。
 		else if (token == "matebench")  mate_bench(pos, is);       // 詰みルーチンに関するbenchをとる。
 		else if (token == "matebench2") mate_bench2(pos, is);      // MATE ENGINEのテスト。(ENGINEに対して局面図を送信する)
+		else if (token == "matescalebench") mate_scale_bench(pos, is); // MATE ENGINEのスレッド数に対するスケーリングのbench。
 		else if (token == "dfpn")       mate_dfpn(pos, is);        // 現在の局面に対してdf-pn詰め将棋ルーチンを呼び出す。
+		else if (token == "dfpnscalebench") dfpn_scale_bench(pos, is); // df-pn詰め将棋ルーチンの並列探索のスケーリングのbench。
 		//else if (token == "matesolve") mate_solve(pos, is);      // 現在の局面に対してN手詰みルーチンを呼び出す。
 		else return false;									       // どのコマンドも処理することがなかった
 			
@@ -34,6 +34,7 @@ extern "C" {
 //#include <iostream>
 #include <sstream>
 //#include <vector>
+#include <unordered_map>
 
 #include <ctime>	// std::ctime()
 #include <cstring>	// std::memset()
@@ -43,6 +44,26 @@ extern "C" {
 #if defined(__linux__) && !defined(__ANDROID__)
 #include <stdlib.h>
 #include <sys/mman.h> // madvise()
+#include <sched.h>        // sched_setaffinity()
+#include <sys/syscall.h>  // SYS_mbind
+#include <dirent.h>       // opendir()
+#endif
+
+#if (defined(__linux__) && !defined(__ANDROID__)) || defined(__APPLE__)
+#include <sys/file.h>     // flock()
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <fcntl.h>    // open()
+#include <unistd.h>   // close()
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>    // __get_cpuid_count()
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>   // __cpuidex(),_xgetbv()
 #endif
 
 #include "misc.h"
@@ -161,6 +182,9 @@ const string engine_info() {
 			<< ENGINE_VERSION << std::setfill('0')
 			<< (Is64Bit ? " 64" : " 32")
 			<< TARGET_CPU
+#if defined(USE_CPU_DISPATCH)
+			<< " (" << CpuId::dispatched_string() << ')'
+#endif
 #if defined(FOR_TOURNAMENT)
 			<< " TOURNAMENT"
 #endif
@@ -248,6 +272,17 @@ const std::string compiler_info() {
 
 	compiler += "\n";
 
+	// このバイナリのTARGET_CPUと、実行中のCPUについての情報
+	compiler += "\nTarget CPU     : " TARGET_CPU;
+#if defined(USE_CPU_DISPATCH)
+	compiler += " (CPU dispatch : " + CpuId::dispatched_string() + ")";
+#endif
+	compiler += "\nCPU features   : " + CpuId::features_string();
+	compiler += "\nBest target CPU: " + CpuId::best_target_cpu();
+	if (!CpuId::supports(TARGET_CPU))
+		compiler += "\nWarning! This CPU does not support TARGET_CPU = " TARGET_CPU;
+	compiler += "\n";
+
 	return compiler;
 }
 
@@ -337,6 +372,12 @@ void prefetch(void* addr) {
 namespace {
 	// LargeMemoryを使っているかどうかがわかるように初回だけその旨を出力する。
 	bool largeMemoryAllocFirstCall = true;
+
+	// LargeMemory::set_page_kind()で指定されたpageの種類
+	std::atomic<LargeMemory::PageKind> requestedPageKind(LargeMemory::PageKind::Auto);
+
+	// 直前のaligned_ttmem_alloc()で実際に用いられたpageの種類
+	std::atomic<LargeMemory::PageKind> lastPageKind(LargeMemory::PageKind::Normal);
 }
 
 /// aligned_ttmem_alloc will return suitably aligned memory, and if possible use large pages.
@@ -344,18 +385,97 @@ namespace {
 /// With c++17 some of this functionality can be simplified.
 #if defined(__linux__) && !defined(__ANDROID__)
 
+#if !defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_SHIFT 26
+#endif
+
+namespace {
+
+	// mmap(MAP_HUGETLB)で確保したメモリの先頭アドレスとサイズ。(aligned_ttmem_free()でmunmap()するために用いる)
+	std::mutex hugetlb_mutex;
+	std::unordered_map<void*, size_t> hugetlb_allocs;
+
+	// hugetlbfsのpage(page_shift == 21なら2MB、30なら1GB)でメモリを確保する。確保できなければnullptrが返る。
+	// hugetlbfsのpageは、事前に /proc/sys/vm/nr_hugepages などで予約されている分しか使えない。
+	// (MAP_NORESERVEを指定していないので、足りなければmmap()の時点で失敗する)
+	void* hugetlb_alloc(size_t allocSize, int page_shift)
+	{
+#if defined(MAP_HUGETLB)
+		const size_t page_size = size_t(1) << page_shift;
+		const size_t size = (allocSize + page_size - 1) & ~(page_size - 1);
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (page_shift << MAP_HUGE_SHIFT), -1, 0);
+		if (p == MAP_FAILED)
+			return nullptr;
+
+		std::lock_guard<std::mutex> lk(hugetlb_mutex);
+		hugetlb_allocs[p] = size;
+		return p;
+#else
+		return nullptr;
+#endif
+	}
+
+	// Transparent Huge Pagesが無効化されているか。
+	bool thp_disabled()
+	{
+		std::ifstream ifs("/sys/kernel/mm/transparent_hugepage/enabled");
+		std::string line;
+		return std::getline(ifs, line) && line.find("[never]") != std::string::npos;
+	}
+}
+
 void* aligned_ttmem_alloc(size_t allocSize, void*& mem , size_t align /* ignore */ ) {
 
-	constexpr size_t alignment = 2 * 1024 * 1024; // assumed 2MB page sizes
-	size_t size = ((allocSize + alignment - 1) / alignment) * alignment; // multiple of alignment
-	if (posix_memalign(&mem, alignment, size))
-		mem = nullptr;
-	madvise(mem, allocSize, MADV_HUGEPAGE);
+	constexpr size_t MB2 = 2 * 1024 * 1024;
+	constexpr size_t GB1 = 1024 * 1024 * 1024;
 
-	// Linux環境で、Hash TableのためにLarge Pageを確保したことを出力する。
-	if (largeMemoryAllocFirstCall)
+	using PageKind = LargeMemory::PageKind;
+	PageKind request = requestedPageKind;
+
+	// LargePageはエンジンオプションにより無効化されているなら通常のpageで確保する。
+	if (request == PageKind::Auto && !Options["LargePageEnable"])
+		request = PageKind::Normal;
+
+	// hugetlbfsのpageで確保してみる。
+	// 自動で決める時は、1GB未満の確保に1GBのpageを使うとメモリの無駄が大きいので使わない。2MBも同様。
+	mem = nullptr;
+	PageKind kind = PageKind::Normal;
+	if (request == PageKind::Huge1GB || (request == PageKind::Auto && allocSize >= GB1))
+		if ((mem = hugetlb_alloc(allocSize, 30)) != nullptr)
+			kind = PageKind::Huge1GB;
+	if (!mem && (request == PageKind::Huge2MB || (request == PageKind::Auto && allocSize >= MB2)))
+		if ((mem = hugetlb_alloc(allocSize, 21)) != nullptr)
+			kind = PageKind::Huge2MB;
+
+	// 確保できなかったなら、従来通り2MBでalignしたメモリを確保して、Transparent Huge Pagesを使ってもらう。
+	if (!mem)
 	{
-		sync_cout << "info string Hash table allocation: Linux Large Pages used." << sync_endl;
+		constexpr size_t alignment = MB2; // assumed 2MB page sizes
+		size_t size = ((allocSize + alignment - 1) / alignment) * alignment; // multiple of alignment
+		if (posix_memalign(&mem, alignment, size))
+			mem = nullptr;
+
+		if (mem && (request == PageKind::Auto || request == PageKind::Transparent) && !thp_disabled())
+		{
+			madvise(mem, allocSize, MADV_HUGEPAGE);
+			kind = PageKind::Transparent;
+		}
+		else if (mem)
+			// 明示的に通常のpageを指定された時(ベンチマーク用)は、THPが常に有効な設定であっても使わせない。
+			madvise(mem, allocSize, MADV_NOHUGEPAGE);
+	}
+	lastPageKind = kind;
+
+	// Linux環境で、Hash TableのためにLarge Pageを確保したかを出力する。
+	// 評価関数用の小さなメモリもこれで確保するので、何度も表示されると煩わしい。初回と、2MB以上の確保の時だけ出力する。
+	if (mem && (largeMemoryAllocFirstCall || allocSize >= MB2))
+	{
+		if (kind == PageKind::Normal)
+			sync_cout << "info string Hash table allocation: Linux Large Pages not used." << sync_endl;
+		else
+			sync_cout << "info string Hash table allocation: Linux Large Pages used. (" << LargeMemory::to_string(kind)
+					  << " , " << (allocSize >> 20) << "MB)" << sync_endl;
 		largeMemoryAllocFirstCall = false;
 	}
 
@@ -438,6 +558,8 @@ void* aligned_ttmem_alloc(size_t allocSize , void*& mem , size_t align /* ignore
 	// 煩わしいので、このメッセージは初回のみの出力と変更する。
 
 //	if (!firstCall)
+	lastPageKind = mem ? LargeMemory::PageKind::Huge2MB : LargeMemory::PageKind::Normal;
+
 	if (largeMemoryAllocFirstCall)
 	{
 		if (mem)
@@ -471,6 +593,7 @@ void* aligned_ttmem_alloc(size_t allocSize, void*& mem , size_t align) {
 
 	size_t size = allocSize + alignment - 1; // allocate some extra space
 	mem = malloc(size);
+	lastPageKind = LargeMemory::PageKind::Normal;
 
 	if (largeMemoryAllocFirstCall)
 	{
@@ -498,6 +621,25 @@ void aligned_ttmem_free(void* mem) {
 	}
 }
 
+#elif defined(__linux__) && !defined(__ANDROID__)
+
+void aligned_ttmem_free(void* mem) {
+
+	// hugetlbfsのpageで確保したメモリならmunmap()する。
+	{
+		std::lock_guard<std::mutex> lk(hugetlb_mutex);
+		auto it = hugetlb_allocs.find(mem);
+		if (it != hugetlb_allocs.end())
+		{
+			munmap(mem, it->second);
+			hugetlb_allocs.erase(it);
+			return;
+		}
+	}
+
+	free(mem);
+}
+
 #else
 
 void aligned_ttmem_free(void* mem) {
@@ -564,6 +706,32 @@ void LargeMemory::static_free(void* mem)
 	aligned_ttmem_free(mem);
 }
 
+// 以降のalloc()で用いるpageの種類を指定する。
+void LargeMemory::set_page_kind(PageKind kind)
+{
+	requestedPageKind = kind;
+}
+
+// 直前のalloc()で実際に用いられたpageの種類を返す。
+LargeMemory::PageKind LargeMemory::last_page_kind()
+{
+	return lastPageKind;
+}
+
+// PageKindを文字列化する。
+std::string LargeMemory::to_string(PageKind kind)
+{
+	switch (kind)
+	{
+	case PageKind::Auto       : return "auto";
+	case PageKind::Normal     : return "normal pages";
+	case PageKind::Transparent: return "transparent huge pages";
+	case PageKind::Huge2MB    : return "2MB huge pages";
+	case PageKind::Huge1GB    : return "1GB huge pages";
+	}
+	return "";
+}
+
 
 
 // --------------------
@@ -572,12 +740,247 @@ void LargeMemory::static_free(void* mem)
 
 namespace WinProcGroup {
 
-#if !defined ( _WIN32 )
+#if defined(__linux__) && !defined(__ANDROID__)
+
+	// Linux環境では、sysfsからNUMAノードの構成を調べて、sched_setaffinity()でスレッドをNUMAノードに割り当てる。
+	// メモリの配置はmbind()で指示する。(libnumaには依存しない)
+
+	// NUMAノードの構成
+	struct NumaTopology
+	{
+		// 各NUMAノードのsysfs上の番号
+		std::vector<int> node_ids;
+
+		// 各NUMAノードに属する論理プロセッサの番号。(プロセスに許可されているもののみ)
+		std::vector<std::vector<int>> cpus;
+
+		// 各NUMAノードの物理コア数
+		std::vector<int> cores;
+
+		NumaTopology()
+		{
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+				return;
+
+			DIR* dir = opendir("/sys/devices/system/node");
+			if (dir == nullptr)
+				return;
+
+			std::vector<int> ids;
+			while (auto entry = readdir(dir))
+			{
+				int id;
+				if (std::sscanf(entry->d_name, "node%d", &id) == 1)
+					ids.push_back(id);
+			}
+			closedir(dir);
+			std::sort(ids.begin(), ids.end());
+
+			for (int id : ids)
+			{
+				std::vector<int> list;
+				for (int cpu : read_cpulist("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"))
+					if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+						list.push_back(cpu);
+
+				// 許可されたプロセッサがないノード(メモリだけのノードなど)は使わない。
+				if (list.empty())
+					continue;
+
+				// (physical_package_id , core_id)が同じものは同じ物理コアである。
+				std::vector<std::pair<int, int>> core_ids;
+				for (int cpu : list)
+				{
+					const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+					core_ids.emplace_back(read_int(path + "physical_package_id"), read_int(path + "core_id"));
+				}
+				std::sort(core_ids.begin(), core_ids.end());
+				core_ids.erase(std::unique(core_ids.begin(), core_ids.end()), core_ids.end());
+
+				node_ids.push_back(id);
+				cpus.push_back(list);
+				cores.push_back((int)core_ids.size());
+			}
+		}
+
+		size_t size() const { return node_ids.size(); }
+
+		// 論理プロセッサcpuの属するNUMAノードのindex。見つからなければ-1。
+		int node_of(int cpu) const
+		{
+			for (size_t n = 0; n < cpus.size(); ++n)
+				if (std::find(cpus[n].begin(), cpus[n].end(), cpu) != cpus[n].end())
+					return (int)n;
+			return -1;
+		}
+
+	private:
+		// "0-15,32-47"のような形式のファイルを読み込む。
+		static std::vector<int> read_cpulist(const std::string& path)
+		{
+			std::vector<int> result;
+			ifstream ifs(path);
+			std::string line;
+			if (!std::getline(ifs, line))
+				return result;
+
+			std::istringstream ss(line);
+			std::string range;
+			while (std::getline(ss, range, ','))
+			{
+				int first, last;
+				const int n = std::sscanf(range.c_str(), "%d-%d", &first, &last);
+				if (n < 1)
+					continue;
+				if (n == 1)
+					last = first;
+				for (int cpu = first; cpu <= last; ++cpu)
+					result.push_back(cpu);
+			}
+			return result;
+		}
+
+		static int read_int(const std::string& path)
+		{
+			int value = -1;
+			ifstream ifs(path);
+			ifs >> value;
+			return value;
+		}
+	};
+
+	// 起動後に一度だけ調べる。
+	static const NumaTopology& numa_topology()
+	{
+		static const NumaTopology topology;
+		return topology;
+	}
+
+	// Options["NumaPolicy"]の値。オプションがなければ"interleave"とみなす。
+	static std::string numa_policy()
+	{
+		return Options.count("NumaPolicy") ? (std::string)Options["NumaPolicy"] : "interleave";
+	}
+
+	// スレッド番号idxに対して、割り当てるNUMAノードのindexを返す。-1ならOSに任せる。
+	// Windows版のbest_group()と同じく、物理コア数分ずつ順番にNUMAノードを埋めていき、
+	// それを超える分(HyperThreadingの論理コア)は各NUMAノードに均等に割り当てる。
+	static int best_node(size_t idx)
+	{
+		const auto& topology = numa_topology();
+		if (topology.size() <= 1)
+			return -1;
+
+		std::vector<int> nodes;
+		size_t threads = 0;
+		for (size_t n = 0; n < topology.size(); ++n)
+		{
+			for (int i = 0; i < topology.cores[n]; ++i)
+				nodes.push_back((int)n);
+			threads += topology.cpus[n].size();
+		}
+
+		for (size_t t = nodes.size(); t < threads; ++t)
+			nodes.push_back(int(t % topology.size()));
+
+		// 論理プロセッサ数を上回るスレッドはOSに任せる。
+		return idx < nodes.size() ? nodes[idx] : -1;
+	}
+
+	// mbind(2)のwrapper。glibcにはwrapperがないのでsyscallで呼び出す。
+	static void mbind_nodes(void* addr, size_t size, int mode, const std::vector<int>& node_ids, unsigned flags)
+	{
+		// 1024ノードまで。
+		constexpr size_t max_node = 1024;
+		unsigned long mask[max_node / (8 * sizeof(unsigned long))] = {};
+		for (int id : node_ids)
+			if (0 <= id && (size_t)id < max_node - 1)
+				mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+
+		// page境界に収まる範囲のみが対象。
+		const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+		const uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+		const uintptr_t end   = ((uintptr_t)addr + size) & ~(page - 1);
+		if (start >= end)
+			return;
+
+		// 失敗しても、OSのデフォルトの配置になるだけなので無視する。
+		syscall(SYS_mbind, (void*)start, (unsigned long)(end - start), mode, mask, (unsigned long)max_node, flags);
+	}
+
+	// <linux/mempolicy.h>の定数。(ヘッダーがない環境のために自前で定義しておく)
+	constexpr int MPOL_PREFERRED_  = 1;
+	constexpr int MPOL_INTERLEAVE_ = 3;
+	constexpr unsigned MPOL_MF_MOVE_ = 1 << 1;
+
+	// このスレッドをbindThisThread()でNUMAノードに割り当てたか。
+	// 割り当てていないスレッドは、たまたま今動いているノードにメモリを移動させても意味がないのでmoveMemoryToThisNode()は何もしない。
+	static thread_local bool bound_to_node = false;
+
+	void bindThisThread(size_t idx)
+	{
+		if (numa_policy() == "none")
+			return;
+
+		// 探索スレッドが8以下のときはOSに任せる。(Windows版のThread::idle_loop()と同じ条件)
+		// MakefileではFORCE_BIND_THIS_THREADが既定で定義されているが、Linuxではこれに関わらず、
+		// ThreadIdOffsetで割り当て先を明示したときだけ8スレッド以下でも割り当てる。
+		// (best_node()はノード0から埋めていくので、少ないスレッド数で同時に起動した複数の思考エンジンが
+		//  すべてノード0に割り当てられて、他のノードが遊んでしまう)
+		const size_t offset = Options.count("ThreadIdOffset") ? (size_t)Options["ThreadIdOffset"] : 0;
+		if (Options.count("Threads") && (size_t)Options["Threads"] <= 8 && offset == 0)
+			return;
+
+		const int node = best_node(idx + offset);
+		if (node == -1)
+			return;
+
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		for (int cpu : numa_topology().cpus[node])
+			CPU_SET(cpu, &mask);
+
+		// pid = 0なら呼び出したスレッドが対象となる。
+		bound_to_node = sched_setaffinity(0, sizeof(mask), &mask) == 0;
+	}
+
+	void interleaveMemory(void* addr, size_t size)
+	{
+		const auto& topology = numa_topology();
+		if (topology.size() <= 1 || numa_policy() != "interleave")
+			return;
+
+		mbind_nodes(addr, size, MPOL_INTERLEAVE_, topology.node_ids, MPOL_MF_MOVE_);
+	}
+
+	void moveMemoryToThisNode(void* addr, size_t size)
+	{
+		const auto& topology = numa_topology();
+		if (topology.size() <= 1 || numa_policy() == "none" || !bound_to_node)
+			return;
+
+		const int node = topology.node_of(sched_getcpu());
+		if (node == -1)
+			return;
+
+		// 他のノードのメモリが足りないときに確保に失敗しないようにMPOL_BINDではなくMPOL_PREFERREDにしておく。
+		mbind_nodes(addr, size, MPOL_PREFERRED_, { topology.node_ids[node] }, MPOL_MF_MOVE_);
+	}
+
+#elif !defined ( _WIN32 )
 
 	void bindThisThread(size_t) {}
+	void interleaveMemory(void*, size_t) {}
+	void moveMemoryToThisNode(void*, size_t) {}
 
 #else
 
+	// Windows環境では、メモリの配置はOSに任せる。
+	void interleaveMemory(void*, size_t) {}
+	void moveMemoryToThisNode(void*, size_t) {}
+
 
 	/// best_group() retrieves logical processor information using Windows specific
 	/// API and returns the best group id for the thread with index idx. Original
@@ -704,6 +1107,209 @@ namespace WinProcGroup {
 
 } // namespace WinProcGroup
 
+// --------------------
+//     CPU判別
+// --------------------
+
+namespace CpuId {
+
+	// cpuid命令で調べた拡張命令の有無
+	struct Features
+	{
+		bool sse2 = false, ssse3 = false, sse41 = false, sse42 = false, popcnt = false;
+		bool avx2 = false, bmi1 = false, bmi2 = false, fma = false;
+		bool avx512f = false, avx512bw = false, avx512dq = false, avx512vl = false;
+		bool avx512vnni = false, avxvnni = false;
+
+		// AMDのCPUであるか、そのFamily
+		bool amd = false;
+		u32 family = 0;
+
+		Features()
+		{
+#if (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))) || (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86)))
+
+			u32 max_leaf, eax, ebx, ecx, edx;
+			cpuid(0, 0, max_leaf, ebx, ecx, edx);
+			amd = ebx == 0x68747541 && edx == 0x69746e65 && ecx == 0x444d4163; // "AuthenticAMD"
+			if (max_leaf < 1)
+				return;
+
+			cpuid(1, 0, eax, ebx, ecx, edx);
+			family = ((eax >> 8) & 0xf) + (((eax >> 8) & 0xf) == 0xf ? ((eax >> 20) & 0xff) : 0);
+			sse2   = edx & (1u << 26);
+			ssse3  = ecx & (1u <<  9);
+			sse41  = ecx & (1u << 19);
+			sse42  = ecx & (1u << 20);
+			popcnt = ecx & (1u << 23);
+
+			// AVX以降の命令は、CPUが対応していてもOSがYMM/ZMMレジスタを保存しないなら使えない。
+			const bool osxsave = ecx & (1u << 27);
+			const bool avx     = ecx & (1u << 28);
+			const bool fma_    = ecx & (1u << 12);
+			const u64  xcr0    = osxsave ? xgetbv() : 0;
+			const bool os_avx    = avx && (xcr0 & 0x06) == 0x06; // XMM,YMM
+			const bool os_avx512 = os_avx && (xcr0 & 0xe0) == 0xe0; // opmask,ZMM
+
+			fma = os_avx && fma_;
+
+			if (max_leaf < 7)
+				return;
+
+			cpuid(7, 0, eax, ebx, ecx, edx);
+			const u32 max_subleaf = eax;
+			bmi1       = ebx & (1u <<  3);
+			avx2       = os_avx && (ebx & (1u << 5));
+			bmi2       = ebx & (1u <<  8);
+			avx512f    = os_avx512 && (ebx & (1u << 16));
+			avx512dq   = os_avx512 && (ebx & (1u << 17));
+			avx512bw   = os_avx512 && (ebx & (1u << 30));
+			avx512vl   = os_avx512 && (ebx & (1u << 31));
+			avx512vnni = os_avx512 && (ecx & (1u << 11));
+
+			if (max_subleaf < 1)
+				return;
+
+			cpuid(7, 1, eax, ebx, ecx, edx);
+			avxvnni = os_avx && (eax & (1u << 4));
+#endif
+		}
+
+	private:
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		static void cpuid(u32 leaf, u32 subleaf, u32& eax, u32& ebx, u32& ecx, u32& edx)
+		{
+			if (!__get_cpuid_count(leaf, subleaf, &eax, &ebx, &ecx, &edx))
+				eax = ebx = ecx = edx = 0;
+		}
+
+		// -mxsaveを指定せずにビルドできるように、xgetbv命令はinline asmで書く。
+		static u64 xgetbv()
+		{
+			u32 eax, edx;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return ((u64)edx << 32) | eax;
+		}
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		static void cpuid(u32 leaf, u32 subleaf, u32& eax, u32& ebx, u32& ecx, u32& edx)
+		{
+			int r[4];
+			__cpuidex(r, (int)leaf, (int)subleaf);
+			eax = (u32)r[0]; ebx = (u32)r[1]; ecx = (u32)r[2]; edx = (u32)r[3];
+		}
+
+		static u64 xgetbv() { return _xgetbv(0); }
+#endif
+	};
+
+	// 起動時に一度だけ調べる。
+	static const Features& features()
+	{
+		static const Features f;
+		return f;
+	}
+
+	std::string features_string()
+	{
+		const auto& f = features();
+		const std::pair<bool, const char*> list[] = {
+			{ f.sse2      , "SSE2"       }, { f.ssse3    , "SSSE3"    }, { f.sse41    , "SSE41"    },
+			{ f.sse42     , "SSE42"      }, { f.popcnt   , "POPCNT"   }, { f.avx2     , "AVX2"     },
+			{ f.bmi1      , "BMI1"       }, { f.bmi2     , "BMI2"     }, { f.fma      , "FMA"      },
+			{ f.avx512f   , "AVX512F"    }, { f.avx512bw , "AVX512BW" }, { f.avx512dq , "AVX512DQ" },
+			{ f.avx512vl  , "AVX512VL"   }, { f.avx512vnni, "AVX512VNNI" }, { f.avxvnni, "AVXVNNI" },
+		};
+
+		std::string s;
+		for (auto& it : list)
+			if (it.first)
+				s += (s.empty() ? "" : " ") + std::string(it.second);
+		return s.empty() ? "none" : s;
+	}
+
+	bool supports(const std::string& target_cpu)
+	{
+		// Makefileで、そのTARGET_CPUに対して指定している-march等で生成されうる命令が使えるかで判定する。
+		const auto& f = features();
+		const bool sse42  = f.sse2 && f.ssse3 && f.sse41 && f.sse42 && f.popcnt;
+		const bool avx2   = sse42 && f.avx2 && f.bmi1 && f.bmi2;
+		const bool avx512 = avx2 && f.fma && f.avx512f && f.avx512bw && f.avx512dq && f.avx512vl;
+
+		if (target_cpu == "AVX512VNNI")           return avx512 && f.avx512vnni;
+		if (target_cpu == "AVX512")               return avx512;
+		if (target_cpu == "AVXVNNI")              return avx2 && f.fma && f.avxvnni;
+		if (target_cpu == "AVX2" || target_cpu == "ZEN3") return avx2;
+		if (target_cpu == "ZEN1" || target_cpu == "ZEN2") return sse42 && f.avx2 && f.bmi1;
+		if (target_cpu == "SSE42")                return sse42;
+		if (target_cpu == "SSE41")                return f.sse2 && f.ssse3 && f.sse41;
+		if (target_cpu == "SSSE3")                return f.sse2 && f.ssse3;
+		if (target_cpu == "SSE2")                 return f.sse2;
+
+		// NO_SSE,OTHERは拡張命令を使わない。
+		return target_cpu == "NO_SSE" || target_cpu == "OTHER";
+	}
+
+	// CPU dispatchで選択する候補。上位のものから順に。
+	static const char* const dispatch_targets[] = {
+		"AVX512VNNI", "AVX512", "AVXVNNI", "AVX2", "SSE42", "SSE41", "SSSE3", "SSE2"
+	};
+
+	std::string best_target_cpu()
+	{
+		for (auto target : dispatch_targets)
+			if (supports(target))
+				return target;
+		return "OTHER";
+	}
+
+	bool fast_pext()
+	{
+		const auto& f = features();
+		return f.bmi2 && !(f.amd && f.family < 0x19);
+	}
+
+	bool dispatch_supports(const std::string& target_cpu)
+	{
+		if (!supports(target_cpu))
+			return false;
+
+		// 環境変数YANEURAOU_TARGET_CPUで指定されたものより上位のものは選ばない。
+		const char* limit = getenv("YANEURAOU_TARGET_CPU");
+		if (limit == nullptr || !*limit)
+			return true;
+
+		for (auto target : dispatch_targets)
+		{
+			if (std::string(limit) == target)
+				return true;
+			if (target_cpu == target)
+				return false;
+		}
+		return true;
+	}
+
+	// set_dispatched()で記録したもの
+	static std::vector<std::pair<std::string, std::string>>& dispatched()
+	{
+		static std::vector<std::pair<std::string, std::string>> list;
+		return list;
+	}
+
+	void set_dispatched(const std::string& kernel, const std::string& target)
+	{
+		dispatched().emplace_back(kernel, target);
+	}
+
+	std::string dispatched_string()
+	{
+		std::string s;
+		for (auto& it : dispatched())
+			s += (s.empty() ? "" : " ") + it.first + "=" + it.second;
+		return s;
+	}
+
+} // namespace CpuId
+
 
 // --------------------
 //  Timer
@@ -796,6 +1402,31 @@ namespace Tools
 			sync_cout << "info string " + std::string(name_) + " Clear done." << sync_endl;
 	}
 
+	// thread_num個のスレッドでf(thread_id)を並列に実行する。
+	void parallel_run(size_t thread_num, const std::function<void(size_t thread_id)>& f)
+	{
+		// 1スレッドなら、スレッドを起動するまでもない。
+		if (thread_num <= 1)
+		{
+			f(0);
+			return;
+		}
+
+		std::vector<std::thread> threads;
+		for (size_t idx = 0; idx < thread_num; idx++)
+		{
+			threads.push_back(std::thread([&f, thread_num, idx]() {
+				if (thread_num > 8)
+					WinProcGroup::bindThisThread(idx);
+
+				f(idx);
+			}));
+		}
+
+		for (std::thread& th : threads)
+			th.join();
+	}
+
 	// 途中での終了処理のためのwrapper
 	// コンソールの出力が完了するのを待ちたいので3秒待ってから::exit(EXIT_FAILURE)する。
 	void exit()
@@ -1033,6 +1664,346 @@ Tools::Result FileOperator::WriteMemoryToFile(const std::string& filename, void*
 	return Tools::Result::Ok();
 }
 
+// --- MemoryMappedFile
+
+// ファイルを読み込み専用でmapする。
+Tools::Result MemoryMappedFile::open(const std::string& filename)
+{
+	close();
+
+#if defined(_WIN32)
+
+	HANDLE hFile = ::CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return Tools::Result(Tools::ResultCode::FileOpenError);
+
+	LARGE_INTEGER file_size;
+	if (!::GetFileSizeEx(hFile, &file_size) || file_size.QuadPart == 0)
+	{
+		::CloseHandle(hFile);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	HANDLE hMap = ::CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (hMap == nullptr)
+	{
+		::CloseHandle(hFile);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	void* p = ::MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	if (p == nullptr)
+	{
+		::CloseHandle(hMap);
+		::CloseHandle(hFile);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	file_handle = hFile;
+	map_handle  = hMap;
+	ptr         = (const u8*)p;
+	size_       = (u64)file_size.QuadPart;
+
+#elif defined(__linux__) || defined(__APPLE__)
+
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return Tools::Result(Tools::ResultCode::FileOpenError);
+
+	struct stat st;
+	if (::fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		::close(fd);
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	}
+
+	void* p = ::mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	// mapしてしまえばfile descriptorは不要。
+	::close(fd);
+
+	if (p == MAP_FAILED)
+		return Tools::Result(Tools::ResultCode::FileReadError);
+
+	ptr   = (const u8*)p;
+	size_ = (u64)st.st_size;
+
+#else
+
+	// mmapのない環境。
+	return Tools::Result(Tools::ResultCode::NotImplementedError);
+
+#endif
+
+	return Tools::Result::Ok();
+}
+
+// open()でmapしたファイルをunmapする。
+void MemoryMappedFile::close()
+{
+	if (ptr == nullptr)
+		return;
+
+#if defined(_WIN32)
+	::UnmapViewOfFile(ptr);
+	::CloseHandle((HANDLE)map_handle);
+	::CloseHandle((HANDLE)file_handle);
+	map_handle = file_handle = nullptr;
+#elif defined(__linux__) || defined(__APPLE__)
+	::munmap((void*)ptr, (size_t)size_);
+#endif
+
+	ptr = nullptr;
+	size_ = 0;
+}
+
+// mapされた領域に対する今後のアクセスパターンをOSに伝える。
+void MemoryMappedFile::advise(Advice advice, u64 offset, u64 size) const
+{
+	if (ptr == nullptr || offset >= size_)
+		return;
+
+	size = std::min(size, size_ - offset);
+
+#if defined(__linux__) || defined(__APPLE__)
+
+	// madvise()に渡すアドレスはpage境界でなければならない。(mapした先頭はpage境界になっている)
+	const u64 page_size = (u64)sysconf(_SC_PAGESIZE);
+	const u64 begin = offset / page_size * page_size;
+	const u64 end   = offset + size;
+
+	int flag = MADV_NORMAL;
+	switch (advice)
+	{
+	case Advice::Sequential: flag = MADV_SEQUENTIAL; break;
+	case Advice::Random    : flag = MADV_RANDOM;     break;
+	case Advice::WillNeed  : flag = MADV_WILLNEED;   break;
+	case Advice::DontNeed  : flag = MADV_DONTNEED;   break;
+	}
+	::madvise((void*)(ptr + begin), (size_t)(end - begin), flag);
+
+#else
+	// Windowsでは、open()でFILE_FLAG_RANDOM_ACCESSを指定しているのでそれに任せる。
+	(void)advice; (void)size;
+#endif
+}
+
+// --- SharedMemory
+
+// 初期化が完了した共有メモリのheaderに書き込む値
+static const u64 SHARED_MEMORY_READY = 0x5241454e55594159ULL; // "YAYUNEAR"
+
+Tools::Result SharedMemory::open(const std::string& name, size_t size, const std::function<bool(void* ptr)>& init, bool& created)
+{
+	close();
+	created = false;
+
+#if (defined(__linux__) && !defined(__ANDROID__)) || defined(__APPLE__)
+
+	// 先頭の1pageはheader。データはpage境界から始まるようにしておく。
+	const size_t header_size = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t total_size = header_size + size;
+
+	int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT, 0600);
+	if (fd == -1)
+		return Tools::Result(Tools::ResultCode::FileOpenError);
+
+	// 使用中のプロセスは、close()するまで共有lock(LOCK_SH)を持ち続ける。
+	// close()のときに他に使用中のプロセスがなければ共有メモリを削除するため。
+	// 作成と初期化は排他lock(LOCK_EX)を取って行う。
+	// flock()のlockはプロセスが終了すると自動的に解除されるので、初期化の途中で落ちても他のプロセスが詰まることはない。
+
+	auto result = Tools::Result::Ok();
+	void* p = MAP_FAILED;
+
+	while (true)
+	{
+		::flock(fd, LOCK_SH);
+
+		struct stat st;
+		if (::fstat(fd, &st) == -1)
+		{
+			result = Tools::Result(Tools::ResultCode::FileReadError);
+			break;
+		}
+
+		// サイズの異なる同名の共有メモリは、他のプロセスが使っているかも知れないので作り直せない。
+		if (st.st_size != 0 && (size_t)st.st_size != total_size)
+		{
+			result = Tools::Result(Tools::ResultCode::FileReadError);
+			break;
+		}
+
+		// すでに初期化済みなら、読み込み専用でmapするだけで良い。
+		if ((size_t)st.st_size == total_size)
+		{
+			p = ::mmap(nullptr, total_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED)
+			{
+				result = Tools::Result(Tools::ResultCode::MemoryAllocationError);
+				break;
+			}
+			if (*(const u64*)p == SHARED_MEMORY_READY)
+				break;
+
+			// 作成直後か、初期化の途中でプロセスが終了したもの。
+			::munmap(p, total_size);
+			p = MAP_FAILED;
+		}
+
+		// 排他lockを取って初期化する。他のプロセスが初期化中(か、初期化済みかを確認中)で取れなければ、
+		// 少し待ってからやりなおす。
+		::flock(fd, LOCK_UN);
+		if (::flock(fd, LOCK_EX | LOCK_NB) == -1)
+		{
+			Tools::sleep(10);
+			continue;
+		}
+
+		// lockを取るまでの間に、他のプロセスが初期化を終えているかも知れない。
+		if (::fstat(fd, &st) == -1 || (st.st_size != 0 && (size_t)st.st_size != total_size))
+		{
+			result = Tools::Result(Tools::ResultCode::FileReadError);
+			break;
+		}
+		if (st.st_size != 0)
+		{
+			p = ::mmap(nullptr, total_size, PROT_READ, MAP_SHARED, fd, 0);
+			const bool ready = p != MAP_FAILED && *(const u64*)p == SHARED_MEMORY_READY;
+			if (p != MAP_FAILED)
+				::munmap(p, total_size);
+			p = MAP_FAILED;
+			if (ready)
+			{
+				::flock(fd, LOCK_UN);
+				continue;
+			}
+		}
+
+		if (st.st_size == 0 && ::ftruncate(fd, (off_t)total_size) == -1)
+		{
+			result = Tools::Result(Tools::ResultCode::MemoryAllocationError);
+			break;
+		}
+
+		p = ::mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			result = Tools::Result(Tools::ResultCode::MemoryAllocationError);
+			break;
+		}
+
+#if defined(__linux__)
+		// 評価関数のテーブルはランダムアクセスされるのでLarge Pageが使えるなら使って欲しい。
+		// (/sys/kernel/mm/transparent_hugepage/shmem_enabledの設定による)
+		::madvise(p, total_size, MADV_HUGEPAGE);
+#endif
+		if (!init((u8*)p + header_size))
+		{
+			::munmap(p, total_size);
+			p = MAP_FAILED;
+			::shm_unlink(name.c_str());
+			result = Tools::Result(Tools::ResultCode::SomeError);
+			break;
+		}
+
+		// 初期化が完了した印をつけて、以降は読み込み専用にする。
+		*(u64*)p = SHARED_MEMORY_READY;
+		::mprotect(p, total_size, PROT_READ);
+		created = true;
+
+		// 共有lockに切り替えて使用を続ける。
+		::flock(fd, LOCK_SH);
+		break;
+	}
+
+	if (result.is_not_ok())
+	{
+		// closeすればlockも解除される。
+		::close(fd);
+		return result;
+	}
+
+	base        = p;
+	mapped_size = total_size;
+	ptr         = (u8*)p + header_size;
+	this->fd    = fd;
+	this->name  = name;
+
+	return Tools::Result::Ok();
+
+#else
+
+	// POSIX shared memoryのない環境。
+	(void)name; (void)size; (void)init;
+	return Tools::Result(Tools::ResultCode::NotImplementedError);
+
+#endif
+}
+
+void SharedMemory::close()
+{
+	if (base == nullptr)
+		return;
+
+#if (defined(__linux__) && !defined(__ANDROID__)) || defined(__APPLE__)
+	::munmap(base, mapped_size);
+
+	// 他に使用中のプロセスがない(共有lockを持っているのが自分だけ)なら、共有メモリを削除する。
+	// 削除しないと、評価関数ファイルを差し替えたりエンジンを更新したりするたびに、古いものが/dev/shmに溜まっていく。
+	if (::flock(fd, LOCK_EX | LOCK_NB) == 0)
+	{
+		// 同名の共有メモリが他のプロセスによって作り直されているかも知れないので、
+		// 自分がmapしていたものであるときだけ削除する。
+		int fd2 = ::shm_open(name.c_str(), O_RDONLY, 0);
+		if (fd2 != -1)
+		{
+			struct stat st_self, st_name;
+			if (::fstat(fd, &st_self) == 0 && ::fstat(fd2, &st_name) == 0
+				&& st_self.st_dev == st_name.st_dev && st_self.st_ino == st_name.st_ino)
+				::shm_unlink(name.c_str());
+			::close(fd2);
+		}
+	}
+	::close(fd);
+	fd = -1;
+#endif
+
+	base = ptr = nullptr;
+	mapped_size = 0;
+	name.clear();
+}
+
+std::string SharedMemory::make_name(const std::string& prefix, const std::vector<std::string>& filenames)
+{
+	// 名前には'/'が使えず、長さの制限もあるので、full pathなどはhash値にしておく。(FNV-1a)
+	u64 h = 14695981039346656037ULL;
+	auto add = [&](const std::string& s) {
+		for (unsigned char c : s)
+			h = (h ^ c) * 1099511628211ULL;
+		h = (h ^ 0xff) * 1099511628211ULL; // 区切り
+	};
+
+	for (auto& filename : filenames)
+	{
+		add(Path::Combine(Directory::GetCurrentFolder(), filename));
+
+#if (defined(__linux__) && !defined(__ANDROID__)) || defined(__APPLE__)
+		struct stat st;
+		if (::stat(filename.c_str(), &st) == 0)
+		{
+			add(std::to_string((u64)st.st_size));
+			add(std::to_string((u64)st.st_mtime));
+		}
+#endif
+	}
+
+	std::stringstream ss;
+	ss << "/" << prefix << "_" << std::hex << std::setfill('0') << std::setw(16) << h;
+	return ss.str();
+}
+
 // --- TextFileReader
 
 // C++のifstreamが遅すぎるので、高速化されたテキストファイル読み込み器
@@ -42,6 +42,7 @@ void start_logger(bool b);
 
 // Large Pageを確保するwrapper class。
 // WindowsのLarge Pageを確保する。
+// Linuxでは、hugetlbfsのpage(1GB/2MB)をmmap(MAP_HUGETLB)で確保して、確保できなければTransparent Huge Pagesを用いる。
 // Large Pageを用いるとメモリアクセスが速くなるらしい。
 // 置換表用のメモリなどはこれで確保する。
 // cf. やねうら王、Large Page対応で10数%速くなった件 : http://yaneuraou.yaneu.com/2020/05/31/%e3%82%84%e3%81%ad%e3%81%86%e3%82%89%e7%8e%8b%e3%80%81large-page%e5%af%be%e5%bf%9c%e3%81%a710%e6%95%b0%e9%80%9f%e3%81%8f%e3%81%aa%e3%81%a3%e3%81%9f%e4%bb%b6/
@@ -74,6 +75,25 @@ struct LargeMemory
 	// static_alloc()で確保したメモリを開放する。
 	static void static_free(void* mem);
 
+	// 確保に用いたpageの種類
+	enum class PageKind {
+		Auto,        // 確保できる一番大きなpage。(set_page_kind()でのみ用いる)
+		Normal,      // 通常のpage(4KB)
+		Transparent, // LinuxのTransparent Huge Pages(OSが可能な時に2MBのpageにしてくれる)
+		Huge2MB,     // 2MBのpage。(Linuxのhugetlbfs、WindowsのLarge Page)
+		Huge1GB,     // 1GBのpage。(Linuxのhugetlbfs)
+	};
+
+	// 以降のalloc()で用いるpageの種類を指定する。デフォルトではAuto。(Linuxのみ。ベンチマーク用)
+	// 指定した種類のpageが確保できなければ、Normalで確保される。
+	static void set_page_kind(PageKind kind);
+
+	// 直前のalloc()で実際に用いられたpageの種類を返す。
+	static PageKind last_page_kind();
+
+	// PageKindを文字列化する。
+	static std::string to_string(PageKind kind);
+
 	~LargeMemory() { free(); }
 
 private:
@@ -225,6 +245,54 @@ namespace WinProcGroup {
 	// 1つ目のプロセッサをまず使い切るようにgroup affinityを割り当てる。
 	// 1つ目のプロセッサの論理コアを使い切ったら次は2つ目のプロセッサを使っていくような動作。
 	void bindThisThread(size_t idx);
+
+	// Linux環境で、[addr,addr+size)のメモリを全NUMAノードに均等(interleave)に割り当てるように指示する。
+	// 置換表のように全スレッドから参照されるメモリを、初回のアクセス(ゼロクリア)の前に呼び出す。
+	// Options["NumaPolicy"]が"interleave"でないとき、NUMAノードが1つのとき、Linux以外の環境では何もしない。
+	void interleaveMemory(void* addr, size_t size);
+
+	// Linux環境で、[addr,addr+size)のメモリを、このスレッドが動作しているNUMAノードに移動させる。
+	// bindThisThread()のあとに、そのスレッドだけが参照するメモリ(Threadクラスのhistoryなど)に対して呼び出す。
+	// page境界に収まる部分のみが対象となる。Options["NumaPolicy"]が"none"のとき、Linux以外の環境では何もしない。
+	void moveMemoryToThisNode(void* addr, size_t size);
+}
+
+// --------------------
+//     CPU判別
+// --------------------
+
+// 実行しているCPUで利用できる拡張命令をcpuid命令で調べる。
+// TARGET_CPUの名前(Makefileで指定するもの)単位で扱う。
+namespace CpuId {
+
+	// 実行中のCPUで利用できる拡張命令を列挙した文字列を返す。
+	// 例) "SSE2 SSSE3 SSE41 SSE42 POPCNT AVX2 BMI2 FMA"
+	std::string features_string();
+
+	// 実行中のCPUで、TARGET_CPUとしてtarget_cpuを指定してビルドした実行ファイルが動作するか。
+	// target_cpuは"AVX2"などMakefileのTARGET_CPUに指定する名前。
+	bool supports(const std::string& target_cpu);
+
+	// 実行中のCPUで動作するTARGET_CPUのうち、最上位のものを返す。
+	// "AVX512VNNI","AVX512","AVXVNNI","AVX2","SSE42","SSE41","SSSE3","SSE2","OTHER"のいずれか。
+	std::string best_target_cpu();
+
+	// PEXT命令(BMI2)が使えて、かつ速いCPUであるか。
+	// AMDのZen/Zen2(Family 17h)はPEXT命令がmicrocodeで実装されていて遅いのでfalse。
+	bool fast_pext();
+
+	// CPU dispatch用のビルド(USE_CPU_DISPATCH)で、TARGET_CPUがtarget_cpuであるコードを選んで良いか。
+	// 実行中のCPUで動作して、かつ、環境変数YANEURAOU_TARGET_CPUが設定されているなら、その名前のCPU以下であるものだけを選ぶ。
+	// (YANEURAOU_TARGET_CPU=SSE42のようにして、上位のCPU向けのコードを使わないようにできる)
+	bool dispatch_supports(const std::string& target_cpu);
+
+	// CPU dispatchで選択したものを記録する。
+	// 例) set_dispatched("NNUE","AVX2")
+	void set_dispatched(const std::string& kernel, const std::string& target);
+
+	// set_dispatched()で記録したものを列挙した文字列を返す。"compiler","usi"コマンドで表示する。
+	// 例) "NNUE=AVX2 Bitboard=PEXT"
+	std::string dispatched_string();
 }
 
 // -----------------------
@@ -319,6 +387,48 @@ namespace Tools
 	// name == nullptrのとき、途中経過は表示しない。
 	extern void memclear(const char* name, void* table, size_t size);
 
+	// thread_num個のスレッドを起動して、それぞれのスレッドでf(thread_id)を呼び出し、すべて終了するまで待つ。
+	// thread_idは0～thread_num-1。thread_num > 8のときは、memclear()と同じくスレッドをNUMA nodeに割り当てる。
+	extern void parallel_run(size_t thread_num, const std::function<void(size_t thread_id)>& f);
+
+	// 配列vを、thread_num個のスレッドで並列にsortする。
+	// 範囲をthread_num個に分けてそれぞれstd::sort()したあと、隣接する範囲同士を並列にstd::inplace_merge()していく。
+	template <typename T, typename Compare>
+	void parallel_sort(std::vector<T>& v, size_t thread_num, Compare comp)
+	{
+		thread_num = std::max(std::min(thread_num, v.size() / 1024), (size_t)1);
+		if (thread_num == 1)
+		{
+			std::sort(v.begin(), v.end(), comp);
+			return;
+		}
+
+		// i番目の範囲の先頭
+		std::vector<size_t> bounds(thread_num + 1);
+		for (size_t i = 0; i <= thread_num; ++i)
+			bounds[i] = v.size() * i / thread_num;
+
+		parallel_run(thread_num, [&](size_t id) {
+			std::sort(v.begin() + bounds[id], v.begin() + bounds[id + 1], comp);
+		});
+
+		// 隣接する範囲を2つずつmergeしていく。
+		while (bounds.size() > 2)
+		{
+			const size_t merge_num = (bounds.size() - 1) / 2;
+			parallel_run(merge_num, [&](size_t id) {
+				std::inplace_merge(v.begin() + bounds[id * 2], v.begin() + bounds[id * 2 + 1], v.begin() + bounds[id * 2 + 2], comp);
+			});
+
+			std::vector<size_t> next;
+			for (size_t i = 0; i < bounds.size(); i += 2)
+				next.push_back(bounds[i]);
+			if (next.back() != bounds.back())
+				next.push_back(bounds.back());
+			bounds.swap(next);
+		}
+	}
+
 	// insertion sort
 	// 昇順に並び替える。学習時のコードで使いたい時があるので用意してある。
 	template <typename T >
@@ -543,6 +653,117 @@ private:
 };
 
 
+// --------------------
+//  Memory Mapped File
+// --------------------
+
+// ファイルを読み込み専用でメモリにmapする。
+// ・ファイルを丸読みしないので、巨大なファイルでもopen()は一瞬で終わる。(実際の読み込みはアクセスした時にOSが行う)
+// ・同じファイルを複数のプロセスがmapした場合、物理メモリはOSによって共有される。
+// ・map中の領域は読み込み専用であり、複数スレッドから同時にアクセスして問題ない。
+struct MemoryMappedFile
+{
+	MemoryMappedFile() {}
+	~MemoryMappedFile() { close(); }
+
+	// コピーされると二重にunmapされてしまうので禁止。
+	MemoryMappedFile(const MemoryMappedFile&) = delete;
+	MemoryMappedFile& operator=(const MemoryMappedFile&) = delete;
+
+	// ファイルを読み込み専用でmapする。すでにopenしているファイルがあればcloseしてから開く。
+	// サイズ0のファイルはmapできないのでFileReadErrorとなる。
+	Tools::Result open(const std::string& filename);
+
+	// open()でmapしたファイルをunmapする。
+	void close();
+
+	// mapされているか。
+	bool is_open() const { return ptr != nullptr; }
+
+	// mapされた領域の先頭アドレス
+	const u8* data() const { return ptr; }
+
+	// mapされたファイルのサイズ[byte]
+	u64 size() const { return size_; }
+
+	// mapされた領域に対する今後のアクセスパターン
+	enum class Advice {
+		Sequential, // 先頭から順番にアクセスする。(OSに先読みを多めにしてもらう)
+		Random,     // ランダムにアクセスする。(先読みは無駄になる)
+		WillNeed,   // 近いうちにアクセスする。(非同期で読み込みを開始してもらう)
+		DontNeed,   // もうアクセスしない。(物理メモリを解放してもらう)
+	};
+
+	// [offset, offset + size)の範囲に対する今後のアクセスパターンをOSに伝える。(Linux/Macのmadvise())
+	// 性能上のヒントに過ぎないので、失敗しても、対応していない環境でも何もしない。
+	// 範囲はpage境界に広げてから渡す。
+	void advise(Advice advice, u64 offset = 0, u64 size = UINT64_MAX) const;
+
+private:
+	const u8* ptr = nullptr;
+	u64 size_ = 0;
+
+#if defined(_WIN32)
+	// CreateFile()とCreateFileMapping()のHANDLE。windows.hをincludeしたくないのでvoid*で持つ。
+	void* file_handle = nullptr;
+	void* map_handle = nullptr;
+#endif
+};
+
+// --------------------
+//  プロセス間の共有メモリ
+// --------------------
+
+// 複数のプロセスで同じ内容のデータを共有するためのメモリ。(Linux/Mac用。POSIX shared memoryを用いる)
+// 同じ評価関数ファイルを読み込んだ評価関数のパラメーターを、同時に起動した複数の思考エンジンで共有するのに用いる。
+// ・最初のプロセスが作成して内容を初期化する。以降のプロセスはそれをmapするだけなので、物理メモリは1つ分で済む。
+// ・初期化が終わったあとは読み込み専用でmapされる。
+// ・共有メモリはすべてのプロセスが終了しても(OSを再起動するまで)/dev/shm以下に残る。
+// ※　Windowsでは、評価関数側でCreateFileMapping()を用いて同等のことをしている。
+struct SharedMemory
+{
+	SharedMemory() {}
+	~SharedMemory() { close(); }
+
+	// コピーされると二重にunmapされてしまうので禁止。
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	// nameで識別されるsizeバイトの共有メモリをmapする。すでにmapしているものがあればcloseしてから開く。
+	// まだどのプロセスも作成していなければ、作成してinit(ptr)を呼び出して内容を初期化する。
+	// (作成と初期化はプロセス間で排他される。初期化の途中でプロセスが終了した場合は、次のプロセスが初期化しなおす)
+	// init()がfalseを返したときは、共有メモリを削除してSomeErrorを返す。
+	// created : 作成して初期化したならtrue、他のプロセスが作成したものをmapしたならfalseが返る。
+	// 共有メモリに対応していない環境ではNotImplementedErrorを返す。
+	Tools::Result open(const std::string& name, size_t size, const std::function<bool(void* ptr)>& init, bool& created);
+
+	// open()でmapした共有メモリをunmapする。
+	// 他にこの共有メモリを使用中のプロセスがなければ、共有メモリ自体も削除する。
+	void close();
+
+	// mapされているか。
+	bool is_open() const { return ptr != nullptr; }
+
+	// mapされた領域の先頭アドレス。page sizeでalignされている。
+	void* data() const { return ptr; }
+
+	// prefix + ファイルのfull path、サイズ、更新日時から共有メモリの名前を作る。
+	// ファイルが更新されると別の名前になるので、古い内容の共有メモリが使われることはない。
+	static std::string make_name(const std::string& prefix, const std::vector<std::string>& filenames);
+
+private:
+	// mapされた領域全体。先頭のpageは初期化済みかどうかを表すheaderとして使う。
+	void* base = nullptr;
+	size_t mapped_size = 0;
+
+	// headerの直後。open()で指定したsizeバイトの領域
+	void* ptr = nullptr;
+
+	// 共有メモリのfile descriptorと名前。使用中であることを示す共有lockを持つために、close()するまで開いておく。
+	int fd = -1;
+	std::string name;
+};
+
 // --------------------
 //    PRNGのasync版
 // --------------------
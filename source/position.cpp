@@ -1746,6 +1746,10 @@ void Position::do_null_move(StateInfo& newSt) {
 #if defined(EVAL_NNUE)
 	// NNUEの場合、KPPT型と違って、手番が違う場合、計算なしに済ますわけにはいかない。
 	st->accumulator.computed_score = false;
+
+	// 駒は動いていない。(前の局面のdirtyPieceがコピーされているので、
+	// 差分計算で何手か遡ったときに、前の局面の指し手を二重に適用してしまわないようにしておく。)
+	st->dirtyPiece.dirty_num = 0;
 #endif
 
 	st->board_key_ ^= Zobrist::side;
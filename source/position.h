@@ -555,6 +555,14 @@ public:
 
 	// 盤面と手駒、手番を与えて、そのsfenを返す。
 	static std::string sfen_from_rawdata(Piece board[81], Hand hands[2], Color turn, int gamePly);
+
+	// 盤面(玉を含む)と手駒、手番を与えて、それをpackしたものを返す。
+	// 玉がいない時は、その玉の位置はSQ_NBとしてpackされる。(set_from_packed_sfen()で玉なしとして復元される)
+	static void sfen_pack_from_rawdata(const Piece board[81], const Hand hands[2], Color turn, PackedSfen& sfen);
+
+	// packされたsfenを、盤面(玉を含む)と手駒、手番に解凍する。
+	// 不正なデータ(256bitにぴったり収まっていないなど)であればfalseを返す。
+	static bool sfen_unpack_to_rawdata(const PackedSfen& sfen, Piece board[81], Hand hands[2], Color& turn);
 #endif
 
 	// -- 利き
@@ -76,7 +76,13 @@ void Thread::idle_loop() {
 	// "Threads"というオプションがない時は、強制的にbindThisThread()しておいていいと思う。(使うスレッド数がここではわからないので..)
 	if (Options.count("Threads")==0 || Options["Threads"] > 8)
 #endif
+	{
 		WinProcGroup::bindThisThread(idx);
+
+		// このスレッドのhistory等は、このスレッドしか参照しないので、このスレッドのNUMAノードに移動させる。
+		// (Threadはmainスレッドでnewされるので、そのままだとmainスレッドのノードに配置されうる)
+		WinProcGroup::moveMemoryToThisNode(this, sizeof(*this));
+	}
 		// このifを有効にすると何故かNUMA環境のマルチスレッド時に弱くなることがある気がする。
 		// (長い時間対局させ続けると安定するようなのだが…)
 		// 上の投稿者と条件が何か違うのだろうか…。
@@ -230,6 +236,9 @@ void ThreadPool::start_thinking(const Position& pos, StateListPtr& states ,
 		// Stockfish12のこのコード、bestMoveChangesがatomic型なのでそこからint型に代入してることになってコンパイラが警告を出す。
 		// ↓のように書いたほうが良い。
 		th->nodes = th->bestMoveChanges = /* th->tbHits = */ th->nmpMinPly = 0;
+#if defined(USE_EVAL_HASH) && defined(EVAL_NNUE)
+		th->evalHashProbes = th->evalHashHits = 0;
+#endif
 
 		th->rootDepth = th->completedDepth = 0;
 		th->rootMoves = rootMoves;
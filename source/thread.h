@@ -99,6 +99,12 @@ public:
  	// bestMoveChanges : 反復深化においてbestMoveが変わった回数。nodeの安定性の指標として用いる。全スレ分集計して使う。
 	std::atomic<uint64_t> nodes,/* tbHits,*/ bestMoveChanges;
 
+#if defined(USE_EVAL_HASH) && defined(EVAL_NNUE)
+	// evalHashProbes : このスレッドがEvalHashを調べた回数
+	// evalHashHits   : そのうちhitした回数
+	std::atomic<uint64_t> evalHashProbes, evalHashHits;
+#endif
+
 
 	// 探索開始局面
 	Position rootPos;
@@ -234,6 +240,12 @@ struct ThreadPool: public std::vector<Thread*>
 	// 今回、goコマンド以降に探索したノード数
 	uint64_t nodes_searched() { return accumulate(&Thread::nodes); }
 
+#if defined(USE_EVAL_HASH) && defined(EVAL_NNUE)
+	// 今回、goコマンド以降にEvalHashを調べた回数と、hitした回数
+	uint64_t eval_hash_probes() { return accumulate(&Thread::evalHashProbes); }
+	uint64_t eval_hash_hits() { return accumulate(&Thread::evalHashHits); }
+#endif
+
 	// 探索終了時に、一番良い探索ができていたスレッドを選ぶ。
 	Thread* get_best_thread() const;
 
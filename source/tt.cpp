@@ -1,4 +1,5 @@
 ﻿#include <cstring>	// std::memset()
+#include <sstream>	// std::ostringstream
 #include "misc.h"
 #include "thread.h"
 #include "tt.h"
@@ -104,6 +105,9 @@ void TranspositionTable::resize(size_t mbSize) {
 
 	clusterCount = newClusterCount;
 
+	// 確保しなおした置換表はクリアしないといけない。
+	keep_on_next_clear = false;
+
 	// tableはCacheLineSizeでalignされたメモリに配置したいので、CacheLineSize-1だけ余分に確保する。
 	// callocではなくmallocにしないと初回の探索でTTにアクセスするとき、特に巨大なTTだと
 	// 極めて遅くなるので、mallocで確保して自前でゼロクリアすることでこれを回避する。
@@ -112,6 +116,10 @@ void TranspositionTable::resize(size_t mbSize) {
 	// Large Pageを確保する。ランダムメモリアクセスが5%程度速くなる。
 	table = static_cast<Cluster*>(tt_memory.alloc(clusterCount * sizeof(Cluster),32));
 
+	// NUMA環境では、全スレッドから均等にアクセスされるので全ノードに分散して配置する。
+	// (Options["NumaPolicy"]が"local"なら、clear()で各スレッドがゼロクリアした部分がそのスレッドのノードに配置される)
+	WinProcGroup::interleaveMemory(table, clusterCount * sizeof(Cluster));
+
 	// clear();
 
 	// →　Stockfish、ここでclear()呼び出しているが、Search::clear()からTT.clear()を呼び出すので
@@ -131,6 +139,13 @@ void TranspositionTable::clear()
 	return;
 #endif
 
+	// load()で読み込んだ直後なので、クリアせずに残す。
+	if (keep_on_next_clear)
+	{
+		keep_on_next_clear = false;
+		return;
+	}
+
 	auto size = clusterCount * sizeof(Cluster);
 
 #if !defined(EVAL_LEARN)
@@ -284,3 +299,223 @@ void TranspositionTable::init_tt_per_thread()
 	}
 }
 #endif
+
+// -----------------------------------
+//   置換表の保存と読み込み
+// -----------------------------------
+
+namespace {
+
+	// 置換表のファイルのheader。このあとにClusterの配列が続く。
+	struct TTFileHeader
+	{
+		char magic[8];      // TT_FILE_MAGIC
+		u32 hash_key_bits;  // HASH_KEY_BITS
+		u32 cluster_size;   // sizeof(Cluster)
+		u64 cluster_count;  // 置換表のClusterの数
+		u64 hirate_key;     // 平手の初期局面のhash key(の下位64bit)。Zobrist Keyが同じであるかの確認用。
+		u32 entry_version;  // TT_ENTRY_VERSION
+		u8  generation8;    // 保存した時の世代カウンター
+		u8  padding[3];
+		char engine[48];    // engine_id()。エディション(評価関数の種類)とバージョンが同じであるかの確認用。
+	};
+
+	constexpr char TT_FILE_MAGIC[8] = { 'Y','O','T','T','F','I','L','2' };
+
+	// エンジン名、評価関数の種類、バージョンを並べた文字列。(TTFileHeader::engineに収まるように切り詰める)
+	// 評価関数が異なれば格納されている評価値の意味が異なり、バージョンが異なれば探索部の使い方が異なるかも知れない。
+	std::string engine_id()
+	{
+		std::ostringstream oss;
+		oss << ENGINE_NAME << ' ' << EVAL_TYPE_NAME << ' ' << ENGINE_VERSION;
+		return oss.str().substr(0, sizeof(TTFileHeader::engine) - 1);
+	}
+
+	// 平手の初期局面のhash key
+	u64 hirate_key()
+	{
+		Position pos;
+		StateInfo si;
+		pos.set_hirate(&si, Threads.main());
+		return (u64)pos.key();
+	}
+}
+
+// 置換表の内容をファイルに保存する。
+Tools::Result TranspositionTable::save(const std::string& filename) const
+{
+	if (clusterCount == 0)
+	{
+		sync_cout << "Error! : TT is not allocated. 'isready' is needed." << sync_endl;
+		return Tools::Result(Tools::ResultCode::SomeError);
+	}
+
+	TTFileHeader header = {};
+	memcpy(header.magic, TT_FILE_MAGIC, sizeof(TT_FILE_MAGIC));
+	header.hash_key_bits = HASH_KEY_BITS;
+	header.cluster_size  = (u32)sizeof(Cluster);
+	header.cluster_count = clusterCount;
+	header.hirate_key    = hirate_key();
+	header.entry_version = TT_ENTRY_VERSION;
+	header.generation8   = generation8;
+	const std::string engine = engine_id();
+	memcpy(header.engine, engine.c_str(), engine.size());
+
+	std::ofstream fs(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!fs)
+		return Tools::Result(Tools::ResultCode::FileOpenError);
+
+	fs.write((const char*)&header, sizeof(header));
+
+	// 巨大なので64MBずつ書き出す。
+	const u64 size = clusterCount * sizeof(Cluster);
+	for (u64 pos = 0; pos < size && fs; pos += 64 * 1024 * 1024)
+		fs.write((const char*)table + pos, (std::streamsize)std::min(size - pos, (u64)64 * 1024 * 1024));
+
+	fs.close();
+	return fs ? Tools::Result::Ok() : Tools::Result(Tools::ResultCode::FileWriteError);
+}
+
+// save()で保存したファイルをmmapして、置換表に読み込む。
+Tools::Result TranspositionTable::load(const std::string& filename)
+{
+	if (clusterCount == 0)
+	{
+		sync_cout << "Error! : TT is not allocated. 'isready' is needed." << sync_endl;
+		return Tools::Result(Tools::ResultCode::SomeError);
+	}
+
+	MemoryMappedFile file;
+	auto result = file.open(filename);
+	if (result.is_not_ok())
+		return result;
+
+	TTFileHeader header;
+	if (file.size() < sizeof(header))
+		return Tools::Result(Tools::ResultCode::FileReadError);
+	memcpy(&header, file.data(), sizeof(header));
+
+	// 保存した時と、hash keyの方式、置換表の構造とサイズが一致しなければ、読み込んでも使えない。
+	auto mismatch = [&](const std::string& mes) {
+		sync_cout << "Error! : " << mes << " mismatch , filename = " << filename << sync_endl;
+		return Tools::Result(Tools::ResultCode::SomeError);
+	};
+	if (memcmp(header.magic, TT_FILE_MAGIC, sizeof(TT_FILE_MAGIC)) != 0)
+		return mismatch("file format");
+	if (header.hash_key_bits != HASH_KEY_BITS)
+		return mismatch("HASH_KEY_BITS (file = " + std::to_string(header.hash_key_bits) + ")");
+	if (header.cluster_size != sizeof(Cluster))
+		return mismatch("TT cluster size (file = " + std::to_string(header.cluster_size) + ")");
+	if (header.entry_version != TT_ENTRY_VERSION)
+		return mismatch("TTEntry version (file = " + std::to_string(header.entry_version) + ")");
+	header.engine[sizeof(header.engine) - 1] = '\0';
+	if (engine_id() != header.engine)
+		return mismatch("engine edition/version (file = " + std::string(header.engine) + ")");
+	if (header.hirate_key != hirate_key())
+		return mismatch("Zobrist key");
+	if (header.cluster_count != clusterCount)
+		return mismatch("USI_Hash (file = " + std::to_string(header.cluster_count * sizeof(Cluster) / (1024 * 1024)) + "[MB])");
+
+	const u64 size = clusterCount * sizeof(Cluster);
+	if (file.size() != sizeof(header) + size)
+		return Tools::Result(Tools::ResultCode::FileReadError);
+
+	// 巨大なので、探索スレッドと同じ数のスレッドで分担してコピーする。
+	file.advise(MemoryMappedFile::Advice::Sequential);
+	const size_t thread_num = std::max(Threads.size(), (size_t)1);
+	const u8* src = file.data() + sizeof(header);
+	Tools::parallel_run(thread_num, [&](size_t id) {
+		const u64 begin = size * id / thread_num;
+		const u64 end = size * (id + 1) / thread_num;
+		memcpy((u8*)table + begin, src + begin, end - begin);
+	});
+
+	generation8 = header.generation8;
+	keep_on_next_clear = true;
+
+	return Tools::Result::Ok();
+}
+
+#if defined(ENABLE_TEST_CMD)
+
+#include <memory>
+#include <sstream>
+
+namespace Test
+{
+	// pageの種類ごとに置換表を確保して、probe()の速度(probes/s)を比較する。
+	// hugetlbfsのpageが予約されていないなど、確保できなかったpageの種類はskipする。
+	static void tt_probe_bench(std::istringstream& is)
+	{
+#if defined(TANUKI_MATE_ENGINE) || defined(YANEURAOU_MATE_ENGINE)
+		// MateEngineではこの置換表は確保されない。
+		sync_cout << "Error! : this engine does not use TT." << sync_endl;
+#else
+		// 置換表のサイズ[MB]、probe()する回数
+		size_t hash_mb = 1024;
+		u64 loop_max = 10000000;
+
+		std::string token;
+		while (is >> token)
+		{
+			if (token == "hash")
+				is >> hash_mb;
+			else if (token == "loop")
+				is >> loop_max;
+		}
+
+		sync_cout << "tt probe bench : hash = " << hash_mb << "[MB] , loop = " << loop_max << sync_endl;
+
+		using PageKind = LargeMemory::PageKind;
+		for (auto kind : { PageKind::Normal, PageKind::Transparent, PageKind::Huge2MB, PageKind::Huge1GB })
+		{
+			// 探索で用いているTTとは別に確保する。
+			LargeMemory::set_page_kind(kind);
+			auto tt = std::make_unique<TranspositionTable>();
+			tt->resize(hash_mb);
+			const PageKind obtained = LargeMemory::last_page_kind();
+			LargeMemory::set_page_kind(PageKind::Auto);
+
+			if (obtained != kind)
+			{
+				sync_cout << LargeMemory::to_string(kind) << " : not available." << sync_endl;
+				continue;
+			}
+
+			// ゼロクリアでpageをすべて割り当てておく。
+			tt->clear();
+
+			PRNG prng(20201017);
+			u64 found_count = 0;
+			const TimePoint start = now();
+			for (u64 i = 0; i < loop_max; ++i)
+			{
+				bool found;
+				tt->probe(prng.rand<Key>(), found);
+				found_count += found;
+			}
+			const TimePoint elapsed = now() - start + 1;
+
+			sync_cout << LargeMemory::to_string(kind) << " : " << elapsed << "[ms] , "
+				<< loop_max * 1000 / elapsed << " probes/s (found = " << found_count << ")" << sync_endl;
+		}
+
+#if defined(EVAL_LEARN)
+		// 別に確保したTTのresize()でスレッドごとのTTが差し替えられたので、元に戻す。
+		TT.init_tt_per_thread();
+#endif
+#endif
+	}
+
+	// 置換表関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool tt_test_cmd(Position& pos, std::istringstream& is, const std::string& token)
+	{
+		if (token == "ttprobebench") tt_probe_bench(is); // pageの種類ごとの置換表のprobe()の速度の計測。
+		else return false;                               // どのコマンドも処理することがなかった
+
+		// いずれかのコマンドを処理した。
+		return true;
+	}
+}
+
+#endif // defined(ENABLE_TEST_CMD)
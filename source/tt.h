@@ -68,6 +68,11 @@ private:
 	uint8_t depth8;
 };
 
+// TTEntryのメンバの並びと、格納している値の意味(bitの割り当てやDEPTH_OFFSETなど)のversion。
+// 置換表をファイルに保存する時に記録しておき、異なるものは読み込まない。(TranspositionTable::save()/load())
+// TTEntryのlayoutを変更した時は、これをインクリメントすること。
+constexpr u32 TT_ENTRY_VERSION = 1;
+
 // --- 置換表本体
 // TT_ENTRYをClusterSize個並べて、クラスターをつくる。
 // このクラスターのTT_ENTRYは同じhash keyに対する保存場所である。(保存場所が被ったときに後続のTT_ENTRYを使う)
@@ -93,7 +98,8 @@ public:
 	// 新しい探索ごとにこの関数を呼び出す。(generationを加算する。)
 	// USE_GLOBAL_OPTIONSが有効のときは、このタイミングで、Options["Threads"]の値を
 	// キャプチャして、探索スレッドごとの置換表と世代カウンターを用意する。
-	void new_search() { generation8 += 8; } // 下位3bitはPV nodeかどうかのフラグとBoundに用いている。
+	// load()で読み込んだ置換表は、最初のnew_search()までは(isreadyでの)clear()でクリアされない。
+	void new_search() { generation8 += 8; keep_on_next_clear = false; } // 下位3bitはPV nodeかどうかのフラグとBoundに用いている。
 
 	// 置換表のなかから与えられたkeyに対応するentryを探す。
 	// 見つかったならfound == trueにしてそのTT_ENTRY*を返す。
@@ -121,6 +127,15 @@ public:
 	// 例) th->tt.clear();
 	void clear();
 
+	// 置換表の内容(Clusterの配列とgeneration)をファイルに保存する。
+	// 解析などで、エンジンを再起動しても(あるいは別のマシンのエンジンでも)それまでの探索結果を引き継ぐために用いる。
+	Tools::Result save(const std::string& filename) const;
+
+	// save()で保存したファイルをmmapして、置換表に読み込む。
+	// hash keyの方式(HASH_KEY_BITS、Zobrist Key)、Clusterのサイズ、置換表のサイズ(USI_Hash)が保存した時と一致しなければエラー。
+	// 読み込んだ置換表は、次のisreadyでクリアされない。(その後、最初のgoまでのclear()は無視される)
+	Tools::Result load(const std::string& filename);
+
 	// keyを元にClusterのindexを求めて、その最初のTTEntry*を返す。
 	TTEntry* first_entry(const Key key) const {
 		// Stockfishのコード
@@ -177,6 +192,9 @@ private:
 	// 世代カウンター。new_search()のごとに8ずつ加算する。TTEntry::save()で用いる。
 	uint8_t generation8;
 
+	// load()で読み込んだ直後であるか。trueならclear()は何もしない。
+	bool keep_on_next_clear = false;
+
 	// --- やねうら王独自拡張
 
 	// 置換表テーブルのメモリ確保用のhelpper
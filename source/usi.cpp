@@ -8,6 +8,10 @@
 #include <sstream>
 #include <queue>
 
+#if defined(ENABLE_TEST_CMD) && defined(EVAL_NNUE)
+#include "eval/nnue/nnue_test_command.h"
+#endif
+
 using namespace std;
 
 // ----------------------------------
@@ -24,6 +28,22 @@ namespace Test
 	// 詰み関係のテストコマンド。コマンドを処理した時 trueが返る。
 	bool mate_test_cmd(Position& pos, std::istringstream& is, const std::string& token);
 
+	// 定跡関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool book_test_cmd(Position& pos, std::istringstream& is, const std::string& token);
+
+	// 置換表関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool tt_test_cmd(Position& pos, std::istringstream& is, const std::string& token);
+
+#if defined(USE_SFEN_PACKER)
+	// 局面の圧縮・解凍関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool sfen_packer_test_cmd(Position& pos, std::istringstream& is, const std::string& token);
+#endif
+
+#if defined(YANEURAOU_ENGINE_DEEP)
+	// ふかうら王のNN関係のテストコマンド。コマンドを処理した時 trueが返る。
+	bool nn_test_cmd(Position& pos, std::istringstream& is, const std::string& token);
+#endif
+
 	void test_cmd(Position& pos, std::istringstream& is)
 	{
 		// 探索をするかも知れないので初期化しておく。
@@ -38,6 +58,35 @@ namespace Test
 		if (mate_test_cmd(pos,is,token))
 			return;
 
+		// 定跡関係の拡張コマンド
+		if (book_test_cmd(pos,is,token))
+			return;
+
+		// 置換表関係の拡張コマンド
+		if (tt_test_cmd(pos,is,token))
+			return;
+
+#if defined(USE_SFEN_PACKER)
+		// 局面の圧縮・解凍関係の拡張コマンド
+		if (sfen_packer_test_cmd(pos,is,token))
+			return;
+#endif
+
+#if defined(YANEURAOU_ENGINE_DEEP)
+		// ふかうら王のNN関係の拡張コマンド
+		if (nn_test_cmd(pos,is,token))
+			return;
+#endif
+
+#if defined(EVAL_NNUE)
+		// NNUE評価関数関係の拡張コマンド
+		if (token == "nn")
+		{
+			Eval::NNUE::TestCommand(pos, is);
+			return;
+		}
+#endif
+
 		sync_cout << "Error! : unknown command = " << token << sync_endl;
 	}
 
@@ -520,6 +569,40 @@ void getoption_cmd(istringstream& is)
 		sync_cout << "No such option: " << name << sync_endl;
 }
 
+// 置換表の内容をファイルに保存する。(USI独自拡張)
+// 例) ttsave tt.bin
+void ttsave_cmd(istringstream& is)
+{
+	string filename = "tt.bin";
+	is >> filename;
+
+	Threads.main()->wait_for_search_finished();
+
+	TimePoint start = now();
+	auto result = TT.save(filename);
+	if (result.is_ok())
+		sync_cout << "info string TT saved to " << filename << " , " << (now() - start) << "[ms]" << sync_endl;
+	else
+		sync_cout << "info string Error! : ttsave failed , " << result.to_string() << sync_endl;
+}
+
+// ttsaveで保存した置換表をファイルから読み込む。(USI独自拡張)
+// 次のisreadyで置換表はクリアされないので、それまでの探索結果を引き継いで探索できる。
+// 例) ttload tt.bin
+void ttload_cmd(istringstream& is)
+{
+	string filename = "tt.bin";
+	is >> filename;
+
+	Threads.main()->wait_for_search_finished();
+
+	TimePoint start = now();
+	auto result = TT.load(filename);
+	if (result.is_ok())
+		sync_cout << "info string TT loaded from " << filename << " , " << (now() - start) << "[ms]" << sync_endl;
+	else
+		sync_cout << "info string Error! : ttload failed , " << result.to_string() << sync_endl;
+}
 
 // go()は、思考エンジンがUSIコマンドの"go"を受け取ったときに呼び出される。
 // この関数は、入力文字列から思考時間とその他のパラメーターをセットし、探索を開始する。
@@ -838,6 +921,10 @@ void USI::loop(int argc, char* argv[])
 		// オプションを取得する(USI独自拡張)
 		else if (token == "getoption") getoption_cmd(is);
 
+		// 置換表をファイルに保存する/ファイルから読み込む(USI独自拡張)
+		else if (token == "ttsave") ttsave_cmd(is);
+		else if (token == "ttload") ttload_cmd(is);
+
 		// 指し手生成祭りの局面をセットする。
 		else if (token == "matsuri") pos.set("l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w GR5pnsg 1", &states->back(), Threads.main());
 
@@ -55,7 +55,10 @@ namespace USI {
 	#if defined(USE_EVAL_HASH)
 			// 評価値用のcacheサイズ。[MB]で指定。
 
-		#if defined(FOR_TOURNAMENT)
+		#if defined(EVAL_NNUE)
+				// NNUEでは、0(EvalHashを用いない)がデフォルト。
+				o["EvalHash"] << Option(0, 0, MaxHashMB, [](const Option& o) { Eval::EvalHash_Resize(o); });
+		#elif defined(FOR_TOURNAMENT)
 				// トーナメント用は少し大きなサイズ
 				o["EvalHash"] << Option(1024, 1, MaxHashMB, [](const Option& o) { Eval::EvalHash_Resize(o); });
 		#else
@@ -138,8 +141,8 @@ namespace USI {
 #endif
 
 
-#if defined (USE_SHARED_MEMORY_IN_EVAL) && defined(_WIN32) && \
-	 (defined(EVAL_KPPT) || defined(EVAL_KPP_KKPT) )
+#if defined (USE_SHARED_MEMORY_IN_EVAL) && \
+	 (defined(EVAL_KPPT) || defined(EVAL_KPP_KKPT) || defined(EVAL_NNUE))
 		// 評価関数パラメーターを共有するか。
 		// デフォルトで有効に変更。(V4.90～)
 		o["EvalShare"] << Option(true);
@@ -154,7 +157,7 @@ namespace USI {
 		o["SkipLoadingEval"] << Option(false);
 #endif
 
-#if defined(_WIN32)
+#if defined(_WIN32) || (defined(__linux__) && !defined(__ANDROID__))
 		// 3990XのようなWindows上で複数のプロセッサグループを持つCPUで、思考エンジンを同時起動したときに
 		// 同じプロセッサグループに割り当てられてしまうのを避けるために、スレッドオフセットを
 		// 指定できるようにしておく。
@@ -162,11 +165,23 @@ namespace USI {
 		// それぞれの思考エンジンにはThreadIdOffset = 0,32,64,96をそれぞれ指定する。
 		// (プロセッサグループは64論理コアごとに1つ作られる。上のケースでは、ThreadIdOffset = 0,0,64,64でも同じ意味。)
 		//	※　1つのPCで複数の思考エンジンを同時に起動して対局させる場合はこれを適切に設定すべき。
+		// Linuxでは、複数のNUMAノードを持つマシンで、スレッドを割り当てるNUMAノードを決めるのに用いる。(NumaPolicy参照)
 
 		o["ThreadIdOffset"] << Option(0, 0, std::thread::hardware_concurrency() - 1);
 #endif
 
-#if defined(_WIN64)
+#if defined(__linux__) && !defined(__ANDROID__)
+		// 複数のNUMAノードを持つ(複数CPUソケットの)Linuxマシンで、スレッドとメモリをどう割り当てるか。
+		//  interleave : スレッドをNUMAノードに割り当てて、置換表は全ノードに均等に分散させる。
+		//  local      : スレッドをNUMAノードに割り当てて、置換表は各スレッドがゼロクリアした部分をそのノードに置く。
+		//  none       : OSに任せる。(従来の挙動)
+		// いずれも、スレッドのhistoryなどはそのスレッドのノードに置く。("none"を除く)
+		// ※　Threadsが8以下のときは、ThreadIdOffsetを指定していなければスレッドの割り当ては行わない。(OSに任せる)
+		//    FORCE_BIND_THIS_THREADを定義したビルド(Makefileの既定)でも同じ。
+		o["NumaPolicy"] << Option(std::vector<std::string>{ "interleave", "local", "none" }, "interleave");
+#endif
+
+#if defined(_WIN64) || (defined(__linux__) && !defined(__ANDROID__))
 		// LargePageを有効化するか。
 		// これを無効化できないと自己対局の時に片側のエンジンだけがLargePageを使うことがあり、
 		// 不公平になるため、無効化する方法が必要であった。